@@ -0,0 +1,62 @@
+# Prefix and install folder
+prefix              := /usr
+PREFIX              := $(prefix)
+exec_prefix         := /usr
+libdir              := /usr/lib
+LIBDIR              := $(libdir)
+
+# A debug build of tools?
+debug               := y
+
+# Tools path
+BISON               := 
+FLEX                := 
+PYTHON := /root/.pyenv/versions/2.7.18/bin/python2
+PYTHON_PATH         := 
+PERL                := 
+CURL_CONFIG         := 
+XML2_CONFIG         := 
+BASH                := 
+XGETTTEXT           := 
+AS86                := @AS86@
+LD86                := @LD86@
+BCC                 := 
+IASL                := 
+FETCHER             := 
+
+# Extra folder for libs/includes
+PREPEND_INCLUDES    := 
+PREPEND_LIB         := 
+APPEND_INCLUDES     := 
+APPEND_LIB          := 
+
+PTHREAD_CFLAGS      := 
+PTHREAD_LDFLAGS     := 
+PTHREAD_LIBS        := -lpthread
+
+PTYFUNCS_LIBS       := 
+
+# Download GIT repositories via HTTP or GIT's own protocol?
+# GIT's protocol is faster and more robust, when it works at all (firewalls
+# may block it). We make it the default, but if your GIT repository downloads
+# fail or hang, please specify GIT_HTTP=y in your environment.
+GIT_HTTP            := 
+
+# Optional components
+XENSTAT_XENTOP      := 
+LIBXENAPI_BINDINGS  := 
+OCAML_TOOLS         := 
+FLASK_POLICY        := 
+CONFIG_MINITERM     := 
+CONFIG_LOMOUNT      := 
+CONFIG_OVMF         := 
+CONFIG_ROMBIOS      := 
+CONFIG_SEABIOS      := 
+
+#System options
+CONFIG_SYSTEM_LIBAIO:= n
+ZLIB                := 
+CONFIG_LIBICONV     := 
+CONFIG_GCRYPT       := 
+EXTFS_LIBS          := 
+CURSES_LIBS         := 
@@ -702,6 +702,116 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_stats_usage(FILE *stream)
+{
+	fprintf(stream, "usage: stats <-p pid> <-m minor> "
+		"[-t images|io|queue|service|total]\n");
+}
+
+static int
+tap_cli_stats(int argc, char **argv)
+{
+	int c, pid, minor, err;
+	const char *type;
+	char buf[TAPDISK_MESSAGE_STRING_LENGTH];
+
+	pid   = -1;
+	minor = -1;
+	type  = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:t:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 't':
+			type = optarg;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_stats_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	err = tap_ctl_stats(pid, minor, type, buf, sizeof(buf));
+	if (!err)
+		printf("%s\n", buf);
+
+	return err;
+
+usage:
+	tap_cli_stats_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_qos_usage(FILE *stream)
+{
+	fprintf(stream, "usage: qos <-p pid> <-m minor> [-i iops] "
+		"[-I iops burst] [-b bytes/s] [-B bytes burst]\n"
+		"  omitted limits are removed; bursts default to one "
+		"second at the limit\n");
+}
+
+static int
+tap_cli_qos(int argc, char **argv)
+{
+	int c, pid, minor;
+	tapdisk_message_qos_t qos;
+
+	pid   = -1;
+	minor = -1;
+	memset(&qos, 0, sizeof(qos));
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:i:I:b:B:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'i':
+			qos.iops = strtoull(optarg, NULL, 10);
+			break;
+		case 'I':
+			qos.iops_burst = strtoull(optarg, NULL, 10);
+			break;
+		case 'b':
+			qos.bps = strtoull(optarg, NULL, 10);
+			break;
+		case 'B':
+			qos.bps_burst = strtoull(optarg, NULL, 10);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_qos_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	return tap_ctl_qos(pid, minor, &qos);
+
+usage:
+	tap_cli_qos_usage(stderr);
+	return EINVAL;
+}
+
 struct command commands[] = {
 	{ .name = "list",         .func = tap_cli_list          },
 	{ .name = "allocate",     .func = tap_cli_allocate      },
@@ -717,6 +827,8 @@ struct command commands[] = {
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
+	{ .name = "stats",        .func = tap_cli_stats         },
+	{ .name = "qos",          .func = tap_cli_qos           },
 };
 
 #define print_commands()					\
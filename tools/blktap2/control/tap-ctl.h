@@ -96,6 +96,11 @@ int tap_ctl_close(const int id, const int minor, const int force);
 int tap_ctl_pause(const int id, const int minor);
 int tap_ctl_unpause(const int id, const int minor, const char *params);
 
+int tap_ctl_stats(const int id, const int minor, const char *type,
+		  char *buf, size_t size);
+int tap_ctl_qos(const int id, const int minor,
+		const tapdisk_message_qos_t *qos);
+
 int tap_ctl_blk_major(void);
 
 #endif
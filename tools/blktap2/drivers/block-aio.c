@@ -154,6 +154,7 @@ int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	}
 
         prv->fd = fd;
+	td_register_file(fd);
 
 done:
 	return ret;	
@@ -224,10 +225,28 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+void tdaio_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	int err;
+	uint64_t size, offset;
+	struct tdaio_state *prv;
+
+	prv     = (struct tdaio_state *)driver->data;
+	size    = treq.secs * (uint64_t)driver->info.sector_size;
+	offset  = treq.sec  * (uint64_t)driver->info.sector_size;
+
+	err = tapdisk_punch_hole(prv->fd, offset, size);
+	if (err == -EOPNOTSUPP)
+		err = 0;
+
+	td_complete_request(treq, err);
+}
+
 int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	
+	td_unregister_file(prv->fd);
 	close(prv->fd);
 
 	return 0;
@@ -252,6 +271,7 @@ struct tap_disk tapdisk_aio = {
 	.td_close           = tdaio_close,
 	.td_queue_read      = tdaio_queue_read,
 	.td_queue_write     = tdaio_queue_write,
+	.td_queue_discard   = tdaio_queue_discard,
 	.td_get_parent_id   = tdaio_get_parent_id,
 	.td_validate_parent = tdaio_validate_parent,
 	.td_debug           = NULL,
@@ -36,6 +36,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-shm-cache.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -131,6 +132,11 @@ struct block_cache {
 
 	radix_tree_t                    tree;
 
+	/* shared mode: pages live in the host-wide segment instead */
+	td_shm_cache_t                 *shm;
+	uint8_t                         key[TD_SHM_CACHE_KEY_SIZE];
+	char                           *bounce;
+
 	block_cache_stats_t             stats;
 };
 
@@ -516,6 +522,32 @@ block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 	cache->request_free_list[cache->requests_free++] = breq;
 }
 
+static int
+block_cache_open_shared(block_cache_t *cache)
+{
+	int err;
+
+	err = tapdisk_shm_cache_image_key(cache->name, cache->key);
+	if (err)
+		return err;
+
+	err = posix_memalign((void **)&cache->bounce, TD_SHM_CACHE_PAGE_SIZE,
+			     2 * TD_SHM_CACHE_PAGE_SIZE);
+	if (err) {
+		cache->bounce = NULL;
+		return -err;
+	}
+
+	cache->shm = tapdisk_shm_cache_attach();
+	if (!cache->shm) {
+		free(cache->bounce);
+		cache->bounce = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
 static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
@@ -536,15 +568,28 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	cache->sectors = driver->info.size;
 
+	cache->requests_free = BLOCK_CACHE_REQUESTS;
+	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
+		cache->request_free_list[i] = cache->requests + i;
+
+	if (tapdisk_shm_cache_enabled()) {
+		err = block_cache_open_shared(cache);
+		if (!err) {
+			DPRINTF("opening shared cache for %s, sectors: "
+				"%"PRIu64"\n", cache->name, cache->sectors);
+			return 0;
+		}
+
+		DPRINTF("shared cache for %s unavailable (%d), "
+			"using private cache\n", cache->name, err);
+	}
+
 	tree = &cache->tree;
 	err  = radix_tree_initialize(tree, cache->sectors);
 	if (err)
 		goto fail;
 
 	tree->cache = cache;
-	cache->requests_free = BLOCK_CACHE_REQUESTS;
-	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
-		cache->request_free_list[i] = cache->requests + i;
 
 	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
 							  -1, /* dummy fd */
@@ -580,6 +625,13 @@ block_cache_close(td_driver_t *driver)
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
+	if (cache->shm) {
+		tapdisk_shm_cache_detach(cache->shm);
+		free(cache->bounce);
+		free(cache->name);
+		return 0;
+	}
+
 	tapdisk_server_unregister_event(cache->timeout_id);
 	radix_tree_free(tree);
 	free(cache->name);
@@ -706,6 +758,108 @@ out:
 	td_forward_request(clone);
 }
 
+static void
+block_cache_populate_shared(td_request_t clone, int err)
+{
+	int i, n;
+	uint64_t first, page;
+	block_cache_t *cache;
+	block_cache_request_t *breq;
+
+	breq        = (block_cache_request_t *)clone.cb_data;
+	cache       = breq->cache;
+	breq->secs -= clone.secs;
+	breq->err   = (breq->err ? breq->err : err);
+
+	if (breq->secs)
+		return;
+
+	if (!breq->err) {
+		first = breq->treq.sec & ~(uint64_t)(TD_SHM_CACHE_PAGE_SECS - 1);
+		page  = first / TD_SHM_CACHE_PAGE_SECS;
+		n     = (breq->treq.sec + breq->treq.secs - first +
+			 TD_SHM_CACHE_PAGE_SECS - 1) / TD_SHM_CACHE_PAGE_SECS;
+
+		memcpy(breq->treq.buf,
+		       breq->buf + ((breq->treq.sec - first) <<
+				    RADIX_TREE_NODE_SHIFT),
+		       breq->treq.secs << RADIX_TREE_NODE_SHIFT);
+
+		for (i = 0; i < n; i++)
+			tapdisk_shm_cache_insert(cache->shm, cache->key,
+						 page + i, breq->buf +
+						 i * TD_SHM_CACHE_PAGE_SIZE);
+	}
+
+	free(breq->buf);
+	td_complete_request(breq->treq, breq->err);
+	block_cache_put_request(cache, breq);
+}
+
+/*
+ * the shared cache holds whole 4k pages: a miss reads every page the
+ * request touches from the parent, and caches all of them.
+ */
+static void
+block_cache_queue_read_shared(block_cache_t *cache, td_request_t treq)
+{
+	int i, n;
+	char *buf;
+	uint64_t first, end;
+	td_request_t clone;
+	block_cache_request_t *breq;
+
+	first = treq.sec & ~(uint64_t)(TD_SHM_CACHE_PAGE_SECS - 1);
+	end   = (treq.sec + treq.secs + TD_SHM_CACHE_PAGE_SECS - 1) &
+		~(uint64_t)(TD_SHM_CACHE_PAGE_SECS - 1);
+	n     = (end - first) / TD_SHM_CACHE_PAGE_SECS;
+
+	if (end > cache->sectors)
+		return td_forward_request(treq);
+
+	for (i = 0; i < n; i++)
+		if (tapdisk_shm_cache_read(cache->shm, cache->key,
+					   first / TD_SHM_CACHE_PAGE_SECS + i,
+					   cache->bounce +
+					   i * TD_SHM_CACHE_PAGE_SIZE))
+			goto miss;
+
+	cache->stats.hits += treq.secs;
+	memcpy(treq.buf,
+	       cache->bounce + ((treq.sec - first) << RADIX_TREE_NODE_SHIFT),
+	       treq.secs << RADIX_TREE_NODE_SHIFT);
+
+	return td_complete_request(treq, 0);
+
+miss:
+	cache->stats.misses += treq.secs;
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		return td_forward_request(treq);
+
+	if (posix_memalign((void **)&buf, TD_SHM_CACHE_PAGE_SIZE,
+			   n * TD_SHM_CACHE_PAGE_SIZE)) {
+		block_cache_put_request(cache, breq);
+		return td_forward_request(treq);
+	}
+
+	breq->treq    = treq;
+	breq->secs    = end - first;
+	breq->err     = 0;
+	breq->buf     = buf;
+	breq->cache   = cache;
+
+	clone         = treq;
+	clone.sec     = first;
+	clone.secs    = end - first;
+	clone.buf     = buf;
+	clone.cb      = block_cache_populate_shared;
+	clone.cb_data = breq;
+
+	td_forward_request(clone);
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -722,6 +876,9 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
+	if (cache->shm)
+		return block_cache_queue_read_shared(cache, treq);
+
 	for (i = 0; i < treq.secs; i++) {
 		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
 		if (!iov[i])
@@ -771,6 +928,41 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+
+	if (cache->shm) {
+		td_shm_cache_stats_t shm;
+
+		tapdisk_shm_cache_stats(cache->shm, &shm);
+		WARN("shared: pages: %u, hits: %"PRIu64", misses: %"PRIu64", "
+		     "evictions: %"PRIu64", resets: %"PRIu64"\n", shm.pages,
+		     shm.hits, shm.misses, shm.evictions, shm.resets);
+	}
+}
+
+static int
+block_cache_stats(td_driver_t *driver, char *buf, size_t size)
+{
+	block_cache_t *cache;
+	block_cache_stats_t *stats;
+	td_shm_cache_stats_t shm;
+
+	cache = (block_cache_t *)driver->data;
+	stats = &cache->stats;
+
+	if (!cache->shm)
+		return snprintf(buf, size, "mode=private reads=%"PRIu64" "
+				"hits=%"PRIu64" misses=%"PRIu64" "
+				"prunes=%"PRIu64, stats->reads, stats->hits,
+				stats->misses, stats->prunes);
+
+	tapdisk_shm_cache_stats(cache->shm, &shm);
+
+	return snprintf(buf, size, "mode=shared reads=%"PRIu64" "
+			"hits=%"PRIu64" misses=%"PRIu64" host_pages=%u "
+			"host_hits=%"PRIu64" host_misses=%"PRIu64" "
+			"host_evictions=%"PRIu64, stats->reads, stats->hits,
+			stats->misses, shm.pages, shm.hits, shm.misses,
+			shm.evictions);
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -784,4 +976,5 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
 };
@@ -77,9 +77,29 @@ struct qcow_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdqcow_state  *state;
+	td_driver_t          *driver;
+	struct qcow_request  *next;
+};
+
+#define QCOW_L2_VALID        0x01
+#define QCOW_L2_READ_PENDING 0x02
+
+struct qcow_l2_table {
+	uint64_t              offset;       /* on-disk offset, 0 if unused */
+	uint64_t             *table;
+	int                   status;
+	int                   lock;         /* pinned while being read */
+	struct tdqcow_state  *state;
+	struct qcow_l2_table *hnext;
+	struct list_head      lru;
+	struct qcow_request  *waiting;      /* requests parked on the read */
+	struct qcow_request  *waiting_tail;
+	struct tiocb          tiocb;
 };
 
 static int decompress_cluster(struct tdqcow_state *s, uint64_t cluster_offset);
+void tdqcow_queue_read(td_driver_t *driver, td_request_t treq);
+void tdqcow_queue_write(td_driver_t *driver, td_request_t treq);
 
 uint32_t gen_cksum(char *ptr, int len)
 {
@@ -364,6 +384,269 @@ int qtruncate(int fd, off_t length, int sparse)
 	return 0;
 }
 
+/*
+ * L2 tables are kept in a hashed cache of s->l2_cache_size entries,
+ * recycled in LRU order.  Misses on the request path are read through
+ * the tiocb queue: the request is parked on the table and resubmitted
+ * once it arrives, so a cold table never stalls the rest of tapdisk.
+ */
+static inline int l2_hash(struct tdqcow_state *s, uint64_t l2_offset)
+{
+	return (int)(((l2_offset >> 9) * 0x9e3779b97f4a7c15ULL) >>
+		     (64 - s->l2_hash_bits));
+}
+
+static void l2_cache_unhash(struct tdqcow_state *s, struct qcow_l2_table *l2)
+{
+	struct qcow_l2_table **pp;
+
+	if (!l2->offset)
+		return;
+
+	for (pp = &s->l2_hash[l2_hash(s, l2->offset)]; *pp; pp = &(*pp)->hnext)
+		if (*pp == l2) {
+			*pp = l2->hnext;
+			break;
+		}
+
+	l2->offset = 0;
+	l2->status = 0;
+	l2->hnext  = NULL;
+}
+
+static struct qcow_l2_table *l2_cache_lookup(struct tdqcow_state *s,
+					     uint64_t l2_offset)
+{
+	struct qcow_l2_table *l2;
+
+	for (l2 = s->l2_hash[l2_hash(s, l2_offset)]; l2; l2 = l2->hnext)
+		if (l2->offset == l2_offset) {
+			list_del(&l2->lru);
+			list_add_tail(&l2->lru, &s->l2_lru);
+			return l2;
+		}
+
+	return NULL;
+}
+
+/* Recycle the least recently used idle entry for the table at l2_offset. */
+static struct qcow_l2_table *l2_cache_alloc(struct tdqcow_state *s,
+					    uint64_t l2_offset)
+{
+	int h;
+	struct qcow_l2_table *l2;
+
+	list_for_each_entry(l2, &s->l2_lru, lru)
+		if (!l2->lock)
+			goto found;
+
+	DPRINTF("L2 cache exhausted (%d tables busy)\n", s->l2_cache_size);
+	return NULL;
+
+found:
+	l2_cache_unhash(s, l2);
+
+	h             = l2_hash(s, l2_offset);
+	l2->offset    = l2_offset;
+	l2->hnext     = s->l2_hash[h];
+	s->l2_hash[h] = l2;
+
+	list_del(&l2->lru);
+	list_add_tail(&l2->lru, &s->l2_lru);
+	return l2;
+}
+
+static void l2_cache_read_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	td_request_t treq;
+	td_driver_t *driver;
+	struct qcow_l2_table *l2 = (struct qcow_l2_table *)arg;
+	struct tdqcow_state *s = l2->state;
+	struct qcow_request *req, *next;
+
+	req = l2->waiting;
+	l2->waiting = l2->waiting_tail = NULL;
+
+	if (err) {
+		DPRINTF("L2 table read at %"PRIu64" failed: %d\n",
+			l2->offset, err);
+		l2_cache_unhash(s, l2);
+	} else
+		l2->status = QCOW_L2_VALID;
+
+	/* keep the table pinned while the waiters are resubmitted */
+	for (; req; req = next) {
+		next   = req->next;
+		treq   = req->treq;
+		driver = req->driver;
+
+		s->aio_free_list[s->aio_free_count++] = req;
+
+		if (err)
+			td_complete_request(treq, err);
+		else if (treq.op == TD_OP_WRITE)
+			tdqcow_queue_write(driver, treq);
+		else
+			tdqcow_queue_read(driver, treq);
+	}
+
+	l2->lock--;
+}
+
+/*
+ * Fill @l2 from disk.  With a driver the read is queued and the entry
+ * left READ_PENDING; without one (callers outside the request path) it
+ * is read synchronously.
+ */
+static int l2_cache_read(struct tdqcow_state *s, td_driver_t *driver,
+			 struct qcow_l2_table *l2)
+{
+	size_t size = s->l2_size * sizeof(uint64_t);
+
+	if (!driver) {
+		if (pread(s->fd, l2->table, size, l2->offset) != size) {
+			l2_cache_unhash(s, l2);
+			return -EIO;
+		}
+		l2->status = QCOW_L2_VALID;
+		return 0;
+	}
+
+	l2->status = QCOW_L2_READ_PENDING;
+	l2->lock++;
+
+	td_prep_read(&l2->tiocb, s->fd, (char *)l2->table, size,
+		     l2->offset, l2_cache_read_complete, l2);
+	td_queue_tiocb(driver, &l2->tiocb);
+	return 0;
+}
+
+/* Park a request until the L2 table it depends on has been read. */
+static int l2_cache_wait(struct tdqcow_state *s, td_driver_t *driver,
+			 struct qcow_l2_table *l2, td_request_t treq)
+{
+	struct qcow_request *req;
+
+	ASSERT(l2->status & QCOW_L2_READ_PENDING);
+
+	if (s->aio_free_count == 0)
+		return -EBUSY;
+
+	req         = s->aio_free_list[--s->aio_free_count];
+	req->treq   = treq;
+	req->state  = s;
+	req->driver = driver;
+	req->next   = NULL;
+
+	if (l2->waiting_tail)
+		l2->waiting_tail->next = req;
+	else
+		l2->waiting = req;
+	l2->waiting_tail = req;
+
+	return 0;
+}
+
+static void l2_cache_reset(struct tdqcow_state *s)
+{
+	int i;
+
+	for (i = 0; i < s->l2_cache_size; i++)
+		if (!s->l2_cache[i].lock)
+			l2_cache_unhash(s, &s->l2_cache[i]);
+}
+
+static void l2_cache_free(struct tdqcow_state *s)
+{
+	free(s->l2_cache);
+	free(s->l2_hash);
+	free(s->l2_cache_data);
+	s->l2_cache      = NULL;
+	s->l2_hash       = NULL;
+	s->l2_cache_data = NULL;
+}
+
+static int l2_cache_init(struct tdqcow_state *s)
+{
+	int i, err;
+	char *env;
+	size_t size;
+
+	s->l2_cache_size = L2_CACHE_SIZE;
+
+	env = getenv("TAPDISK2_QCOW_L2_CACHE");
+	if (env) {
+		i = atoi(env);
+		if (i > 0 && i <= L2_CACHE_MAX)
+			s->l2_cache_size = i;
+		else
+			DPRINTF("Ignoring bad L2 cache size '%s'\n", env);
+	}
+
+	s->l2_hash_bits = 1;
+	while ((1 << s->l2_hash_bits) < 2 * s->l2_cache_size)
+		s->l2_hash_bits++;
+
+	INIT_LIST_HEAD(&s->l2_lru);
+
+	s->l2_cache = calloc(s->l2_cache_size, sizeof(struct qcow_l2_table));
+	s->l2_hash  = calloc(1 << s->l2_hash_bits,
+			     sizeof(struct qcow_l2_table *));
+	if (!s->l2_cache || !s->l2_hash)
+		goto fail;
+
+	size = (size_t)s->l2_size * sizeof(uint64_t);
+	err  = posix_memalign((void **)&s->l2_cache_data, 4096,
+			      size * s->l2_cache_size);
+	if (err) {
+		s->l2_cache_data = NULL;
+		goto fail;
+	}
+
+	for (i = 0; i < s->l2_cache_size; i++) {
+		struct qcow_l2_table *l2 = &s->l2_cache[i];
+
+		l2->table = s->l2_cache_data + (size_t)i * s->l2_size;
+		l2->state = s;
+		list_add_tail(&l2->lru, &s->l2_lru);
+	}
+
+	DPRINTF("L2 cache: %d tables of %zu bytes\n", s->l2_cache_size, size);
+	return 0;
+
+fail:
+	l2_cache_free(s);
+	return -ENOMEM;
+}
+
+/*
+ * Reserve the image up to @end for newly allocated metadata or
+ * clusters.  fd_end tracks allocation so no lseek is needed to find
+ * the end of the image; sparse images are extended with ftruncate
+ * rather than by writing zeroes.
+ */
+static int qcow_extend(struct tdqcow_state *s, uint64_t end)
+{
+	if (end > s->file_size) {
+		if (s->sparse) {
+			if (ftruncate(s->fd, end) == -1) {
+				DPRINTF("Ftruncate failed (%s)\n",
+					strerror(errno));
+				return -errno;
+			}
+		} else if (qtruncate(s->fd, end, 0) != 0) {
+			DPRINTF("ERROR truncating file\n");
+			return -EIO;
+		}
+		s->file_size = end;
+	}
+
+	if (end > s->fd_end)
+		s->fd_end = end;
+
+	return 0;
+}
+
 /* 'allocate' is:
  *
  * 0 to not allocate.
@@ -375,24 +658,31 @@ int qtruncate(int fd, off_t length, int sparse)
  * 'compressed_size'. 'compressed_size' must be > 0 and <
  * cluster_size 
  *
- * return 0 if not allocated.
+ * The cluster offset is returned in '*result', 0 if not allocated.
+ * If the L2 table is still being read, -EAGAIN is returned and
+ * '*pending' names the table to wait on.  'driver' may be NULL to
+ * load missing tables synchronously.
  */
-static uint64_t get_cluster_offset(struct tdqcow_state *s,
-                                   uint64_t offset, int allocate,
-                                   int compressed_size,
-                                   int n_start, int n_end)
+static int get_cluster_offset(struct tdqcow_state *s, td_driver_t *driver,
+			      uint64_t offset, int allocate,
+			      int compressed_size,
+			      int n_start, int n_end,
+			      uint64_t *result,
+			      struct qcow_l2_table **pending)
 {
-	int min_index, i, j, l1_index, l2_index, l2_sector, l1_sector;
+	int i, err, l1_index, l2_index, l2_sector, l1_sector;
 	char *tmp_ptr2, *l2_ptr, *l1_ptr;
 	uint64_t *tmp_ptr;
 	uint64_t l2_offset, *l2_table, cluster_offset, tmp;
-	uint32_t min_count;
-	int new_l2_table;
+	size_t l2_bytes;
+	struct qcow_l2_table *l2;
+
+	*result  = 0;
+	l2_bytes = s->l2_size * sizeof(uint64_t);
 
 	/*Check L1 table for the extent offset*/
 	l1_index = offset >> (s->l2_bits + s->cluster_bits);
 	l2_offset = s->l1_table[l1_index];
-	new_l2_table = 0;
 	if (!l2_offset) {
 		if (!allocate)
 			return 0;
@@ -407,18 +697,18 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
 		l2_offset = (l2_offset + s->cluster_size - 1) 
 			& ~(s->cluster_size - 1);
 
+		l2 = l2_cache_alloc(s, l2_offset);
+		if (!l2)
+			return -EBUSY;
+
+		/*Extend file for L2 table 
+		 *(initialised to zero in case we crash)*/
+		err = qcow_extend(s, l2_offset + l2_bytes);
+		if (err)
+			goto fail_l2;
+
 		/* update the L1 entry */
 		s->l1_table[l1_index] = l2_offset;
-		
-		/*Truncate file for L2 table 
-		 *(initialised to zero in case we crash)*/
-		if (qtruncate(s->fd, 
-			      l2_offset + (s->l2_size * sizeof(uint64_t)),
-			      s->sparse) != 0) {
-			DPRINTF("ERROR truncating file\n");
-			return 0;
-		}
-		s->fd_end = l2_offset + (s->l2_size * sizeof(uint64_t));
 
 		/*Update the L1 table entry on disk
                  * (for O_DIRECT we write 4KByte blocks)*/
@@ -427,6 +717,8 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
 
 		if (posix_memalign((void **)&tmp_ptr, 4096, 4096) != 0) {
 			DPRINTF("ERROR allocating memory for L1 table\n");
+			err = -ENOMEM;
+			goto fail_l1;
 		}
 		memcpy(tmp_ptr, l1_ptr, 4096);
 
@@ -440,89 +732,72 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
 		 * For safety, we must ensure that
 		 * entry is written before blocks.
 		 */
-		lseek(s->fd, s->l1_table_offset + (l1_sector << 12), SEEK_SET);
-		if (write(s->fd, tmp_ptr, 4096) != 4096) {
+		if (pwrite(s->fd, tmp_ptr, 4096,
+			   s->l1_table_offset + (l1_sector << 12)) != 4096) {
 			free(tmp_ptr);
-		 	return 0;
+			err = -EIO;
+			goto fail_l1;
 		}
 		free(tmp_ptr);
 
-		new_l2_table = 1;
-		goto cache_miss;
-	} else if (s->min_cluster_alloc == s->l2_size) {
-		/*Fast-track the request*/
-		cluster_offset = l2_offset + (s->l2_size * sizeof(uint64_t));
-		l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-		return cluster_offset + (l2_index * s->cluster_size);
-	}
+		l2_table = l2->table;
 
-	/*Check to see if L2 entry is already cached*/
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			/* increment the hit count */
-			if (++s->l2_cache_counts[i] == 0xffffffff) {
-				for (j = 0; j < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			goto found;
-		}
-	}
-
-cache_miss:
-	/* not found: load a new entry in the least used one */
-	min_index = 0;
-	min_count = 0xffffffff;
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
-		}
-	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
-
-	/*If extent pre-allocated, read table from disk, 
-	 *otherwise write new table to disk*/
-	if (new_l2_table) {
 		/*Should we allocate the whole extent? Adjustable parameter.*/
 		if (s->cluster_alloc == s->l2_size) {
-			cluster_offset = l2_offset + 
-				(s->l2_size * sizeof(uint64_t));
+			cluster_offset = l2_offset + l2_bytes;
 			cluster_offset = (cluster_offset + s->cluster_size - 1)
 				& ~(s->cluster_size - 1);
-			if (qtruncate(s->fd, cluster_offset + 
-				  (s->cluster_size * s->l2_size), 
-				      s->sparse) != 0) {
-				DPRINTF("ERROR truncating file\n");
-				return 0;
-			}
-			s->fd_end = cluster_offset + 
-				(s->cluster_size * s->l2_size);
+			err = qcow_extend(s, cluster_offset +
+					  (s->cluster_size * s->l2_size));
+			if (err)
+				goto fail_l2;
 			for (i = 0; i < s->l2_size; i++) {
 				l2_table[i] = cpu_to_be64(cluster_offset + 
 							  (i*s->cluster_size));
 			}  
-		} else memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+		} else memset(l2_table, 0, l2_bytes);
 
-		lseek(s->fd, l2_offset, SEEK_SET);
-		if (write(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) !=
-		   s->l2_size * sizeof(uint64_t))
-			return 0;
-	} else {
-		lseek(s->fd, l2_offset, SEEK_SET);
-		if (read(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) != 
-		    s->l2_size * sizeof(uint64_t))
-			return 0;
+		if (pwrite(s->fd, l2_table, l2_bytes, l2_offset) != l2_bytes) {
+			err = -EIO;
+			goto fail_l2;
+		}
+
+		l2->status = QCOW_L2_VALID;
+		goto found;
+	} else if (s->min_cluster_alloc == s->l2_size) {
+		/*Fast-track the request*/
+		cluster_offset = l2_offset + l2_bytes;
+		l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+		*result = cluster_offset + (l2_index * s->cluster_size);
+		return 0;
+	}
+
+	/*Check to see if L2 entry is already cached*/
+	l2 = l2_cache_lookup(s, l2_offset);
+	if (l2)
+		s->l2_hits++;
+	else {
+		/* not found: load it into the least recently used entry */
+		s->l2_misses++;
+
+		l2 = l2_cache_alloc(s, l2_offset);
+		if (!l2)
+			return -EBUSY;
+
+		err = l2_cache_read(s, driver, l2);
+		if (err)
+			return err;
+	}
+
+	if (l2->status & QCOW_L2_READ_PENDING) {
+		*pending = l2;
+		return -EAGAIN;
 	}
-	
-	/*Update the cache entries*/ 
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
 
 found:
 	/*The extent is split into 's->l2_size' blocks of 
 	 *size 's->cluster_size'*/
+	l2_table = l2->table;
 	l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
 	cluster_offset = be64_to_cpu(l2_table[l2_index]);
 
@@ -537,29 +812,28 @@ found:
 			   decompress it in the case it is not completely
 			   overwritten */
 			if (decompress_cluster(s, cluster_offset) < 0)
-				return 0;
-			cluster_offset = lseek(s->fd, s->fd_end, SEEK_SET);
-			cluster_offset = (cluster_offset + s->cluster_size - 1)
+				return -EIO;
+			cluster_offset = (s->fd_end + s->cluster_size - 1)
 				& ~(s->cluster_size - 1);
+			err = qcow_extend(s, cluster_offset + s->cluster_size);
+			if (err)
+				return err;
 			/* write the cluster content - not asynchronous */
-			lseek(s->fd, cluster_offset, SEEK_SET);
-			if (write(s->fd, s->cluster_cache, s->cluster_size) != 
-			    s->cluster_size)
-			    return -1;
+			if (pwrite(s->fd, s->cluster_cache, s->cluster_size,
+				   cluster_offset) != s->cluster_size)
+			    return -EIO;
 		} else {
 			/* allocate a new cluster */
-			cluster_offset = lseek(s->fd, s->fd_end, SEEK_SET);
+			cluster_offset = s->fd_end;
 			if (allocate == 1) {
 				/* round to cluster size */
 				cluster_offset = 
 					(cluster_offset + s->cluster_size - 1) 
 					& ~(s->cluster_size - 1);
-				if (qtruncate(s->fd, cluster_offset + 
-					      s->cluster_size, s->sparse)!=0) {
-					DPRINTF("ERROR truncating file\n");
-					return 0;
-				}
-				s->fd_end = (cluster_offset + s->cluster_size);
+				err = qcow_extend(s, cluster_offset +
+						  s->cluster_size);
+				if (err)
+					return err;
 				/* if encrypted, we must initialize the cluster
 				   content which won't be written */
 				if (s->crypt_method && 
@@ -578,13 +852,17 @@ found:
 									s->cluster_data, 
 									s->cluster_data + 512, 1, 1,
 									&s->aes_encrypt_key);
-							lseek(s->fd, cluster_offset + i * 512, SEEK_SET);
-							if (write(s->fd, s->cluster_data, 512) != 512)
-								return -1;
+							if (pwrite(s->fd, s->cluster_data, 512,
+								   cluster_offset + i * 512) != 512)
+								return -EIO;
 						}
 					}
 				}
 			} else {
+				err = qcow_extend(s, cluster_offset +
+						  compressed_size);
+				if (err)
+					return err;
 				cluster_offset |= QCOW_OFLAG_COMPRESSED | 
 					(uint64_t)compressed_size 
 						<< (63 - s->cluster_bits);
@@ -600,16 +878,51 @@ found:
 		
 		if (posix_memalign((void **)&tmp_ptr2, 4096, 4096) != 0) {
 			DPRINTF("ERROR allocating memory for L1 table\n");
+			return -ENOMEM;
 		}
 		memcpy(tmp_ptr2, l2_ptr, 4096);
-		lseek(s->fd, l2_offset + (l2_sector << 12), SEEK_SET);
-		if (write(s->fd, tmp_ptr2, 4096) != 4096) {
+		if (pwrite(s->fd, tmp_ptr2, 4096,
+			   l2_offset + (l2_sector << 12)) != 4096) {
 			free(tmp_ptr2);
-			return -1;
+			return -EIO;
 		}
 		free(tmp_ptr2);
 	}
-	return cluster_offset;
+
+	*result = cluster_offset;
+	return 0;
+
+fail_l1:
+	s->l1_table[l1_index] = 0;
+fail_l2:
+	l2_cache_unhash(s, l2);
+	return err;
+}
+
+/*
+ * Nonzero if the cluster holding @sector is known to be unallocated
+ * without going to disk.
+ */
+static int cluster_clear_cached(struct tdqcow_state *s, uint64_t sector)
+{
+	int l1_index, l2_index;
+	uint64_t offset, l2_offset;
+	struct qcow_l2_table *l2;
+
+	offset    = sector << 9;
+	l1_index  = offset >> (s->l2_bits + s->cluster_bits);
+	l2_offset = s->l1_table[l1_index];
+	if (!l2_offset)
+		return 1;
+	if (s->min_cluster_alloc == s->l2_size)
+		return 0;
+
+	l2 = l2_cache_lookup(s, l2_offset);
+	if (!l2 || !(l2->status & QCOW_L2_VALID))
+		return 0;
+
+	l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+	return !l2->table[l2_index];
 }
 
 static int qcow_is_allocated(struct tdqcow_state *s, int64_t sector_num,
@@ -618,7 +931,9 @@ static int qcow_is_allocated(struct tdqcow_state *s, int64_t sector_num,
 	int index_in_cluster, n;
 	uint64_t cluster_offset;
 
-	cluster_offset = get_cluster_offset(s, sector_num << 9, 0, 0, 0, 0);
+	if (get_cluster_offset(s, NULL, sector_num << 9, 0, 0, 0, 0,
+			       &cluster_offset, NULL))
+		cluster_offset = 0;
 	index_in_cluster = sector_num & (s->cluster_sectors - 1);
 	n = s->cluster_sectors - index_in_cluster;
 	if (n > nb_sectors)
@@ -869,6 +1184,7 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 	td_disk_info_t *bs = &(driver->info);
 	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
 	QCowHeader header;
+	struct stat st;
 	uint64_t final_cluster = 0;
 
  	DPRINTF("QCOW: Opening %s\n", name);
@@ -928,9 +1244,8 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 		goto fail;
 
 	/* alloc L2 cache */
-	size = s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t);
-	ret = posix_memalign((void **)&s->l2_cache, 4096, size);
-	if(ret != 0) goto fail;
+	if (l2_cache_init(s))
+		goto fail;
 
 	size = s->cluster_size;
 	ret = posix_memalign((void **)&s->cluster_cache, 4096, size);
@@ -956,6 +1271,13 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 	  goto fail;
 	}
 
+	if (fstat(fd, &st))
+		goto fail;
+	if (S_ISBLK(st.st_mode))
+		s->file_size = ~0ULL;
+	else
+		s->file_size = st.st_size;
+
 	if (!final_cluster)
 		s->fd_end = s->l1_table_offset +
 			((s->l1_size * sizeof(uint64_t) + 4095) & ~4095);
@@ -972,7 +1294,7 @@ fail:
 
 	free_aio_state(s);
 	free(s->l1_table);
-	free(s->l2_cache);
+	l2_cache_free(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(fd);
@@ -984,7 +1306,7 @@ void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
 	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
 	int ret = 0, index_in_cluster, n, i;
 	uint64_t cluster_offset, sector, nb_sectors;
-	struct qcow_prv* prv;
+	struct qcow_l2_table *l2;
 	td_request_t clone = treq;
 	char* buf = treq.buf;
 
@@ -993,8 +1315,6 @@ void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
 
 	/*We store a local record of the request*/
 	while (nb_sectors > 0) {
-		cluster_offset = 
-			get_cluster_offset(s, sector << 9, 0, 0, 0, 0);
 		index_in_cluster = sector & (s->cluster_sectors - 1);
 		n = s->cluster_sectors - index_in_cluster;
 		if (n > nb_sectors)
@@ -1004,23 +1324,29 @@ void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
 			td_complete_request(treq, -EBUSY);
 			return;
 		}
-		
-		if(!cluster_offset) {
-            int i;
-            /* Forward entire request if possible. */
-            for(i=0; i<nb_sectors; i++)
-                if(get_cluster_offset(s, (sector+i) << 9, 0, 0, 0, 0))
-                    goto coalesce_failed;
-            treq.buf  = buf;
-            treq.sec  = sector;
-            treq.secs = nb_sectors;
-			td_forward_request(treq);
-            return;
-coalesce_failed:            
-			treq.buf  = buf;
-			treq.sec  = sector;
-			treq.secs = n;
-			td_forward_request(treq);
+
+		clone.buf  = buf;
+		clone.sec  = sector;
+		clone.secs = n;
+
+		ret = get_cluster_offset(s, driver, sector << 9, 0, 0, 0, 0,
+					 &cluster_offset, &l2);
+		if (ret == -EAGAIN) {
+			ret = l2_cache_wait(s, driver, l2, clone);
+			if (ret)
+				td_complete_request(clone, ret);
+		} else if (ret) {
+			td_complete_request(clone, ret);
+		} else if(!cluster_offset) {
+			/* Forward as much of the request as is known
+			 * to be unallocated. */
+			for (i = n; i < nb_sectors; i += s->cluster_sectors)
+				if (!cluster_clear_cached(s, sector + i))
+					break;
+			if (i > nb_sectors)
+				i = nb_sectors;
+			n = clone.secs = i;
+			td_forward_request(clone);
 
 		} else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
 			if (decompress_cluster(s, cluster_offset) < 0) {
@@ -1054,7 +1380,7 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 	int ret = 0, index_in_cluster, n, i;
 	uint64_t cluster_offset, sector, nb_sectors;
 	td_callback_t cb;
-	struct qcow_prv* prv;
+	struct qcow_l2_table *l2;
 	char* buf = treq.buf;
 	td_request_t clone=treq;
 
@@ -1073,13 +1399,24 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 			return;
 		}
 
-		cluster_offset = get_cluster_offset(s, sector << 9, 1, 0,
-						    index_in_cluster, 
-						    index_in_cluster+n);
-		if (!cluster_offset) {
+		clone.buf  = buf;
+		clone.sec  = sector;
+		clone.secs = n;
+
+		ret = get_cluster_offset(s, driver, sector << 9, 1, 0,
+					 index_in_cluster,
+					 index_in_cluster+n,
+					 &cluster_offset, &l2);
+		if (ret == -EAGAIN) {
+			ret = l2_cache_wait(s, driver, l2, clone);
+			if (ret)
+				td_complete_request(clone, ret);
+			goto next;
+		}
+		if (ret || !cluster_offset) {
 			DPRINTF("Ooops, no write cluster offset!\n");
-			td_complete_request(treq, -EIO);
-			return;
+			td_complete_request(clone, ret ? ret : -EIO);
+			goto next;
 		}
 
 		if (s->crypt_method) {
@@ -1098,7 +1435,8 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 
 		  async_write(driver, clone);
 		}
-		
+
+next:
 		nb_sectors -= n;
 		sector += n;
 		buf += n * 512;
@@ -1164,10 +1502,13 @@ int tdqcow_close(td_driver_t *driver)
 	/*Update the hdr cksum*/
 	tdqcow_update_checksum(s);
 
+	DPRINTF("%s: L2 cache hits %"PRIu64", misses %"PRIu64"\n",
+		s->name, s->l2_hits, s->l2_misses);
+
 	free_aio_state(s);
 	free(s->name);
 	free(s->l1_table);
-	free(s->l2_cache);
+	l2_cache_free(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(s->fd);	
@@ -1330,9 +1671,8 @@ static int qcow_make_empty(struct tdqcow_state *s)
 		return -1;
 	}
 
-	memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+	l2_cache_reset(s);
+	s->fd_end = s->file_size = s->l1_table_offset + l1_length;
 
 	return 0;
 }
@@ -1385,11 +1725,13 @@ static int qcow_compress_cluster(struct tdqcow_state *s, int64_t sector_num,
 		/* could not compress: write normal cluster */
 		//tdqcow_queue_write(bs, sector_num, buf, s->cluster_sectors);
 	} else {
-		cluster_offset = get_cluster_offset(s, sector_num << 9, 2, 
-                                            out_len, 0, 0);
+		if (get_cluster_offset(s, NULL, sector_num << 9, 2,
+				       out_len, 0, 0, &cluster_offset, NULL)) {
+			free(out_buf);
+			return -1;
+		}
 		cluster_offset &= s->cluster_offset_mask;
-		lseek(s->fd, cluster_offset, SEEK_SET);
-		if (write(s->fd, out_buf, out_len) != out_len) {
+		if (pwrite(s->fd, out_buf, out_len, cluster_offset) != out_len) {
 			free(out_buf);
 			return -1;
 		}
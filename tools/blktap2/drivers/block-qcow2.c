@@ -0,0 +1,2029 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * A note on allocating writes:
+ * A write to a cluster that is not yet allocated (or is shared,
+ * compressed or a v3 zero cluster) needs a new host cluster, a
+ * refcount update and an L2 update, and possibly a new L2 table and
+ * L1 update.  Such writes are grouped in a transaction covering one
+ * L2 table.  The transaction collects writes until the next scheduler
+ * pass and then, in order:
+ *   - reserves host clusters at the end of the image and loads the
+ *     refcount blocks describing them;
+ *   - writes the refcount updates and the cluster contents (partially
+ *     written clusters are filled from the old cluster or the parent
+ *     image first);
+ *   - updates and writes the L2 table;
+ *   - for a new L2 table, updates and writes the L1 entry.
+ * Only then are the data writes completed.  One transaction is in
+ * flight at a time; other allocating writes wait for it to finish.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "bswap.h"
+#include "list.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-log.h"
+#include "qcow2.h"
+
+#define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+#define QCOW2_SECTOR            512
+#define QCOW2_CACHE_SIZE        64     /* default number of cached tables */
+#define QCOW2_CACHE_MIN         8      /* tables pinned by a transaction */
+#define QCOW2_CACHE_MAX         65536
+#define QCOW2_TX_MAX            64     /* clusters per transaction */
+
+#define QCOW2_TABLE_VALID        0x01
+#define QCOW2_TABLE_READ_PENDING 0x02
+
+#ifndef MIN
+#define MIN(a, b)               (((a) < (b)) ? (a) : (b))
+#endif
+
+#define ROUND_UP(_x, _a)        (((_x) + (_a) - 1) & ~((uint64_t)(_a) - 1))
+#define ROUND_DOWN(_x, _a)      ((_x) & ~((uint64_t)(_a) - 1))
+
+struct qcow2_state;
+
+struct qcow2_request {
+	td_request_t               treq;
+	struct tiocb               tiocb;
+	struct qcow2_state        *state;
+	td_driver_t               *driver;
+	struct qcow2_request      *next;
+};
+
+/* a cached L2 table or refcount block, kept in on-disk byte order */
+struct qcow2_table {
+	uint64_t                   offset;     /* 0 if unused */
+	void                      *data;
+	int                        status;
+	int                        lock;
+	int                        dirty_lo;   /* bytes to write back */
+	int                        dirty_hi;
+	struct qcow2_state        *state;
+	struct qcow2_table        *hnext;
+	struct list_head           lru;
+	struct qcow2_request      *waiting;
+	struct qcow2_request      *waiting_tail;
+	struct tiocb               tiocb;
+};
+
+/* one cluster being allocated by a transaction */
+struct qcow2_cluster {
+	uint64_t                   vcluster;   /* guest cluster number */
+	uint64_t                   old;        /* L2 entry before the write */
+	uint64_t                   offset;     /* new host offset */
+	int                        fill_secs;  /* parent read outstanding */
+	int                        fill_err;
+	char                      *bounce;
+	struct qcow2_state        *state;
+	struct qcow2_request      *chunks;
+	struct qcow2_request      *chunks_tail;
+	struct tiocb               tiocb;
+};
+
+enum {
+	QCOW2_TX_IDLE = 0,
+	QCOW2_TX_OPEN,           /* collecting writes */
+	QCOW2_TX_META,           /* waiting for refcount blocks */
+	QCOW2_TX_DATA,           /* refcount and data writes */
+	QCOW2_TX_L2,             /* L2 table write */
+	QCOW2_TX_L1,             /* L1 entry write */
+};
+
+struct qcow2_tx {
+	int                        state;
+	int                        err;
+	int                        pending;
+	int                        reserved;
+	event_id_t                 event;
+	td_driver_t               *driver;
+	uint32_t                   l1_index;
+	uint64_t                   l2_offset;
+	int                        new_l2;
+	struct qcow2_table        *l2;
+	int                        nr_refblocks;
+	struct qcow2_table        *refblocks[QCOW2_TX_MAX + 1];
+	int                        nr;
+	struct qcow2_cluster       clusters[QCOW2_TX_MAX];
+	char                      *l1_buf;
+	struct tiocb               l1_tiocb;
+};
+
+struct qcow2_state {
+	int                        fd;
+	char                      *name;
+	td_flag_t                  flags;
+
+	uint32_t                   version;
+	int                        cluster_bits;
+	uint32_t                   cluster_size;
+	int                        cluster_sectors;
+	int                        l2_bits;
+	int                        l2_size;
+	int                        rb_bits;    /* log2 refcounts per block */
+	uint64_t                   size;
+
+	uint64_t                   backing_file_offset;
+	uint32_t                   backing_file_size;
+	int                        backing_type;
+
+	uint32_t                   l1_size;
+	uint64_t                   l1_table_offset;
+	uint64_t                  *l1_table;   /* host byte order */
+
+	uint32_t                   rt_size;
+	uint64_t                   rt_offset;
+	uint64_t                  *rt;         /* host byte order */
+
+	uint64_t                   alloc_end;  /* next free host cluster */
+
+	/* L2 and refcount block cache */
+	int                        cache_size;
+	int                        hash_bits;
+	struct qcow2_table        *tables;
+	struct qcow2_table       **hash;
+	struct list_head           lru;
+	char                      *cache_data;
+	uint64_t                   hits;
+	uint64_t                   misses;
+
+	/* last decompressed cluster */
+	uint8_t                   *cluster_cache;
+	uint8_t                   *cluster_data;
+	uint64_t                   cluster_cache_offset;
+
+	int                        nr_reqs;
+	int                        nr_free;
+	struct qcow2_request      *reqs;
+	struct qcow2_request     **free_list;
+
+	/* allocating writes waiting for the current transaction */
+	struct qcow2_request      *alloc_wait;
+	struct qcow2_request      *alloc_wait_tail;
+
+	struct qcow2_tx            tx;
+
+	uint64_t                   reads;
+	uint64_t                   writes;
+	uint64_t                   allocs;
+};
+
+static void qcow2_queue_read(td_driver_t *, td_request_t);
+static void qcow2_queue_write(td_driver_t *, td_request_t);
+static void qcow2_tx_run(struct qcow2_state *);
+static void qcow2_tx_put(struct qcow2_state *, int);
+
+static inline uint64_t
+qcow2_l2_index(struct qcow2_state *s, uint64_t offset)
+{
+	return (offset >> s->cluster_bits) & (s->l2_size - 1);
+}
+
+static inline uint32_t
+qcow2_l1_index(struct qcow2_state *s, uint64_t offset)
+{
+	return offset >> (s->cluster_bits + s->l2_bits);
+}
+
+static struct qcow2_request *
+qcow2_alloc_request(struct qcow2_state *s, td_driver_t *driver,
+		    td_request_t treq)
+{
+	struct qcow2_request *req;
+
+	if (!s->nr_free)
+		return NULL;
+
+	req         = s->free_list[--s->nr_free];
+	req->treq   = treq;
+	req->state  = s;
+	req->driver = driver;
+	req->next   = NULL;
+
+	return req;
+}
+
+static inline void
+qcow2_free_request(struct qcow2_state *s, struct qcow2_request *req)
+{
+	s->free_list[s->nr_free++] = req;
+}
+
+static void
+qcow2_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qcow2_request *req = (struct qcow2_request *)arg;
+	struct qcow2_state *s = req->state;
+
+	td_complete_request(req->treq, err);
+	qcow2_free_request(s, req);
+}
+
+static int
+qcow2_queue_data(struct qcow2_state *s, td_driver_t *driver,
+		 td_request_t treq, uint64_t offset)
+{
+	struct qcow2_request *req;
+
+	req = qcow2_alloc_request(s, driver, treq);
+	if (!req)
+		return -EBUSY;
+
+	if (treq.op == TD_OP_WRITE)
+		td_prep_write(&req->tiocb, s->fd, treq.buf,
+			      treq.secs << SECTOR_SHIFT, offset,
+			      qcow2_complete, req);
+	else
+		td_prep_read(&req->tiocb, s->fd, treq.buf,
+			     treq.secs << SECTOR_SHIFT, offset,
+			     qcow2_complete, req);
+
+	td_queue_tiocb(driver, &req->tiocb);
+	return 0;
+}
+
+/*
+ * Metadata cache.  L2 tables and refcount blocks are both one cluster
+ * and share a hashed cache recycled in LRU order.  Misses are read
+ * through the tiocb queue; requests that need a table being read are
+ * parked on it and resubmitted when it arrives.
+ */
+static inline int
+qcow2_hash(struct qcow2_state *s, uint64_t offset)
+{
+	return (int)(((offset >> s->cluster_bits) * 0x9e3779b97f4a7c15ULL) >>
+		     (64 - s->hash_bits));
+}
+
+static void
+qcow2_table_unhash(struct qcow2_state *s, struct qcow2_table *t)
+{
+	struct qcow2_table **pp;
+
+	if (!t->offset)
+		return;
+
+	for (pp = &s->hash[qcow2_hash(s, t->offset)]; *pp; pp = &(*pp)->hnext)
+		if (*pp == t) {
+			*pp = t->hnext;
+			break;
+		}
+
+	t->offset = 0;
+	t->status = 0;
+	t->hnext  = NULL;
+}
+
+static struct qcow2_table *
+qcow2_table_lookup(struct qcow2_state *s, uint64_t offset)
+{
+	struct qcow2_table *t;
+
+	for (t = s->hash[qcow2_hash(s, offset)]; t; t = t->hnext)
+		if (t->offset == offset) {
+			list_del(&t->lru);
+			list_add_tail(&t->lru, &s->lru);
+			return t;
+		}
+
+	return NULL;
+}
+
+static struct qcow2_table *
+qcow2_table_alloc(struct qcow2_state *s, uint64_t offset)
+{
+	int h;
+	struct qcow2_table *t;
+
+	list_for_each_entry(t, &s->lru, lru)
+		if (!t->lock)
+			goto found;
+
+	DPRINTF("%s: metadata cache exhausted\n", s->name);
+	return NULL;
+
+found:
+	qcow2_table_unhash(s, t);
+
+	h          = qcow2_hash(s, offset);
+	t->offset  = offset;
+	t->hnext   = s->hash[h];
+	s->hash[h] = t;
+
+	list_del(&t->lru);
+	list_add_tail(&t->lru, &s->lru);
+	return t;
+}
+
+static void
+qcow2_table_read_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	td_request_t treq;
+	td_driver_t *driver;
+	struct qcow2_table *t = (struct qcow2_table *)arg;
+	struct qcow2_state *s = t->state;
+	struct qcow2_request *req, *next;
+
+	req = t->waiting;
+	t->waiting = t->waiting_tail = NULL;
+
+	if (err) {
+		EPRINTF("%s: table read at 0x%"PRIx64" failed: %d\n",
+			s->name, t->offset, err);
+		qcow2_table_unhash(s, t);
+	} else
+		t->status = QCOW2_TABLE_VALID;
+
+	/* keep the table pinned while the waiters are resubmitted */
+	for (; req; req = next) {
+		next   = req->next;
+		treq   = req->treq;
+		driver = req->driver;
+
+		qcow2_free_request(s, req);
+
+		if (err)
+			td_complete_request(treq, err);
+		else if (treq.op == TD_OP_WRITE)
+			qcow2_queue_write(driver, treq);
+		else
+			qcow2_queue_read(driver, treq);
+	}
+
+	t->lock--;
+
+	if (s->tx.state == QCOW2_TX_META)
+		qcow2_tx_run(s);
+}
+
+static void
+qcow2_table_read(struct qcow2_state *s, td_driver_t *driver,
+		 struct qcow2_table *t)
+{
+	s->misses++;
+	t->status = QCOW2_TABLE_READ_PENDING;
+	t->lock++;
+
+	td_prep_read(&t->tiocb, s->fd, t->data, s->cluster_size,
+		     t->offset, qcow2_table_read_complete, t);
+	td_queue_tiocb(driver, &t->tiocb);
+}
+
+/* Look up the table at @offset, starting a read if it is not cached. */
+static int
+qcow2_table_get(struct qcow2_state *s, td_driver_t *driver,
+		uint64_t offset, struct qcow2_table **table)
+{
+	struct qcow2_table *t;
+
+	t = qcow2_table_lookup(s, offset);
+	if (t)
+		s->hits++;
+	else {
+		t = qcow2_table_alloc(s, offset);
+		if (!t)
+			return -EBUSY;
+		qcow2_table_read(s, driver, t);
+	}
+
+	*table = t;
+	return (t->status & QCOW2_TABLE_READ_PENDING) ? -EAGAIN : 0;
+}
+
+/* Park a request until the table it depends on has been read. */
+static int
+qcow2_table_wait(struct qcow2_state *s, td_driver_t *driver,
+		 struct qcow2_table *t, td_request_t treq)
+{
+	struct qcow2_request *req;
+
+	req = qcow2_alloc_request(s, driver, treq);
+	if (!req)
+		return -EBUSY;
+
+	if (t->waiting_tail)
+		t->waiting_tail->next = req;
+	else
+		t->waiting = req;
+	t->waiting_tail = req;
+
+	return 0;
+}
+
+static inline void
+qcow2_table_dirty(struct qcow2_table *t, int lo, int hi)
+{
+	if (t->dirty_hi <= t->dirty_lo) {
+		t->dirty_lo = lo;
+		t->dirty_hi = hi;
+		return;
+	}
+
+	if (lo < t->dirty_lo)
+		t->dirty_lo = lo;
+	if (hi > t->dirty_hi)
+		t->dirty_hi = hi;
+}
+
+static void
+qcow2_tx_io_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	qcow2_tx_put((struct qcow2_state *)arg, err);
+}
+
+/* Write back the dirty part of a table as part of the transaction. */
+static void
+qcow2_table_write(struct qcow2_state *s, struct qcow2_table *t)
+{
+	uint64_t lo, hi;
+
+	lo = ROUND_DOWN(t->dirty_lo, QCOW2_SECTOR);
+	hi = ROUND_UP(t->dirty_hi, QCOW2_SECTOR);
+	t->dirty_lo = t->dirty_hi = 0;
+
+	s->tx.pending++;
+	td_prep_write(&t->tiocb, s->fd, (char *)t->data + lo, hi - lo,
+		      t->offset + lo, qcow2_tx_io_complete, s);
+	td_queue_tiocb(s->tx.driver, &t->tiocb);
+}
+
+static void
+qcow2_cache_free(struct qcow2_state *s)
+{
+	free(s->tables);
+	free(s->hash);
+	free(s->cache_data);
+	s->tables     = NULL;
+	s->hash       = NULL;
+	s->cache_data = NULL;
+}
+
+static int
+qcow2_cache_init(struct qcow2_state *s)
+{
+	int i, err;
+	char *env;
+
+	s->cache_size = QCOW2_CACHE_SIZE;
+
+	env = getenv("TAPDISK2_QCOW2_CACHE");
+	if (env) {
+		i = atoi(env);
+		if (i >= QCOW2_CACHE_MIN && i <= QCOW2_CACHE_MAX)
+			s->cache_size = i;
+		else
+			DPRINTF("ignoring bad cache size '%s'\n", env);
+	}
+
+	s->hash_bits = 1;
+	while ((1 << s->hash_bits) < 2 * s->cache_size)
+		s->hash_bits++;
+
+	INIT_LIST_HEAD(&s->lru);
+
+	s->tables = calloc(s->cache_size, sizeof(struct qcow2_table));
+	s->hash   = calloc(1 << s->hash_bits, sizeof(struct qcow2_table *));
+	if (!s->tables || !s->hash)
+		goto fail;
+
+	err = posix_memalign((void **)&s->cache_data, getpagesize(),
+			     (size_t)s->cluster_size * s->cache_size);
+	if (err) {
+		s->cache_data = NULL;
+		goto fail;
+	}
+
+	for (i = 0; i < s->cache_size; i++) {
+		struct qcow2_table *t = s->tables + i;
+
+		t->data  = s->cache_data + (size_t)i * s->cluster_size;
+		t->state = s;
+		list_add_tail(&t->lru, &s->lru);
+	}
+
+	return 0;
+
+fail:
+	qcow2_cache_free(s);
+	return -ENOMEM;
+}
+
+/*
+ * Find the L2 entry for guest @offset.  Returns 0 with the entry in
+ * *entry (0 if unallocated), or -EAGAIN with *table set to the L2
+ * table being read.  *table is NULL if the L1 has no table yet.
+ */
+static int
+qcow2_get_l2_entry(struct qcow2_state *s, td_driver_t *driver,
+		   uint64_t offset, uint64_t *entry,
+		   struct qcow2_table **table)
+{
+	int err;
+	uint32_t l1_index;
+	uint64_t l2_offset;
+	struct qcow2_table *t;
+
+	*entry = 0;
+	*table = NULL;
+
+	l1_index = qcow2_l1_index(s, offset);
+	if (l1_index >= s->l1_size)
+		return -EINVAL;
+
+	l2_offset = s->l1_table[l1_index] & QCOW2_OFFSET_MASK;
+	if (!l2_offset)
+		return 0;
+
+	err = qcow2_table_get(s, driver, l2_offset, &t);
+	*table = t;
+	if (err)
+		return err;
+
+	*entry = be64_to_cpu(((uint64_t *)t->data)[qcow2_l2_index(s, offset)]);
+	return 0;
+}
+
+/* Nonzero if guest @sector is known to be unallocated without I/O. */
+static int
+qcow2_sector_clear_cached(struct qcow2_state *s, uint64_t sector)
+{
+	uint32_t l1_index;
+	uint64_t offset, l2_offset;
+	struct qcow2_table *t;
+
+	offset   = sector << SECTOR_SHIFT;
+	l1_index = qcow2_l1_index(s, offset);
+	if (l1_index >= s->l1_size)
+		return 0;
+
+	l2_offset = s->l1_table[l1_index] & QCOW2_OFFSET_MASK;
+	if (!l2_offset)
+		return 1;
+
+	t = qcow2_table_lookup(s, l2_offset);
+	if (!t || !(t->status & QCOW2_TABLE_VALID))
+		return 0;
+
+	return !((uint64_t *)t->data)[qcow2_l2_index(s, offset)];
+}
+
+static int
+qcow2_decompress_cluster(struct qcow2_state *s, uint64_t entry)
+{
+	int ret, csize_shift;
+	z_stream strm;
+	uint64_t coffset, start, nb_csectors, len;
+
+	csize_shift = 62 - (s->cluster_bits - 8);
+	coffset     = entry & ((1ULL << csize_shift) - 1);
+	nb_csectors = ((entry >> csize_shift) &
+		       ((1ULL << (s->cluster_bits - 8)) - 1)) + 1;
+
+	if (s->cluster_cache_offset == coffset)
+		return 0;
+
+	start = ROUND_DOWN(coffset, QCOW2_SECTOR);
+	len   = ROUND_UP(coffset + nb_csectors * QCOW2_SECTOR, QCOW2_SECTOR)
+		- start;
+	if (len > 2 * s->cluster_size)
+		return -EIO;
+
+	if (pread(s->fd, s->cluster_data, len, start) != len)
+		return -errno ? : -EIO;
+
+	memset(&strm, 0, sizeof(strm));
+	strm.next_in   = s->cluster_data + (coffset - start);
+	strm.avail_in  = len - (coffset - start);
+	strm.next_out  = s->cluster_cache;
+	strm.avail_out = s->cluster_size;
+
+	if (inflateInit2(&strm, -12) != Z_OK)
+		return -EIO;
+	ret = inflate(&strm, Z_FINISH);
+	inflateEnd(&strm);
+
+	if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+	    strm.total_out != s->cluster_size)
+		return -EIO;
+
+	s->cluster_cache_offset = coffset;
+	return 0;
+}
+
+static void
+qcow2_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	int err, i;
+	uint64_t entry, idx;
+	td_request_t clone;
+	struct qcow2_table *t;
+	struct qcow2_state *s = (struct qcow2_state *)driver->data;
+
+	while (treq.secs) {
+		clone      = treq;
+		idx        = treq.sec & (s->cluster_sectors - 1);
+		clone.secs = MIN(treq.secs, s->cluster_sectors - idx);
+
+		err = qcow2_get_l2_entry(s, driver, clone.sec << SECTOR_SHIFT,
+					 &entry, &t);
+		if (err == -EAGAIN) {
+			err = qcow2_table_wait(s, driver, t, clone);
+			goto next;
+		}
+		if (err)
+			goto next;
+
+		if (entry & QCOW2_OFLAG_COMPRESSED) {
+			err = qcow2_decompress_cluster(s, entry);
+			if (!err) {
+				memcpy(clone.buf, s->cluster_cache +
+				       (idx << SECTOR_SHIFT),
+				       clone.secs << SECTOR_SHIFT);
+				td_complete_request(clone, 0);
+			}
+		} else if (s->version >= 3 && (entry & QCOW2_OFLAG_ZERO)) {
+			memset(clone.buf, 0, clone.secs << SECTOR_SHIFT);
+			td_complete_request(clone, 0);
+		} else if (!(entry & QCOW2_OFFSET_MASK)) {
+			/* forward as much as is known to be unallocated */
+			for (i = clone.secs; i < treq.secs;
+			     i += s->cluster_sectors)
+				if (!qcow2_sector_clear_cached(s, treq.sec + i))
+					break;
+			clone.secs = MIN(i, treq.secs);
+			td_forward_request(clone);
+		} else {
+			s->reads++;
+			err = qcow2_queue_data(s, driver, clone,
+					       (entry & QCOW2_OFFSET_MASK) +
+					       (idx << SECTOR_SHIFT));
+		}
+
+	next:
+		if (err)
+			td_complete_request(clone, err);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += clone.secs << SECTOR_SHIFT;
+	}
+}
+
+/*
+ * Reserve a host cluster at the end of the image.  Refcount blocks are
+ * created here, synchronously, when the new cluster is the first one
+ * in their range; this happens once per (cluster_size / 2) clusters.
+ */
+static int
+qcow2_reserve_cluster(struct qcow2_state *s, uint64_t *offset)
+{
+	int err;
+	char *buf;
+	uint64_t idx, k, rb, sec;
+
+	for (;;) {
+		idx = s->alloc_end >> s->cluster_bits;
+		k   = idx >> s->rb_bits;
+
+		if (k >= s->rt_size) {
+			EPRINTF("%s: refcount table full\n", s->name);
+			return -ENOSPC;
+		}
+
+		if (s->rt[k] & QCOW2_OFFSET_MASK)
+			break;
+
+		/* new refcount block, describing itself */
+		rb = s->alloc_end;
+
+		err = posix_memalign((void **)&buf, QCOW2_SECTOR,
+				     s->cluster_size);
+		if (err)
+			return -err;
+
+		memset(buf, 0, s->cluster_size);
+		((uint16_t *)buf)[idx & ((1 << s->rb_bits) - 1)] =
+			cpu_to_be16(1);
+
+		if (pwrite(s->fd, buf, s->cluster_size, rb) !=
+		    s->cluster_size) {
+			err = -errno ? : -EIO;
+			goto fail;
+		}
+
+		/* and hook it into the refcount table */
+		s->rt[k] = rb;
+		sec = ROUND_DOWN(k * sizeof(uint64_t), QCOW2_SECTOR);
+		memcpy(buf, (char *)s->rt + sec, QCOW2_SECTOR);
+		for (idx = 0; idx < QCOW2_SECTOR / sizeof(uint64_t); idx++)
+			cpu_to_be64s((uint64_t *)buf + idx);
+
+		if (pwrite(s->fd, buf, QCOW2_SECTOR, s->rt_offset + sec) !=
+		    QCOW2_SECTOR) {
+			s->rt[k] = 0;
+			err = -errno ? : -EIO;
+			goto fail;
+		}
+
+		free(buf);
+		s->alloc_end += s->cluster_size;
+	}
+
+	*offset       = s->alloc_end;
+	s->alloc_end += s->cluster_size;
+	return 0;
+
+fail:
+	free(buf);
+	return err;
+}
+
+static int
+qcow2_alloc_wait(struct qcow2_state *s, td_driver_t *driver,
+		 td_request_t treq)
+{
+	struct qcow2_request *req;
+
+	req = qcow2_alloc_request(s, driver, treq);
+	if (!req)
+		return -EBUSY;
+
+	if (s->alloc_wait_tail)
+		s->alloc_wait_tail->next = req;
+	else
+		s->alloc_wait = req;
+	s->alloc_wait_tail = req;
+
+	return 0;
+}
+
+static void
+qcow2_tx_submit(event_id_t id, char mode, void *private)
+{
+	struct qcow2_state *s = (struct qcow2_state *)private;
+	struct qcow2_tx *tx = &s->tx;
+
+	tapdisk_server_unregister_event(tx->event);
+	tx->event = 0;
+	tx->state = QCOW2_TX_META;
+
+	qcow2_tx_run(s);
+}
+
+static int
+qcow2_tx_open(struct qcow2_state *s, td_driver_t *driver,
+	      uint32_t l1_index, struct qcow2_table *l2)
+{
+	struct qcow2_tx *tx = &s->tx;
+	event_id_t id;
+
+	/* submit on the next pass, once the whole ring has been queued */
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					   -1, 0, qcow2_tx_submit, s);
+	if (id < 0)
+		return id;
+
+	tx->state    = QCOW2_TX_OPEN;
+	tx->event    = id;
+	tx->driver   = driver;
+	tx->l1_index = l1_index;
+	tx->l2       = l2;
+	tx->new_l2   = !l2;
+	if (l2)
+		l2->lock++;
+
+	return 0;
+}
+
+static int
+qcow2_tx_add(struct qcow2_state *s, td_driver_t *driver,
+	     td_request_t treq, uint64_t entry, struct qcow2_table *l2)
+{
+	int i, err;
+	uint32_t l1_index;
+	uint64_t vcluster;
+	struct qcow2_cluster *c;
+	struct qcow2_request *req;
+	struct qcow2_tx *tx = &s->tx;
+
+	l1_index = qcow2_l1_index(s, treq.sec << SECTOR_SHIFT);
+	vcluster = treq.sec >> (s->cluster_bits - SECTOR_SHIFT);
+
+	if (tx->state == QCOW2_TX_IDLE) {
+		err = qcow2_tx_open(s, driver, l1_index, l2);
+		if (err)
+			return err;
+	}
+
+	if (tx->state != QCOW2_TX_OPEN || tx->l1_index != l1_index)
+		return qcow2_alloc_wait(s, driver, treq);
+
+	c = NULL;
+	for (i = 0; i < tx->nr; i++)
+		if (tx->clusters[i].vcluster == vcluster) {
+			c = tx->clusters + i;
+			break;
+		}
+
+	if (!c) {
+		if (tx->nr == QCOW2_TX_MAX)
+			return qcow2_alloc_wait(s, driver, treq);
+
+		c = tx->clusters + tx->nr;
+		memset(c, 0, sizeof(*c));
+		c->vcluster = vcluster;
+		c->old      = entry;
+		c->state    = s;
+	}
+
+	req = qcow2_alloc_request(s, driver, treq);
+	if (!req)
+		return -EBUSY;
+
+	if (c == tx->clusters + tx->nr)
+		tx->nr++;
+
+	if (c->chunks_tail)
+		c->chunks_tail->next = req;
+	else
+		c->chunks = req;
+	c->chunks_tail = req;
+
+	return 0;
+}
+
+static void
+qcow2_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	int err;
+	uint64_t entry, idx;
+	td_request_t clone;
+	struct qcow2_table *t;
+	struct qcow2_state *s = (struct qcow2_state *)driver->data;
+
+	while (treq.secs) {
+		clone      = treq;
+		idx        = treq.sec & (s->cluster_sectors - 1);
+		clone.secs = MIN(treq.secs, s->cluster_sectors - idx);
+
+		err = qcow2_get_l2_entry(s, driver, clone.sec << SECTOR_SHIFT,
+					 &entry, &t);
+		if (err == -EAGAIN) {
+			err = qcow2_table_wait(s, driver, t, clone);
+			goto next;
+		}
+		if (err)
+			goto next;
+
+		if ((entry & QCOW2_OFLAG_COPIED) &&
+		    (entry & QCOW2_OFFSET_MASK) &&
+		    !(entry & QCOW2_OFLAG_COMPRESSED) &&
+		    !(s->version >= 3 && (entry & QCOW2_OFLAG_ZERO))) {
+			s->writes++;
+			err = qcow2_queue_data(s, driver, clone,
+					       (entry & QCOW2_OFFSET_MASK) +
+					       (idx << SECTOR_SHIFT));
+		} else
+			err = qcow2_tx_add(s, driver, clone, entry, t);
+
+	next:
+		if (err)
+			td_complete_request(clone, err);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += clone.secs << SECTOR_SHIFT;
+	}
+}
+
+static int
+qcow2_tx_reserve(struct qcow2_state *s)
+{
+	int i, err;
+	struct qcow2_table *t;
+	struct qcow2_tx *tx = &s->tx;
+
+	if (tx->new_l2) {
+		err = qcow2_reserve_cluster(s, &tx->l2_offset);
+		if (err)
+			return err;
+
+		t = qcow2_table_alloc(s, tx->l2_offset);
+		if (!t) {
+			s->alloc_end -= s->cluster_size;
+			return -EBUSY;
+		}
+
+		memset(t->data, 0, s->cluster_size);
+		t->status = QCOW2_TABLE_VALID;
+		t->lock++;
+		tx->l2 = t;
+	}
+
+	for (i = 0; i < tx->nr; i++) {
+		err = qcow2_reserve_cluster(s, &tx->clusters[i].offset);
+		if (err)
+			return err;
+	}
+
+	tx->reserved = 1;
+	s->allocs   += tx->nr;
+	return 0;
+}
+
+static int
+qcow2_tx_get_refblock(struct qcow2_state *s, uint64_t offset,
+		      struct qcow2_table **table)
+{
+	int i, err;
+	uint64_t rb;
+	struct qcow2_table *t;
+	struct qcow2_tx *tx = &s->tx;
+
+	rb = s->rt[offset >> (s->cluster_bits + s->rb_bits)] &
+		QCOW2_OFFSET_MASK;
+
+	for (i = 0; i < tx->nr_refblocks; i++)
+		if (tx->refblocks[i]->offset == rb) {
+			t = tx->refblocks[i];
+			goto out;
+		}
+
+	/*
+	 * With the cache full of tables being read, wait for one of
+	 * those reads to complete; the cache is large enough to hold
+	 * all the tables a transaction pins.
+	 */
+	err = qcow2_table_get(s, tx->driver, rb, &t);
+	if (err == -EBUSY)
+		return -EAGAIN;
+	if (err && err != -EAGAIN)
+		return err;
+
+	t->lock++;
+	tx->refblocks[tx->nr_refblocks++] = t;
+
+out:
+	*table = t;
+	if (t->status & QCOW2_TABLE_READ_PENDING)
+		return -EAGAIN;
+	if (!(t->status & QCOW2_TABLE_VALID))
+		return -EIO;
+	return 0;
+}
+
+/* Take a reference on every cluster the transaction allocates. */
+static int
+qcow2_tx_refcounts(struct qcow2_state *s, int update)
+{
+	int i, n, err, pending;
+	uint64_t idx, offset;
+	uint16_t *rc;
+	struct qcow2_table *t;
+	struct qcow2_tx *tx = &s->tx;
+
+	pending = 0;
+
+	for (i = -1; i < tx->nr; i++) {
+		if (i < 0) {
+			if (!tx->new_l2)
+				continue;
+			offset = tx->l2_offset;
+		} else
+			offset = tx->clusters[i].offset;
+
+		err = qcow2_tx_get_refblock(s, offset, &t);
+		if (err == -EAGAIN) {
+			pending = 1;
+			continue;
+		}
+		if (err)
+			return err;
+
+		if (!update)
+			continue;
+
+		idx = (offset >> s->cluster_bits) & ((1 << s->rb_bits) - 1);
+		rc  = (uint16_t *)t->data + idx;
+		n   = be16_to_cpu(*rc);
+		if (n)
+			DPRINTF("%s: cluster 0x%"PRIx64" already has "
+				"refcount %d\n", s->name, offset, n);
+		*rc = cpu_to_be16(n + 1);
+
+		qcow2_table_dirty(t, idx * sizeof(uint16_t),
+				  (idx + 1) * sizeof(uint16_t));
+	}
+
+	return pending ? -EAGAIN : 0;
+}
+
+static void
+qcow2_cluster_write(struct qcow2_state *s, struct qcow2_cluster *c)
+{
+	struct qcow2_request *req;
+
+	for (req = c->chunks; req; req = req->next) {
+		uint64_t idx = req->treq.sec & (s->cluster_sectors - 1);
+		memcpy(c->bounce + (idx << SECTOR_SHIFT), req->treq.buf,
+		       req->treq.secs << SECTOR_SHIFT);
+	}
+
+	s->tx.pending++;
+	td_prep_write(&c->tiocb, s->fd, c->bounce, s->cluster_size,
+		      c->offset, qcow2_tx_io_complete, s);
+	td_queue_tiocb(s->tx.driver, &c->tiocb);
+}
+
+static void
+qcow2_cluster_fill_complete(td_request_t treq, int err)
+{
+	struct qcow2_cluster *c = (struct qcow2_cluster *)treq.cb_data;
+	struct qcow2_state *s = c->state;
+
+	if (err)
+		c->fill_err = err;
+
+	c->fill_secs -= treq.secs;
+	if (c->fill_secs)
+		return;
+
+	if (!c->fill_err)
+		qcow2_cluster_write(s, c);
+	qcow2_tx_put(s, c->fill_err);
+}
+
+static void
+qcow2_cluster_read_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qcow2_cluster *c = (struct qcow2_cluster *)arg;
+	struct qcow2_state *s = c->state;
+
+	if (!err)
+		qcow2_cluster_write(s, c);
+	qcow2_tx_put(s, err);
+}
+
+/*
+ * Write the contents of a newly allocated cluster.  Fully overwritten
+ * clusters are written straight from the request buffers; otherwise
+ * the old contents are gathered in a bounce buffer first.
+ */
+static void
+qcow2_tx_cluster(struct qcow2_state *s, struct qcow2_cluster *c)
+{
+	int i, err, covered;
+	uint64_t sec, secs, idx;
+	td_request_t treq;
+	struct qcow2_request *req;
+	struct qcow2_tx *tx = &s->tx;
+	uint8_t map[(1 << QCOW2_MAX_CLUSTER_BITS) >> (SECTOR_SHIFT + 3)];
+
+	memset(map, 0, sizeof(map));
+	for (req = c->chunks; req; req = req->next) {
+		idx = req->treq.sec & (s->cluster_sectors - 1);
+		for (i = 0; i < req->treq.secs; i++)
+			map[(idx + i) >> 3] |= 1 << ((idx + i) & 7);
+	}
+
+	covered = 0;
+	for (i = 0; i < s->cluster_sectors; i++)
+		if (map[i >> 3] & (1 << (i & 7)))
+			covered++;
+
+	if (covered == s->cluster_sectors) {
+		for (req = c->chunks; req; req = req->next) {
+			idx = req->treq.sec & (s->cluster_sectors - 1);
+			tx->pending++;
+			td_prep_write(&req->tiocb, s->fd, req->treq.buf,
+				      req->treq.secs << SECTOR_SHIFT,
+				      c->offset + (idx << SECTOR_SHIFT),
+				      qcow2_tx_io_complete, s);
+			td_queue_tiocb(tx->driver, &req->tiocb);
+		}
+		return;
+	}
+
+	err = posix_memalign((void **)&c->bounce, getpagesize(),
+			     s->cluster_size);
+	if (err) {
+		c->bounce = NULL;
+		tx->err   = -ENOMEM;
+		return;
+	}
+
+	if (c->old & QCOW2_OFLAG_COMPRESSED) {
+		err = qcow2_decompress_cluster(s, c->old);
+		if (err) {
+			tx->err = err;
+			return;
+		}
+		memcpy(c->bounce, s->cluster_cache, s->cluster_size);
+		qcow2_cluster_write(s, c);
+
+	} else if (s->version >= 3 && (c->old & QCOW2_OFLAG_ZERO)) {
+		memset(c->bounce, 0, s->cluster_size);
+		qcow2_cluster_write(s, c);
+
+	} else if (c->old & QCOW2_OFFSET_MASK) {
+		/* shared cluster: copy the old contents */
+		tx->pending++;
+		td_prep_read(&c->tiocb, s->fd, c->bounce, s->cluster_size,
+			     c->old & QCOW2_OFFSET_MASK,
+			     qcow2_cluster_read_complete, c);
+		td_queue_tiocb(tx->driver, &c->tiocb);
+
+	} else {
+		/* unallocated: fill from the parent, zeroes if there is none */
+		sec  = c->vcluster << (s->cluster_bits - SECTOR_SHIFT);
+		secs = MIN(s->cluster_sectors, (s->size >> SECTOR_SHIFT) - sec);
+		if (secs < s->cluster_sectors)
+			memset(c->bounce + (secs << SECTOR_SHIFT), 0,
+			       (s->cluster_sectors - secs) << SECTOR_SHIFT);
+
+		treq         = c->chunks->treq;
+		treq.op      = TD_OP_READ;
+		treq.buf     = c->bounce;
+		treq.sec     = sec;
+		treq.secs    = secs;
+		treq.cb      = qcow2_cluster_fill_complete;
+		treq.cb_data = c;
+
+		c->fill_secs = secs;
+		tx->pending++;
+		td_forward_request(treq);
+	}
+}
+
+static void
+qcow2_tx_finish(struct qcow2_state *s)
+{
+	int i;
+	td_request_t treq;
+	td_driver_t *driver;
+	struct qcow2_cluster *c;
+	struct qcow2_request *req, *next;
+	struct qcow2_tx *tx = &s->tx;
+
+	if (tx->err)
+		EPRINTF("%s: allocating write failed: %d\n", s->name, tx->err);
+
+	for (i = 0; i < tx->nr; i++) {
+		c = tx->clusters + i;
+		for (req = c->chunks; req; req = next) {
+			next = req->next;
+			td_complete_request(req->treq, tx->err);
+			qcow2_free_request(s, req);
+		}
+		free(c->bounce);
+	}
+
+	if (tx->l2) {
+		tx->l2->lock--;
+		if (tx->err && tx->new_l2)
+			qcow2_table_unhash(s, tx->l2);
+	}
+	for (i = 0; i < tx->nr_refblocks; i++)
+		tx->refblocks[i]->lock--;
+
+	tx->state        = QCOW2_TX_IDLE;
+	tx->err          = 0;
+	tx->pending      = 0;
+	tx->reserved     = 0;
+	tx->l2           = NULL;
+	tx->new_l2       = 0;
+	tx->nr           = 0;
+	tx->nr_refblocks = 0;
+
+	/* retry the writes that were waiting for this transaction */
+	req = s->alloc_wait;
+	s->alloc_wait = s->alloc_wait_tail = NULL;
+
+	for (; req; req = next) {
+		next   = req->next;
+		treq   = req->treq;
+		driver = req->driver;
+
+		qcow2_free_request(s, req);
+		qcow2_queue_write(driver, treq);
+	}
+}
+
+static void
+qcow2_tx_put(struct qcow2_state *s, int err)
+{
+	int i;
+	uint64_t *l2;
+	struct qcow2_tx *tx = &s->tx;
+
+	if (err && !tx->err)
+		tx->err = err;
+
+	if (--tx->pending)
+		return;
+
+	if (tx->err)
+		goto finish;
+
+	switch (tx->state) {
+	case QCOW2_TX_DATA:
+		/* data and refcounts are on disk: point the L2 table at it */
+		tx->state   = QCOW2_TX_L2;
+		tx->pending = 1;
+
+		l2 = (uint64_t *)tx->l2->data;
+		for (i = 0; i < tx->nr; i++) {
+			struct qcow2_cluster *c = tx->clusters + i;
+			uint64_t idx = c->vcluster & (s->l2_size - 1);
+
+			l2[idx] = cpu_to_be64(c->offset | QCOW2_OFLAG_COPIED);
+			qcow2_table_dirty(tx->l2, idx * sizeof(uint64_t),
+					  (idx + 1) * sizeof(uint64_t));
+		}
+		if (tx->new_l2)
+			qcow2_table_dirty(tx->l2, 0, s->cluster_size);
+
+		qcow2_table_write(s, tx->l2);
+		qcow2_tx_put(s, 0);
+		return;
+
+	case QCOW2_TX_L2:
+		if (!tx->new_l2)
+			break;
+
+		tx->state   = QCOW2_TX_L1;
+		tx->pending = 1;
+
+		s->l1_table[tx->l1_index] = tx->l2_offset | QCOW2_OFLAG_COPIED;
+
+		i = ROUND_DOWN(tx->l1_index, QCOW2_SECTOR / sizeof(uint64_t));
+		memcpy(tx->l1_buf, s->l1_table + i, QCOW2_SECTOR);
+		for (l2 = (uint64_t *)tx->l1_buf;
+		     (char *)l2 < tx->l1_buf + QCOW2_SECTOR; l2++)
+			cpu_to_be64s(l2);
+
+		td_prep_write(&tx->l1_tiocb, s->fd, tx->l1_buf, QCOW2_SECTOR,
+			      s->l1_table_offset + i * sizeof(uint64_t),
+			      qcow2_tx_io_complete, s);
+		td_queue_tiocb(tx->driver, &tx->l1_tiocb);
+		return;
+
+	case QCOW2_TX_L1:
+		break;
+	}
+
+finish:
+	qcow2_tx_finish(s);
+}
+
+static void
+qcow2_tx_run(struct qcow2_state *s)
+{
+	int i, err;
+	struct qcow2_tx *tx = &s->tx;
+
+	if (!tx->reserved) {
+		err = qcow2_tx_reserve(s);
+		if (err)
+			goto fail;
+	}
+
+	err = qcow2_tx_refcounts(s, 0);
+	if (err == -EAGAIN)
+		return;
+	if (err)
+		goto fail;
+
+	tx->state   = QCOW2_TX_DATA;
+	tx->pending = 1;
+
+	qcow2_tx_refcounts(s, 1);
+	for (i = 0; i < tx->nr_refblocks; i++)
+		qcow2_table_write(s, tx->refblocks[i]);
+
+	for (i = 0; i < tx->nr; i++)
+		qcow2_tx_cluster(s, tx->clusters + i);
+
+	qcow2_tx_put(s, 0);
+	return;
+
+fail:
+	tx->err = err;
+	qcow2_tx_finish(s);
+}
+
+static int
+qcow2_read_aligned(int fd, uint64_t offset, size_t len, void **buf,
+		   size_t *skip)
+{
+	int err;
+	size_t size;
+	uint64_t start;
+
+	start = ROUND_DOWN(offset, QCOW2_SECTOR);
+	size  = ROUND_UP(offset + len, QCOW2_SECTOR) - start;
+
+	err = posix_memalign(buf, getpagesize(), size);
+	if (err) {
+		*buf = NULL;
+		return -err;
+	}
+
+	if (pread(fd, *buf, size, start) != size) {
+		err = errno ? -errno : -EIO;
+		free(*buf);
+		*buf = NULL;
+		return err;
+	}
+
+	*skip = offset - start;
+	return 0;
+}
+
+static int
+qcow2_load_table(struct qcow2_state *s, uint64_t offset, uint32_t entries,
+		 uint64_t **table)
+{
+	int err;
+	size_t skip;
+	uint32_t i;
+	void *buf;
+	uint64_t *t;
+
+	t = calloc(ROUND_UP(entries, QCOW2_SECTOR / sizeof(uint64_t)),
+		   sizeof(uint64_t));
+	if (!t)
+		return -ENOMEM;
+
+	if (entries) {
+		err = qcow2_read_aligned(s->fd, offset,
+					 entries * sizeof(uint64_t),
+					 &buf, &skip);
+		if (err) {
+			free(t);
+			return err;
+		}
+
+		memcpy(t, (char *)buf + skip, entries * sizeof(uint64_t));
+		free(buf);
+
+		for (i = 0; i < entries; i++)
+			be64_to_cpus(t + i);
+	}
+
+	*table = t;
+	return 0;
+}
+
+static int
+qcow2_backing_format(const char *fmt)
+{
+	if (!strcmp(fmt, "qcow2"))
+		return DISK_TYPE_QCOW2;
+	if (!strcmp(fmt, "qcow"))
+		return DISK_TYPE_QCOW;
+	if (!strcmp(fmt, "vpc") || !strcmp(fmt, "vhd"))
+		return DISK_TYPE_VHD;
+	if (!strcmp(fmt, "raw"))
+		return DISK_TYPE_AIO;
+	return -1;
+}
+
+/* Walk the header extensions; only the backing format is of interest. */
+static int
+qcow2_read_extensions(struct qcow2_state *s, char *hdr, size_t start,
+		      size_t end)
+{
+	char fmt[32];
+	QCow2HeaderExt ext;
+
+	s->backing_type = -1;
+
+	while (start + sizeof(ext) <= end) {
+		memcpy(&ext, hdr + start, sizeof(ext));
+		ext.magic = be32_to_cpu(ext.magic);
+		ext.len = be32_to_cpu(ext.len);
+		start += sizeof(ext);
+
+		if (ext.magic == QCOW2_EXT_END)
+			break;
+		if (ext.len > end - start)
+			return -EINVAL;
+
+		if (ext.magic == QCOW2_EXT_BACKING_FMT &&
+		    ext.len < sizeof(fmt)) {
+			memcpy(fmt, hdr + start, ext.len);
+			fmt[ext.len] = '\0';
+			s->backing_type = qcow2_backing_format(fmt);
+		}
+
+		start += ROUND_UP(ext.len, 8);
+	}
+
+	return 0;
+}
+
+static int
+qcow2_read_header(struct qcow2_state *s, td_flag_t flags)
+{
+	int err;
+	void *buf;
+	size_t skip, hlen, end;
+	QCow2Header h;
+
+	err = qcow2_read_aligned(s->fd, 0, 1 << QCOW2_MIN_CLUSTER_BITS,
+				 &buf, &skip);
+	if (err)
+		return err;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(&h, buf, sizeof(h));
+	free(buf);
+
+	h.magic = be32_to_cpu(h.magic);
+	h.version = be32_to_cpu(h.version);
+	h.backing_file_offset = be64_to_cpu(h.backing_file_offset);
+	h.backing_file_size = be32_to_cpu(h.backing_file_size);
+	h.cluster_bits = be32_to_cpu(h.cluster_bits);
+	h.size = be64_to_cpu(h.size);
+	h.crypt_method = be32_to_cpu(h.crypt_method);
+	h.l1_size = be32_to_cpu(h.l1_size);
+	h.l1_table_offset = be64_to_cpu(h.l1_table_offset);
+	h.refcount_table_offset = be64_to_cpu(h.refcount_table_offset);
+	h.refcount_table_clusters = be32_to_cpu(h.refcount_table_clusters);
+	h.nb_snapshots = be32_to_cpu(h.nb_snapshots);
+	h.snapshots_offset = be64_to_cpu(h.snapshots_offset);
+
+	if (h.magic != QCOW2_MAGIC)
+		return -EINVAL;
+
+	if (h.version == 2) {
+		hlen = QCOW2_V2_HEADER_SIZE;
+		h.refcount_order = 4;
+	} else if (h.version == 3) {
+		h.incompatible_features = be64_to_cpu(h.incompatible_features);
+		h.compatible_features = be64_to_cpu(h.compatible_features);
+		h.autoclear_features = be64_to_cpu(h.autoclear_features);
+		h.refcount_order = be32_to_cpu(h.refcount_order);
+		h.header_length = be32_to_cpu(h.header_length);
+		hlen = h.header_length;
+		if (hlen < sizeof(h))
+			return -EINVAL;
+	} else {
+		EPRINTF("%s: unsupported qcow2 version %u\n",
+			s->name, h.version);
+		return -EINVAL;
+	}
+
+	if (h.cluster_bits < QCOW2_MIN_CLUSTER_BITS ||
+	    h.cluster_bits > QCOW2_MAX_CLUSTER_BITS)
+		return -EINVAL;
+
+	if (h.crypt_method) {
+		EPRINTF("%s: encrypted qcow2 images are not supported\n",
+			s->name);
+		return -EINVAL;
+	}
+
+	if (h.incompatible_features) {
+		EPRINTF("%s: incompatible features 0x%"PRIx64"\n",
+			s->name, h.incompatible_features);
+		return -EINVAL;
+	}
+
+	if (h.refcount_order != 4) {
+		EPRINTF("%s: unsupported refcount width %d\n",
+			s->name, 1 << h.refcount_order);
+		return -EINVAL;
+	}
+
+	if (h.nb_snapshots && !(flags & TD_OPEN_RDONLY)) {
+		EPRINTF("%s: images with internal snapshots can only be "
+			"opened read-only\n", s->name);
+		return -EINVAL;
+	}
+
+	s->version         = h.version;
+	s->cluster_bits    = h.cluster_bits;
+	s->cluster_size    = 1 << s->cluster_bits;
+	s->cluster_sectors = s->cluster_size >> SECTOR_SHIFT;
+	s->l2_bits         = s->cluster_bits - 3;
+	s->l2_size         = 1 << s->l2_bits;
+	s->rb_bits         = s->cluster_bits - 1;
+	s->size            = h.size;
+	s->l1_size         = h.l1_size;
+	s->l1_table_offset = h.l1_table_offset;
+	s->rt_offset       = h.refcount_table_offset;
+	s->rt_size         = h.refcount_table_clusters <<
+		(s->cluster_bits - 3);
+
+	s->backing_file_offset = h.backing_file_offset;
+	s->backing_file_size   = h.backing_file_size;
+
+	if (s->l1_size < ROUND_UP(s->size, (uint64_t)s->cluster_size <<
+				  s->l2_bits) >> (s->cluster_bits + s->l2_bits))
+		return -EINVAL;
+
+	/* extensions run up to the backing file name or the cluster end */
+	end = s->cluster_size;
+	if (s->backing_file_offset && s->backing_file_offset < end)
+		end = s->backing_file_offset;
+	if (hlen >= end)
+		return 0;
+
+	err = qcow2_read_aligned(s->fd, 0, end, &buf, &skip);
+	if (err)
+		return err;
+
+	err = qcow2_read_extensions(s, buf, hlen, end);
+	free(buf);
+
+	return err;
+}
+
+static void
+qcow2_free_state(struct qcow2_state *s)
+{
+	free(s->reqs);
+	free(s->free_list);
+	free(s->l1_table);
+	free(s->rt);
+	qcow2_cache_free(s);
+	free(s->cluster_cache);
+	free(s->cluster_data);
+	free(s->tx.l1_buf);
+	free(s->name);
+}
+
+static int
+qcow2_open(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	int i, err, o_flags;
+	off_t end;
+	struct qcow2_state *s = (struct qcow2_state *)driver->data;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+
+	DPRINTF("QCOW2: Opening %s\n", name);
+
+	s->name = strdup(name);
+	if (!s->name)
+		return -ENOMEM;
+
+	o_flags = O_DIRECT | O_LARGEFILE |
+		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
+	s->fd = open(name, o_flags);
+	if (s->fd == -1) {
+		err = -errno;
+		DPRINTF("Unable to open %s (%d)\n", name, err);
+		goto fail;
+	}
+
+	s->flags = flags;
+
+	err = qcow2_read_header(s, flags);
+	if (err)
+		goto fail;
+
+	err = qcow2_load_table(s, s->l1_table_offset, s->l1_size,
+			       &s->l1_table);
+	if (err)
+		goto fail;
+
+	err = qcow2_load_table(s, s->rt_offset, s->rt_size, &s->rt);
+	if (err)
+		goto fail;
+
+	err = qcow2_cache_init(s);
+	if (err)
+		goto fail;
+
+	err = -ENOMEM;
+	if (posix_memalign((void **)&s->cluster_cache, getpagesize(),
+			   s->cluster_size) ||
+	    posix_memalign((void **)&s->cluster_data, getpagesize(),
+			   2 * s->cluster_size) ||
+	    posix_memalign((void **)&s->tx.l1_buf, getpagesize(),
+			   QCOW2_SECTOR))
+		goto fail;
+	s->cluster_cache_offset = -1;
+
+	/* a segment (i.e. a page) can span multiple clusters */
+	s->nr_reqs   = ((getpagesize() / s->cluster_size) + 1) *
+		MAX_SEGMENTS_PER_REQ * MAX_REQUESTS;
+	s->nr_free   = s->nr_reqs;
+	s->reqs      = calloc(s->nr_reqs, sizeof(struct qcow2_request));
+	s->free_list = calloc(s->nr_reqs, sizeof(struct qcow2_request *));
+	if (!s->reqs || !s->free_list)
+		goto fail;
+
+	for (i = 0; i < s->nr_reqs; i++)
+		s->free_list[i] = s->reqs + i;
+
+	end = lseek(s->fd, 0, SEEK_END);
+	if (end == (off_t)-1) {
+		err = -errno;
+		goto fail;
+	}
+	s->alloc_end = ROUND_UP((uint64_t)end, s->cluster_size);
+
+	driver->info.size        = s->size >> SECTOR_SHIFT;
+	driver->info.sector_size = QCOW2_SECTOR;
+	driver->info.info        = 0;
+
+	return 0;
+
+fail:
+	DPRINTF("QCOW2 open of %s failed: %d\n", name, err);
+	if (s->fd != -1)
+		close(s->fd);
+	qcow2_free_state(s);
+	memset(s, 0, sizeof(*s));
+	return err;
+}
+
+static int
+qcow2_close(td_driver_t *driver)
+{
+	struct qcow2_state *s = (struct qcow2_state *)driver->data;
+
+	if (s->tx.event)
+		tapdisk_server_unregister_event(s->tx.event);
+
+	DPRINTF("%s: reads %"PRIu64", writes %"PRIu64", allocated %"PRIu64
+		" clusters, cache hits %"PRIu64", misses %"PRIu64"\n",
+		s->name, s->reads, s->writes, s->allocs, s->hits, s->misses);
+
+	close(s->fd);
+	qcow2_free_state(s);
+	return 0;
+}
+
+static int
+qcow2_get_image_type(const char *file, int *type)
+{
+	int fd;
+	ssize_t size;
+	char buf[8];
+	uint32_t magic, version;
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	size = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (size != sizeof(buf))
+		return (errno ? -errno : -EIO);
+
+	memcpy(&magic, buf, sizeof(magic));
+	memcpy(&version, buf + 4, sizeof(version));
+	be32_to_cpus(&magic);
+	be32_to_cpus(&version);
+
+	if (magic == QCOW2_MAGIC && version >= 2)
+		*type = DISK_TYPE_QCOW2;
+	else if (magic == QCOW2_MAGIC)
+		*type = DISK_TYPE_QCOW;
+	else if (!memcmp(buf, "conectix", 8))
+		*type = DISK_TYPE_VHD;
+	else
+		*type = DISK_TYPE_AIO;
+
+	return 0;
+}
+
+static int
+qcow2_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	int err;
+	void *buf;
+	size_t skip;
+	char *name, *dir, *path;
+	struct qcow2_state *s = (struct qcow2_state *)driver->data;
+
+	if (!s->backing_file_offset)
+		return TD_NO_PARENT;
+
+	if (!s->backing_file_size || s->backing_file_size > PATH_MAX)
+		return -EINVAL;
+
+	err = qcow2_read_aligned(s->fd, s->backing_file_offset,
+				 s->backing_file_size, &buf, &skip);
+	if (err)
+		return err;
+
+	name = strndup((char *)buf + skip, s->backing_file_size);
+	free(buf);
+	if (!name)
+		return -ENOMEM;
+
+	/* relative names are relative to the image */
+	if (name[0] != '/') {
+		dir = strdup(s->name);
+		if (!dir) {
+			free(name);
+			return -ENOMEM;
+		}
+
+		err = asprintf(&path, "%s/%s", dirname(dir), name);
+		free(dir);
+		free(name);
+		if (err == -1)
+			return -ENOMEM;
+		name = path;
+	}
+
+	id->drivertype = s->backing_type;
+	if (id->drivertype < 0) {
+		err = qcow2_get_image_type(name, &id->drivertype);
+		if (err) {
+			free(name);
+			return err;
+		}
+	}
+
+	id->name = name;
+	return 0;
+}
+
+static int
+qcow2_validate_parent(td_driver_t *driver,
+		      td_driver_t *pdriver, td_flag_t flags)
+{
+	/* a backing file may be smaller or larger than the image */
+	return 0;
+}
+
+static void
+qcow2_debug(td_driver_t *driver)
+{
+	struct qcow2_state *s = (struct qcow2_state *)driver->data;
+
+	DBG(TLOG_WARN, "%s: READS: 0x%08"PRIx64", WRITES: 0x%08"PRIx64", "
+	    "ALLOCS: 0x%08"PRIx64"\n", s->name, s->reads, s->writes, s->allocs);
+	DBG(TLOG_WARN, "CACHE: %d tables, hits 0x%08"PRIx64", "
+	    "misses 0x%08"PRIx64"\n", s->cache_size, s->hits, s->misses);
+	DBG(TLOG_WARN, "TX: state %d, clusters %d, pending %d, "
+	    "alloc_end 0x%08"PRIx64", free requests %d\n", s->tx.state,
+	    s->tx.nr, s->tx.pending, s->alloc_end, s->nr_free);
+}
+
+/*
+ * Image creation.  The layout is: header cluster (with the backing
+ * file name), L1 table, refcount table, refcount blocks and, when
+ * preallocating, L2 tables followed by the data clusters.  The
+ * refcount table is sized for a fully allocated image.
+ */
+static int
+qcow2_write_at(int fd, const void *buf, size_t len, uint64_t offset)
+{
+	if (pwrite(fd, buf, len, offset) != len)
+		return errno ? -errno : -EIO;
+	return 0;
+}
+
+int
+qcow2_create(const char *filename, uint64_t size,
+	     const char *backing_file, int cluster_bits, int prealloc)
+{
+	int fd, err, rb_bits;
+	size_t blen;
+	char *buf;
+	uint16_t *rb;
+	uint64_t *table;
+	QCow2Header h;
+	QCow2HeaderExt ext;
+	uint64_t cs, i, j, l1_size, l1_clusters, l2_tables, data_clusters;
+	uint64_t rt_clusters, rb_count, total, meta, l1_off, rt_off, rb_off;
+	uint64_t l2_off, data_off;
+
+	if (!cluster_bits)
+		cluster_bits = QCOW2_DEFAULT_CLUSTER_BITS;
+	if (cluster_bits < QCOW2_MIN_CLUSTER_BITS ||
+	    cluster_bits > QCOW2_MAX_CLUSTER_BITS)
+		return -EINVAL;
+	if (backing_file && prealloc != QCOW2_PREALLOC_OFF)
+		return -EINVAL;
+
+	cs      = 1ULL << cluster_bits;
+	rb_bits = cluster_bits - 1;
+	size    = ROUND_UP(size, QCOW2_SECTOR);
+
+	blen = backing_file ? strlen(backing_file) : 0;
+	if (QCOW2_V2_HEADER_SIZE + sizeof(ext) + blen > cs)
+		return -ENAMETOOLONG;
+
+	l1_size       = ROUND_UP(size, cs << (cluster_bits - 3)) >>
+		(2 * cluster_bits - 3);
+	l1_clusters   = ROUND_UP(l1_size * sizeof(uint64_t), cs) >>
+		cluster_bits;
+	l2_tables     = l1_size;
+	data_clusters = ROUND_UP(size, cs) >> cluster_bits;
+
+	/*
+	 * Size the refcount structures for every cluster the image can
+	 * ever hold, including the refcount structures themselves.
+	 */
+	total = 1 + l1_clusters + l2_tables + data_clusters;
+	rt_clusters = 1;
+	for (;;) {
+		rb_count = ROUND_UP(total + rt_clusters + 1 +
+				    (total >> rb_bits), 1ULL << rb_bits) >>
+			rb_bits;
+		if (rb_count * sizeof(uint64_t) <= rt_clusters * cs)
+			break;
+		rt_clusters++;
+	}
+
+	l1_off   = cs;
+	rt_off   = l1_off + l1_clusters * cs;
+	rb_off   = rt_off + rt_clusters * cs;
+
+	/* refcount blocks for the clusters written now */
+	meta = 1 + l1_clusters + rt_clusters;
+	if (prealloc != QCOW2_PREALLOC_OFF)
+		meta += l2_tables + data_clusters;
+	rb_count = 0;
+	while (ROUND_UP(meta + rb_count, 1ULL << rb_bits) >> rb_bits > rb_count)
+		rb_count++;
+	meta += rb_count;
+
+	l2_off   = rb_off + rb_count * cs;
+	data_off = l2_off + l2_tables * cs;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fd == -1)
+		return -errno;
+
+	buf = calloc(1, cs);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* header */
+	memset(&h, 0, sizeof(h));
+	h.magic                   = cpu_to_be32(QCOW2_MAGIC);
+	h.version                 = cpu_to_be32(2);
+	h.cluster_bits            = cpu_to_be32(cluster_bits);
+	h.size                    = cpu_to_be64(size);
+	h.l1_size                 = cpu_to_be32(l1_size);
+	h.l1_table_offset         = cpu_to_be64(l1_off);
+	h.refcount_table_offset   = cpu_to_be64(rt_off);
+	h.refcount_table_clusters = cpu_to_be32(rt_clusters);
+	if (backing_file) {
+		h.backing_file_offset =
+			cpu_to_be64(QCOW2_V2_HEADER_SIZE + sizeof(ext));
+		h.backing_file_size   = cpu_to_be32(blen);
+		memcpy(buf + QCOW2_V2_HEADER_SIZE + sizeof(ext),
+		       backing_file, blen);
+	}
+	memcpy(buf, &h, QCOW2_V2_HEADER_SIZE);
+
+	err = qcow2_write_at(fd, buf, cs, 0);
+	if (err)
+		goto out;
+
+	/* L1 table */
+	table = (uint64_t *)buf;
+	for (i = 0; i < l1_clusters; i++) {
+		memset(buf, 0, cs);
+		if (prealloc != QCOW2_PREALLOC_OFF)
+			for (j = 0; j < cs / sizeof(uint64_t); j++) {
+				uint64_t n = i * (cs / sizeof(uint64_t)) + j;
+				if (n >= l1_size)
+					break;
+				table[j] = cpu_to_be64((l2_off + n * cs) |
+						       QCOW2_OFLAG_COPIED);
+			}
+		err = qcow2_write_at(fd, buf, cs, l1_off + i * cs);
+		if (err)
+			goto out;
+	}
+
+	/* refcount table */
+	for (i = 0; i < rt_clusters; i++) {
+		memset(buf, 0, cs);
+		for (j = 0; j < cs / sizeof(uint64_t); j++) {
+			uint64_t n = i * (cs / sizeof(uint64_t)) + j;
+			if (n >= rb_count)
+				break;
+			table[j] = cpu_to_be64(rb_off + n * cs);
+		}
+		err = qcow2_write_at(fd, buf, cs, rt_off + i * cs);
+		if (err)
+			goto out;
+	}
+
+	/* refcount blocks: everything up to the end of the image is used */
+	rb = (uint16_t *)buf;
+	for (i = 0; i < rb_count; i++) {
+		memset(buf, 0, cs);
+		for (j = 0; j < (1ULL << rb_bits); j++) {
+			uint64_t n = (i << rb_bits) + j;
+			if (n >= meta)
+				break;
+			rb[j] = cpu_to_be16(1);
+		}
+		err = qcow2_write_at(fd, buf, cs, rb_off + i * cs);
+		if (err)
+			goto out;
+	}
+
+	if (prealloc == QCOW2_PREALLOC_OFF)
+		goto out;
+
+	/* L2 tables mapping the data clusters in order */
+	for (i = 0; i < l2_tables; i++) {
+		memset(buf, 0, cs);
+		for (j = 0; j < cs / sizeof(uint64_t); j++) {
+			uint64_t n = i * (cs / sizeof(uint64_t)) + j;
+			if (n >= data_clusters)
+				break;
+			table[j] = cpu_to_be64((data_off + n * cs) |
+					       QCOW2_OFLAG_COPIED);
+		}
+		err = qcow2_write_at(fd, buf, cs, l2_off + i * cs);
+		if (err)
+			goto out;
+	}
+
+	if (prealloc == QCOW2_PREALLOC_FULL) {
+		memset(buf, 0, cs);
+		for (i = 0; i < data_clusters; i++) {
+			err = qcow2_write_at(fd, buf, cs, data_off + i * cs);
+			if (err)
+				goto out;
+		}
+	} else if (ftruncate(fd, data_off + data_clusters * cs))
+		err = -errno;
+
+out:
+	free(buf);
+	if (close(fd) && !err)
+		err = -errno;
+	if (err)
+		unlink(filename);
+	return err;
+}
+
+struct tap_disk tapdisk_qcow2 = {
+	.disk_type           = "tapdisk_qcow2",
+	.flags               = 0,
+	.private_data_size   = sizeof(struct qcow2_state),
+	.td_open             = qcow2_open,
+	.td_close            = qcow2_close,
+	.td_queue_read       = qcow2_queue_read,
+	.td_queue_write      = qcow2_queue_write,
+	.td_get_parent_id    = qcow2_get_parent_id,
+	.td_validate_parent  = qcow2_validate_parent,
+	.td_debug            = qcow2_debug,
+};
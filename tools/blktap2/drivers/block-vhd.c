@@ -38,9 +38,12 @@
  *   - BAT and bitmap updates: data writes are grouped in transactions
  *     as above, but a special extra write is included in the transaction,
  *     which zeros out the newly allocated bitmap on disk.  When the data
- *     writes and the zero-bitmap write complete, the BAT and bitmap writes
- *     are started in parallel.  The transaction is completed only after both
- *     the BAT and bitmap writes successfully return.
+ *     writes and the zero-bitmap write complete, the bitmap write is
+ *     started.  The transaction is completed only after both the BAT and
+ *     bitmap writes successfully return.
+ * The BAT write itself is shared by all blocks allocated in the same
+ * pass (see struct vhd_bat_state), and is only issued once the zeroed
+ * bitmaps of every block in the batch have reached disk.
  */
 
 #include <errno.h>
@@ -53,11 +56,14 @@
 #include <string.h>    /* for memset.                                 */
 #include <libaio.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #include "libvhd.h"
+#include "list.h"
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-server.h"
 #include "tapdisk-disktype.h"
 
 unsigned int SPB;
@@ -72,10 +78,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%lu, BBLK: 0x%04x\n",				\
+		    "%lu, BBLKS: %d\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.nr_pending);					\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -109,11 +115,14 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               256
+#define VHD_CACHE_MIN                8
+#define VHD_CACHE_MAX                65536
+
+#define VHD_BAT_BATCH                32
+#define VHD_BAT_BATCH_SECS           8
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
-#define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
@@ -121,6 +130,7 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_READ           3
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
+#define VHD_OP_DISCARD               6
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -138,6 +148,7 @@ unsigned int SPB;
 
 #define VHD_FLAG_BAT_LOCKED          1
 #define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_FLAG_BAT_WRITE_DONE      4
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
@@ -182,21 +193,43 @@ struct vhd_request {
 	struct vhd_transaction   *tx;
 };
 
+struct vhd_bat_pending {
+	uint32_t                  blk;         /* blk num of pending write */
+	uint64_t                  offset;      /* file offset of same */
+	int                       waiting;     /* bitmap tx waits for bat */
+	int                       drained;     /* failed tx has finished */
+	struct vhd_request        zero_req;    /* for initializing bitmap */
+};
+
+/*
+ * Blocks allocated during the same pass are gathered into one batch,
+ * whose BAT entries go out in a single write once every member's zeroed
+ * bitmap is on disk.  A batch holds up to VHD_BAT_BATCH blocks whose
+ * entries lie within VHD_BAT_BATCH_SECS sectors of the table; writes to
+ * other unallocated blocks wait for the batch to complete.
+ */
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
+	int                       error;
+	int                       zeroing;     /* zero bitmap writes in flight */
+	int                       nr_pending;
+	int                       max_pending;
+	uint32_t                  first_sec;   /* bat sectors spanned */
+	uint32_t                  last_sec;
+	uint64_t                  next_db;     /* next_db before the batch */
+	event_id_t                event;
+	struct vhd_bat_pending    pending[VHD_BAT_BATCH];
 	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
 };
 
 struct vhd_bitmap {
 	u32                       blk;
-	u64                       seqno;       /* lru sequence number */
 	vhd_flag_t                status;
+	struct list_head          lru;
+	struct vhd_bitmap        *hnext;
 
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
@@ -227,13 +260,15 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	int                       bm_cache_size;
+	int                       bm_hash_bits;
+	struct vhd_bitmap       **bitmap;      /* hash of cached bitmaps */
+	struct list_head          bm_lru;      /* cached bitmaps, lru first */
 
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap       **bitmap_free;
+	struct vhd_bitmap        *bitmap_list;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -248,6 +283,15 @@ struct vhd_state {
 	uint64_t                  read_size;
 	uint64_t                  writes;
 	uint64_t                  write_size;
+
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_evictions;
+	uint64_t                  bm_writes;
+	uint64_t                  bat_writes;
+	uint64_t                  bat_blocks;
+	uint64_t                  discards;
+	uint64_t                  released;
 };
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
@@ -258,16 +302,26 @@ struct vhd_state {
 
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void finish_bat_batch(struct vhd_state *, int);
 
-static struct vhd_state  *_vhd_master;
+/*
+ * The zero buffer is shared by every open vhd, which with server
+ * threads may live on different event loops.
+ */
+static pthread_mutex_t    _vhd_zlock = PTHREAD_MUTEX_INITIALIZER;
+static int                _vhd_zrefs;
 static unsigned long      _vhd_zsize;
 static char              *_vhd_zeros;
 
 static int
 vhd_initialize(struct vhd_state *s)
 {
+	int err = 0;
+
+	pthread_mutex_lock(&_vhd_zlock);
+
 	if (_vhd_zeros)
-		return 0;
+		goto out;
 
 	_vhd_zsize = 2 * getpagesize();
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
@@ -276,26 +330,34 @@ vhd_initialize(struct vhd_state *s)
 	_vhd_zeros = mmap(0, _vhd_zsize, PROT_READ,
 			  MAP_SHARED | MAP_ANON, -1, 0);
 	if (_vhd_zeros == MAP_FAILED) {
-		EPRINTF("vhd_initialize failed: %d\n", -errno);
+		err = -errno;
+		EPRINTF("vhd_initialize failed: %d\n", err);
 		_vhd_zeros = NULL;
 		_vhd_zsize = 0;
-		return -errno;
+		goto fail;
 	}
 
-	_vhd_master = s;
-	return 0;
+out:
+	_vhd_zrefs++;
+fail:
+	pthread_mutex_unlock(&_vhd_zlock);
+	return err;
 }
 
 static void
 vhd_free(struct vhd_state *s)
 {
-	if (_vhd_master != s || !_vhd_zeros)
-		return;
+	pthread_mutex_lock(&_vhd_zlock);
+
+	if (!_vhd_zeros || --_vhd_zrefs)
+		goto out;
 
 	munmap(_vhd_zeros, _vhd_zsize);
 	_vhd_zsize  = 0;
 	_vhd_zeros  = NULL;
-	_vhd_master = NULL;
+
+out:
+	pthread_mutex_unlock(&_vhd_zlock);
 }
 
 static char *
@@ -321,6 +383,13 @@ set_batmap(struct vhd_state *s, uint32_t blk)
 	}
 }
 
+static inline void
+clear_batmap(struct vhd_state *s, uint32_t blk)
+{
+	if (s->bat.batmap.map)
+		vhd_batmap_clear(&s->vhd, &s->bat.batmap, blk);
+}
+
 static inline int
 test_batmap(struct vhd_state *s, uint32_t blk)
 {
@@ -436,8 +505,8 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign((void **)&s->bat.bat_buf,
-			     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	err = posix_memalign((void **)&s->bat.bat_buf, VHD_SECTOR_SIZE,
+			     vhd_sectors_to_bytes(VHD_BAT_BATCH_SECS));
 	if (err) {
 		s->bat.bat_buf = NULL;
 		goto fail;
@@ -456,29 +525,69 @@ vhd_free_bitmap_cache(struct vhd_state *s)
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
-	}
+	if (s->bitmap_list)
+		for (i = 0; i < s->bm_cache_size; i++) {
+			bm = s->bitmap_list + i;
+			free(bm->map);
+			free(bm->shadow);
+		}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	free(s->bitmap);
+	free(s->bitmap_free);
+	free(s->bitmap_list);
+	s->bitmap        = NULL;
+	s->bitmap_free   = NULL;
+	s->bitmap_list   = NULL;
+	s->bm_free_count = 0;
 }
 
+/*
+ * Bitmaps are kept in a hashed cache of s->bm_cache_size entries,
+ * recycled in LRU order.  The size can be tuned through
+ * TAPDISK2_VHD_BITMAP_CACHE; each entry costs two bitmaps of memory.
+ */
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
 	int i, err, map_size;
 	struct vhd_bitmap *bm;
+	char *env;
+
+	s->bm_cache_size = VHD_CACHE_SIZE;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	env = getenv("TAPDISK2_VHD_BITMAP_CACHE");
+	if (env) {
+		i = atoi(env);
+		if (i >= VHD_CACHE_MIN && i <= VHD_CACHE_MAX)
+			s->bm_cache_size = i;
+		else
+			DPRINTF("Ignoring bad bitmap cache size '%s'\n", env);
+	}
+
+	s->bm_hash_bits = 1;
+	while ((1 << s->bm_hash_bits) < 2 * s->bm_cache_size)
+		s->bm_hash_bits++;
+
+	INIT_LIST_HEAD(&s->bm_lru);
+
+	s->bitmap      = calloc(1 << s->bm_hash_bits,
+				sizeof(struct vhd_bitmap *));
+	s->bitmap_free = calloc(s->bm_cache_size,
+				sizeof(struct vhd_bitmap *));
+	s->bitmap_list = calloc(s->bm_cache_size,
+				sizeof(struct vhd_bitmap));
+	if (!s->bitmap || !s->bitmap_free || !s->bitmap_list) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	/* keep enough bitmaps free for readers while a batch is open */
+	s->bat.max_pending = MIN(VHD_BAT_BATCH, s->bm_cache_size / 2);
 
-	s->bm_lru        = 0;
 	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	s->bm_free_count = s->bm_cache_size;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 
 		err = posix_memalign((void **)&bm->map, 512, map_size);
@@ -622,6 +731,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		err = vhd_open(&s->vhd, name, o_flags);
 		if (err) {
 			EPRINTF("Unable to open [%s] (%d)!\n", name, err);
+			vhd_free(s);
 			return err;
 		}
 	}
@@ -664,6 +774,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		s->writes++;
 	}
 
+	td_register_file(s->vhd.fd);
+
         return 0;
 
  fail:
@@ -719,6 +831,13 @@ vhd_log_close(struct vhd_state *s)
 
 	DPRINTF("%s: b: %u, a: %u, f: %u, n: %"PRIu64"\n",
 		s->vhd.file, s->bat.bat.entries, allocated, full, s->next_db);
+	DPRINTF("%s: bitmap cache: %d, hits: %"PRIu64", misses: %"PRIu64
+		", evictions: %"PRIu64", bitmap writes: %"PRIu64", "
+		"bat writes: %"PRIu64" (%"PRIu64" blocks), discards: %"PRIu64
+		" (%"PRIu64" blocks released)\n", s->vhd.file,
+		s->bm_cache_size, s->bm_hits, s->bm_misses, s->bm_evictions,
+		s->bm_writes, s->bat_writes, s->bat_blocks, s->discards,
+		s->released);
 }
 
 static int
@@ -738,9 +857,10 @@ _vhd_close(td_driver_t *driver)
 	/* 
 	 * write footer if:
 	 *   - we killed it on open (opened with strict) 
-	 *   - we've written data since opening
+	 *   - we've written data (or discarded blocks) since opening
 	 */
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) || s->writes) {
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) ||
+	    s->writes || s->discards) {
 		memcpy(&s->vhd.bat, &s->bat.bat, sizeof(vhd_bat_t));
 		err = vhd_write_footer(&s->vhd, &s->vhd.footer);
 		memset(&s->vhd.bat, 0, sizeof(vhd_bat_t));
@@ -757,6 +877,9 @@ _vhd_close(td_driver_t *driver)
 	}
 
  free:
+	if (s->bat.event)
+		tapdisk_server_unregister_event(s->bat.event);
+	td_unregister_file(s->vhd.fd);
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
@@ -928,12 +1051,14 @@ transaction_completed(struct vhd_transaction *tx)
 static inline void
 init_bat(struct vhd_state *s)
 {
+	ASSERT(!s->bat.event && !s->bat.zeroing);
+
 	s->bat.req.tx     = NULL;
 	s->bat.req.next   = NULL;
 	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
 	s->bat.status     = 0;
+	s->bat.error      = 0;
+	s->bat.nr_pending = 0;
 }
 
 static inline void
@@ -954,11 +1079,40 @@ bat_locked(struct vhd_state *s)
 	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
 }
 
+static inline struct vhd_bat_pending *
+bat_pending(struct vhd_state *s, uint32_t blk)
+{
+	int i;
+
+	for (i = 0; i < s->bat.nr_pending; i++)
+		if (s->bat.pending[i].blk == blk)
+			return s->bat.pending + i;
+
+	return NULL;
+}
+
+/* can a write to unallocated blk join the current batch? */
+static inline int
+bat_batch_open(struct vhd_state *s, uint32_t blk)
+{
+	uint32_t sec;
+
+	if (!bat_locked(s))
+		return 1;
+
+	if (test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED) ||
+	    s->bat.nr_pending >= s->bat.max_pending || s->bat.error)
+		return 0;
+
+	sec = blk / 128;
+	return (MAX(sec, s->bat.last_sec) -
+		MIN(sec, s->bat.first_sec) < VHD_BAT_BATCH_SECS);
+}
+
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
@@ -968,21 +1122,39 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline int
+bitmap_hash(struct vhd_state *s, uint32_t block)
+{
+	return (int)((block * 0x9e3779b97f4a7c15ULL) >> (64 - s->bm_hash_bits));
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = s->bitmap[bitmap_hash(s, block)]; bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	for (pp = &s->bitmap[bitmap_hash(s, bm->blk)]; *pp; pp = &(*pp)->hnext)
+		if (*pp == bm) {
+			*pp = bm->hnext;
+			break;
+		}
+
+	bm->hnext = NULL;
+	list_del(&bm->lru);
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1033,25 +1205,17 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	u64 seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
+	list_for_each_entry(bm, &s->bm_lru, lru)
+		if (!bitmap_locked(bm)) {
+			ASSERT(!bitmap_in_use(bm));
+			unhash_bitmap(s, bm);
+			s->bm_evictions++;
+			return bm;
 		}
-	}
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
-	}
-
-	return  lru;
+	return NULL;
 }
 
 static int
@@ -1076,62 +1240,34 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_del(&bm->lru);
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	int h;
+
+	ASSERT(!get_bitmap(s, bm->blk));
 
-	ASSERT(0);
+	h            = bitmap_hash(s, bm->blk);
+	bm->hnext    = s->bitmap[h];
+	s->bitmap[h] = bm;
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(get_bitmap(s, bm->blk) == bm);
 
-	s->bitmap[i] = NULL;
+	unhash_bitmap(s, bm);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
@@ -1156,7 +1292,7 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
 		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		    !bat_pending(s, blk) && !bat_batch_open(s, blk))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1173,6 +1309,7 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 
 	/* bump lru count */
 	touch_bitmap(s, bm);
+	s->bm_hits++;
 
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
 		return VHD_BM_READ_PENDING;
@@ -1264,157 +1401,241 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
-static inline uint64_t
+static inline int
+new_block_gap(struct vhd_state *s)
+{
+	/* data region of segment should begin on page boundary */
+	if ((s->next_db + s->bm_secs) % s->spp)
+		return (s->spp - ((s->next_db + s->bm_secs) % s->spp));
+
+	return 0;
+}
+
+static struct vhd_bat_pending *
 reserve_new_block(struct vhd_state *s, uint32_t blk)
 {
-	int gap = 0;
+	uint32_t sec;
+	struct vhd_bat_pending *p;
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(bat_batch_open(s, blk) && !bat_pending(s, blk));
 
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp)
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
+	sec = blk / 128;
+	if (!bat_locked(s)) {
+		lock_bat(s);
+		s->bat.next_db   = s->next_db;
+		s->bat.first_sec = sec;
+		s->bat.last_sec  = sec;
+	} else {
+		s->bat.first_sec = MIN(sec, s->bat.first_sec);
+		s->bat.last_sec  = MAX(sec, s->bat.last_sec);
+	}
+
+	p = s->bat.pending + s->bat.nr_pending++;
+	memset(p, 0, sizeof(*p));
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	p->blk     = blk;
+	p->offset  = s->next_db + new_block_gap(s);
+	s->next_db = p->offset + s->spb + s->bm_secs;
 
-	return s->next_db;
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", pending: %d\n",
+	    blk, p->offset, s->bat.nr_pending);
+
+	return p;
 }
 
-static int
+static void
 schedule_bat_write(struct vhd_state *s)
 {
-	int i;
-	u32 blk;
-	char *buf;
+	int i, secs;
+	u32 *buf, first;
 	u64 offset;
+	struct vhd_bat_pending *p;
 	struct vhd_request *req;
 
-	ASSERT(bat_locked(s));
+	ASSERT(bat_locked(s) && !s->bat.zeroing);
+	ASSERT(test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+
+	if (s->bat.error)
+		return finish_bat_batch(s, s->bat.error);
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	req   = &s->bat.req;
+	buf   = (u32 *)s->bat.bat_buf;
+	first = s->bat.first_sec * 128;
+	secs  = s->bat.last_sec - s->bat.first_sec + 1;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, first), vhd_sectors_to_bytes(secs));
 
-	((u32 *)buf)[blk % 128] = s->bat.pbw_offset;
+	for (i = 0; i < s->bat.nr_pending; i++) {
+		p = s->bat.pending + i;
+		buf[p->blk - first] = p->offset;
+	}
 
-	for (i = 0; i < 128; i++)
-		BE32_OUT(&((u32 *)buf)[i]);
+	for (i = 0; i < secs * 128; i++)
+		BE32_OUT(&buf[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
-	req->treq.secs = 1;
-	req->treq.buf  = buf;
+	offset         = s->vhd.header.table_offset + first * 4;
+	req->treq.secs = secs;
+	req->treq.buf  = (char *)buf;
 	req->op        = VHD_OP_BAT_WRITE;
 	req->next      = NULL;
 
 	aio_write(s, req, offset);
+	s->bat_writes++;
+	s->bat_blocks += s->bat.nr_pending;
+
+	DBG(TLOG_DBG, "blks: %d, secs: %d, table_offset: 0x%08"PRIx64"\n",
+	    s->bat.nr_pending, secs, offset);
+}
+
+/*
+ * Close the batch.  Its BAT write waits for every zero bitmap write
+ * in the batch: a BAT entry must never reach disk before the bitmap
+ * it points to has been initialized.
+ */
+static void
+flush_bat(struct vhd_state *s)
+{
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	if (!s->bat.zeroing)
+		schedule_bat_write(s);
+}
 
-	return 0;
+static void
+flush_bat_event(event_id_t id, char mode, void *private)
+{
+	struct vhd_state *s = (struct vhd_state *)private;
+
+	tapdisk_server_unregister_event(s->bat.event);
+	s->bat.event = 0;
+
+	flush_bat(s);
+}
+
+/* flush on the next pass, once the whole ring has been queued */
+static void
+schedule_bat_flush(struct vhd_state *s)
+{
+	event_id_t id;
+
+	if (s->bat.event)
+		return;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					   -1, 0, flush_bat_event, s);
+	if (id < 0) {
+		flush_bat(s);
+		return;
+	}
+
+	s->bat.event = id;
 }
 
 static void
-schedule_zero_bm_write(struct vhd_state *s,
-		       struct vhd_bitmap *bm, uint64_t lb_end)
+schedule_zero_bm_write(struct vhd_state *s, struct vhd_bitmap *bm,
+		       struct vhd_bat_pending *p, uint64_t lb_end)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &p->zero_req;
 
 	init_vhd_request(s, req);
 
 	offset         = vhd_sectors_to_bytes(lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = p->blk * s->spb;
+	req->treq.secs = (p->offset - lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    p->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
 	aio_write(s, req, offset);
+	s->bat.zeroing++;
 }
 
 static int
-update_bat(struct vhd_state *s, uint32_t blk)
+get_new_bitmap(struct vhd_state *s, uint32_t blk, struct vhd_bitmap **bitmap)
 {
 	int err;
-	uint64_t lb_end;
 	struct vhd_bitmap *bm;
 
-	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		return 0;
-	}
-
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
 	bm = get_bitmap(s, blk);
 	if (!bm) {
 		/* install empty bitmap in cache */
 		err = alloc_vhd_bitmap(s, &bm, blk);
-		if (err) 
+		if (err)
 			return err;
 
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	schedule_zero_bm_write(s, bm, lb_end);
-	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
-
+	*bitmap = bm;
 	return 0;
 }
 
 static int
-allocate_block(struct vhd_state *s, uint32_t blk)
+update_bat(struct vhd_state *s, uint32_t blk, uint64_t *offset)
 {
-	char *zeros;
-	int err, gap;
-	uint64_t offset, size;
+	int err;
+	uint64_t lb_end;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_pending *p;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
-		return 0;
-	}
+	p = bat_pending(s, blk);
+	if (p)
+		goto out;
 
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
+	err = get_new_bitmap(s, blk, &bm);
+	if (err)
+		return err;
 
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
-	}
+	lb_end = s->next_db;
+	p      = reserve_new_block(s, blk);
+	schedule_zero_bm_write(s, bm, p, lb_end);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	schedule_bat_flush(s);
+
+ out:
+	if (s->bat.error)
+		return -EBUSY;
 
-	s->bat.pbw_offset = s->next_db;
+	*offset = p->offset;
+	return 0;
+}
+
+static int
+allocate_block(struct vhd_state *s, uint32_t blk, uint64_t *offset)
+{
+	int err;
+	uint64_t size;
+	struct vhd_bitmap *bm;
+	struct vhd_bat_pending *p;
+
+	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	p = bat_pending(s, blk);
+	if (p)
+		goto out;
+
+	err = get_new_bitmap(s, blk, &bm);
+	if (err)
+		return err;
 
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
+	if (lseek(s->vhd.fd, vhd_sectors_to_bytes(s->next_db),
+		  SEEK_SET) == (off_t)-1) {
 		ERR(errno, "lseek failed\n");
 		return -errno;
 	}
 
-	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
+	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + new_block_gap(s));
 	err  = write(s->vhd.fd, vhd_zeros(size), size);
 	if (err != size) {
 		err = (err == -1 ? -errno : -EIO);
@@ -1422,23 +1643,16 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		return err;
 	}
 
-	/* empty bitmap could already be in
-	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
-	if (!bm) {
-		/* install empty bitmap in cache */
-		err = alloc_vhd_bitmap(s, &bm, blk);
-		if (err) 
-			return err;
-
-		install_bitmap(s, bm);
-	}
-
-	lock_bat(s);
+	p = reserve_new_block(s, blk);
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	schedule_bat_flush(s);
+
+ out:
+	if (s->bat.error)
+		return -EBUSY;
 
+	*offset = p->offset;
 	return 0;
 }
 
@@ -1506,14 +1720,12 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 
 	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BAT)) {
 		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-			err = allocate_block(s, blk);
+			err = allocate_block(s, blk, &offset);
 		else
-			err = update_bat(s, blk);
+			err = update_bat(s, blk, &offset);
 
 		if (err)
 			return err;
-
-		offset = s->bat.pbw_offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1585,6 +1797,7 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 	lock_bitmap(bm);
 	install_bitmap(s, bm);
 	set_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
+	s->bm_misses++;
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, nr_secs: 0x%04x, "
 	    "offset: 0x%08"PRIx64"\n", s->vhd.file, req->treq.sec, blk,
@@ -1608,8 +1821,9 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		struct vhd_bat_pending *p = bat_pending(s, blk);
+		ASSERT(bat_locked(s) && p);
+		offset = p->offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1628,6 +1842,7 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	lock_bitmap(bm);
 	touch_bitmap(s, bm);     /* bump lru count */
 	set_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
+	s->bm_writes++;
 
 	DBG(TLOG_DBG, "%s: blk: 0x%04x, sec: 0x%08"PRIx64", nr_secs: 0x%04x, "
 	    "offset: 0x%"PRIx64"\n", s->vhd.file, blk, req->treq.sec,
@@ -1670,6 +1885,141 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+/* 
+ * the last block in the file is never released: the footer lives
+ * right behind it and vhd_write_footer places it by the bat.
+ */
+static inline int
+tail_block(struct vhd_state *s, uint32_t blk)
+{
+	return (bat_entry(s, blk) + s->bm_secs + s->spb >= s->next_db);
+}
+
+static int
+write_bat_sector(struct vhd_state *s, uint32_t blk)
+{
+	int i;
+	u32 *buf, first;
+	off_t offset;
+	ssize_t ret;
+
+	buf    = (u32 *)s->bat.bat_buf;
+	first  = blk - (blk % 128);
+	offset = s->vhd.header.table_offset + first * 4;
+
+	memcpy(buf, &bat_entry(s, first), VHD_SECTOR_SIZE);
+	for (i = 0; i < 128; i++)
+		BE32_OUT(&buf[i]);
+
+	ret = pwrite(s->vhd.fd, buf, VHD_SECTOR_SIZE, offset);
+	if (ret != VHD_SECTOR_SIZE)
+		return (ret == -1 ? -errno : -EIO);
+
+	s->bat_writes++;
+	return 0;
+}
+
+/*
+ * Unallocate a block discarded in full.  The bat sector is rewritten
+ * synchronously, which is rare enough not to matter, and the space is
+ * handed back to the filesystem by punching a hole over the bitmap and
+ * data.  Freed blocks are never reused: new blocks still go to next_db,
+ * so requests racing with the release can't land in someone else's data.
+ */
+static int
+release_block(struct vhd_state *s, uint32_t blk)
+{
+	int err;
+	u32 offset;
+	struct vhd_bitmap *bm;
+
+	if (bat_locked(s))
+		return -EBUSY;
+
+	bm = get_bitmap(s, blk);
+	if (bm) {
+		if (bitmap_locked(bm) || bitmap_in_use(bm))
+			return -EBUSY;
+		free_vhd_bitmap(s, bm);
+	}
+
+	offset = bat_entry(s, blk);
+	bat_entry(s, blk) = DD_BLK_UNUSED;
+
+	err = write_bat_sector(s, blk);
+	if (err) {
+		ERR(err, "releasing block 0x%04x", blk);
+		bat_entry(s, blk) = offset;
+		return err;
+	}
+
+	clear_batmap(s, blk);
+	s->discards++;
+	s->released++;
+
+	err = tapdisk_punch_hole(s->vhd.fd, vhd_sectors_to_bytes(offset),
+				 vhd_sectors_to_bytes(s->bm_secs + s->spb));
+	if (err && err != -EOPNOTSUPP)
+		EPRINTF("%s: punching hole at 0x%08x: %d\n",
+			s->vhd.file, offset, err);
+
+	DBG(TLOG_DBG, "%s: blk: 0x%04x, offset: 0x%08x\n",
+	    s->vhd.file, blk, offset);
+
+	return 0;
+}
+
+/*
+ * A partial discard clears bits in the bitmap.  It joins the bitmap
+ * transaction as an already finished request, so the cleared bits reach
+ * disk with the next bitmap write and it completes along with it.
+ */
+static int
+schedule_bitmap_discard(struct vhd_state *s,
+			struct vhd_bitmap *bm, td_request_t treq)
+{
+	int i;
+	u32 sec;
+	struct vhd_request *req;
+	struct vhd_transaction *tx = &bm->tx;
+
+	ASSERT(bm && bitmap_valid(bm));
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq  = treq;
+	req->op    = VHD_OP_DISCARD;
+	req->flags = VHD_FLAG_REQ_FINISHED;
+	req->next  = NULL;
+
+	lock_bitmap(bm);
+	clear_batmap(s, bm->blk);
+	s->discards++;
+
+	if (tx->closed) {
+		add_to_tail(&bm->queue, req);
+		set_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED);
+		return 0;
+	}
+
+	add_to_transaction(tx, req);
+	tx->finished++;
+
+	sec = treq.sec % s->spb;
+	for (i = 0; i < treq.secs; i++)
+		vhd_bitmap_clear(&s->vhd, bm->shadow, sec + i);
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, bm->blk, treq.secs);
+
+	if (transaction_completed(tx))
+		finish_data_transaction(s, bm);
+
+	return 0;
+}
+
 static void
 vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -1829,6 +2179,79 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static void
+vhd_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	int err;
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		err = tapdisk_punch_hole(s->vhd.fd,
+					 vhd_sectors_to_bytes(treq.sec),
+					 vhd_sectors_to_bytes(treq.secs));
+		if (err == -EOPNOTSUPP)
+			err = 0;
+		s->discards++;
+		td_complete_request(treq, err);
+		return;
+	}
+
+	while (treq.secs) {
+		u32 blk;
+		td_request_t clone;
+		struct vhd_bitmap *bm;
+
+		err        = 0;
+		clone      = treq;
+		blk        = clone.sec / s->spb;
+		clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+
+		/* nothing allocated (or allocation still in flight) */
+		if (bat_entry(s, blk) == DD_BLK_UNUSED) {
+			td_complete_request(clone, 0);
+			goto next;
+		}
+
+		if (clone.secs == s->spb && !tail_block(s, blk)) {
+			err = release_block(s, blk);
+			if (err == -EBUSY)
+				goto busy;
+			td_complete_request(clone, err);
+			goto next;
+		}
+
+		bm = get_bitmap(s, blk);
+		if (!bm) {
+			err = schedule_bitmap_read(s, blk);
+			if (err)
+				goto fail;
+
+			err = __vhd_queue_request(s, VHD_OP_DISCARD, clone);
+		} else if (!bitmap_valid(bm))
+			err = __vhd_queue_request(s, VHD_OP_DISCARD, clone);
+		else
+			err = schedule_bitmap_discard(s, bm, clone);
+
+		if (err)
+			goto fail;
+
+	next:
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		continue;
+
+	busy:
+		clone.blocked = 1;
+	fail:
+		clone.secs = treq.secs;
+		td_complete_request(clone, err);
+		break;
+	}
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -1887,8 +2310,14 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 			if (!r->error) {
 				u32 sec = r->treq.sec % s->spb;
 				for (i = 0; i < r->treq.secs; i++)
-					vhd_bitmap_set(&s->vhd,
-						       bm->shadow, sec + i);
+					if (r->op == VHD_OP_DISCARD)
+						vhd_bitmap_clear(&s->vhd,
+								 bm->shadow,
+								 sec + i);
+					else
+						vhd_bitmap_set(&s->vhd,
+							       bm->shadow,
+							       sec + i);
 			}
 		}
 		r = next;
@@ -1899,27 +2328,31 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		finish_data_transaction(s, bm);
 }
 
+/*
+ * After a failed batch the BAT stays locked until the transactions of
+ * all its blocks have drained, so that no new allocation races with
+ * requests still completing against the abandoned blocks.
+ */
 static void
 finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	struct vhd_transaction *tx = &bm->tx;
+	int i;
+	struct vhd_bat_pending *p;
 
-	if (!bat_locked(s))
+	if (!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_DONE) ||
+	    !s->bat.error)
 		return;
 
-	if (s->bat.pbw_blk != bm->blk)
+	p = bat_pending(s, bm->blk);
+	if (!p || test_vhd_flag(bm->tx.status, VHD_FLAG_TX_LIVE))
 		return;
 
-	if (!s->bat.req.error)
-		goto release;
-
-	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
-		goto release;
+	p->drained = 1;
 
-	tx->closed = 1;
-	return;
+	for (i = 0; i < s->bat.nr_pending; i++)
+		if (!s->bat.pending[i].drained)
+			return;
 
- release:
 	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
 	unlock_bat(s);
 	init_bat(s);
@@ -1936,15 +2369,12 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		struct vhd_bat_pending *p = bat_pending(s, bm->blk);
+		ASSERT(p);
+		p->waiting = 1;
+		return;
 	}
 
 	if (tx->error) {
@@ -1984,44 +2414,76 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 }
 
 static void
-finish_bat_write(struct vhd_request *req)
+finish_bat_batch(struct vhd_state *s, int error)
 {
+	int i;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_pending *p;
 	struct vhd_transaction *tx;
-	struct vhd_state *s = req->state;
 
-	s->returned++;
-	TRACE(s);
+	DBG(TLOG_DBG, "blks: %d, err: %d\n", s->bat.nr_pending, error);
+	ASSERT(bat_locked(s) && !s->bat.zeroing);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_DONE);
+	s->bat.error = error;
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	/* nothing else has been allocated behind the batch */
+	if (error)
+		s->next_db = s->bat.next_db;
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	for (i = 0; i < s->bat.nr_pending; i++) {
+		p  = s->bat.pending + i;
+		bm = get_bitmap(s, p->blk);
+		tx = &bm->tx;
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+		ASSERT(bm && bitmap_valid(bm));
+		ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT));
+
+		if (!error)
+			bat_entry(s, p->blk) = p->offset;
+		else {
+			tx->error = (tx->error ? tx->error : error);
+			if (test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
+				tx->closed = 1;
+		}
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+
+		if (p->waiting) {
+			p->waiting = 0;
+			finish_bitmap_transaction(s, bm, error);
+		} else if (!bitmap_in_use(bm))
+			unlock_bitmap(bm);
+
+		if (!bat_locked(s))
+			return;
 	}
 
-	finish_bat_transaction(s, bm);
+	if (!error) {
+		unlock_bat(s);
+		init_bat(s);
+		return;
+	}
+
+	for (i = 0; i < s->bat.nr_pending && bat_locked(s); i++) {
+		bm = get_bitmap(s, s->bat.pending[i].blk);
+		finish_bat_transaction(s, bm);
+	}
+}
+
+static void
+finish_bat_write(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	DBG(TLOG_DBG, "blks: %d, err %d\n", s->bat.nr_pending, req->error);
+	ASSERT(bat_locked(s) &&
+	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+
+	finish_bat_batch(s, req->error);
 }
 
 static void
@@ -2039,23 +2501,26 @@ finish_zero_bm_write(struct vhd_request *req)
 	bm  = get_bitmap(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
+	ASSERT(bat_locked(s) && s->bat.zeroing > 0);
+	ASSERT(bat_pending(s, blk));
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
+	s->bat.zeroing--;
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
 		tx->error = req->error;
-		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
-		schedule_bat_write(s);
+		if (!s->bat.error)
+			s->bat.error = req->error;
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
+
+	if (!s->bat.zeroing &&
+	    test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED))
+		schedule_bat_write(s);
 }
 
 static void
@@ -2090,12 +2555,15 @@ finish_bitmap_read(struct vhd_request *req)
 			free_vhd_request(s, r);
 
 			ASSERT(tmp.op == VHD_OP_DATA_READ || 
-			       tmp.op == VHD_OP_DATA_WRITE);
+			       tmp.op == VHD_OP_DATA_WRITE ||
+			       tmp.op == VHD_OP_DISCARD);
 
 			if (tmp.op == VHD_OP_DATA_READ)
 				vhd_queue_read(s->driver, tmp.treq);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
 				vhd_queue_write(s->driver, tmp.treq);
+			else
+				vhd_queue_discard(s->driver, tmp.treq);
 
 			r = next;
 		}
@@ -2261,14 +2729,14 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: (%d total)\n", s->bm_cache_size);
+	for (i = 0; s->bitmap_list && i < s->bm_cache_size; i++) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
+		struct vhd_bitmap *bm = s->bitmap_list + i;
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
+		if (get_bitmap(s, bm->blk) != bm)
 			continue;
 
 		tx = &bm->tx;
@@ -2298,9 +2766,15 @@ vhd_debug(td_driver_t *driver)
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, pending: %d, zeroing: %d, "
+	    "err: %d, secs: 0x%04x-0x%04x\n", s->bat.status, s->bat.nr_pending,
+	    s->bat.zeroing, s->bat.error, s->bat.first_sec, s->bat.last_sec);
+	for (i = 0; i < s->bat.nr_pending; i++) {
+		struct vhd_bat_pending *p = s->bat.pending + i;
+		DBG(TLOG_WARN, "%d: blk: 0x%04x, pbw_off: 0x%08"PRIx64", "
+		    "waiting: %d, drained: %d\n", i, p->blk, p->offset,
+		    p->waiting, p->drained);
+	}
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2308,6 +2782,21 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static int
+vhd_stats(td_driver_t *driver, char *buf, size_t size)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	return snprintf(buf, size, "bm_cache=%d bm_hits=%"PRIu64" "
+			"bm_misses=%"PRIu64" bm_evictions=%"PRIu64" "
+			"bm_writes=%"PRIu64" bat_writes=%"PRIu64" "
+			"bat_blocks=%"PRIu64" discards=%"PRIu64" "
+			"released=%"PRIu64, s->bm_cache_size, s->bm_hits,
+			s->bm_misses, s->bm_evictions, s->bm_writes,
+			s->bat_writes, s->bat_blocks, s->discards,
+			s->released);
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2316,7 +2805,9 @@ struct tap_disk tapdisk_vhd = {
 	.td_close           = _vhd_close,
 	.td_queue_read      = vhd_queue_read,
 	.td_queue_write     = vhd_queue_write,
+	.td_queue_discard   = vhd_queue_discard,
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
 };
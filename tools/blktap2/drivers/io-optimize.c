@@ -35,6 +35,7 @@
 
 #include "io-optimize.h"
 #include "tapdisk-log.h"
+#include "libaio-compat.h"
 
 #if (!defined(TEST) && defined(DEBUG))
 #define DBG(ctx, f, a...) tlog_write(TLOG_DBG, f, ##a)
@@ -61,6 +62,15 @@ opio_free(struct opioctx *ctx)
 
 	free(ctx->event_queue);
 	ctx->event_queue = NULL;
+
+	free(ctx->vecs);
+	ctx->vecs = NULL;
+
+	free(ctx->free_vecs);
+	ctx->free_vecs = NULL;
+
+	free(ctx->gap_buf);
+	ctx->gap_buf = NULL;
 }
 
 int
@@ -77,13 +87,29 @@ opio_init(struct opioctx *ctx, int num_iocbs)
 	ctx->iocb_queue    = calloc(1, sizeof(struct iocb *) * num_iocbs);
 	ctx->event_queue   = calloc(1, sizeof(struct io_event) * num_iocbs);
 
+	/* a vectored iocb stands for at least two others */
+	ctx->num_vecs      = (num_iocbs + 1) / 2;
+	ctx->free_vec_cnt  = ctx->num_vecs;
+	ctx->vecs          = calloc(1, sizeof(struct opvec) * ctx->num_vecs);
+	ctx->free_vecs     = calloc(1, sizeof(struct opvec *) * ctx->num_vecs);
+
 	if (!ctx->opios || !ctx->free_opios ||
-	    !ctx->iocb_queue || !ctx->event_queue)
+	    !ctx->iocb_queue || !ctx->event_queue ||
+	    !ctx->vecs || !ctx->free_vecs)
+		goto fail;
+
+	/* holes between merged reads land here, and are thrown away */
+	if (posix_memalign((void **)&ctx->gap_buf, 4096, OPIO_MAX_GAP)) {
+		ctx->gap_buf = NULL;
 		goto fail;
+	}
 
 	for (i = 0; i < num_iocbs; i++)
 		ctx->free_opios[i] = &ctx->opios[i];
 
+	for (i = 0; i < ctx->num_vecs; i++)
+		ctx->free_vecs[i] = &ctx->vecs[i];
+
 	return 0;
 
  fail:
@@ -99,9 +125,19 @@ alloc_opio(struct opioctx *ctx)
 	return ctx->free_opios[--ctx->free_opio_cnt];
 }
 
+static inline struct opvec *
+alloc_opvec(struct opioctx *ctx)
+{
+	if (ctx->free_vec_cnt <= 0)
+		return NULL;
+	return ctx->free_vecs[--ctx->free_vec_cnt];
+}
+
 static inline void
 free_opio(struct opioctx *ctx, struct opio *op)
 {
+	if (op->vec)
+		ctx->free_vecs[ctx->free_vec_cnt++] = op->vec;
 	memset(op, 0, sizeof(struct opio));
 	ctx->free_opios[ctx->free_opio_cnt++] = op;
 }
@@ -111,9 +147,10 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->data           = op->data;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
+	io->aio_lio_opcode = op->opcode;
 }
 
 static inline int
@@ -127,9 +164,34 @@ iocb_optimized(struct opioctx *ctx, struct iocb *io)
 }
 
 static inline int
-contiguous_sectors(struct iocb *l, struct iocb *r)
+iocb_vectored(struct iocb *io)
+{
+	return (io->aio_lio_opcode == __IO_CMD_PREADV ||
+		io->aio_lio_opcode == __IO_CMD_PWRITEV);
+}
+
+static inline int
+iocb_mergeable(struct iocb *io)
+{
+	return (io->aio_lio_opcode == IO_CMD_PREAD ||
+		io->aio_lio_opcode == IO_CMD_PWRITE);
+}
+
+/* opcode and length of an iocb as queued, before any merging */
+static inline short
+iocb_opcode(struct opioctx *ctx, struct iocb *io)
 {
-	return (l->u.c.offset + l->u.c.nbytes == r->u.c.offset);
+	if (iocb_optimized(ctx, io))
+		return ((struct opio *)io->data)->opcode;
+	return io->aio_lio_opcode;
+}
+
+static inline unsigned long
+iocb_bytes(struct opioctx *ctx, struct iocb *io)
+{
+	if (iocb_optimized(ctx, io))
+		return ((struct opio *)io->data)->total;
+	return io->u.c.nbytes;
 }
 
 static inline int
@@ -139,11 +201,13 @@ contiguous_buffers(struct iocb *l, struct iocb *r)
 }
 
 static inline int
-contiguous_iocbs(struct iocb *l, struct iocb *r)
+iocb_before(struct iocb *l, struct iocb *r)
 {
-	return ((l->aio_fildes == r->aio_fildes) &&
-		contiguous_sectors(l, r) &&
-		contiguous_buffers(l, r));
+	if (l->aio_fildes != r->aio_fildes)
+		return l->aio_fildes < r->aio_fildes;
+	if (l->aio_lio_opcode != r->aio_lio_opcode)
+		return l->aio_lio_opcode < r->aio_lio_opcode;
+	return l->u.c.offset < r->u.c.offset;
 }
 
 static inline void
@@ -164,6 +228,8 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->buf    = io->u.c.buf;
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
+	op->opcode = io->aio_lio_opcode;
+	op->total  = io->u.c.nbytes;
 	op->data   = io->data;
 	op->iocb   = io;
 	io->data   = op;
@@ -197,29 +263,141 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 
 	opio->head        = ophead;
 	head->u.c.nbytes += io->u.c.nbytes;
+	ophead->total    += io->u.c.nbytes;
 	ophead->list.tail = ophead->list.tail->next = opio;
 	
 	return 0;
 }
 
+/*
+ * merge io into a readv/writev of head, which is converted on first use.
+ * a non-zero gap is read into the scratch buffer.
+ */
+static int
+merge_vector(struct opioctx *ctx,
+	     struct iocb *head, struct iocb *io, unsigned long gap)
+{
+	int nr;
+	struct iovec *iov;
+	struct opio *ophead, *opio;
+
+	nr = (iocb_vectored(head) ? head->u.c.nbytes : 1);
+	if (nr + (gap ? 2 : 1) > OPIO_MAX_IOVS)
+		return -EINVAL;
+
+	if (!iocb_vectored(head) && ctx->free_vec_cnt <= 0)
+		return -ENOMEM;
+
+	ophead = opio_get(ctx, head);
+	if (!ophead)
+		return -ENOMEM;
+
+	opio = opio_get(ctx, io);
+	if (!opio)
+		return -ENOMEM;
+
+	if (!ophead->vec) {
+		ophead->vec     = alloc_opvec(ctx);
+		iov             = ophead->vec->iov;
+		iov[0].iov_base = head->u.c.buf;
+		iov[0].iov_len  = head->u.c.nbytes;
+		head->u.c.buf   = iov;
+		head->aio_lio_opcode = (ophead->opcode == IO_CMD_PREAD ?
+					__IO_CMD_PREADV : __IO_CMD_PWRITEV);
+		ctx->stats.vectored++;
+	}
+
+	iov = ophead->vec->iov;
+
+	if (gap) {
+		iov[nr].iov_base = ctx->gap_buf;
+		iov[nr].iov_len  = gap;
+		nr++;
+
+		ctx->stats.gaps++;
+		ctx->stats.gap_bytes += gap;
+	}
+
+	iov[nr].iov_base = io->u.c.buf;
+	iov[nr].iov_len  = io->u.c.nbytes;
+	nr++;
+
+	opio->head        = ophead;
+	head->u.c.nbytes  = nr;
+	ophead->total    += gap + io->u.c.nbytes;
+	ophead->list.tail = ophead->list.tail->next = opio;
+
+	return 0;
+}
+
 static int
 merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
-	if (head->aio_lio_opcode != io->aio_lio_opcode)
+	long long gap;
+
+	if (!iocb_mergeable(io))
+		return -EINVAL;
+
+	if (head->aio_fildes != io->aio_fildes ||
+	    iocb_opcode(ctx, head) != io->aio_lio_opcode)
 		return -EINVAL;
 
-	if (!contiguous_iocbs(head, io))
+	gap = io->u.c.offset - (head->u.c.offset + iocb_bytes(ctx, head));
+	if (gap < 0)
 		return -EINVAL;
 
-	return merge_tail(ctx, head, io);		
+	if (gap) {
+		/* only reads can skip over the data in between */
+		if (io->aio_lio_opcode != IO_CMD_PREAD || gap > OPIO_MAX_GAP)
+			return -EINVAL;
+
+		return merge_vector(ctx, head, io, gap);
+	}
+
+	if (!iocb_vectored(head) && contiguous_buffers(head, io))
+		return merge_tail(ctx, head, io);
+
+	return merge_vector(ctx, head, io, 0);
 }
 
+/*
+ * stable insertion sort by (fd, opcode, offset): batches are small and
+ * usually close to sorted already.  returns non-zero if anything moved.
+ */
+static int
+sort_iocbs(struct iocb **q, int num)
+{
+	int i, j, moved;
+	struct iocb *io;
+
+	for (i = 0; i < num; i++)
+		if (!iocb_mergeable(q[i]))
+			return 0;
+
+	moved = 0;
+	for (i = 1; i < num; i++) {
+		io = q[i];
+		for (j = i; j > 0 && iocb_before(io, q[j - 1]); j--)
+			q[j] = q[j - 1];
+		if (j != i) {
+			q[j]  = io;
+			moved = 1;
+		}
+	}
+
+	return moved;
+}
+
+/*
+ * requests within a batch carry no ordering guarantees, so they are
+ * sorted by offset and every run of adjacent (or, for reads, nearly
+ * adjacent) iocbs is submitted as one.
+ */
 int
 io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 {
 	int i, on_queue;
 	struct iocb *io, **q;
-	struct opio *ophead;
 	
 	if (!num)
 		return 0;
@@ -228,6 +406,10 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 	q = ctx->iocb_queue;
 	memcpy(q, queue, num * sizeof(struct iocb *));
 
+	if (sort_iocbs(q, num))
+		ctx->stats.reordered++;
+
+	queue[0] = q[0];
 	for (i = 1; i < num; i++) {
 		io = q[i];
 		if (merge(ctx, queue[on_queue], io) != 0)
@@ -238,6 +420,10 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 	print_merged_iocbs(ctx, queue, on_queue + 1);
 #endif
 
+	ctx->stats.batches++;
+	ctx->stats.iocbs  += num;
+	ctx->stats.merged += on_queue + 1;
+
 	return ++on_queue;
 }
 
@@ -297,7 +483,7 @@ expand_event(struct opioctx *ctx,
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
+	if (event->res == ophead->total)
 		err = 0;
 	else if ((int)event->res < 0)
 		err = (int)event->res;
@@ -350,7 +536,20 @@ __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
 	char *type;
 
-	type = (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write");
+	switch (io->aio_lio_opcode) {
+	case IO_CMD_PREAD:
+		type = "read";
+		break;
+	case __IO_CMD_PREADV:
+		type = "readv";
+		break;
+	case __IO_CMD_PWRITEV:
+		type = "writev";
+		break;
+	default:
+		type = "write";
+		break;
+	}
 
 	DBG(ctx, "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
 	    " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes, 
@@ -516,7 +715,8 @@ randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
 }
 
 static int
-simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
+simulate_io(struct opioctx *ctx,
+	    struct iocb **iocbs, struct io_event *events, int num_iocbs)
 {
 	int i, done;
 	struct iocb *io;
@@ -531,7 +731,7 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 		io      = iocbs[i];
 		ep      = &events[i];
 		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+		ep->res = (random() % 10 < 8 ? iocb_bytes(ctx, io) : 0);
 	}
 
 	return done;
@@ -639,7 +839,8 @@ main(int argc, char **argv)
 			DBG(&ctx, "optimized remaining: %d\n", op_rem);
 
 			DBG(&ctx, "simulating\n");
-			num_events = simulate_io(ioqueue + op_done, events, op_rem);
+			num_events = simulate_io(&ctx, ioqueue + op_done,
+						 events, op_rem);
 			print_events(&ctx, events, num_events);
 
 			DBG(&ctx, "splitting %d\n", num_events);
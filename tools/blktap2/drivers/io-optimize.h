@@ -29,10 +29,22 @@
 #ifndef __IO_OPTIMIZE_H__
 #define __IO_OPTIMIZE_H__
 
+#include <stdint.h>
+#include <sys/uio.h>
 #include <libaio.h>
 
+/* iovecs available to one vectored, merged iocb */
+#define OPIO_MAX_IOVS       64
+
+/* largest hole between two reads that may be read through */
+#define OPIO_MAX_GAP        (16 << 10)
+
 struct opio;
 
+struct opvec {
+	struct iovec        iov[OPIO_MAX_IOVS];
+};
+
 struct opio_list {
 	struct opio        *head;
 	struct opio        *tail;
@@ -42,6 +54,9 @@ struct opio {
 	char               *buf;
 	unsigned long       nbytes;
 	long long           offset;
+	short               opcode;
+	unsigned long       total;
+	struct opvec       *vec;
 	void               *data;
 	struct iocb        *iocb;
 	struct io_event     event;
@@ -50,6 +65,16 @@ struct opio {
 	struct opio_list    list;
 };
 
+struct opio_stats {
+	uint64_t            batches;
+	uint64_t            iocbs;
+	uint64_t            merged;
+	uint64_t            reordered;
+	uint64_t            vectored;
+	uint64_t            gaps;
+	uint64_t            gap_bytes;
+};
+
 struct opioctx {
 	int                 num_opios;
 	int                 free_opio_cnt;
@@ -57,6 +82,14 @@ struct opioctx {
 	struct opio       **free_opios;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
+
+	int                 num_vecs;
+	int                 free_vec_cnt;
+	struct opvec       *vecs;
+	struct opvec      **free_vecs;
+	char               *gap_buf;
+
+	struct opio_stats   stats;
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
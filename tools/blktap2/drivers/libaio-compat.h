@@ -84,6 +84,10 @@ static inline void __io_set_eventfd(struct iocb *iocb, int eventfd)
 #define SYS_eventfd __NR_eventfd
 #endif
 
+/* vectored commands, missing from older libaio headers */
+#define __IO_CMD_PREADV		7
+#define __IO_CMD_PWRITEV	8
+
 static inline int tapdisk_sys_eventfd(int initval)
 {
 	return syscall(SYS_eventfd, initval, 0);
@@ -40,6 +40,7 @@
 #include <string.h>
 #include "tapdisk.h"
 #include "qcow.h"
+#include "qcow2.h"
 
 #if 1
 #define DFPRINTF(_f, _a...) fprintf ( stderr, _f , ## _a )
@@ -53,8 +54,9 @@ void help(void)
 {
 	fprintf(stderr, "Qcow-utils: v1.0.0\n");
 	fprintf(stderr, 
-		"usage: qcow-create [-h help] [-r reserve] <SIZE(MB)> <FILENAME> "
-		"[<BACKING_FILENAME>]\n"); 
+		"usage: qcow-create [-h help] [-r reserve] [-f qcow|qcow2] "
+		"[-c cluster_bits] [-p off|metadata|full] <SIZE(MB)> "
+		"<FILENAME> [<BACKING_FILENAME>]\n");
 	exit(-1);
 }
 
@@ -62,11 +64,12 @@ int main(int argc, char *argv[])
 {
 	int ret = -1, c, backed = 0;
 	int sparse =  1;
+	int qcow2 = 0, cluster_bits = 0, prealloc = QCOW2_PREALLOC_OFF;
 	uint64_t size;
 	char filename[MAX_NAME_LEN], bfilename[MAX_NAME_LEN];
 
         for(;;) {
-                c = getopt(argc, argv, "hr");
+                c = getopt(argc, argv, "hrf:c:p:");
                 if (c == -1)
                         break;
                 switch(c) {
@@ -77,6 +80,25 @@ int main(int argc, char *argv[])
                 case 'r':
 			sparse = 0;
 			break;
+		case 'f':
+			if (!strcmp(optarg, "qcow2"))
+				qcow2 = 1;
+			else if (strcmp(optarg, "qcow"))
+				help();
+			break;
+		case 'c':
+			cluster_bits = atoi(optarg);
+			break;
+		case 'p':
+			if (!strcmp(optarg, "off"))
+				prealloc = QCOW2_PREALLOC_OFF;
+			else if (!strcmp(optarg, "metadata"))
+				prealloc = QCOW2_PREALLOC_METADATA;
+			else if (!strcmp(optarg, "full"))
+				prealloc = QCOW2_PREALLOC_FULL;
+			else
+				help();
+			break;
 		default:
 			fprintf(stderr, "Unknown option\n");
 			help();
@@ -107,7 +129,10 @@ int main(int argc, char *argv[])
 	}
 
 	DFPRINTF("Creating file size %"PRIu64", name %s\n",(uint64_t)size, filename);
-	if (!backed)
+	if (qcow2)
+		ret = qcow2_create(filename, size, backed ? bfilename : NULL,
+				   cluster_bits, prealloc);
+	else if (!backed)
 		ret = qcow_create(filename,size,NULL,sparse);
 	else
 		ret = qcow_create(filename,size,bfilename,sparse);
@@ -30,6 +30,7 @@
 #define _QCOW_H_
 
 #include "aes.h"
+#include "list.h"
 /**************************************************************/
 /* QEMU COW block driver with compression and encryption support */
 
@@ -79,7 +80,11 @@ uint32_t gen_cksum(char *ptr, int len);
 int get_filesize(char *filename, uint64_t *size, struct stat *st);
 int qtruncate(int fd, off_t length, int sparse);
 
-#define L2_CACHE_SIZE 16  /*Fixed allocation in Qemu*/
+#define L2_CACHE_SIZE 256    /*Default number of cached L2 tables,
+			      *override with TAPDISK2_QCOW_L2_CACHE*/
+#define L2_CACHE_MAX  65536
+
+struct qcow_l2_table;
 
 struct tdqcow_state {
         int fd;                        /*Main Qcow file descriptor */
@@ -104,10 +109,15 @@ struct tdqcow_state {
 	uint64_t l1_table_offset;      /*L1 table offset from beginning of 
 					*file*/
 	uint64_t *l1_table;            /*L1 table entries*/
-	uint64_t *l2_cache;            /*We maintain a cache of size 
-					*L2_CACHE_SIZE of most read entries*/
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];     /*L2 cache entries*/
-	uint32_t l2_cache_counts[L2_CACHE_SIZE];      /*Cache access record*/
+	int l2_cache_size;             /*Number of cached L2 tables*/
+	int l2_hash_bits;              /*log2 of the L2 hash bucket count*/
+	struct qcow_l2_table *l2_cache;  /*L2 cache entries*/
+	struct qcow_l2_table **l2_hash;  /*L2 cache entries by offset*/
+	struct list_head l2_lru;       /*L2 cache entries, oldest first*/
+	uint64_t *l2_cache_data;       /*Table storage for the L2 cache*/
+	uint64_t l2_hits;
+	uint64_t l2_misses;
+	uint64_t file_size;            /*Length the file is known to cover*/
 	uint8_t *cluster_cache;          
 	uint8_t *cluster_data;
 	uint64_t cluster_cache_offset; /**/
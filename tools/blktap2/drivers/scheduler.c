@@ -30,6 +30,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
 #include "scheduler.h"
 #include "tapdisk-log.h"
@@ -37,6 +42,7 @@
 #define DBG(_f, _a...)               tlog_write(TLOG_DBG, _f, ##_a)
 
 #define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_MAX_READY          64
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -49,6 +55,7 @@
 
 typedef struct event {
 	char                         mode;
+	char                         dead;
 	event_id_t                   id;
 
 	int                          fd;
@@ -58,105 +65,504 @@ typedef struct event {
 	event_cb_t                   cb;
 	void                        *private;
 
+	int                          timer;
+	int                          pass;
+
 	struct list_head             next;
+	struct list_head             fd_next;
 } event_t;
 
+/*
+ * All events registered on one fd. The fd is polled for the union of
+ * their modes.
+ */
+struct scheduler_fd {
+	char                         mode;
+	char                         always;
+	struct list_head             events;
+};
+
+typedef struct scheduler_ready {
+	int                          fd;
+	char                         mode;
+} scheduler_ready_t;
+
+/*
+ * Timeouts are kept in a binary min-heap on the deadline. Among equal
+ * deadlines, events which already ran in the current pass sort last,
+ * so that a zero timeout fires once per pass rather than forever.
+ */
+static inline int
+scheduler_timer_before(event_t *a, event_t *b)
+{
+	if (a->deadline != b->deadline)
+		return a->deadline < b->deadline;
+	return a->pass < b->pass;
+}
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_timer_swap(scheduler_t *s, int a, int b)
 {
-	int diff;
-	struct timeval now;
-	event_t *event, *tmp;
+	event_t *event = s->timers[a];
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	s->timers[a] = s->timers[b];
+	s->timers[b] = event;
 
-	s->max_fd  = 0;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
+	s->timers[a]->timer = a;
+	s->timers[b]->timer = b;
+}
 
-	gettimeofday(&now, NULL);
+static void
+scheduler_timer_up(scheduler_t *s, int i)
+{
+	int parent;
 
-	scheduler_for_each_event(s, event, tmp) {
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!scheduler_timer_before(s->timers[i], s->timers[parent]))
+			break;
+
+		scheduler_timer_swap(s, i, parent);
+		i = parent;
+	}
+}
+
+static void
+scheduler_timer_down(scheduler_t *s, int i)
+{
+	int l, r, min;
+
+	for (;;) {
+		l   = 2 * i + 1;
+		r   = l + 1;
+		min = i;
+
+		if (l < s->nr_timers &&
+		    scheduler_timer_before(s->timers[l], s->timers[min]))
+			min = l;
+		if (r < s->nr_timers &&
+		    scheduler_timer_before(s->timers[r], s->timers[min]))
+			min = r;
+
+		if (min == i)
+			break;
+
+		scheduler_timer_swap(s, i, min);
+		i = min;
+	}
+}
+
+static void
+scheduler_timer_update(scheduler_t *s, event_t *event)
+{
+	if (event->timer < 0)
+		return;
+
+	scheduler_timer_up(s, event->timer);
+	scheduler_timer_down(s, event->timer);
+}
+
+static int
+scheduler_timer_add(scheduler_t *s, event_t *event)
+{
+	event_t **timers;
+	int max;
+
+	if (s->nr_timers == s->max_timers) {
+		max    = s->max_timers ? s->max_timers * 2 : 16;
+		timers = realloc(s->timers, max * sizeof(*timers));
+		if (!timers)
+			return -ENOMEM;
+
+		s->timers     = timers;
+		s->max_timers = max;
+	}
+
+	event->timer = s->nr_timers++;
+	s->timers[event->timer] = event;
+	scheduler_timer_up(s, event->timer);
+
+	return 0;
+}
+
+static void
+scheduler_timer_del(scheduler_t *s, event_t *event)
+{
+	int i = event->timer;
+
+	if (i < 0)
+		return;
+
+	event->timer = -1;
+
+	if (i == --s->nr_timers)
+		return;
+
+	s->timers[i] = s->timers[s->nr_timers];
+	s->timers[i]->timer = i;
+	scheduler_timer_update(s, s->timers[i]);
+}
+
+#ifdef __linux__
+
+static int
+scheduler_backend_init(scheduler_t *s)
+{
+	s->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->poll_fd == -1)
+		return -errno;
+
+	return 0;
+}
+
+static void
+scheduler_backend_destroy(scheduler_t *s)
+{
+	if (s->poll_fd != -1)
+		close(s->poll_fd);
+	s->poll_fd = -1;
+}
+
+static int
+scheduler_backend_update(scheduler_t *s, int fd,
+			 struct scheduler_fd *sfd, char mode)
+{
+	struct epoll_event ev;
+	int op, err;
+
+	if (sfd->always) {
+		if (!mode) {
+			sfd->always = 0;
+			s->nr_always--;
 		}
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	if (mode & SCHEDULER_POLL_READ_FD)
+		ev.events |= EPOLLIN;
+	if (mode & SCHEDULER_POLL_WRITE_FD)
+		ev.events |= EPOLLOUT;
+	if (mode & SCHEDULER_POLL_EXCEPT_FD)
+		ev.events |= EPOLLPRI;
+
+	op = (!sfd->mode ? EPOLL_CTL_ADD :
+	      mode ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+
+	err = epoll_ctl(s->poll_fd, op, fd, &ev);
+	if (err && errno == ENOENT && op == EPOLL_CTL_MOD) {
+		/* closed and reopened under the same number */
+		op  = EPOLL_CTL_ADD;
+		err = epoll_ctl(s->poll_fd, op, fd, &ev);
+	}
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
+	if (!err)
+		return 0;
+
+	switch (op) {
+	case EPOLL_CTL_DEL:
+		/* the fd may have been closed already */
+		return 0;
+
+	case EPOLL_CTL_ADD:
+		/* regular files: select() always reported them ready */
+		if (errno == EPERM) {
+			sfd->always = 1;
+			s->nr_always++;
+			return 0;
 		}
+	}
+
+	return -errno;
+}
+
+static int
+scheduler_backend_wait(scheduler_t *s, int timeout,
+		       scheduler_ready_t *ready, int max)
+{
+	struct epoll_event events[SCHEDULER_MAX_READY];
+	struct scheduler_fd *sfd;
+	int i, n, fd;
+
+	if (s->nr_always)
+		timeout = 0;
+
+	n = epoll_wait(s->poll_fd, events, MIN(max, SCHEDULER_MAX_READY),
+		       timeout);
+	if (n < 0)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		ready[i].fd   = events[i].data.fd;
+		ready[i].mode = 0;
+
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			ready[i].mode |= SCHEDULER_POLL_READ_FD;
+		if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			ready[i].mode |= SCHEDULER_POLL_WRITE_FD;
+		if (events[i].events & EPOLLPRI)
+			ready[i].mode |= SCHEDULER_POLL_EXCEPT_FD;
+	}
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
+	for (fd = 0; s->nr_always && fd < s->nr_fds && n < max; fd++) {
+		sfd = s->fds[fd];
+		if (sfd && sfd->always) {
+			ready[n].fd   = fd;
+			ready[n].mode = sfd->mode;
+			n++;
 		}
+	}
+
+	return n;
+}
+
+#else
+
+static int
+scheduler_backend_init(scheduler_t *s)
+{
+	s->poll_fd = -1;
+	return 0;
+}
+
+static void
+scheduler_backend_destroy(scheduler_t *s)
+{
+}
+
+static int
+scheduler_backend_update(scheduler_t *s, int fd,
+			 struct scheduler_fd *sfd, char mode)
+{
+	return 0;
+}
+
+static int
+scheduler_backend_wait(scheduler_t *s, int timeout,
+		       scheduler_ready_t *ready, int max)
+{
+	struct pollfd *pfds;
+	struct scheduler_fd *sfd;
+	int i, n, fd, nr;
+
+	pfds = calloc(s->nr_fds ? : 1, sizeof(*pfds));
+	if (!pfds) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (nr = 0, fd = 0; fd < s->nr_fds; fd++) {
+		sfd = s->fds[fd];
+		if (!sfd || !sfd->mode)
+			continue;
+
+		pfds[nr].fd = fd;
+		if (sfd->mode & SCHEDULER_POLL_READ_FD)
+			pfds[nr].events |= POLLIN;
+		if (sfd->mode & SCHEDULER_POLL_WRITE_FD)
+			pfds[nr].events |= POLLOUT;
+		if (sfd->mode & SCHEDULER_POLL_EXCEPT_FD)
+			pfds[nr].events |= POLLPRI;
+		nr++;
+	}
+
+	n = poll(pfds, nr, timeout);
+	if (n < 0)
+		goto out;
+
+	for (n = 0, i = 0; i < nr && n < max; i++) {
+		if (!pfds[i].revents)
+			continue;
+
+		ready[n].fd   = pfds[i].fd;
+		ready[n].mode = 0;
+
+		if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+			ready[n].mode |= SCHEDULER_POLL_READ_FD;
+		if (pfds[i].revents & (POLLOUT | POLLHUP | POLLERR))
+			ready[n].mode |= SCHEDULER_POLL_WRITE_FD;
+		if (pfds[i].revents & POLLPRI)
+			ready[n].mode |= SCHEDULER_POLL_EXCEPT_FD;
+		n++;
+	}
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
+out:
+	free(pfds);
+	return n;
+}
+
+#endif
+
+static struct scheduler_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd **fds;
+	int nr;
+
+	if (fd >= s->nr_fds) {
+		nr  = MAX(fd + 1, s->nr_fds * 2);
+		fds = realloc(s->fds, nr * sizeof(*fds));
+		if (!fds)
+			return NULL;
+
+		memset(fds + s->nr_fds, 0, (nr - s->nr_fds) * sizeof(*fds));
+		s->fds    = fds;
+		s->nr_fds = nr;
+	}
+
+	if (!s->fds[fd]) {
+		s->fds[fd] = calloc(1, sizeof(struct scheduler_fd));
+		if (!s->fds[fd])
+			return NULL;
+
+		INIT_LIST_HEAD(&s->fds[fd]->events);
+	}
+
+	return s->fds[fd];
+}
+
+static void
+scheduler_put_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *sfd = s->fds[fd];
+
+	if (sfd && list_empty(&sfd->events)) {
+		free(sfd);
+		s->fds[fd] = NULL;
+	}
+}
+
+static int
+scheduler_update_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *sfd = s->fds[fd];
+	event_t *event;
+	char mode;
+	int err;
+
+	mode = 0;
+	list_for_each_entry(event, &sfd->events, fd_next)
+		if (!event->dead)
+			mode |= event->mode & SCHEDULER_POLL_FD;
+
+	if (mode == sfd->mode)
+		return 0;
+
+	err = scheduler_backend_update(s, fd, sfd, mode);
+	if (!err)
+		sfd->mode = mode;
+
+	return err;
+}
+
+static void
+scheduler_reap_events(scheduler_t *s)
+{
+	event_t *event, *tmp;
+
+	list_for_each_entry_safe(event, tmp, &s->dead, next) {
+		list_del(&event->next);
+
+		if (event->mode & SCHEDULER_POLL_FD) {
+			list_del(&event->fd_next);
+			scheduler_put_fd(s, event->fd);
 		}
+
+		free(event);
+	}
+}
+
+static int
+scheduler_prepare_timeout(scheduler_t *s)
+{
+	int diff;
+	struct timeval now;
+
+	s->timeout = SCHEDULER_MAX_TIMEOUT;
+
+	if (s->nr_timers) {
+		gettimeofday(&now, NULL);
+
+		diff = s->timers[0]->deadline - now.tv_sec;
+		if (diff > 0)
+			s->timeout = MIN(s->timeout, diff);
+		else
+			s->timeout = 0;
 	}
 
 	s->timeout = MIN(s->timeout, s->max_timeout);
+
+	return s->timeout;
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
 {
+	event->pass = s->pass;
+
 	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
 		struct timeval now;
 		gettimeofday(&now, NULL);
 		event->deadline = now.tv_sec + event->timeout;
+		scheduler_timer_update(s, event);
 	}
 
 	event->cb(event->id, mode, event->private);
 }
 
+/*
+ * As with select(), a ready fd wakes the first event waiting for each
+ * mode, and an event runs at most once per pass. Events unregistered
+ * meanwhile are only freed once the pass is over.
+ */
 static void
-scheduler_run_events(scheduler_t *s)
+scheduler_run_fd(scheduler_t *s, int fd, char mode)
 {
-	struct timeval now;
-	event_t *event, *tmp;
+	struct scheduler_fd *sfd;
+	event_t *event;
+	char m, done;
 
-	gettimeofday(&now, NULL);
+	if (fd >= s->nr_fds || !s->fds[fd])
+		return;
 
- again:
-	s->restart = 0;
+	sfd  = s->fds[fd];
+	done = 0;
 
-	scheduler_for_each_event(s, event, tmp) {
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
-			goto next;
-		}
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		if (event->dead || event->pass == s->pass)
+			continue;
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
-			goto next;
-		}
+		m = event->mode & mode & ~done;
+		if (!m)
+			continue;
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
-			goto next;
-		}
+		if (m & SCHEDULER_POLL_READ_FD)
+			m = SCHEDULER_POLL_READ_FD;
+		else if (m & SCHEDULER_POLL_WRITE_FD)
+			m = SCHEDULER_POLL_WRITE_FD;
+		else
+			m = SCHEDULER_POLL_EXCEPT_FD;
 
-		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
-		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+		done |= m;
+		scheduler_event_callback(s, event, m);
+	}
+}
 
-	next:
-		if (s->restart)
-			goto again;
+static void
+scheduler_run_timers(scheduler_t *s)
+{
+	struct timeval now;
+	event_t *event;
+
+	gettimeofday(&now, NULL);
+
+	while (s->nr_timers) {
+		event = s->timers[0];
+		if (event->deadline > now.tv_sec || event->pass == s->pass)
+			break;
+
+		scheduler_event_callback(s, event, SCHEDULER_POLL_TIMEOUT);
 	}
 }
 
@@ -166,6 +572,8 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 {
 	event_t *event;
 	struct timeval now;
+	struct scheduler_fd *sfd;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -173,6 +581,9 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
+	if ((mode & SCHEDULER_POLL_FD) && fd < 0)
+		return -EINVAL;
+
 	event = calloc(1, sizeof(event_t));
 	if (!event)
 		return -ENOMEM;
@@ -180,6 +591,7 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	gettimeofday(&now, NULL);
 
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->fd_next);
 
 	event->mode     = mode;
 	event->fd       = fd;
@@ -187,14 +599,47 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	event->deadline = now.tv_sec + timeout;
 	event->cb       = cb;
 	event->private  = private;
+	event->timer    = -1;
+	event->pass     = s->pass;
 	event->id       = s->uuid++;
 
 	if (!s->uuid)
 		s->uuid++;
 
+	if (mode & SCHEDULER_POLL_FD) {
+		sfd = scheduler_get_fd(s, fd);
+		if (!sfd) {
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		list_add_tail(&event->fd_next, &sfd->events);
+
+		err = scheduler_update_fd(s, fd);
+		if (err)
+			goto fail;
+	}
+
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		err = scheduler_timer_add(s, event);
+		if (err)
+			goto fail;
+	}
+
 	list_add_tail(&event->next, &s->events);
 
 	return event->id;
+
+fail:
+	if (!list_empty(&event->fd_next)) {
+		event->dead = 1;
+		scheduler_update_fd(s, fd);
+		list_del(&event->fd_next);
+	}
+	if (mode & SCHEDULER_POLL_FD)
+		scheduler_put_fd(s, fd);
+	free(event);
+	return err;
 }
 
 void
@@ -208,8 +653,15 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 	scheduler_for_each_event(s, event, tmp)
 		if (event->id == id) {
 			list_del(&event->next);
-			free(event);
-			s->restart = 1;
+			event->dead = 1;
+
+			scheduler_timer_del(s, event);
+			if (event->mode & SCHEDULER_POLL_FD)
+				scheduler_update_fd(s, event->fd);
+
+			list_add_tail(&event->next, &s->dead);
+			if (!s->dispatching)
+				scheduler_reap_events(s);
 			break;
 		}
 }
@@ -221,45 +673,89 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 		s->max_timeout = MIN(s->max_timeout, timeout);
 }
 
+/* for waits shorter than the second granularity of timer events */
+void
+scheduler_set_max_timeout_ms(scheduler_t *s, int timeout)
+{
+	if (timeout >= 0)
+		s->max_timeout_ms = MIN(s->max_timeout_ms, timeout);
+}
+
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
-	int ret;
-	struct timeval tv;
+	scheduler_ready_t ready[SCHEDULER_MAX_READY];
+	int i, ret;
 
-	scheduler_prepare_events(s);
-
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
+	scheduler_prepare_timeout(s);
 
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	ret = scheduler_backend_wait(s, MIN(s->timeout * 1000,
+					    s->max_timeout_ms),
+				     ready, SCHEDULER_MAX_READY);
 
-	s->restart     = 0;
-	s->timeout     = SCHEDULER_MAX_TIMEOUT;
-	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
+	s->timeout        = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout    = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout_ms = SCHEDULER_MAX_TIMEOUT * 1000;
 
 	if (ret < 0)
 		return ret;
 
-	scheduler_run_events(s);
+	s->pass++;
+	s->dispatching = 1;
+
+	for (i = 0; i < ret; i++)
+		scheduler_run_fd(s, ready[i].fd, ready[i].mode);
+
+	scheduler_run_timers(s);
+
+	s->dispatching = 0;
+	scheduler_reap_events(s);
 
 	return ret;
 }
 
-void
+int
 scheduler_initialize(scheduler_t *s)
 {
 	memset(s, 0, sizeof(scheduler_t));
 
 	s->uuid = 1;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
-
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->dead);
+
+	return scheduler_backend_init(s);
+}
+
+void
+scheduler_destroy(scheduler_t *s)
+{
+	event_t *event, *tmp;
+	int fd;
+
+	scheduler_for_each_event(s, event, tmp) {
+		list_del(&event->next);
+		free(event);
+	}
+
+	list_for_each_entry_safe(event, tmp, &s->dead, next) {
+		list_del(&event->next);
+		free(event);
+	}
+
+	for (fd = 0; fd < s->nr_fds; fd++)
+		free(s->fds[fd]);
+
+	free(s->fds);
+	free(s->timers);
+
+	scheduler_backend_destroy(s);
+
+	s->fds       = NULL;
+	s->nr_fds    = 0;
+	s->timers    = NULL;
+	s->nr_timers = 0;
 }
@@ -28,8 +28,6 @@
 #ifndef _SCHEDULER_H_
 #define _SCHEDULER_H_
 
-#include <sys/select.h>
-
 #include "list.h"
 
 #define SCHEDULER_POLL_READ_FD       0x1
@@ -40,26 +38,39 @@
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct event;
+struct scheduler_fd;
+
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	int                          poll_fd;
+	int                          nr_always;
+
+	struct scheduler_fd        **fds;
+	int                          nr_fds;
+
+	struct event               **timers;
+	int                          nr_timers;
+	int                          max_timers;
 
 	struct list_head             events;
+	struct list_head             dead;
 
 	int                          uuid;
-	int                          max_fd;
 	int                          timeout;
-	int                          restart;
 	int                          max_timeout;
+	int                          max_timeout_ms;
+	int                          pass;
+	int                          dispatching;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
+void scheduler_destroy(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
 void scheduler_unregister_event(scheduler_t *,  event_id_t);
 void scheduler_set_max_timeout(scheduler_t *, int);
+void scheduler_set_max_timeout_ms(scheduler_t *, int);
 int scheduler_wait_for_events(scheduler_t *);
 
 #endif
@@ -0,0 +1,626 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Drive the tapdisk I/O queue directly with a fixed number of requests in
+ * flight, to compare queue drivers without a guest.  By default the
+ * target is a scratch image in RAM, and with -z it is /dev/zero, so that
+ * the numbers reflect the cost of the I/O path itself rather than that
+ * of a disk.
+ *
+ * With -i, requests go through a VBD to an image driver instead, for
+ * comparing image formats (e.g. aio:, vhd: and qcow2: images of the same
+ * size) on the same storage.  The whole chain of parent images is opened.
+ *
+ * With -e, time the event loop instead: one scheduler pass with a given
+ * number of idle events registered, while a single event stays ready.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-queue.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "scheduler.h"
+
+#define BENCH_RAM_DIR  "/dev/shm"
+#define BENCH_NULL     "/dev/zero"
+
+struct bench_request {
+	struct tiocb          tiocb;
+	char                 *buf;
+	uint64_t              start;
+};
+
+struct bench {
+	int                   fd;
+	int                   write;
+	size_t                size;
+	uint64_t              blocks;
+
+	unsigned long         count;
+	unsigned long         issued;
+	unsigned long         completed;
+	unsigned long         errors;
+	uint64_t             *latency;
+
+	struct bench_request *reqs;
+	int                   depth;
+
+	/* image mode */
+	td_vbd_t             *vbd;
+	int                  *idle;
+	int                   nr_idle;
+};
+
+static void
+usage(const char *app, int err)
+{
+	fprintf(stderr, "usage: %s [-q lio|rwio|uring] [-d depth] "
+		"[-s size] [-n count] [-w] [-f file | [-z] -m MB]\n"
+		"       %s [-q lio|rwio|uring] [-d depth] [-s size] "
+		"[-n count] [-w] -i type:image\n"
+		"       %s -e events [-n count]\n", app, app, app);
+	fprintf(stderr, "  -q  I/O queue driver (default lio)\n"
+		"  -d  requests in flight (default 32)\n"
+		"  -s  request size in bytes (default 4096)\n"
+		"  -n  number of requests (default 100000)\n"
+		"  -w  write instead of read\n"
+		"  -f  image file or device to use, opened O_DIRECT\n"
+		"  -z  use " BENCH_NULL " rather than a RAM image\n"
+		"  -m  size of the RAM or null image (default 256)\n"
+		"  -i  image to use through its tapdisk driver\n"
+		"  -e  time scheduler passes with this many idle events\n");
+	exit(err);
+}
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_complete(void *, struct tiocb *, int);
+
+static void
+bench_issue(struct bench *b, struct bench_request *req)
+{
+	long long offset;
+
+	offset = (long long)(random() % b->blocks) * b->size;
+
+	tapdisk_prep_tiocb(&req->tiocb, b->fd, b->write, req->buf, b->size,
+			   offset, bench_complete, b);
+	req->start = bench_now();
+	b->issued++;
+
+	tapdisk_server_queue_tiocb(&req->tiocb);
+}
+
+static void
+bench_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct bench *b = arg;
+	struct bench_request *req = (struct bench_request *)tiocb;
+
+	if (err)
+		b->errors++;
+
+	b->latency[b->completed++] = bench_now() - req->start;
+
+	if (b->issued < b->count)
+		bench_issue(b, req);
+}
+
+static int
+bench_open(struct bench *b, const char *path, int null, unsigned long mb)
+{
+	char name[] = BENCH_RAM_DIR "/tapdisk-bench.XXXXXX";
+	off_t size;
+	int fd;
+
+	if (null) {
+		fd = open(BENCH_NULL, O_RDWR);
+		if (fd == -1) {
+			fprintf(stderr, "open(%s): %d\n", BENCH_NULL, errno);
+			return -errno;
+		}
+
+		size = (off_t)mb << 20;
+	} else if (path) {
+		fd = open(path, O_RDWR | O_DIRECT | O_LARGEFILE);
+		if (fd == -1) {
+			fprintf(stderr, "open(%s): %d\n", path, errno);
+			return -errno;
+		}
+
+		size = lseek(fd, 0, SEEK_END);
+		if (size == (off_t)-1) {
+			close(fd);
+			return -errno;
+		}
+	} else {
+		fd = mkstemp(name);
+		if (fd == -1) {
+			fprintf(stderr, "mkstemp(%s): %d\n", name, errno);
+			return -errno;
+		}
+		unlink(name);
+
+		size = (off_t)mb << 20;
+		if (ftruncate(fd, size)) {
+			close(fd);
+			return -errno;
+		}
+	}
+
+	b->fd     = fd;
+	b->blocks = size / b->size;
+	if (!b->blocks) {
+		fprintf(stderr, "image smaller than one request\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void
+bench_vbd_issue(struct bench *b, int idx)
+{
+	int i, psize;
+	size_t left;
+	td_vbd_t *vbd = b->vbd;
+	td_vbd_request_t *vreq;
+	blkif_request_t *breq;
+
+	psize = getpagesize();
+	vreq  = vbd->request_list + idx;
+	breq  = &vreq->req;
+
+	memset(breq, 0, sizeof(*breq));
+	breq->id            = idx;
+	breq->operation     = b->write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+	breq->sector_number = (random() % b->blocks) *
+		(b->size >> SECTOR_SHIFT);
+
+	for (i = 0, left = b->size; left; i++) {
+		size_t len = left < psize ? left : psize;
+
+		breq->seg[i].first_sect = 0;
+		breq->seg[i].last_sect  = (len >> SECTOR_SHIFT) - 1;
+		breq->nr_segments++;
+		left -= len;
+	}
+
+	b->reqs[idx].start = bench_now();
+	b->issued++;
+
+	vbd->received++;
+	vreq->vbd = vbd;
+	tapdisk_vbd_move_request(vreq, &vbd->new_requests);
+}
+
+static void
+bench_vbd_response(void *arg, blkif_response_t *rsp)
+{
+	struct bench *b = arg;
+	struct bench_request *req = b->reqs + rsp->id;
+
+	if (rsp->status != BLKIF_RSP_OKAY)
+		b->errors++;
+
+	b->latency[b->completed++] = bench_now() - req->start;
+
+	/* the VBD still owns the request: reissue it on the next pass */
+	b->idle[b->nr_idle++] = rsp->id;
+}
+
+static int
+bench_vbd_open(struct bench *b, const char *params)
+{
+	int err, type, psize;
+	const char *path;
+	image_t image;
+
+	type = tapdisk_disktype_parse_params(params, &path);
+	if (type < 0) {
+		fprintf(stderr, "invalid image %s: %d\n", params, type);
+		return type;
+	}
+
+	err = tapdisk_vbd_initialize(0);
+	if (err)
+		return err;
+
+	b->vbd = tapdisk_server_get_vbd(0);
+	if (!b->vbd)
+		return -ENODEV;
+
+	tapdisk_vbd_set_callback(b->vbd, bench_vbd_response, b);
+
+	err = tapdisk_vbd_parse_stack(b->vbd, params);
+	if (err)
+		return err;
+
+	err = tapdisk_vbd_open_vdi(b->vbd, path, type,
+				   TAPDISK_STORAGE_TYPE_DEFAULT,
+				   b->write ? 0 : TD_OPEN_RDONLY);
+	if (err) {
+		fprintf(stderr, "failed to open %s: %d\n", path, err);
+		return err;
+	}
+	b->vbd->reopened = 1;
+
+	err = tapdisk_vbd_get_image_info(b->vbd, &image);
+	if (err)
+		return err;
+
+	b->blocks = (image.size << SECTOR_SHIFT) / b->size;
+	if (!b->blocks) {
+		fprintf(stderr, "image smaller than one request\n");
+		return -EINVAL;
+	}
+
+	/* as in tapdisk-stream, the VBD maps its ring buffers from vstart */
+	psize = getpagesize();
+	err   = posix_memalign((void **)&b->vbd->ring.vstart, psize,
+			       psize * BLKTAP_MMAP_REGION_SIZE);
+	if (err) {
+		b->vbd->ring.vstart = 0;
+		return -err;
+	}
+	memset((void *)b->vbd->ring.vstart, 0xa5,
+	       psize * BLKTAP_MMAP_REGION_SIZE);
+
+	b->idle = calloc(b->depth, sizeof(b->idle[0]));
+	if (!b->idle)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int
+bench_vbd_run(struct bench *b)
+{
+	int i;
+
+	for (i = 0; i < b->depth; i++)
+		b->idle[b->nr_idle++] = i;
+
+	while (b->completed < b->count) {
+		if (b->nr_idle && b->issued < b->count) {
+			while (b->nr_idle && b->issued < b->count)
+				bench_vbd_issue(b, b->idle[--b->nr_idle]);
+
+			tapdisk_vbd_issue_requests(b->vbd);
+			/* the new requests are only submitted after a pass */
+			tapdisk_server_set_max_timeout(0);
+		}
+
+		tapdisk_server_iterate();
+	}
+
+	return 0;
+}
+
+static void
+bench_vbd_close(struct bench *b)
+{
+	tapdisk_vbd_close_vdi(b->vbd);
+	tapdisk_server_remove_vbd(b->vbd);
+	free((void *)b->vbd->ring.vstart);
+	free(b->vbd->name);
+	free(b->vbd);
+	free(b->idle);
+	b->vbd = NULL;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_report(struct bench *b, uint64_t elapsed, struct rusage *ru)
+{
+	double secs, cpu;
+
+	secs = elapsed / 1e9;
+	cpu  = ru->ru_utime.tv_sec * 1e6 + ru->ru_utime.tv_usec +
+		ru->ru_stime.tv_sec * 1e6 + ru->ru_stime.tv_usec;
+
+	qsort(b->latency, b->completed, sizeof(b->latency[0]), bench_cmp);
+
+	printf("requests: %lu, errors: %lu, time: %.3fs\n",
+	       b->completed, b->errors, secs);
+	printf("iops: %.0f, MB/s: %.1f, cpu/request: %.2fus\n",
+	       b->completed / secs,
+	       b->completed * (double)b->size / secs / (1 << 20),
+	       cpu / b->completed);
+	printf("latency us: p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+	       b->latency[b->completed / 2] / 1e3,
+	       b->latency[b->completed * 99 / 100] / 1e3,
+	       b->latency[b->completed * 999 / 1000] / 1e3,
+	       b->latency[b->completed - 1] / 1e3);
+}
+
+static void
+bench_event(event_id_t id, char mode, void *private)
+{
+	unsigned long *ran = private;
+
+	(*ran)++;
+}
+
+static int
+bench_events(int nr, unsigned long count)
+{
+	scheduler_t s;
+	unsigned long i, ran;
+	uint64_t start, elapsed;
+	int *fds, err;
+
+	err = scheduler_initialize(&s);
+	if (err) {
+		fprintf(stderr, "failed to set up the scheduler: %d\n", err);
+		return -err;
+	}
+
+	fds = calloc(nr + 1, sizeof(*fds));
+	if (!fds) {
+		fprintf(stderr, "out of memory\n");
+		return ENOMEM;
+	}
+
+	ran = 0;
+
+	for (i = 0; i <= nr; i++) {
+		/* the last one is signalled and never read, so always ready */
+		fds[i] = eventfd(i == nr, 0);
+		if (fds[i] == -1) {
+			err = errno;
+			fprintf(stderr, "eventfd %lu: %d\n", i, err);
+			return err;
+		}
+
+		if (i < nr)
+			err = scheduler_register_event(&s,
+						       SCHEDULER_POLL_READ_FD |
+						       SCHEDULER_POLL_TIMEOUT,
+						       fds[i], 600,
+						       bench_event, NULL);
+		else
+			err = scheduler_register_event(&s,
+						       SCHEDULER_POLL_READ_FD,
+						       fds[i], 0,
+						       bench_event, &ran);
+		if (err < 0) {
+			fprintf(stderr, "failed to register event %lu: %d\n",
+				i, err);
+			return -err;
+		}
+	}
+
+	start = bench_now();
+	for (i = 0; i < count; i++)
+		scheduler_wait_for_events(&s);
+	elapsed = bench_now() - start;
+
+	printf("events: %d, passes: %lu, dispatched: %lu, ns/pass: %.0f\n",
+	       nr, count, ran, (double)elapsed / count);
+
+	scheduler_destroy(&s);
+	for (i = 0; i <= nr; i++)
+		close(fds[i]);
+	free(fds);
+
+	return ran == count ? 0 : EIO;
+}
+
+static int
+bench_image(struct bench *b, int drv, const char *image)
+{
+	struct rusage ru;
+	uint64_t start;
+	int err;
+
+	b->latency = calloc(b->count, sizeof(b->latency[0]));
+	b->reqs    = calloc(b->depth, sizeof(b->reqs[0]));
+	if (!b->latency || !b->reqs) {
+		fprintf(stderr, "out of memory\n");
+		return ENOMEM;
+	}
+
+	tapdisk_server_init();
+	tapdisk_server_set_queue_driver(drv);
+	err = tapdisk_server_complete();
+	if (err) {
+		fprintf(stderr, "failed to set up the I/O queue: %d\n", err);
+		return -err;
+	}
+
+	err = bench_vbd_open(b, image);
+	if (err)
+		return -err;
+
+	start = bench_now();
+	bench_vbd_run(b);
+
+	getrusage(RUSAGE_SELF, &ru);
+	bench_report(b, bench_now() - start, &ru);
+
+	bench_vbd_close(b);
+
+	return b->errors ? EIO : 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench b;
+	struct rusage ru;
+	const char *path, *image;
+	unsigned long mb;
+	uint64_t start;
+	int c, i, err, drv, null, events;
+	char *mem;
+
+	memset(&b, 0, sizeof(b));
+	b.depth = 32;
+	b.size  = 4096;
+	b.count = 100000;
+	drv     = TIO_DRV_LIO;
+	path    = NULL;
+	image   = NULL;
+	null    = 0;
+	mb      = 256;
+	events  = -1;
+
+	while ((c = getopt(argc, argv, "q:d:s:n:wf:zm:i:e:h")) != -1) {
+		switch (c) {
+		case 'q':
+			drv = tapdisk_queue_driver(optarg);
+			if (drv < 0)
+				usage(argv[0], EINVAL);
+			break;
+		case 'd':
+			b.depth = atoi(optarg);
+			break;
+		case 's':
+			b.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b.count = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			b.write = 1;
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'z':
+			null = 1;
+			break;
+		case 'm':
+			mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 'e':
+			events = atoi(optarg);
+			if (events < 0)
+				usage(argv[0], EINVAL);
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], EINVAL);
+		}
+	}
+
+	if (optind != argc || b.depth <= 0 || !b.count || (null && path) ||
+	    !b.size || b.size % 512 || b.depth > TAPDISK_TIOCBS)
+		usage(argv[0], EINVAL);
+
+	if (events >= 0)
+		return bench_events(events, b.count);
+
+	if (b.depth > b.count)
+		b.depth = b.count;
+
+	if (image) {
+		if (path || null || b.depth > MAX_REQUESTS ||
+		    b.size > BLKIF_MAX_SEGMENTS_PER_REQUEST * getpagesize())
+			usage(argv[0], EINVAL);
+		return bench_image(&b, drv, image);
+	}
+
+	err = bench_open(&b, path, null, mb);
+	if (err)
+		return -err;
+
+	b.latency = calloc(b.count, sizeof(b.latency[0]));
+	b.reqs    = calloc(b.depth, sizeof(b.reqs[0]));
+	if (!b.latency || !b.reqs ||
+	    posix_memalign((void **)&mem, getpagesize(), b.depth * b.size)) {
+		fprintf(stderr, "out of memory\n");
+		return ENOMEM;
+	}
+	memset(mem, 0xa5, b.depth * b.size);
+
+	tapdisk_server_init();
+	tapdisk_server_set_queue_driver(drv);
+	err = tapdisk_server_complete();
+	if (err) {
+		fprintf(stderr, "failed to set up the I/O queue: %d\n", err);
+		return -err;
+	}
+
+	tapdisk_server_register_file(b.fd);
+	tapdisk_server_register_buffer(mem, b.depth * b.size);
+
+	start = bench_now();
+
+	for (i = 0; i < b.depth; i++) {
+		b.reqs[i].buf = mem + i * b.size;
+		bench_issue(&b, &b.reqs[i]);
+	}
+
+	/* nothing is in flight yet: don't sleep before the first submit */
+	tapdisk_server_set_max_timeout(0);
+	while (b.completed < b.count)
+		tapdisk_server_iterate();
+
+	getrusage(RUSAGE_SELF, &ru);
+	bench_report(&b, bench_now() - start, &ru);
+
+	tapdisk_server_unregister_buffer(mem);
+	tapdisk_server_unregister_file(b.fd);
+	close(b.fd);
+
+	return b.errors ? EIO : 0;
+}
@@ -61,6 +61,10 @@ struct tapdisk_control_connection {
 
 static struct tapdisk_control td_control;
 
+#define tapdisk_control_for_each_vbd(vbd)				\
+	for ((vbd) = tapdisk_server_next_vbd(NULL); (vbd);		\
+	     (vbd) = tapdisk_server_next_vbd(vbd))
+
 static void
 tapdisk_control_initialize(void)
 {
@@ -104,7 +108,7 @@ tapdisk_control_allocate_connection(int fd)
 static void
 tapdisk_control_close_connection(struct tapdisk_control_connection *connection)
 {
-	tapdisk_server_unregister_event(connection->event_id);
+	tapdisk_server_unregister_main_event(connection->event_id);
 	close(connection->socket);
 	free(connection);
 }
@@ -220,7 +224,6 @@ tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 {
 	int i;
 	td_vbd_t *vbd;
-	struct list_head *head;
 	tapdisk_message_t response;
 
 	i = 0;
@@ -229,9 +232,7 @@ tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 	response.type = TAPDISK_MESSAGE_LIST_MINORS_RSP;
 	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
-
-	list_for_each_entry(vbd, head, next) {
+	tapdisk_control_for_each_vbd(vbd) {
 		response.u.minors.list[i++] = vbd->minor;
 		if (i >= TAPDISK_MESSAGE_MAX_MINORS) {
 			response.type = TAPDISK_MESSAGE_ERROR;
@@ -250,7 +251,6 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 		     tapdisk_message_t *request)
 {
 	td_vbd_t *vbd;
-	struct list_head *head;
 	tapdisk_message_t response;
 	int count, i;
 
@@ -258,13 +258,11 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 	response.type = TAPDISK_MESSAGE_LIST_RSP;
 	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
-
 	count = 0;
-	list_for_each_entry(vbd, head, next)
+	tapdisk_control_for_each_vbd(vbd)
 		count++;
 
-	list_for_each_entry(vbd, head, next) {
+	tapdisk_control_for_each_vbd(vbd) {
 		response.u.list.count   = count--;
 		response.u.list.minor   = vbd->minor;
 		response.u.list.state   = vbd->state;
@@ -627,6 +625,70 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
+static void
+tapdisk_control_stats_vbd(struct tapdisk_control_connection *connection,
+			  tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+
+	response.type = TAPDISK_MESSAGE_STATS_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	request->u.string.text[TAPDISK_MESSAGE_STRING_LENGTH - 1] = '\0';
+
+	err = tapdisk_vbd_stats(vbd, request->u.string.text,
+				response.u.response.message,
+				sizeof(response.u.response.message));
+	if (err > 0)
+		err = 0;
+
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+static void
+tapdisk_control_qos_vbd(struct tapdisk_control_connection *connection,
+			tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	tapdisk_message_t response;
+	tapdisk_message_qos_t *qos;
+
+	memset(&response, 0, sizeof(response));
+
+	response.type = TAPDISK_MESSAGE_QOS_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	qos = &request->u.qos;
+	tapdisk_vbd_set_qos(vbd, qos->iops, qos->iops_burst,
+			    qos->bps, qos->bps_burst);
+	err = 0;
+
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 {
@@ -645,25 +707,50 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	if (err)
 		goto fail;
 
+	/*
+	 * The VBD may be served by a worker thread: borrow its loop
+	 * for the duration of the request.
+	 */
+	if (message.type == TAPDISK_MESSAGE_LIST ||
+	    message.type == TAPDISK_MESSAGE_LIST_MINORS)
+		tapdisk_server_enter_all();
+	else
+		tapdisk_server_enter(message.cookie);
+
 	switch (message.type) {
 	case TAPDISK_MESSAGE_PID:
-		return tapdisk_control_get_pid(connection, &message);
+		tapdisk_control_get_pid(connection, &message);
+		break;
 	case TAPDISK_MESSAGE_LIST_MINORS:
-		return tapdisk_control_list_minors(connection, &message);
+		tapdisk_control_list_minors(connection, &message);
+		break;
 	case TAPDISK_MESSAGE_LIST:
-		return tapdisk_control_list(connection, &message);
+		tapdisk_control_list(connection, &message);
+		break;
 	case TAPDISK_MESSAGE_ATTACH:
-		return tapdisk_control_attach_vbd(connection, &message);
+		tapdisk_control_attach_vbd(connection, &message);
+		break;
 	case TAPDISK_MESSAGE_DETACH:
-		return tapdisk_control_detach_vbd(connection, &message);
+		tapdisk_control_detach_vbd(connection, &message);
+		break;
 	case TAPDISK_MESSAGE_OPEN:
-		return tapdisk_control_open_image(connection, &message);
+		tapdisk_control_open_image(connection, &message);
+		break;
 	case TAPDISK_MESSAGE_PAUSE:
-		return tapdisk_control_pause_vbd(connection, &message);
+		tapdisk_control_pause_vbd(connection, &message);
+		break;
 	case TAPDISK_MESSAGE_RESUME:
-		return tapdisk_control_resume_vbd(connection, &message);
+		tapdisk_control_resume_vbd(connection, &message);
+		break;
 	case TAPDISK_MESSAGE_CLOSE:
-		return tapdisk_control_close_image(connection, &message);
+		tapdisk_control_close_image(connection, &message);
+		break;
+	case TAPDISK_MESSAGE_STATS:
+		tapdisk_control_stats_vbd(connection, &message);
+		break;
+	case TAPDISK_MESSAGE_QOS:
+		tapdisk_control_qos_vbd(connection, &message);
+		break;
 	default: {
 		tapdisk_message_t response;
 	fail:
@@ -681,6 +768,8 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		break;
 	}
 	}
+
+	tapdisk_server_leave();
 }
 
 static void
@@ -701,10 +790,10 @@ tapdisk_control_accept(event_id_t id, char mode, void *private)
 		EPRINTF("failed to allocate new control connection\n");
 	}
 
-	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					    connection->socket, 0,
-					    tapdisk_control_handle_request,
-					    connection);
+	err = tapdisk_server_register_main_event(SCHEDULER_POLL_READ_FD,
+						 connection->socket, 0,
+						 tapdisk_control_handle_request,
+						 connection);
 	if (err == -1) {
 		close(fd);
 		free(connection);
@@ -808,9 +897,9 @@ tapdisk_control_create_socket(char **socket_path)
 		goto fail;
 	}
 
-	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					    td_control.socket, 0,
-					    tapdisk_control_accept, NULL);
+	err = tapdisk_server_register_main_event(SCHEDULER_POLL_READ_FD,
+						 td_control.socket, 0,
+						 tapdisk_control_accept, NULL);
 	if (err < 0) {
 		EPRINTF("failed to add watch: %d\n", err);
 		goto fail;
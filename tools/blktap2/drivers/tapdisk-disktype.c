@@ -76,6 +76,12 @@ static const disk_info_t qcow_disk = {
        0,
 };
 
+static const disk_info_t qcow2_disk = {
+       "qcow2",
+       "qcow2 disk (qcow2)",
+       0,
+};
+
 static const disk_info_t block_cache_disk = {
        "bc",
        "block cache image (bc)",
@@ -112,6 +118,7 @@ const disk_info_t *tapdisk_disk_types[] = {
 	[DISK_TYPE_LOG]	= &log_disk,
 	[DISK_TYPE_VINDEX]	= &vhd_index_disk,
 	[DISK_TYPE_REMUS]	= &remus_disk,
+	[DISK_TYPE_QCOW2]	= &qcow2_disk,
 	0,
 };
 
@@ -126,6 +133,7 @@ extern struct tap_disk tapdisk_block_cache;
 extern struct tap_disk tapdisk_vhd_index;
 extern struct tap_disk tapdisk_log;
 extern struct tap_disk tapdisk_remus;
+extern struct tap_disk tapdisk_qcow2;
 
 const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_AIO]         = &tapdisk_aio,
@@ -137,9 +145,12 @@ const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_RAM]         = &tapdisk_ram,
 	[DISK_TYPE_QCOW]        = &tapdisk_qcow,
 	[DISK_TYPE_BLOCK_CACHE] = &tapdisk_block_cache,
+#if 0
 	[DISK_TYPE_VINDEX]      = &tapdisk_vhd_index,
+#endif
 	[DISK_TYPE_LOG]         = &tapdisk_log,
 	[DISK_TYPE_REMUS]       = &tapdisk_remus,
+	[DISK_TYPE_QCOW2]       = &tapdisk_qcow2,
 	0,
 };
 
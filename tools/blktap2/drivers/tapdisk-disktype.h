@@ -40,6 +40,7 @@
 #define DISK_TYPE_LOG         8
 #define DISK_TYPE_REMUS       9
 #define DISK_TYPE_VINDEX      10
+#define DISK_TYPE_QCOW2       11
 
 #define DISK_TYPE_NAME_MAX    32
 
@@ -213,6 +213,40 @@ fail:
 	td_complete_request(treq, err);
 }
 
+void
+td_queue_discard(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	/* discard is advisory: drivers without support just ignore it */
+	if (!driver->ops->td_queue_discard) {
+		err = 0;
+		goto fail;
+	}
+
+	driver->ops->td_queue_discard(driver, treq);
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
 void
 td_forward_request(td_request_t treq)
 {
@@ -245,6 +279,22 @@ td_prep_write(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	tapdisk_prep_tiocb(tiocb, fd, 1, buf, bytes, offset, cb, arg);
 }
 
+/*
+ * Drivers register the image fds they pass to td_prep_{read,write} while
+ * they are open, so that the I/O queue may look them up in advance.
+ */
+int
+td_register_file(int fd)
+{
+	return tapdisk_server_register_file(fd);
+}
+
+void
+td_unregister_file(int fd)
+{
+	tapdisk_server_unregister_file(fd);
+}
+
 void
 td_debug(td_image_t *image)
 {
@@ -257,3 +307,15 @@ td_debug(td_image_t *image)
 
 	tapdisk_driver_debug(driver);
 }
+
+int
+td_stats(td_image_t *image, char *buf, size_t size)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return 0;
+
+	return tapdisk_driver_stats(driver, buf, size);
+}
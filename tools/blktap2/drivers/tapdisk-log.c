@@ -33,6 +33,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <inttypes.h>
 #include <sys/time.h>
 
@@ -67,6 +68,7 @@ struct tlog {
 
 static struct ehandle tapdisk_err;
 static struct tlog tapdisk_log;
+static pthread_mutex_t tapdisk_log_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void
 open_tlog(char *file, size_t bytes, int level, int append)
@@ -118,6 +120,8 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 	if (level > tapdisk_log.level)
 		return;
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	avail = tapdisk_log.size - (tapdisk_log.p - tapdisk_log.buf);
 	if (avail < MAX_ENTRY_LEN) {
 		if (tapdisk_log.append)
@@ -141,6 +145,8 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 
 	tapdisk_log.cnt++;
 	tapdisk_log.p += len;
+
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
@@ -153,17 +159,19 @@ __tlog_error(int err, const char *func, const char *fmt, ...)
 
 	err = (err > 0 ? err : -err);
 
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	for (i = 0; i < tapdisk_err.cnt; i++) {
 		e = &tapdisk_err.errors[i];
 		if (e->err == err && e->func == func) {
 			e->cnt++;
-			return;
+			goto out;
 		}
 	}
 
 	if (tapdisk_err.cnt >= MAX_ERROR_MESSAGES) {
 		tapdisk_err.dropped++;
-		return;
+		goto out;
 	}
 
 	gettimeofday(&t, NULL);
@@ -184,6 +192,9 @@ __tlog_error(int err, const char *func, const char *fmt, ...)
 	e->err  = err;
 	e->func = (char *)func;
 	tapdisk_err.cnt++;
+
+out:
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
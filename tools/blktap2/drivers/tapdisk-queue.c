@@ -28,11 +28,21 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <libaio.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#ifdef TAPDISK_IO_URING
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "tapdisk.h"
 #include "tapdisk-log.h"
@@ -64,7 +74,8 @@ queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 		struct tiocb *prev = (struct tiocb *)
 			queue->iocbs[queue->queued - 1]->data;
 		prev->next = tiocb;
-	}
+	} else if (queue->window)
+		gettimeofday(&queue->plugged, NULL);
 
 	queue->iocbs[queue->queued++] = iocb;
 }
@@ -160,6 +171,9 @@ cancel_tiocbs(struct tqueue *queue, int err)
 static int
 fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 {
+	int i;
+	struct tiocb *tiocb;
+
 	ERR(err, "io_submit error: %d of %d failed",
 	    total - succeeded, total);
 
@@ -168,6 +182,13 @@ fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 	queue->queued = io_expand_iocbs(&queue->opioctx,
 					queue->iocbs, succeeded, total);
 
+	/* io_merge may have reordered them: relink the survivors */
+	for (i = 0; i < queue->queued; i++) {
+		tiocb       = queue->iocbs[i]->data;
+		tiocb->next = (i + 1 < queue->queued ?
+			       queue->iocbs[i + 1]->data : NULL);
+	}
+
 	return cancel_tiocbs(queue, err);
 }
 
@@ -212,6 +233,16 @@ tapdisk_rwio_rw(const struct iocb *iocb)
 	size_t size   = iocb->u.c.nbytes;
 	ssize_t (*func)(int, void *, size_t) = 
 		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
+	ssize_t ret;
+
+	switch (iocb->aio_lio_opcode) {
+	case __IO_CMD_PREADV:
+		ret = preadv(fd, (struct iovec *)buf, size, off);
+		return (ret < 0 ? -errno : ret);
+	case __IO_CMD_PWRITEV:
+		ret = pwritev(fd, (struct iovec *)buf, size, off);
+		return (ret < 0 ? -errno : ret);
+	}
 
 	if (lseek(fd, off, SEEK_SET) == (off_t)-1)
 		return -errno;
@@ -262,9 +293,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -547,6 +578,553 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef TAPDISK_IO_URING
+/*
+ * io_uring
+ *
+ * Requests are written straight into the submission ring shared with
+ * the kernel, and each queue flush is handed over with a single
+ * io_uring_enter(2).  Completions are signalled on an eventfd and reaped
+ * from the shared completion ring without any further system call.
+ *
+ * Image fds and data buffers registered with the queue are registered
+ * with the ring too, saving the kernel a file lookup and a page pin per
+ * request.
+ */
+
+#define URING_MAX_FILES         64
+#define URING_MAX_BUFFERS       16
+
+struct uring {
+	int                  ring_fd;
+
+	void                *sq_ring;
+	size_t               sq_ring_size;
+	unsigned int        *sq_head;
+	unsigned int        *sq_tail;
+	unsigned int        *sq_mask;
+	unsigned int        *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t               sqes_size;
+
+	void                *cq_ring;
+	size_t               cq_ring_size;
+	unsigned int        *cq_head;
+	unsigned int        *cq_tail;
+	unsigned int        *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	int                  event_fd;
+	int                  event_id;
+
+	struct io_event     *aio_events;
+
+	/* fd registered at each slot of the ring's file table, or -1 */
+	int                  files[URING_MAX_FILES];
+	int                  flags;
+
+	struct iovec         buffers[URING_MAX_BUFFERS];
+	int                  nr_buffers;
+};
+
+#define URING_FLAG_FILES        (1<<0)
+#define URING_FLAG_BUFFERS      (1<<1)
+
+static inline int
+__io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		 unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+__io_uring_register(int fd, unsigned int opcode, void *arg,
+		    unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	if (uring->event_fd >= 0) {
+		close(uring->event_fd);
+		uring->event_fd = -1;
+	}
+
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_size);
+		uring->sqes = NULL;
+	}
+
+	if (uring->cq_ring) {
+		munmap(uring->cq_ring, uring->cq_ring_size);
+		uring->cq_ring = NULL;
+	}
+
+	if (uring->sq_ring) {
+		munmap(uring->sq_ring, uring->sq_ring_size);
+		uring->sq_ring = NULL;
+	}
+
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+}
+
+static int
+tapdisk_uring_map_rings(struct uring *uring, struct io_uring_params *p)
+{
+	char *sq, *cq;
+
+	uring->sq_ring_size = p->sq_off.array +
+		p->sq_entries * sizeof(unsigned int);
+	uring->sq_ring = mmap(0, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			      IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+		return -errno;
+	}
+
+	uring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(0, uring->sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			   IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		return -errno;
+	}
+
+	uring->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+	uring->cq_ring = mmap(0, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			      IORING_OFF_CQ_RING);
+	if (uring->cq_ring == MAP_FAILED) {
+		uring->cq_ring = NULL;
+		return -errno;
+	}
+
+	sq = uring->sq_ring;
+	uring->sq_head  = (unsigned int *)(sq + p->sq_off.head);
+	uring->sq_tail  = (unsigned int *)(sq + p->sq_off.tail);
+	uring->sq_mask  = (unsigned int *)(sq + p->sq_off.ring_mask);
+	uring->sq_array = (unsigned int *)(sq + p->sq_off.array);
+
+	cq = uring->cq_ring;
+	uring->cq_head  = (unsigned int *)(cq + p->cq_off.head);
+	uring->cq_tail  = (unsigned int *)(cq + p->cq_off.tail);
+	uring->cq_mask  = (unsigned int *)(cq + p->cq_off.ring_mask);
+	uring->cqes     = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+static void
+tapdisk_uring_setup_files(struct uring *uring)
+{
+	int i, err;
+
+	/* start with an empty table, filled in by tio_register_file */
+	for (i = 0; i < URING_MAX_FILES; i++)
+		uring->files[i] = -1;
+
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_FILES,
+				  uring->files, URING_MAX_FILES);
+	if (err) {
+		DPRINTF("io_uring: no registered files: %d\n", -errno);
+		return;
+	}
+
+	uring->flags |= URING_FLAG_FILES;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *uring = queue->tio_data;
+	unsigned int head, tail;
+	int i, ret, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_uring_cqe *cqe;
+	struct io_event *ep;
+	uint64_t val;
+
+	read_exact(uring->event_fd, &val, sizeof(val));
+
+	head = *uring->cq_head;
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (ret = 0; head != tail; head++, ret++) {
+		cqe     = &uring->cqes[head & *uring->cq_mask];
+		ep      = uring->aio_events + ret;
+		ep->obj = (struct iocb *)(uintptr_t)cqe->user_data;
+		ep->res = cqe->res;
+	}
+
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+	split = io_split(&queue->opioctx, uring->aio_events, ret);
+	tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	uring->ring_fd  = -1;
+	uring->event_fd = -1;
+	uring->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+	uring->ring_fd = __io_uring_setup(qlen, &p);
+	if (uring->ring_fd < 0) {
+		err = -errno;
+		DPRINTF("io_uring_setup failed: %d\n", err);
+		goto fail;
+	}
+
+	/* IORING_OP_READ/WRITE arrived together with this feature */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		err = -ENOSYS;
+		DPRINTF("io_uring: kernel too old for IORING_OP_READ\n");
+		goto fail;
+	}
+
+	err = tapdisk_uring_map_rings(uring, &p);
+	if (err)
+		goto fail;
+
+	uring->event_fd = tapdisk_sys_eventfd(0);
+	if (uring->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_EVENTFD,
+				  &uring->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	/* the cq ring holds at least as many entries as the sq ring */
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	tapdisk_uring_setup_files(uring);
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_file_slot(struct uring *uring, int fd)
+{
+	int i;
+
+	if (uring->flags & URING_FLAG_FILES)
+		for (i = 0; i < URING_MAX_FILES; i++)
+			if (uring->files[i] == fd)
+				return i;
+
+	return -1;
+}
+
+static int
+tapdisk_uring_update_file(struct uring *uring, int slot, int fd)
+{
+	struct io_uring_files_update update;
+	int err;
+
+	memset(&update, 0, sizeof(update));
+	update.offset = slot;
+	update.fds    = (uintptr_t)&fd;
+
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_FILES_UPDATE,
+				  &update, 1);
+	if (err < 0)
+		return -errno;
+
+	uring->files[slot] = fd;
+	return 0;
+}
+
+static int
+tapdisk_uring_register_file(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+	int slot;
+
+	if (!(uring->flags & URING_FLAG_FILES))
+		return -ENOSYS;
+
+	if (tapdisk_uring_file_slot(uring, fd) >= 0)
+		return 0;
+
+	slot = tapdisk_uring_file_slot(uring, -1);
+	if (slot < 0)
+		return -ENOSPC;
+
+	return tapdisk_uring_update_file(uring, slot, fd);
+}
+
+static void
+tapdisk_uring_unregister_file(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+	int slot;
+
+	slot = tapdisk_uring_file_slot(uring, fd);
+	if (slot >= 0 && fd >= 0)
+		tapdisk_uring_update_file(uring, slot, -1);
+}
+
+/*
+ * The ring's buffer table can only be replaced as a whole, which is fine
+ * for the handful of long lived regions (ring mappings) that use it.
+ */
+static void
+tapdisk_uring_update_buffers(struct uring *uring)
+{
+	int err;
+
+	if (uring->flags & URING_FLAG_BUFFERS) {
+		__io_uring_register(uring->ring_fd, IORING_UNREGISTER_BUFFERS,
+				    NULL, 0);
+		uring->flags &= ~URING_FLAG_BUFFERS;
+	}
+
+	if (!uring->nr_buffers)
+		return;
+
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS,
+				  uring->buffers, uring->nr_buffers);
+	if (err) {
+		DPRINTF("io_uring: cannot register buffers: %d\n", -errno);
+		return;
+	}
+
+	uring->flags |= URING_FLAG_BUFFERS;
+}
+
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	struct uring *uring = queue->tio_data;
+	struct iovec *iov;
+
+	if (uring->nr_buffers == URING_MAX_BUFFERS)
+		return -ENOSPC;
+
+	iov = &uring->buffers[uring->nr_buffers++];
+	iov->iov_base = buf;
+	iov->iov_len  = size;
+
+	tapdisk_uring_update_buffers(uring);
+
+	return (uring->flags & URING_FLAG_BUFFERS) ? 0 : -EINVAL;
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *uring = queue->tio_data;
+	int i;
+
+	for (i = 0; i < uring->nr_buffers; i++)
+		if (uring->buffers[i].iov_base == buf)
+			break;
+
+	if (i == uring->nr_buffers)
+		return;
+
+	uring->buffers[i] = uring->buffers[--uring->nr_buffers];
+	tapdisk_uring_update_buffers(uring);
+}
+
+static int
+tapdisk_uring_buffer_index(struct uring *uring, char *buf, size_t size)
+{
+	struct iovec *iov;
+	int i;
+
+	if (!(uring->flags & URING_FLAG_BUFFERS))
+		return -1;
+
+	for (i = 0; i < uring->nr_buffers; i++) {
+		iov = &uring->buffers[i];
+		if (buf >= (char *)iov->iov_base &&
+		    buf + size <= (char *)iov->iov_base + iov->iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+tapdisk_uring_prep_sqe(struct uring *uring, struct io_uring_sqe *sqe,
+		       struct iocb *iocb)
+{
+	int write, slot, idx;
+
+	write = (iocb->aio_lio_opcode == IO_CMD_PWRITE);
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd        = iocb->aio_fildes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->addr      = (uintptr_t)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->user_data = (uintptr_t)iocb;
+
+	slot = tapdisk_uring_file_slot(uring, iocb->aio_fildes);
+	if (slot >= 0) {
+		sqe->fd     = slot;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+
+	switch (iocb->aio_lio_opcode) {
+	case __IO_CMD_PREADV:
+		sqe->opcode = IORING_OP_READV;
+		return;
+	case __IO_CMD_PWRITEV:
+		sqe->opcode = IORING_OP_WRITEV;
+		return;
+	}
+
+	idx = tapdisk_uring_buffer_index(uring, iocb->u.c.buf,
+					 iocb->u.c.nbytes);
+	if (idx >= 0) {
+		sqe->opcode    = write ? IORING_OP_WRITE_FIXED :
+			IORING_OP_READ_FIXED;
+		sqe->buf_index = idx;
+	} else
+		sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned int tail, idx;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	/*
+	 * No more than queue->size iocbs are ever in flight, and the sq
+	 * ring is at least that large, so there is always room.
+	 */
+	tail = *uring->sq_tail;
+	for (i = 0; i < merged; i++, tail++) {
+		idx = tail & *uring->sq_mask;
+		tapdisk_uring_prep_sqe(uring, &uring->sqes[idx],
+				       queue->iocbs[i]);
+		uring->sq_array[idx] = idx;
+	}
+	__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = __io_uring_enter(uring->ring_fd, merged, 0, 0);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	/* withdraw whatever the kernel did not consume */
+	if (submitted < merged)
+		__atomic_store_n(uring->sq_tail,
+				 __atomic_load_n(uring->sq_head,
+						 __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static const struct tio td_tio_uring = {
+	.name                  = "uring",
+	.data_size             = sizeof(struct uring),
+	.tio_setup             = tapdisk_uring_setup,
+	.tio_destroy           = tapdisk_uring_destroy,
+	.tio_submit            = tapdisk_uring_submit,
+	.tio_register_file     = tapdisk_uring_register_file,
+	.tio_unregister_file   = tapdisk_uring_unregister_file,
+	.tio_register_buffer   = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+};
+#endif /* TAPDISK_IO_URING */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +1153,11 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef TAPDISK_IO_URING
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -655,11 +1238,22 @@ tapdisk_debug_queue(struct tqueue *queue)
 {
 	struct tiocb *tiocb = queue->deferred.head;
 
+	struct opio_stats *st = &queue->opioctx.stats;
+
 	WARN("TAPDISK QUEUE:\n");
 	WARN("size: %d, tio: %s, queued: %d, iocbs_pending: %d, "
 	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	WARN("merging: batches: %"PRIu64", iocbs: %"PRIu64", submitted: "
+	     "%"PRIu64" (%"PRIu64".%02"PRIu64":1), reordered: %"PRIu64", "
+	     "vectored: %"PRIu64", gaps: %"PRIu64" (%"PRIu64" bytes), "
+	     "window: %dus, plugs: %"PRIu64"\n",
+	     st->batches, st->iocbs, st->merged,
+	     st->merged ? st->iocbs / st->merged : 0,
+	     st->merged ? (st->iocbs * 100 / st->merged) % 100 : 0,
+	     st->reordered, st->vectored, st->gaps, st->gap_bytes,
+	     queue->window, queue->plugs);
 
 	if (tiocb) {
 		WARN("deferred:\n");
@@ -690,6 +1284,84 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	tiocb->next = NULL;
 }
 
+int
+tapdisk_queue_driver(const char *name)
+{
+	if (!strcmp(name, "lio"))
+		return TIO_DRV_LIO;
+	if (!strcmp(name, "rwio"))
+		return TIO_DRV_RWIO;
+	if (!strcmp(name, "uring"))
+		return TIO_DRV_URING;
+
+	return -EINVAL;
+}
+
+void
+tapdisk_queue_set_window(struct tqueue *queue, int usecs)
+{
+	queue->window = (usecs > 0 ? usecs : 0);
+}
+
+/*
+ * returns the number of msecs the caller may wait for more iocbs
+ * before submitting, or 0 if the queue should be submitted now.
+ */
+int
+tapdisk_queue_plugged(struct tqueue *queue)
+{
+	long usecs;
+	struct timeval now;
+
+	if (!queue->window || !queue->queued)
+		return 0;
+
+	if (tapdisk_queue_full(queue) || deferred_tiocbs(queue))
+		return 0;
+
+	gettimeofday(&now, NULL);
+	usecs = (now.tv_sec - queue->plugged.tv_sec) * 1000000L +
+		(now.tv_usec - queue->plugged.tv_usec);
+	if (usecs < 0 || usecs >= queue->window)
+		return 0;
+
+	queue->plugs++;
+
+	return (queue->window - usecs + 999) / 1000;
+}
+
+int
+tapdisk_queue_register_file(struct tqueue *queue, int fd)
+{
+	if (!queue->tio || !queue->tio->tio_register_file)
+		return -ENOSYS;
+
+	return queue->tio->tio_register_file(queue, fd);
+}
+
+void
+tapdisk_queue_unregister_file(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_unregister_file)
+		queue->tio->tio_unregister_file(queue, fd);
+}
+
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return -ENOSYS;
+
+	return queue->tio->tio_register_buffer(queue, buf, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
+
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
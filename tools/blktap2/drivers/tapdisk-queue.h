@@ -30,6 +30,7 @@
 #define TAPDISK_QUEUE_H
 
 #include <libaio.h>
+#include <sys/time.h>
 
 #include "io-optimize.h"
 #include "scheduler.h"
@@ -81,7 +82,14 @@ struct tqueue {
 	/* optional tapdisk filter */
 	struct tfilter       *filter;
 
+	/* submission may be held back for up to window usecs after
+	 * the first iocb of a batch is queued, so that io_merge sees
+	 * more of the requests arriving close together */
+	int                   window;
+	struct timeval        plugged;
+
 	uint64_t              deferrals;
+	uint64_t              plugs;
 };
 
 struct tio {
@@ -91,11 +99,19 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional: let the driver pin down fds and buffers in advance */
+	int  (*tio_register_file)     (struct tqueue *queue, int fd);
+	void (*tio_unregister_file)   (struct tqueue *queue, int fd);
+	int  (*tio_register_buffer)   (struct tqueue *queue,
+				       void *buf, size_t size);
+	void (*tio_unregister_buffer) (struct tqueue *queue, void *buf);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
 /*
@@ -121,5 +137,18 @@ int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
+int tapdisk_queue_driver(const char *name);
+void tapdisk_queue_set_window(struct tqueue *, int usecs);
+int tapdisk_queue_plugged(struct tqueue *);
+
+/*
+ * Image fds and data buffers used for many requests may be registered
+ * with the queue.  Registration is only a hint: queues whose driver has
+ * no use for it, or runs out of slots, carry on as before.
+ */
+int tapdisk_queue_register_file(struct tqueue *, int fd);
+void tapdisk_queue_unregister_file(struct tqueue *, int fd);
+int tapdisk_queue_register_buffer(struct tqueue *, void *buf, size_t size);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *buf);
 
 #endif
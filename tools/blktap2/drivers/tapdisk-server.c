@@ -27,8 +27,10 @@
  */
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 
@@ -42,9 +44,36 @@
 
  tapdisk_server_t server;
 
+/*
+ * The loop the calling thread is driving. Worker threads point this
+ * at themselves; the main thread points it at a worker for as long as
+ * it has borrowed one.
+ */
+static __thread tapdisk_server_thread_t *current = &server.main;
+
+static volatile sig_atomic_t tapdisk_server_signals[NSIG];
+
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	list_for_each_entry_safe(vbd, tmp, &current->vbds, next)
 
+#define tapdisk_server_for_each_thread(t)				\
+	for ((t) = &server.main; (t); (t) = tapdisk_server_next_thread(t))
+
+static tapdisk_server_thread_t *
+tapdisk_server_next_thread(tapdisk_server_thread_t *t)
+{
+	if (t == &server.main)
+		return server.nr_threads ? server.threads : NULL;
+
+	if (++t < server.threads + server.nr_threads)
+		return t;
+
+	return NULL;
+}
+
+/*
+ * Images are only shared between VBDs served by the same loop.
+ */
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
 {
@@ -66,39 +95,132 @@ tapdisk_server_get_shared_image(td_image_t *image)
 struct list_head *
 tapdisk_server_get_all_vbds(void)
 {
-	return &server.vbds;
+	return &current->vbds;
 }
 
-td_vbd_t *
-tapdisk_server_get_vbd(uint16_t uuid)
+static tapdisk_server_thread_t *
+__tapdisk_server_find_vbd(uint16_t uuid, td_vbd_t **_vbd)
 {
 	td_vbd_t *vbd, *tmp;
+	tapdisk_server_thread_t *t;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
-		if (vbd->uuid == uuid)
-			return vbd;
+	tapdisk_server_for_each_thread(t)
+		list_for_each_entry_safe(vbd, tmp, &t->vbds, next)
+			if (vbd->uuid == uuid) {
+				*_vbd = vbd;
+				return t;
+			}
 
+	*_vbd = NULL;
 	return NULL;
 }
 
+td_vbd_t *
+tapdisk_server_get_vbd(uint16_t uuid)
+{
+	td_vbd_t *vbd;
+
+	pthread_mutex_lock(&server.lock);
+	__tapdisk_server_find_vbd(uuid, &vbd);
+	pthread_mutex_unlock(&server.lock);
+
+	return vbd;
+}
+
+/*
+ * Walks the VBDs of every loop; start with NULL. Only stable while
+ * the workers are parked, see tapdisk_server_enter_all().
+ */
+td_vbd_t *
+tapdisk_server_next_vbd(td_vbd_t *vbd)
+{
+	struct list_head *pos;
+	tapdisk_server_thread_t *t;
+
+	t   = &server.main;
+	pos = t->vbds.next;
+
+	if (vbd) {
+		pos = vbd->next.next;
+		tapdisk_server_for_each_thread(t)
+			if (pos == &t->vbds)
+				break;
+		if (!t)
+			return list_entry(pos, td_vbd_t, next);
+	}
+
+	while (pos == &t->vbds) {
+		t = tapdisk_server_next_thread(t);
+		if (!t)
+			return NULL;
+
+		pos = t->vbds.next;
+	}
+
+	return list_entry(pos, td_vbd_t, next);
+}
+
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
-	list_add_tail(&vbd->next, &server.vbds);
+	pthread_mutex_lock(&server.lock);
+	list_add_tail(&vbd->next, &current->vbds);
+	current->nr_vbds++;
+	pthread_mutex_unlock(&server.lock);
 }
 
 void
 tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
+	pthread_mutex_lock(&server.lock);
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	current->nr_vbds--;
+	pthread_mutex_unlock(&server.lock);
+
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&current->aio_queue, tiocb);
+}
+
+void
+tapdisk_server_set_queue_driver(int drv)
+{
+	server.aio_drv = drv;
+}
+
+void
+tapdisk_server_set_queue_window(int usecs)
+{
+	server.aio_window = usecs;
+}
+
+int
+tapdisk_server_register_file(int fd)
+{
+	return tapdisk_queue_register_file(&current->aio_queue, fd);
+}
+
+void
+tapdisk_server_unregister_file(int fd)
+{
+	tapdisk_queue_unregister_file(&current->aio_queue, fd);
+}
+
+int
+tapdisk_server_register_buffer(void *buf, size_t size)
+{
+	return tapdisk_queue_register_buffer(&current->aio_queue, buf, size);
+}
+
+void
+tapdisk_server_unregister_buffer(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&current->aio_queue, buf);
 }
 
 void
@@ -106,7 +228,7 @@ tapdisk_server_debug(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_debug_queue(&current->aio_queue);
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		tapdisk_vbd_debug(vbd);
@@ -114,31 +236,216 @@ tapdisk_server_debug(void)
 	tlog_flush();
 }
 
+static void
+tapdisk_server_wake(tapdisk_server_thread_t *t)
+{
+	char c = 0;
+
+	if (t->wake_fd[1] != -1)
+		write(t->wake_fd[1], &c, 1);
+}
+
+static void
+tapdisk_server_wake_all(void)
+{
+	tapdisk_server_thread_t *t;
+
+	tapdisk_server_for_each_thread(t)
+		tapdisk_server_wake(t);
+}
+
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
+	tapdisk_server_thread_t *t;
+	int idle;
+
+	idle = 1;
+
+	pthread_mutex_lock(&server.lock);
+
+	tapdisk_server_for_each_thread(t)
+		if (!list_empty(&t->vbds))
+			idle = 0;
+
+	if (idle) {
 		server.run = 0;
+		tapdisk_server_wake_all();
+	}
+
+	pthread_mutex_unlock(&server.lock);
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&current->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&current->scheduler, event);
+}
+
+/*
+ * Events which must stay with the main loop, i.e. the control socket,
+ * no matter which loop the caller is operating on.
+ */
+event_id_t
+tapdisk_server_register_main_event(char mode, int fd,
+				   int timeout, event_cb_t cb, void *data)
+{
+	return scheduler_register_event(&server.main.scheduler,
+					mode, fd, timeout, cb, data);
+}
+
+void
+tapdisk_server_unregister_main_event(event_id_t event)
+{
+	return scheduler_unregister_event(&server.main.scheduler, event);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(&current->scheduler, seconds);
+}
+
+void
+tapdisk_server_set_max_timeout_ms(int msecs)
+{
+	scheduler_set_max_timeout_ms(&current->scheduler, msecs);
+}
+
+void
+tapdisk_server_set_threads(int nr)
+{
+	if (nr < 0)
+		nr = 0;
+	if (nr > TAPDISK_MAX_THREADS)
+		nr = TAPDISK_MAX_THREADS;
+
+	server.nr_threads = nr;
+}
+
+/*
+ * Stop a worker between two iterations. Called with the server lock
+ * held; a worker which has exited stays parked.
+ */
+static void
+tapdisk_server_park(tapdisk_server_thread_t *t)
+{
+	t->park++;
+	tapdisk_server_wake(t);
+
+	while (!t->parked)
+		pthread_cond_wait(&server.cond, &server.lock);
+}
+
+static void
+tapdisk_server_unpark(tapdisk_server_thread_t *t)
+{
+	t->park--;
+	pthread_cond_broadcast(&server.cond);
+}
+
+static tapdisk_server_thread_t *
+tapdisk_server_least_loaded(void)
+{
+	tapdisk_server_thread_t *t, *best;
+	int i;
+
+	best = server.threads;
+	for (i = 1; i < server.nr_threads; i++) {
+		t = &server.threads[i];
+		if (t->nr_vbds < best->nr_vbds)
+			best = t;
+	}
+
+	return best;
+}
+
+static void
+tapdisk_server_borrow(tapdisk_server_thread_t *t)
+{
+	pthread_mutex_lock(&server.lock);
+	tapdisk_server_park(t);
+	pthread_mutex_unlock(&server.lock);
+
+	server.borrowed = t;
+	current = t;
+}
+
+/*
+ * Control requests are handled on the main thread. Before touching a
+ * VBD, park the worker serving it and operate on that worker's loop
+ * until tapdisk_server_leave(). Unknown VBDs go to the least loaded
+ * worker, which is where an ATTACH will then add them.
+ */
+void
+tapdisk_server_enter(td_uuid_t uuid)
+{
+	tapdisk_server_thread_t *t;
+	td_vbd_t *vbd;
+
+	if (!server.nr_threads || server.borrowed || server.borrowed_all)
+		return;
+
+	pthread_mutex_lock(&server.lock);
+	t = __tapdisk_server_find_vbd(uuid, &vbd);
+	pthread_mutex_unlock(&server.lock);
+
+	if (!t || t == &server.main)
+		t = tapdisk_server_least_loaded();
+
+	tapdisk_server_borrow(t);
+}
+
+/*
+ * Park every worker, for requests which walk all VBDs.
+ */
+void
+tapdisk_server_enter_all(void)
+{
+	int i;
+
+	if (!server.nr_threads || server.borrowed || server.borrowed_all)
+		return;
+
+	pthread_mutex_lock(&server.lock);
+	for (i = 0; i < server.nr_threads; i++)
+		tapdisk_server_park(&server.threads[i]);
+	pthread_mutex_unlock(&server.lock);
+
+	server.borrowed_all = 1;
+}
+
+void
+tapdisk_server_leave(void)
+{
+	int i;
+
+	if (!server.borrowed && !server.borrowed_all)
+		return;
+
+	current = &server.main;
+
+	pthread_mutex_lock(&server.lock);
+
+	if (server.borrowed)
+		tapdisk_server_unpark(server.borrowed);
+
+	if (server.borrowed_all)
+		for (i = 0; i < server.nr_threads; i++)
+			tapdisk_server_unpark(&server.threads[i]);
+
+	pthread_mutex_unlock(&server.lock);
+
+	server.borrowed     = NULL;
+	server.borrowed_all = 0;
 }
 
 static void
@@ -174,7 +481,15 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	int wait;
+
+	wait = tapdisk_queue_plugged(&current->aio_queue);
+	if (wait) {
+		tapdisk_server_set_max_timeout_ms(wait);
+		return;
+	}
+
+	tapdisk_submit_all_tiocbs(&current->aio_queue);
 }
 
 static void
@@ -208,20 +523,89 @@ tapdisk_server_stop_vbds(void)
 static int
 tapdisk_server_init_aio(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	int err;
+
+	err = tapdisk_init_queue(&current->aio_queue, TAPDISK_TIOCBS,
+				 server.aio_drv, NULL);
+	if (err && server.aio_drv != TIO_DRV_LIO) {
+		DPRINTF("I/O queue driver %d unavailable (%d), "
+			"falling back to lio\n", server.aio_drv, err);
+		err = tapdisk_init_queue(&current->aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, NULL);
+	}
+
+	if (!err)
+		tapdisk_queue_set_window(&current->aio_queue,
+					 server.aio_window);
+
+	return err;
 }
 
 static void
 tapdisk_server_close_aio(void)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	tapdisk_free_queue(&current->aio_queue);
 }
 
 static void
-tapdisk_server_close(void)
+tapdisk_server_drain_wakeups(event_id_t id, char mode, void *private)
 {
-	tapdisk_server_close_aio();
+	tapdisk_server_thread_t *t = private;
+	char buf[64];
+
+	while (read(t->wake_fd[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+static int
+tapdisk_server_init_thread(tapdisk_server_thread_t *t)
+{
+	INIT_LIST_HEAD(&t->vbds);
+	t->wake_fd[0] = t->wake_fd[1] = -1;
+	t->wake_event = -1;
+
+	return scheduler_initialize(&t->scheduler);
+}
+
+static int
+tapdisk_server_open_wakeups(tapdisk_server_thread_t *t)
+{
+	int i, err;
+
+	err = pipe(t->wake_fd);
+	if (err) {
+		err = -errno;
+		t->wake_fd[0] = t->wake_fd[1] = -1;
+		return err;
+	}
+
+	for (i = 0; i < 2; i++) {
+		fcntl(t->wake_fd[i], F_SETFL, O_NONBLOCK);
+		fcntl(t->wake_fd[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	err = scheduler_register_event(&t->scheduler, SCHEDULER_POLL_READ_FD,
+				       t->wake_fd[0], 0,
+				       tapdisk_server_drain_wakeups, t);
+	if (err < 0)
+		return err;
+
+	t->wake_event = err;
+	return 0;
+}
+
+static void
+tapdisk_server_close_wakeups(tapdisk_server_thread_t *t)
+{
+	if (t->wake_event >= 0)
+		scheduler_unregister_event(&t->scheduler, t->wake_event);
+	if (t->wake_fd[0] != -1)
+		close(t->wake_fd[0]);
+	if (t->wake_fd[1] != -1)
+		close(t->wake_fd[1]);
+
+	t->wake_fd[0] = t->wake_fd[1] = -1;
+	t->wake_event = -1;
 }
 
 void
@@ -233,7 +617,7 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(&current->scheduler);
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %d\n", ret);
 
@@ -242,15 +626,147 @@ tapdisk_server_iterate(void)
 	tapdisk_server_kick_responses();
 }
 
-static void
-__tapdisk_server_run(void)
+static void *
+tapdisk_server_thread_run(void *arg)
 {
-	while (server.run)
+	tapdisk_server_thread_t *t = arg;
+
+	current = t;
+
+	while (server.run) {
 		tapdisk_server_iterate();
+
+		pthread_mutex_lock(&server.lock);
+		if (t->park) {
+			t->parked = 1;
+			pthread_cond_broadcast(&server.cond);
+			while (t->park)
+				pthread_cond_wait(&server.cond, &server.lock);
+			t->parked = 0;
+		}
+		pthread_mutex_unlock(&server.lock);
+	}
+
+	pthread_mutex_lock(&server.lock);
+	t->parked = 1;
+	pthread_cond_broadcast(&server.cond);
+	pthread_mutex_unlock(&server.lock);
+
+	return NULL;
+}
+
+static int
+tapdisk_server_start_threads(void)
+{
+	tapdisk_server_thread_t *t;
+	sigset_t mask, omask;
+	int i, err;
+
+	if (!server.nr_threads)
+		return 0;
+
+	server.threads = calloc(server.nr_threads, sizeof(*server.threads));
+	if (!server.threads) {
+		server.nr_threads = 0;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < server.nr_threads; i++) {
+		err = tapdisk_server_init_thread(&server.threads[i]);
+		if (err)
+			goto fail;
+	}
+
+	err = tapdisk_server_open_wakeups(&server.main);
+	if (err)
+		goto fail;
+
+	for (i = 0; i < server.nr_threads; i++) {
+		t = &server.threads[i];
+
+		err = tapdisk_server_open_wakeups(t);
+		if (err)
+			goto fail;
+
+		current = t;
+		err = tapdisk_server_init_aio();
+		current = &server.main;
+		if (err)
+			goto fail;
+	}
+
+	/* signals are taken on the main thread only */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+
+	for (i = 0; i < server.nr_threads; i++) {
+		t = &server.threads[i];
+
+		err = pthread_create(&t->thread, NULL,
+				     tapdisk_server_thread_run, t);
+		if (err) {
+			err = -err;
+			break;
+		}
+
+		t->started = 1;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+	if (!err)
+		return 0;
+
+fail:
+	DPRINTF("failed to start %d server threads: %d\n",
+		server.nr_threads, err);
+	return err;
 }
 
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_server_stop_threads(void)
+{
+	tapdisk_server_thread_t *t;
+	int i;
+
+	if (!server.threads)
+		return;
+
+	pthread_mutex_lock(&server.lock);
+	server.run = 0;
+	tapdisk_server_wake_all();
+	pthread_mutex_unlock(&server.lock);
+
+	for (i = 0; i < server.nr_threads; i++) {
+		t = &server.threads[i];
+
+		if (t->started)
+			pthread_join(t->thread, NULL);
+
+		current = t;
+		tapdisk_server_close_aio();
+		tapdisk_server_close_wakeups(t);
+		scheduler_destroy(&t->scheduler);
+		current = &server.main;
+	}
+
+	tapdisk_server_close_wakeups(&server.main);
+
+	free(server.threads);
+	server.threads    = NULL;
+	server.nr_threads = 0;
+}
+
+static void
+tapdisk_server_close(void)
+{
+	tapdisk_server_stop_threads();
+	tapdisk_server_close_aio();
+	scheduler_destroy(&server.main.scheduler);
+}
+
+static void
+tapdisk_server_handle_signal(int signal)
 {
 	td_vbd_t *vbd, *tmp;
 	static int xfsz_error_sent = 0;
@@ -277,15 +793,59 @@ tapdisk_server_signal_handler(int signal)
 	}
 }
 
+/*
+ * With worker threads, a signal may interrupt the main thread while it
+ * holds a worker, so handling is deferred to the main loop, which then
+ * visits each worker in turn.
+ */
+static void
+tapdisk_server_deliver_signals(void)
+{
+	int sig, i;
+
+	for (sig = 1; sig < NSIG; sig++) {
+		if (!tapdisk_server_signals[sig])
+			continue;
+
+		tapdisk_server_signals[sig] = 0;
+
+		for (i = 0; i < server.nr_threads; i++) {
+			tapdisk_server_borrow(&server.threads[i]);
+			tapdisk_server_handle_signal(sig);
+			tapdisk_server_leave();
+		}
+	}
+}
+
+static void
+__tapdisk_server_run(void)
+{
+	while (server.run) {
+		tapdisk_server_iterate();
+		tapdisk_server_deliver_signals();
+	}
+}
+
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	if (server.nr_threads) {
+		tapdisk_server_signals[signal] = 1;
+		return;
+	}
+
+	tapdisk_server_handle_signal(signal);
+}
+
 int
 tapdisk_server_init(void)
 {
 	memset(&server, 0, sizeof(server));
-	INIT_LIST_HEAD(&server.vbds);
-
-	scheduler_initialize(&server.scheduler);
+	server.aio_drv = TIO_DRV_LIO;
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.cond, NULL);
 
-	return 0;
+	return tapdisk_server_init_thread(&server.main);
 }
 
 int
@@ -299,10 +859,14 @@ tapdisk_server_complete(void)
 
 	server.run = 1;
 
+	err = tapdisk_server_start_threads();
+	if (err)
+		goto fail;
+
 	return 0;
 
 fail:
-	tapdisk_server_close_aio();
+	tapdisk_server_close();
 	return err;
 }
 
@@ -311,7 +875,9 @@ tapdisk_server_initialize(void)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		return err;
 
 	err = tapdisk_server_complete();
 	if (err)
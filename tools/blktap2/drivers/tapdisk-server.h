@@ -28,6 +28,8 @@
 #ifndef _TAPDISK_SERVER_H_
 #define _TAPDISK_SERVER_H_
 
+#include <pthread.h>
+
 #include "list.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-queue.h"
@@ -38,16 +40,32 @@ td_image_t *tapdisk_server_get_shared_image(td_image_t *);
 
 struct list_head *tapdisk_server_get_all_vbds(void);
 td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
+td_vbd_t *tapdisk_server_next_vbd(td_vbd_t *);
 void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
+void tapdisk_server_set_queue_driver(int);
+void tapdisk_server_set_queue_window(int);
+int tapdisk_server_register_file(int);
+void tapdisk_server_unregister_file(int);
+int tapdisk_server_register_buffer(void *, size_t);
+void tapdisk_server_unregister_buffer(void *);
 
 void tapdisk_server_check_state(void);
 
 event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
+event_id_t tapdisk_server_register_main_event(char, int, int,
+					      event_cb_t, void *);
+void tapdisk_server_unregister_main_event(event_id_t);
 void tapdisk_server_set_max_timeout(int);
+void tapdisk_server_set_max_timeout_ms(int);
+
+void tapdisk_server_set_threads(int);
+void tapdisk_server_enter(td_uuid_t);
+void tapdisk_server_enter_all(void);
+void tapdisk_server_leave(void);
 
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(void);
@@ -56,12 +74,41 @@ int tapdisk_server_run(void);
 void tapdisk_server_iterate(void);
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
+#define TAPDISK_MAX_THREADS         64
 
-typedef struct tapdisk_server {
-	int                          run;
+/*
+ * An event loop: a scheduler, an I/O queue and the VBDs they serve.
+ * The main loop also owns the control socket; with worker threads
+ * configured, VBDs are spread over the workers instead.
+ */
+typedef struct tapdisk_server_thread {
+	pthread_t                    thread;
+	int                          started;
 	struct list_head             vbds;
+	int                          nr_vbds;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+
+	int                          wake_fd[2];
+	event_id_t                   wake_event;
+	int                          park;
+	int                          parked;
+} tapdisk_server_thread_t;
+
+typedef struct tapdisk_server {
+	int                          run;
+	int                          aio_drv;
+	int                          aio_window;
+
+	tapdisk_server_thread_t      main;
+	tapdisk_server_thread_t     *threads;
+	int                          nr_threads;
+
+	tapdisk_server_thread_t     *borrowed;
+	int                          borrowed_all;
+
+	pthread_mutex_t              lock;
+	pthread_cond_t               cond;
 } tapdisk_server_t;
 
 #endif
@@ -0,0 +1,542 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "md5.h"
+#include "libvhd.h"
+#include "tapdisk.h"
+#include "tapdisk-shm-cache.h"
+
+/*
+ * Segment layout: header, hash buckets, page slots, then the page data.
+ * All of it is covered by one process-shared, robust mutex in the header;
+ * lookups and inserts are short (one hash chain and one 4k copy).  Pages
+ * are evicted with a clock sweep over the slots.
+ *
+ * The creator sizes and initializes the segment before publishing the
+ * magic; attachers wait for it.  If a tapdisk dies holding the lock the
+ * next locker finds the mutex EOWNERDEAD and wipes the index, which costs
+ * nothing but cached pages.  The segment is never unlinked by tapdisk:
+ * it outlives the VMs so a restarted VM finds its parent still warm.
+ */
+
+#define TD_SHM_CACHE_MAGIC           0x74647368636163ULL
+#define TD_SHM_CACHE_VERSION         1
+#define TD_SHM_CACHE_DEFAULT_MB      256
+#define TD_SHM_CACHE_MAX_MB          (64 << 10)
+#define TD_SHM_CACHE_ATTACH_TRIES    1000   /* 1ms apart */
+
+#define TD_SHM_CACHE_NIL             ((uint32_t)-1)
+
+#define TD_SHM_SLOT_VALID            1
+#define TD_SHM_SLOT_REFERENCED       2
+
+struct td_shm_cache_header {
+	uint64_t                     magic;
+	uint32_t                     version;
+	uint32_t                     nr_pages;
+	uint32_t                     nr_buckets;
+	uint32_t                     hand;
+	uint32_t                     free;
+	uint32_t                     pad;
+	uint64_t                     buckets_off;
+	uint64_t                     slots_off;
+	uint64_t                     data_off;
+	uint64_t                     size;
+	pthread_mutex_t              lock;
+	td_shm_cache_stats_t         stats;
+};
+
+struct td_shm_cache_slot {
+	uint8_t                      key[TD_SHM_CACHE_KEY_SIZE];
+	uint64_t                     page;
+	uint32_t                     next;
+	uint32_t                     flags;
+};
+
+struct td_shm_cache {
+	int                          refs;
+	struct td_shm_cache_header  *hdr;
+	uint32_t                    *buckets;
+	struct td_shm_cache_slot    *slots;
+	char                        *data;
+};
+
+/* one mapping per process, shared by all its VBDs */
+static pthread_mutex_t    _shm_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static td_shm_cache_t     _shm_cache;
+
+#define round_up(_x, _a)  (((_x) + (_a) - 1) & ~((uint64_t)(_a) - 1))
+
+static unsigned long
+tapdisk_shm_cache_size_mb(void)
+{
+	char *env, *end;
+	unsigned long mb;
+
+	env = getenv(TD_SHM_CACHE_ENV);
+	if (!env || !*env)
+		return 0;
+
+	mb = strtoul(env, &end, 0);
+	if (*end)
+		mb = TD_SHM_CACHE_DEFAULT_MB;
+
+	if (mb > TD_SHM_CACHE_MAX_MB)
+		mb = TD_SHM_CACHE_MAX_MB;
+
+	return mb;
+}
+
+int
+tapdisk_shm_cache_enabled(void)
+{
+	return tapdisk_shm_cache_size_mb() != 0;
+}
+
+static inline uint32_t
+tapdisk_shm_cache_hash(struct td_shm_cache_header *hdr,
+		       const uint8_t *key, uint64_t page)
+{
+	int i;
+	uint64_t h;
+
+	h = page * 0x9e3779b97f4a7c15ULL;
+	for (i = 0; i < TD_SHM_CACHE_KEY_SIZE; i++)
+		h = (h ^ key[i]) * 0x100000001b3ULL;
+
+	return (uint32_t)((h ^ (h >> 32)) % hdr->nr_buckets);
+}
+
+static void
+tapdisk_shm_cache_reset(td_shm_cache_t *cache)
+{
+	uint32_t i;
+	struct td_shm_cache_header *hdr = cache->hdr;
+
+	for (i = 0; i < hdr->nr_buckets; i++)
+		cache->buckets[i] = TD_SHM_CACHE_NIL;
+
+	for (i = 0; i < hdr->nr_pages; i++) {
+		cache->slots[i].flags = 0;
+		cache->slots[i].next  = (i + 1 < hdr->nr_pages ?
+					 i + 1 : TD_SHM_CACHE_NIL);
+	}
+
+	hdr->free        = 0;
+	hdr->hand        = 0;
+	hdr->stats.pages = 0;
+}
+
+static int
+tapdisk_shm_cache_lock(td_shm_cache_t *cache)
+{
+	int err;
+
+	err = pthread_mutex_lock(&cache->hdr->lock);
+	if (err == EOWNERDEAD) {
+		EPRINTF("shared cache lock owner died, resetting cache\n");
+		tapdisk_shm_cache_reset(cache);
+		cache->hdr->stats.resets++;
+		pthread_mutex_consistent(&cache->hdr->lock);
+		err = 0;
+	}
+
+	return -err;
+}
+
+static inline void
+tapdisk_shm_cache_unlock(td_shm_cache_t *cache)
+{
+	pthread_mutex_unlock(&cache->hdr->lock);
+}
+
+static void
+tapdisk_shm_cache_map(td_shm_cache_t *cache, struct td_shm_cache_header *hdr)
+{
+	cache->hdr     = hdr;
+	cache->buckets = (uint32_t *)((char *)hdr + hdr->buckets_off);
+	cache->slots   = (struct td_shm_cache_slot *)
+		((char *)hdr + hdr->slots_off);
+	cache->data    = (char *)hdr + hdr->data_off;
+}
+
+static int
+tapdisk_shm_cache_create(td_shm_cache_t *cache, int fd, unsigned long mb)
+{
+	uint64_t size;
+	uint32_t pages;
+	pthread_mutexattr_t attr;
+	struct td_shm_cache_header hdr, *shdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	pages           = ((uint64_t)mb << 20) >> TD_SHM_CACHE_PAGE_SHIFT;
+	hdr.version     = TD_SHM_CACHE_VERSION;
+	hdr.nr_pages    = pages;
+	hdr.nr_buckets  = pages;
+	hdr.buckets_off = round_up(sizeof(hdr), 64);
+	hdr.slots_off   = round_up(hdr.buckets_off +
+				   (uint64_t)pages * sizeof(uint32_t), 64);
+	hdr.data_off    = round_up(hdr.slots_off + (uint64_t)pages *
+				   sizeof(struct td_shm_cache_slot),
+				   TD_SHM_CACHE_PAGE_SIZE);
+	hdr.size        = hdr.data_off +
+		((uint64_t)pages << TD_SHM_CACHE_PAGE_SHIFT);
+	size            = hdr.size;
+
+	if (ftruncate(fd, size))
+		return -errno;
+
+	shdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shdr == MAP_FAILED)
+		return -errno;
+
+	memcpy(shdr, &hdr, sizeof(hdr));
+	tapdisk_shm_cache_map(cache, shdr);
+	tapdisk_shm_cache_reset(cache);
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shdr->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	/* publish */
+	__sync_synchronize();
+	shdr->magic = TD_SHM_CACHE_MAGIC;
+
+	DPRINTF("created shared cache: %u pages, %"PRIu64" bytes\n",
+		pages, size);
+	return 0;
+}
+
+static int
+tapdisk_shm_cache_open(td_shm_cache_t *cache, int fd)
+{
+	int i;
+	struct stat st;
+	struct td_shm_cache_header *hdr;
+
+	/* wait for the creator to size and initialize the segment */
+	for (i = 0; i < TD_SHM_CACHE_ATTACH_TRIES; i++) {
+		if (fstat(fd, &st))
+			return -errno;
+
+		if (st.st_size >= sizeof(*hdr)) {
+			hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED, fd, 0);
+			if (hdr == MAP_FAILED)
+				return -errno;
+
+			if (hdr->magic == TD_SHM_CACHE_MAGIC)
+				goto found;
+
+			munmap(hdr, st.st_size);
+		}
+
+		usleep(1000);
+	}
+
+	/*
+	 * the creator died before publishing the segment: unlink it so
+	 * the next attacher starts over.  anyone still mapping it keeps
+	 * working, just with a private copy.
+	 */
+	EPRINTF("shared cache %s never initialized\n", TD_SHM_CACHE_NAME);
+	shm_unlink(TD_SHM_CACHE_NAME);
+	return -ETIMEDOUT;
+
+found:
+	__sync_synchronize();
+	if (hdr->version != TD_SHM_CACHE_VERSION || hdr->size > st.st_size) {
+		EPRINTF("shared cache %s: version %u, size %"PRIu64
+			" incompatible\n", TD_SHM_CACHE_NAME,
+			hdr->version, hdr->size);
+		munmap(hdr, st.st_size);
+		return -EINVAL;
+	}
+
+	tapdisk_shm_cache_map(cache, hdr);
+	return 0;
+}
+
+/*
+ * pages are keyed by image uuid, so that every tapdisk reading the same
+ * parent finds them whatever path it was opened by.  images without a
+ * uuid are identified by the file itself.
+ */
+int
+tapdisk_shm_cache_image_key(const char *name, uint8_t *key)
+{
+	int err;
+	struct stat st;
+	vhd_context_t vhd;
+	uint64_t id[4];
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
+	if (!err) {
+		if (!vhd_uuid_is_nil(&vhd.footer.uuid)) {
+			memcpy(key, &vhd.footer.uuid, TD_SHM_CACHE_KEY_SIZE);
+			vhd_close(&vhd);
+			return 0;
+		}
+		vhd_close(&vhd);
+	}
+
+	if (stat(name, &st))
+		return -errno;
+
+	id[0] = st.st_dev;
+	id[1] = st.st_ino;
+	id[2] = st.st_size;
+	id[3] = st.st_mtime;
+	md5_sum((uint8_t *)id, sizeof(id), key);
+
+	return 0;
+}
+
+td_shm_cache_t *
+tapdisk_shm_cache_attach(void)
+{
+	int fd, err;
+	unsigned long mb;
+	td_shm_cache_t *cache;
+
+	cache = &_shm_cache;
+	pthread_mutex_lock(&_shm_cache_lock);
+
+	if (cache->refs)
+		goto out;
+
+	mb = tapdisk_shm_cache_size_mb();
+	if (!mb) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	fd = shm_open(TD_SHM_CACHE_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd != -1) {
+		err = tapdisk_shm_cache_create(cache, fd, mb);
+		if (err)
+			shm_unlink(TD_SHM_CACHE_NAME);
+	} else if (errno == EEXIST) {
+		fd = shm_open(TD_SHM_CACHE_NAME, O_RDWR, 0);
+		if (fd == -1)
+			err = -errno;
+		else
+			err = tapdisk_shm_cache_open(cache, fd);
+	} else
+		err = -errno;
+
+	if (fd != -1)
+		close(fd);
+
+	if (err)
+		goto fail;
+
+out:
+	cache->refs++;
+	pthread_mutex_unlock(&_shm_cache_lock);
+	return cache;
+
+fail:
+	EPRINTF("attaching shared cache %s: %d\n", TD_SHM_CACHE_NAME, err);
+	memset(cache, 0, sizeof(*cache));
+	pthread_mutex_unlock(&_shm_cache_lock);
+	return NULL;
+}
+
+void
+tapdisk_shm_cache_detach(td_shm_cache_t *cache)
+{
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&_shm_cache_lock);
+
+	if (!--cache->refs) {
+		munmap(cache->hdr, cache->hdr->size);
+		memset(cache, 0, sizeof(*cache));
+	}
+
+	pthread_mutex_unlock(&_shm_cache_lock);
+}
+
+static struct td_shm_cache_slot *
+tapdisk_shm_cache_find(td_shm_cache_t *cache, const uint8_t *key,
+		       uint64_t page, uint32_t **prev)
+{
+	uint32_t *p, i;
+	struct td_shm_cache_slot *slot;
+
+	p = cache->buckets + tapdisk_shm_cache_hash(cache->hdr, key, page);
+
+	for (i = *p; i != TD_SHM_CACHE_NIL; i = slot->next) {
+		slot = cache->slots + i;
+		if (slot->page == page &&
+		    !memcmp(slot->key, key, TD_SHM_CACHE_KEY_SIZE)) {
+			if (prev)
+				*prev = p;
+			return slot;
+		}
+		p = &slot->next;
+	}
+
+	return NULL;
+}
+
+static inline char *
+tapdisk_shm_cache_page(td_shm_cache_t *cache, struct td_shm_cache_slot *slot)
+{
+	return cache->data +
+		((uint64_t)(slot - cache->slots) << TD_SHM_CACHE_PAGE_SHIFT);
+}
+
+/*
+ * copy the page into @buf; returns -ENOENT on a miss
+ */
+int
+tapdisk_shm_cache_read(td_shm_cache_t *cache,
+		       const uint8_t *key, uint64_t page, char *buf)
+{
+	int err;
+	struct td_shm_cache_slot *slot;
+
+	err = tapdisk_shm_cache_lock(cache);
+	if (err)
+		return err;
+
+	slot = tapdisk_shm_cache_find(cache, key, page, NULL);
+	if (slot) {
+		slot->flags |= TD_SHM_SLOT_REFERENCED;
+		memcpy(buf, tapdisk_shm_cache_page(cache, slot),
+		       TD_SHM_CACHE_PAGE_SIZE);
+		cache->hdr->stats.hits++;
+	} else {
+		cache->hdr->stats.misses++;
+		err = -ENOENT;
+	}
+
+	tapdisk_shm_cache_unlock(cache);
+	return err;
+}
+
+static struct td_shm_cache_slot *
+tapdisk_shm_cache_evict(td_shm_cache_t *cache)
+{
+	uint32_t n, *prev;
+	struct td_shm_cache_slot *slot, *found;
+	struct td_shm_cache_header *hdr = cache->hdr;
+
+	/* two sweeps at most: the first may just clear reference bits */
+	for (n = 0; n < 2 * hdr->nr_pages; n++) {
+		slot      = cache->slots + hdr->hand;
+		hdr->hand = (hdr->hand + 1) % hdr->nr_pages;
+
+		if (!(slot->flags & TD_SHM_SLOT_VALID))
+			continue;
+
+		if (slot->flags & TD_SHM_SLOT_REFERENCED) {
+			slot->flags &= ~TD_SHM_SLOT_REFERENCED;
+			continue;
+		}
+
+		found = tapdisk_shm_cache_find(cache, slot->key,
+					       slot->page, &prev);
+		if (found != slot)
+			continue;
+
+		*prev       = slot->next;
+		slot->flags = 0;
+		hdr->stats.evictions++;
+		hdr->stats.pages--;
+		return slot;
+	}
+
+	return NULL;
+}
+
+void
+tapdisk_shm_cache_insert(td_shm_cache_t *cache,
+			 const uint8_t *key, uint64_t page, const char *buf)
+{
+	uint32_t *bucket;
+	struct td_shm_cache_slot *slot;
+	struct td_shm_cache_header *hdr = cache->hdr;
+
+	if (tapdisk_shm_cache_lock(cache))
+		return;
+
+	if (tapdisk_shm_cache_find(cache, key, page, NULL))
+		goto out;
+
+	if (hdr->free != TD_SHM_CACHE_NIL) {
+		slot      = cache->slots + hdr->free;
+		hdr->free = slot->next;
+	} else {
+		slot = tapdisk_shm_cache_evict(cache);
+		if (!slot)
+			goto out;
+	}
+
+	memcpy(slot->key, key, TD_SHM_CACHE_KEY_SIZE);
+	memcpy(tapdisk_shm_cache_page(cache, slot), buf,
+	       TD_SHM_CACHE_PAGE_SIZE);
+
+	bucket      = cache->buckets + tapdisk_shm_cache_hash(hdr, key, page);
+	slot->page  = page;
+	slot->flags = TD_SHM_SLOT_VALID;
+	slot->next  = *bucket;
+	*bucket     = slot - cache->slots;
+
+	hdr->stats.pages++;
+	hdr->stats.inserts++;
+
+out:
+	tapdisk_shm_cache_unlock(cache);
+}
+
+void
+tapdisk_shm_cache_stats(td_shm_cache_t *cache, td_shm_cache_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (tapdisk_shm_cache_lock(cache))
+		return;
+
+	*stats = cache->hdr->stats;
+	tapdisk_shm_cache_unlock(cache);
+}
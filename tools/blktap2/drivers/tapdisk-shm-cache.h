@@ -0,0 +1,68 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_SHM_CACHE_H_
+#define _TAPDISK_SHM_CACHE_H_
+
+#include <inttypes.h>
+
+/*
+ * Host-wide read cache in a shared memory segment, indexed by
+ * (image uuid, 4k page).  Every tapdisk on the host attaches the same
+ * segment, so VBDs reading a common read-only parent share its pages.
+ */
+
+#define TD_SHM_CACHE_NAME            "/tapdisk2-cache"
+#define TD_SHM_CACHE_ENV             "TAPDISK2_SHARED_CACHE"  /* size, MB */
+#define TD_SHM_CACHE_PAGE_SHIFT      12
+#define TD_SHM_CACHE_PAGE_SIZE       (1 << TD_SHM_CACHE_PAGE_SHIFT)
+#define TD_SHM_CACHE_PAGE_SECS       (TD_SHM_CACHE_PAGE_SIZE >> 9)
+#define TD_SHM_CACHE_KEY_SIZE        16
+
+typedef struct td_shm_cache          td_shm_cache_t;
+typedef struct td_shm_cache_stats    td_shm_cache_stats_t;
+
+struct td_shm_cache_stats {
+	uint32_t                     pages;
+	uint64_t                     hits;
+	uint64_t                     misses;
+	uint64_t                     inserts;
+	uint64_t                     evictions;
+	uint64_t                     resets;
+};
+
+int tapdisk_shm_cache_enabled(void);
+int tapdisk_shm_cache_image_key(const char *, uint8_t *);
+td_shm_cache_t *tapdisk_shm_cache_attach(void);
+void tapdisk_shm_cache_detach(td_shm_cache_t *);
+int tapdisk_shm_cache_read(td_shm_cache_t *,
+			   const uint8_t *, uint64_t, char *);
+void tapdisk_shm_cache_insert(td_shm_cache_t *,
+			      const uint8_t *, uint64_t, const char *);
+void tapdisk_shm_cache_stats(td_shm_cache_t *, td_shm_cache_stats_t *);
+
+#endif
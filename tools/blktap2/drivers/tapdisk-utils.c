@@ -26,6 +26,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -148,6 +149,22 @@ tapdisk_get_image_size(int fd, uint64_t *_sectors, uint32_t *_sector_size)
 	return 0;
 }
 
+/*
+ * Deallocate @len bytes at @off, leaving the file size untouched.
+ * Returns -EOPNOTSUPP where the filesystem (or libc) can't punch holes.
+ */
+int
+tapdisk_punch_hole(int fd, uint64_t off, uint64_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len))
+		return (errno == ENOSYS ? -EOPNOTSUPP : -errno);
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
 #ifdef __linux__
 
 int tapdisk_linux_version(void)
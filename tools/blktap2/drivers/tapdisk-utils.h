@@ -37,6 +37,7 @@ void tapdisk_stop_logging(void);
 int tapdisk_set_resource_limits(void);
 int tapdisk_namedup(char **, const char *);
 int tapdisk_get_image_size(int, uint64_t *, uint32_t *);
+int tapdisk_punch_hole(int, uint64_t, uint64_t);
 int tapdisk_linux_version(void);
 
 int read_exact(int fd, void *data, size_t size); /* EOF => -1, errno=0 */
@@ -42,6 +42,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-shm-cache.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-vbd.h"
 #include "blktap2.h"
@@ -67,6 +68,9 @@
 #define TD_VBD_EIO_SLEEP            1
 #define TD_VBD_WATCHDOG_TIMEOUT     10
 
+/* longest idle period credited to a qos bucket at once */
+#define TD_VBD_QOS_MAX_REFILL       10000000ULL
+
 static void tapdisk_vbd_ring_event(event_id_t, char, void *);
 static void tapdisk_vbd_callback(void *, blkif_response_t *);
 
@@ -222,10 +226,15 @@ tapdisk_vbd_add_block_cache(td_vbd_t *vbd)
 	if (!cache)
 		return -ENOMEM;
 
-	/* try to load existing cache */
-	err = td_load(cache);
-	if (!err)
-		goto done;
+	/*
+	 * try to load existing cache.  a shared cache is opened per vbd:
+	 * the pages are shared anyway, and this keeps hit counts per vbd.
+	 */
+	if (!tapdisk_shm_cache_enabled()) {
+		err = td_load(cache);
+		if (!err)
+			goto done;
+	}
 
 	/* hack driver to send open() correct image size */
 	if (!target->driver) {
@@ -629,6 +638,11 @@ tapdisk_vbd_map_device(td_vbd_t *vbd, const char *devname)
 	ring->vstart =
 		(unsigned long)ring->mem + (BLKTAP_RING_PAGES * psize);
 
+	/* request data pages; best effort, the queue copes without */
+	tapdisk_server_register_buffer((void *)ring->vstart,
+				       psize * (BLKTAP_MMAP_REGION_SIZE -
+						BLKTAP_RING_PAGES));
+
 	ioctl(ring->fd, BLKTAP_IOCTL_SETMODE, BLKTAP_MODE_INTERPOSE);
 
 	return 0;
@@ -650,6 +664,8 @@ tapdisk_vbd_unmap_device(td_vbd_t *vbd)
 
 	psize = getpagesize();
 
+	if (vbd->ring.mem > 0)
+		tapdisk_server_unregister_buffer((void *)vbd->ring.vstart);
 	if (vbd->ring.fd != -1)
 		close(vbd->ring.fd);
 	if (vbd->ring.mem > 0)
@@ -828,6 +844,165 @@ tapdisk_vbd_debug(td_vbd_t *vbd)
 		td_debug(image);
 }
 
+/*
+ * Collect the driver counters of each image in the chain, one
+ * "type: counters" entry per image, separated by "; ".
+ */
+static int
+tapdisk_vbd_image_stats(td_vbd_t *vbd, char *buf, size_t size)
+{
+	int len, n, m;
+	td_image_t *image, *tmp;
+
+	len = 0;
+	buf[0] = '\0';
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		n = snprintf(buf + len, size - len, "%s%s: ",
+			     (len ? "; " : ""),
+			     tapdisk_disk_types[image->type]->name);
+		if (n < 0 || (size_t)n >= size - len)
+			return -ENOSPC;
+
+		m = td_stats(image, buf + len + n, size - len - n);
+		if (m <= 0) {
+			buf[len] = '\0';
+			continue;
+		}
+
+		if ((size_t)m >= size - len - n)
+			return -ENOSPC;
+
+		len += n + m;
+	}
+
+	return len;
+}
+
+static int
+tapdisk_vbd_io_stats(td_vbd_t *vbd, char *buf, size_t size)
+{
+	int n;
+
+	n = snprintf(buf, size, "reads=%"PRIu64" rbytes=%"PRIu64" "
+		     "writes=%"PRIu64" wbytes=%"PRIu64" "
+		     "discards=%"PRIu64" dbytes=%"PRIu64" "
+		     "errors=%"PRIu64" retries=%"PRIu64" "
+		     "iops_limit=%"PRIu64"/%"PRIu64" "
+		     "bps_limit=%"PRIu64"/%"PRIu64" throttled=%"PRIu64,
+		     vbd->ops[0], vbd->bytes[0], vbd->ops[1], vbd->bytes[1],
+		     vbd->ops[2], vbd->bytes[2], vbd->errors, vbd->retries,
+		     vbd->qos_iops.rate, vbd->qos_iops.burst,
+		     vbd->qos_bps.rate, vbd->qos_bps.burst, vbd->throttled);
+
+	return ((size_t)n >= size ? -ENOSPC : n);
+}
+
+/* upper bound of the bucket holding the permille'th percentile */
+static uint64_t
+tapdisk_vbd_latency_percentile(td_vbd_latency_t *lat, int permille)
+{
+	int i;
+	uint64_t want, seen;
+
+	want = (lat->count * permille + 999) / 1000;
+	seen = 0;
+
+	for (i = 0; i < TD_VBD_LAT_BUCKETS - 1; i++) {
+		seen += lat->bucket[i];
+		if (seen >= want)
+			return 2ULL << i;
+	}
+
+	return lat->max;
+}
+
+static int
+tapdisk_vbd_latency_stats(td_vbd_latency_t *lat, char *buf, size_t size)
+{
+	int i, n, len;
+
+	len = snprintf(buf, size, "count=%"PRIu64" avg=%"PRIu64"us "
+		       "max=%"PRIu64"us p50<%"PRIu64"us p90<%"PRIu64"us "
+		       "p99<%"PRIu64"us p99.9<%"PRIu64"us",
+		       lat->count, lat->count ? lat->sum / lat->count : 0,
+		       lat->max,
+		       tapdisk_vbd_latency_percentile(lat, 500),
+		       tapdisk_vbd_latency_percentile(lat, 900),
+		       tapdisk_vbd_latency_percentile(lat, 990),
+		       tapdisk_vbd_latency_percentile(lat, 999));
+	if ((size_t)len >= size)
+		return -ENOSPC;
+
+	/* non-empty buckets, by upper bound, for as long as they fit */
+	for (i = 0; i < TD_VBD_LAT_BUCKETS; i++) {
+		if (!lat->bucket[i])
+			continue;
+
+		if (i == TD_VBD_LAT_BUCKETS - 1)
+			n = snprintf(buf + len, size - len, " inf:%"PRIu64,
+				     lat->bucket[i]);
+		else
+			n = snprintf(buf + len, size - len, " <%llu:%"PRIu64,
+				     2ULL << i, lat->bucket[i]);
+		if ((size_t)n >= size - len) {
+			buf[len] = '\0';
+			break;
+		}
+
+		len += n;
+	}
+
+	return len;
+}
+
+/*
+ * type selects what to report: "images" (the default) for the driver
+ * counters, "io" for request counters and qos limits, or "queue",
+ * "service" and "total" for a latency histogram.
+ */
+int
+tapdisk_vbd_stats(td_vbd_t *vbd, const char *type, char *buf, size_t size)
+{
+	if (!type || !type[0] || !strcmp(type, "images"))
+		return tapdisk_vbd_image_stats(vbd, buf, size);
+
+	if (!strcmp(type, "io"))
+		return tapdisk_vbd_io_stats(vbd, buf, size);
+
+	if (!strcmp(type, "queue"))
+		return tapdisk_vbd_latency_stats(&vbd->lat_queue, buf, size);
+
+	if (!strcmp(type, "service"))
+		return tapdisk_vbd_latency_stats(&vbd->lat_service, buf, size);
+
+	if (!strcmp(type, "total"))
+		return tapdisk_vbd_latency_stats(&vbd->lat_total, buf, size);
+
+	return -EINVAL;
+}
+
+static void
+tapdisk_vbd_init_bucket(td_vbd_bucket_t *b, uint64_t rate, uint64_t burst)
+{
+	b->rate  = rate;
+	b->burst = (burst ? : rate);
+	b->level = b->burst * 1000000LL;
+}
+
+void
+tapdisk_vbd_set_qos(td_vbd_t *vbd, uint64_t iops, uint64_t iops_burst,
+		    uint64_t bps, uint64_t bps_burst)
+{
+	tapdisk_vbd_init_bucket(&vbd->qos_iops, iops, iops_burst);
+	tapdisk_vbd_init_bucket(&vbd->qos_bps, bps, bps_burst);
+	gettimeofday(&vbd->qos_ts, NULL);
+
+	DPRINTF("%s: qos iops %"PRIu64"/%"PRIu64", bps %"PRIu64"/%"PRIu64"\n",
+		vbd->name, vbd->qos_iops.rate, vbd->qos_iops.burst,
+		vbd->qos_bps.rate, vbd->qos_bps.burst);
+}
+
 static void
 tapdisk_vbd_drop_log(td_vbd_t *vbd)
 {
@@ -1052,12 +1227,102 @@ tapdisk_vbd_callback(void *arg, blkif_response_t *rsp)
 	tapdisk_vbd_write_response_to_ring(vbd, rsp);
 }
 
+static inline uint64_t
+tapdisk_vbd_usecs(const struct timeval *from, const struct timeval *to)
+{
+	int64_t us;
+
+	us = (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_usec - from->tv_usec);
+
+	return (us > 0 ? us : 0);
+}
+
+static void
+tapdisk_vbd_account_latency(td_vbd_latency_t *lat, uint64_t us)
+{
+	int i;
+	uint64_t v;
+
+	for (i = 0, v = us >> 1; v && i < TD_VBD_LAT_BUCKETS - 1; i++)
+		v >>= 1;
+
+	lat->bucket[i]++;
+	lat->count++;
+	lat->sum += us;
+	if (us > lat->max)
+		lat->max = us;
+}
+
+static uint64_t
+tapdisk_vbd_request_bytes(blkif_request_t *req)
+{
+	int i;
+	uint64_t secs;
+
+	if (req->operation == BLKIF_OP_DISCARD)
+		return ((blkif_request_discard_t *)req)->nr_sectors <<
+			SECTOR_SHIFT;
+
+	secs = 0;
+	for (i = 0; i < req->nr_segments &&
+		     i < BLKIF_MAX_SEGMENTS_PER_REQUEST; i++)
+		if (req->seg[i].last_sect >= req->seg[i].first_sect)
+			secs += req->seg[i].last_sect -
+				req->seg[i].first_sect + 1;
+
+	return secs << SECTOR_SHIFT;
+}
+
+static void
+tapdisk_vbd_account_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	int op;
+	struct timeval now;
+
+	switch (vreq->req.operation) {
+	case BLKIF_OP_READ:
+		op = 0;
+		break;
+	case BLKIF_OP_WRITE:
+		op = 1;
+		break;
+	case BLKIF_OP_DISCARD:
+		op = 2;
+		break;
+	default:
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+
+	/* requests failed before they reached an image */
+	if (!timerisset(&vreq->ts_issued))
+		vreq->ts_issued = now;
+	if (!timerisset(&vreq->ts_queued))
+		vreq->ts_queued = vreq->ts_issued;
+
+	vbd->ops[op]++;
+	if (vreq->status == BLKIF_RSP_OKAY)
+		vbd->bytes[op] += tapdisk_vbd_request_bytes(&vreq->req);
+
+	tapdisk_vbd_account_latency(&vbd->lat_queue,
+				    tapdisk_vbd_usecs(&vreq->ts_queued,
+						      &vreq->ts_issued));
+	tapdisk_vbd_account_latency(&vbd->lat_service,
+				    tapdisk_vbd_usecs(&vreq->ts_issued, &now));
+	tapdisk_vbd_account_latency(&vbd->lat_total,
+				    tapdisk_vbd_usecs(&vreq->ts_queued, &now));
+}
+
 static void
 tapdisk_vbd_make_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
 	blkif_request_t tmp;
 	blkif_response_t *rsp;
 
+	tapdisk_vbd_account_request(vbd, vreq);
+
 	tmp = vreq->req;
 	rsp = (blkif_response_t *)&vreq->req;
 
@@ -1211,7 +1476,8 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 			vbd->errors++;
 			ERR(err, "req %"PRIu64": %s 0x%04x secs to "
 			    "0x%08"PRIx64, vreq->req.id,
-			    (treq.op == TD_OP_WRITE ? "write" : "read"),
+			    (treq.op == TD_OP_WRITE ? "write" :
+			     treq.op == TD_OP_DISCARD ? "discard" : "read"),
 			    treq.secs, treq.sec);
 		}
 	} else {
@@ -1247,6 +1513,12 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 
 	vreq->submitting++;
 
+	/* discards only ever apply to the leaf image */
+	if (treq.op == TD_OP_DISCARD) {
+		td_complete_request(treq, 0);
+		goto done;
+	}
+
 	if (tapdisk_vbd_is_last_image(vbd, image)) {
 		memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
 		td_complete_request(treq, 0);
@@ -1318,18 +1590,17 @@ tapdisk_vbd_forward_request(td_request_t treq)
 {
 	td_vbd_t *vbd;
 	td_image_t *image;
-	td_vbd_request_t *vreq;
 
 	image = treq.image;
 	vbd   = (td_vbd_t *)image->private;
-	vreq  = (td_vbd_request_t *)treq.private;
 
 	gettimeofday(&vbd->ts, NULL);
 
 	if (tapdisk_vbd_queue_ready(vbd))
 		__tapdisk_vbd_reissue_td_request(vbd, image, treq);
 	else
-		__tapdisk_vbd_complete_td_request(vbd, vreq, treq, -EIO);
+		/* drivers may forward requests with their own callback */
+		td_complete_request(treq, -EIO);
 }
 
 static void
@@ -1372,6 +1643,8 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	vreq->submitting = 1;
 	gettimeofday(&vbd->ts, NULL);
 	gettimeofday(&vreq->last_try, NULL);
+	if (!timerisset(&vreq->ts_issued))
+		vreq->ts_issued = vreq->last_try;
 	tapdisk_vbd_move_request(vreq, &vbd->pending_requests);
 
 #if 0
@@ -1384,6 +1657,33 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	if (err)
 		goto fail;
 
+	if (req->operation == BLKIF_OP_DISCARD) {
+		blkif_request_discard_t *dreq = (blkif_request_discard_t *)req;
+
+		treq.id             = id;
+		treq.sidx           = 0;
+		treq.blocked        = 0;
+		treq.buf            = NULL;
+		treq.sec            = dreq->sector_number;
+		treq.secs           = (int)dreq->nr_sectors;
+		treq.image          = image;
+		treq.cb             = tapdisk_vbd_complete_td_request;
+		treq.cb_data        = NULL;
+		treq.private        = vreq;
+		treq.op             = TD_OP_DISCARD;
+
+		DBG(TLOG_DBG, "%s: req %d discard sec 0x%08"PRIx64" "
+		    "secs 0x%04x\n", image->name, id, treq.sec, treq.secs);
+
+		vreq->secs_pending += treq.secs;
+		vbd->secs_pending  += treq.secs;
+
+		td_queue_discard(image, treq);
+
+		err = 0;
+		goto out;
+	}
+
 	for (i = 0; i < req->nr_segments; i++) {
 		nsects = req->seg[i].last_sect - req->seg[i].first_sect + 1;
 		page   = (char *)MMAP_VADDR(ring->vstart, 
@@ -1498,6 +1798,74 @@ tapdisk_vbd_reissue_failed_requests(td_vbd_t *vbd)
 	return err;
 }
 
+static void
+tapdisk_vbd_refill_bucket(td_vbd_bucket_t *b, uint64_t us)
+{
+	int64_t max;
+
+	if (!b->rate)
+		return;
+
+	max       = b->burst * 1000000LL;
+	b->level += b->rate * us;
+	if (b->level > max)
+		b->level = max;
+}
+
+/* usecs until an empty bucket is back above zero */
+static uint64_t
+tapdisk_vbd_bucket_wait(td_vbd_bucket_t *b)
+{
+	if (!b->rate || b->level > 0)
+		return 0;
+
+	return -b->level / b->rate + 1;
+}
+
+/*
+ * Charge a new request against the qos buckets.  If either is empty
+ * the request stays on new_requests, and the server is asked to come
+ * back once it has refilled.
+ */
+static int
+tapdisk_vbd_qos_admit(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	uint64_t us, wait;
+	struct timeval now;
+
+	if (!vbd->qos_iops.rate && !vbd->qos_bps.rate)
+		return 1;
+
+	gettimeofday(&now, NULL);
+	us = tapdisk_vbd_usecs(&vbd->qos_ts, &now);
+	if (us > TD_VBD_QOS_MAX_REFILL)
+		us = TD_VBD_QOS_MAX_REFILL;
+	vbd->qos_ts = now;
+
+	tapdisk_vbd_refill_bucket(&vbd->qos_iops, us);
+	tapdisk_vbd_refill_bucket(&vbd->qos_bps, us);
+
+	wait = tapdisk_vbd_bucket_wait(&vbd->qos_iops);
+	us   = tapdisk_vbd_bucket_wait(&vbd->qos_bps);
+	if (us > wait)
+		wait = us;
+
+	if (wait) {
+		vbd->throttled++;
+		tapdisk_server_set_max_timeout_ms((wait + 999) / 1000);
+		return 0;
+	}
+
+	if (vbd->qos_iops.rate)
+		vbd->qos_iops.level -= 1000000;
+	/* discards move no data */
+	if (vbd->qos_bps.rate && vreq->req.operation != BLKIF_OP_DISCARD)
+		vbd->qos_bps.level -=
+			tapdisk_vbd_request_bytes(&vreq->req) * 1000000;
+
+	return 1;
+}
+
 static int
 tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 {
@@ -1505,6 +1873,9 @@ tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 	td_vbd_request_t *vreq, *tmp;
 
 	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
+		if (!tapdisk_vbd_qos_admit(vbd, vreq))
+			return 0;
+
 		err = tapdisk_vbd_issue_request(vbd, vreq);
 		if (err)
 			return err;
@@ -1557,6 +1928,7 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 	td_ring_t *ring;
 	blkif_request_t *req;
 	td_vbd_request_t *vreq;
+	struct timeval now;
 
 	ring = &vbd->ring;
 	if (!ring->sring)
@@ -1565,6 +1937,8 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 	rp   = ring->fe_ring.sring->req_prod;
 	xen_rmb();
 
+	gettimeofday(&now, NULL);
+
 	for (rc = ring->fe_ring.req_cons; rc != rp; rc++) {
 		req = RING_GET_REQUEST(&ring->fe_ring, rc);
 		++ring->fe_ring.req_cons;
@@ -1578,6 +1952,7 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 		memcpy(&vreq->req, req, sizeof(blkif_request_t));
 		vbd->received++;
 		vreq->vbd = vbd;
+		vreq->ts_queued = now;
 
 		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
 
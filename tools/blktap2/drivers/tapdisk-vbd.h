@@ -50,10 +50,15 @@
 #define TD_VBD_RETRY_NEEDED         0x0100
 #define TD_VBD_LOG_DROPPED          0x0200
 
+/* latency buckets: [2^i, 2^(i+1)) usecs, the last one open-ended */
+#define TD_VBD_LAT_BUCKETS          26
+
 typedef struct td_ring              td_ring_t;
 typedef struct td_vbd_request       td_vbd_request_t;
 typedef struct td_vbd_driver_info   td_vbd_driver_info_t;
 typedef struct td_vbd_handle        td_vbd_t;
+typedef struct td_vbd_latency       td_vbd_latency_t;
+typedef struct td_vbd_bucket        td_vbd_bucket_t;
 typedef void (*td_vbd_cb_t)        (void *, blkif_response_t *);
 
 struct td_ring {
@@ -75,10 +80,31 @@ struct td_vbd_request {
 	int                         num_retries;
 	struct timeval              last_try;
 
+	struct timeval              ts_queued; /* pulled off the ring */
+	struct timeval              ts_issued; /* first handed to an image */
+
 	td_vbd_t                   *vbd;
 	struct list_head            next;
 };
 
+struct td_vbd_latency {
+	uint64_t                    count;
+	uint64_t                    sum;
+	uint64_t                    max;
+	uint64_t                    bucket[TD_VBD_LAT_BUCKETS];
+};
+
+/*
+ * token bucket: refilled at rate per second up to burst; levels are
+ * kept in millionths of a token and may go negative, so a request
+ * larger than the bucket still gets through once it is full.
+ */
+struct td_vbd_bucket {
+	uint64_t                    rate;
+	uint64_t                    burst;
+	int64_t                     level;
+};
+
 struct td_vbd_driver_info {
 	char                       *params;
 	int                         type;
@@ -125,6 +151,17 @@ struct td_vbd_handle {
 	uint64_t                    secs_pending;
 	uint64_t                    retries;
 	uint64_t                    errors;
+
+	uint64_t                    ops[3];   /* read, write, discard */
+	uint64_t                    bytes[3];
+	td_vbd_latency_t            lat_queue;
+	td_vbd_latency_t            lat_service;
+	td_vbd_latency_t            lat_total;
+
+	td_vbd_bucket_t             qos_iops;
+	td_vbd_bucket_t             qos_bps;
+	struct timeval              qos_ts;
+	uint64_t                    throttled;
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -201,6 +238,9 @@ int tapdisk_vbd_kick(td_vbd_t *);
 void tapdisk_vbd_check_state(td_vbd_t *);
 void tapdisk_vbd_check_progress(td_vbd_t *);
 void tapdisk_vbd_debug(td_vbd_t *);
+int tapdisk_vbd_stats(td_vbd_t *, const char *, char *, size_t);
+void tapdisk_vbd_set_qos(td_vbd_t *, uint64_t iops, uint64_t iops_burst,
+			 uint64_t bps, uint64_t bps_burst);
 
 void tapdisk_vbd_complete_vbd_request(td_vbd_t *, td_vbd_request_t *);
 
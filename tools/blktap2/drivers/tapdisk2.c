@@ -42,7 +42,17 @@
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s [-D] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s [-D] [-q lio|rwio|uring] [-w usecs] "
+		"[-t threads] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "  -q selects the I/O queue driver; defaults to "
+		"$TAPDISK2_QUEUE, else lio\n");
+	fprintf(stderr, "  -w holds I/O back for up to usecs to merge "
+		"nearby requests;\n     defaults to "
+		"$TAPDISK2_QUEUE_WINDOW, else 0\n");
+	fprintf(stderr, "  -t serves VBDs from up to %d worker threads, "
+		"each with its own\n     event loop and I/O queue; "
+		"defaults to 0, all VBDs on the main loop\n",
+		TAPDISK_MAX_THREADS);
 	exit(err);
 }
 
@@ -50,16 +60,31 @@ int
 main(int argc, char *argv[])
 {
 	char *control;
-	int c, err, nodaemon;
+	const char *queue, *window;
+	int c, err, nodaemon, drv, threads;
 
 	control  = NULL;
 	nodaemon = 0;
+	threads  = 0;
+	queue    = getenv("TAPDISK2_QUEUE");
+	window   = getenv("TAPDISK2_QUEUE_WINDOW");
 
-	while ((c = getopt(argc, argv, "s:Dh")) != -1) {
+	while ((c = getopt(argc, argv, "s:q:w:t:Dh")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
 			break;
+		case 'q':
+			queue = optarg;
+			break;
+		case 'w':
+			window = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 0 || threads > TAPDISK_MAX_THREADS)
+				usage(argv[0], EINVAL);
+			break;
 		case 'h':
 			usage(argv[0], 0);
 			break;
@@ -79,6 +104,15 @@ main(int argc, char *argv[])
 	if (optind != argc)
 		usage(argv[0], EINVAL);
 
+	drv = TIO_DRV_LIO;
+	if (queue) {
+		drv = tapdisk_queue_driver(queue);
+		if (drv < 0) {
+			fprintf(stderr, "unknown I/O queue driver %s\n", queue);
+			usage(argv[0], EINVAL);
+		}
+	}
+
 	if (chdir("/")) {
 		DPRINTF("failed to chdir(/): %d\n", errno);
 		err = 1;
@@ -93,6 +127,11 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
+	tapdisk_server_set_queue_driver(drv);
+	if (window)
+		tapdisk_server_set_queue_window(atoi(window));
+	tapdisk_server_set_threads(threads);
+
 	if (!nodaemon) {
 		err = daemon(0, 1);
 		if (err) {
@@ -50,6 +50,7 @@ typedef struct tapdisk_message_string    tapdisk_message_string_t;
 typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
+typedef struct tapdisk_message_qos       tapdisk_message_qos_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -88,6 +89,14 @@ struct tapdisk_message_list {
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+/* zero rates are unlimited, zero bursts default to one second's worth */
+struct tapdisk_message_qos {
+	uint64_t                         iops;
+	uint64_t                         iops_burst;
+	uint64_t                         bps;
+	uint64_t                         bps_burst;
+};
+
 struct tapdisk_message {
 	uint16_t                         type;
 	uint16_t                         cookie;
@@ -100,6 +109,7 @@ struct tapdisk_message {
 		tapdisk_message_minors_t minors;
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
+		tapdisk_message_qos_t    qos;
 	} u;
 };
 
@@ -126,6 +136,10 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_LIST_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_STATS,
+	TAPDISK_MESSAGE_STATS_RSP,
+	TAPDISK_MESSAGE_QOS,
+	TAPDISK_MESSAGE_QOS_RSP,
 };
 
 static inline char *
@@ -195,6 +209,18 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_STATS:
+		return "stats";
+
+	case TAPDISK_MESSAGE_STATS_RSP:
+		return "stats response";
+
+	case TAPDISK_MESSAGE_QOS:
+		return "qos";
+
+	case TAPDISK_MESSAGE_QOS_RSP:
+		return "qos response";
+
 	default:
 		return "unknown";
 	}
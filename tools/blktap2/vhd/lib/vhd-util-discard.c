@@ -0,0 +1,258 @@
+/* Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libvhd.h"
+
+/*
+ * Release allocated blocks that hold nothing: blocks with an empty
+ * bitmap, and, in images without a parent, blocks whose present sectors
+ * are all zero.  (Zeroed sectors in a differencing image mask the
+ * parent's data, so they must stay.)  The bat is rewritten first, then
+ * the freed space is handed back with a hole punch and the file is
+ * trimmed if its last blocks went away.
+ */
+
+static int
+vhd_util_discard_punch(vhd_context_t *vhd, off_t off, off_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(vhd->fd,
+		      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len))
+		return -errno;
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+static int
+vhd_util_block_empty(vhd_context_t *vhd, uint32_t blk, int diff)
+{
+	int err, empty;
+	uint32_t i, j;
+	char *map, *buf, *sec;
+
+	map   = NULL;
+	buf   = NULL;
+	empty = 0;
+
+	err = vhd_read_bitmap(vhd, blk, &map);
+	if (err)
+		return err;
+
+	if (!diff) {
+		err = vhd_read_block(vhd, blk, &buf);
+		if (err)
+			goto out;
+	}
+
+	for (i = 0; i < vhd->spb; i++) {
+		if (!vhd_bitmap_test(vhd, map, i))
+			continue;
+
+		if (diff)
+			goto out;
+
+		sec = buf + vhd_sectors_to_bytes(i);
+		for (j = 0; j < VHD_SECTOR_SIZE; j++)
+			if (sec[j])
+				goto out;
+	}
+
+	empty = 1;
+
+out:
+	free(map);
+	free(buf);
+	return (err ? : empty);
+}
+
+int
+vhd_util_discard(int argc, char **argv)
+{
+	char *name;
+	off_t end, eof;
+	vhd_context_t vhd;
+	uint64_t *offsets;
+	uint32_t i, allocated, released;
+	int c, err, diff, dry_run, batmap;
+
+	name      = NULL;
+	offsets   = NULL;
+	dry_run   = 0;
+	allocated = 0;
+	released  = 0;
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:ch")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'c':
+			dry_run = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || optind != argc)
+		goto usage;
+
+	err = vhd_open(&vhd, name, (dry_run ? VHD_OPEN_RDONLY : VHD_OPEN_RDWR));
+	if (err) {
+		printf("error opening %s: %d\n", name, err);
+		return err;
+	}
+
+	if (!vhd_type_dynamic(&vhd)) {
+		printf("%s is not a dynamic image\n", name);
+		err = -EINVAL;
+		goto done;
+	}
+
+	err = vhd_get_bat(&vhd);
+	if (err)
+		goto done;
+
+	batmap = 0;
+	if (vhd_has_batmap(&vhd)) {
+		err = vhd_get_batmap(&vhd);
+		if (err)
+			goto done;
+		batmap = 1;
+	}
+
+	offsets = calloc(vhd.bat.entries, sizeof(uint64_t));
+	if (!offsets) {
+		err = -ENOMEM;
+		goto done;
+	}
+
+	diff = (vhd.footer.type == HD_TYPE_DIFF);
+
+	for (i = 0; i < vhd.bat.entries; i++) {
+		if (vhd.bat.bat[i] == DD_BLK_UNUSED)
+			continue;
+
+		allocated++;
+
+		err = vhd_util_block_empty(&vhd, i, diff);
+		if (err < 0) {
+			printf("error reading block %u: %d\n", i, err);
+			goto done;
+		}
+
+		if (err)
+			offsets[released++] = vhd.bat.bat[i];
+		if (err && !dry_run) {
+			vhd.bat.bat[i] = DD_BLK_UNUSED;
+			if (batmap)
+				vhd_batmap_clear(&vhd, &vhd.batmap, i);
+		}
+	}
+
+	err = 0;
+	printf("%s: %u of %u allocated blocks %s\n", name, released,
+	       allocated, (dry_run ? "can be released" : "released"));
+
+	if (dry_run || !released)
+		goto done;
+
+	err = vhd_write_bat(&vhd, &vhd.bat);
+	if (err)
+		goto done;
+
+	if (batmap) {
+		err = vhd_write_batmap(&vhd, &vhd.batmap);
+		if (err)
+			goto done;
+	}
+
+	for (i = 0; i < released; i++) {
+		err = vhd_util_discard_punch(&vhd,
+					     vhd_sectors_to_bytes(offsets[i]),
+					     vhd_sectors_to_bytes(vhd.bm_secs +
+								  vhd.spb));
+		if (err == -EOPNOTSUPP)
+			break;
+		if (err) {
+			printf("error punching hole at 0x%08"PRIx64": %d\n",
+			       offsets[i], err);
+			goto done;
+		}
+	}
+
+	err = 0;
+	if (vhd.is_block)
+		goto done;
+
+	/* move the footer in behind the last remaining block */
+	err = vhd_end_of_data(&vhd, &end);
+	if (err)
+		goto done;
+
+	err = vhd_seek(&vhd, 0, SEEK_END);
+	if (err)
+		goto done;
+
+	eof = vhd_position(&vhd);
+	if (eof == (off_t)-1) {
+		err = -errno;
+		goto done;
+	}
+
+	if (end + sizeof(vhd_footer_t) >= eof)
+		goto done;
+
+	err = vhd_write_footer(&vhd, &vhd.footer);
+	if (err)
+		goto done;
+
+	if (ftruncate(vhd.fd, end + sizeof(vhd_footer_t)))
+		err = -errno;
+
+ done:
+	free(offsets);
+	vhd_close(&vhd);
+	return err;
+
+usage:
+	printf("options: <-n name> [-c check only] [-h help]\n");
+	return -EINVAL;
+}
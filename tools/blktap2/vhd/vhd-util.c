@@ -59,6 +59,7 @@ struct command commands[] = {
 	{ .name = "scan",        .func = vhd_util_scan          },
 	{ .name = "check",       .func = vhd_util_check         },
 	{ .name = "revert",      .func = vhd_util_revert        },
+	{ .name = "discard",     .func = vhd_util_discard       },
 };
 
 #define print_commands()					\
@@ -0,0 +1 @@
+/root/repo/tools/include/../../xen/include/xen/libelf.h
\ No newline at end of file
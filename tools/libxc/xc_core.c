@@ -59,6 +59,11 @@
  *  |.shstrtab: section header string table                  |
  *  +--------------------------------------------------------+
  *
+ * A compressed dump (XC_DUMPCORE_COMPRESS) has .xen_pages_zlib instead of
+ * .xen_pages, placed after .shstrtab at the end of the file; see
+ * struct xen_dumpcore_zblock.  A sparse dump (XC_DUMPCORE_SPARSE) has the
+ * usual layout with holes where .xen_pages holds zero pages.
+ *
  */
 
 #include "xg_private.h"
@@ -66,9 +71,13 @@
 #include "xc_dom.h"
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
 
 /* number of pages to write at a time */
 #define DUMP_INCREMENT (4 * 1024)
+/* number of pages to map at a time */
+#define DUMP_MAP_BATCH 256
 
 /* string table */
 struct xc_core_strtab {
@@ -435,11 +444,349 @@ get_guest_width(xc_interface *xch,
     return 0;
 }
 
-int
-xc_domain_dumpcore_via_callback(xc_interface *xch,
-                                uint32_t domid,
-                                void *args,
-                                dumpcore_rtn_t dump_rtn)
+/*
+ * Overwrite length bytes at offset of what has already been written.  Only
+ * needed for XC_DUMPCORE_COMPRESS, whose section sizes are known last.
+ */
+typedef int (dumpcore_fixup_rtn_t)(xc_interface *xch, void *arg,
+                                   uint64_t offset, char *buffer,
+                                   size_t length);
+
+/*
+ * Writing out the guest pages.
+ *
+ * Pages are gathered DUMP_INCREMENT at a time and written with one call
+ * of the dump routine.  With XC_DUMPCORE_SPARSE, runs of zero pages are
+ * passed down as a NULL buffer so that the file writer can seek over them
+ * instead.  With XC_DUMPCORE_COMPRESS, pages are gathered into blocks of
+ * DUMP_ZBLOCK_PAGES which a pool of threads compresses while the next
+ * blocks are mapped; finished blocks are written out in order.
+ */
+
+/* pages per compressed block */
+#define DUMP_ZBLOCK_PAGES       256
+/* most compression threads used */
+#define DUMP_ZTHREADS_MAX       8
+
+struct dump_zslot {
+    char           *in;
+    unsigned char  *out;
+    unsigned long   nr_pages;
+    uLongf          zlen;
+    enum { ZSLOT_FREE, ZSLOT_FULL, ZSLOT_BUSY, ZSLOT_DONE } state;
+    int             err;
+};
+
+struct dump_zpool {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    pthread_t           threads[DUMP_ZTHREADS_MAX];
+    unsigned int        nr_threads;
+    struct dump_zslot   slots[2 * DUMP_ZTHREADS_MAX];
+    unsigned int        nr_slots;
+    unsigned int        fill;   /* slot being filled */
+    unsigned int        write;  /* oldest slot not yet written */
+    unsigned int        next;   /* next slot for a thread to compress */
+    int                 exiting;
+};
+
+struct dump_pages {
+    xc_interface       *xch;
+    void               *args;
+    dumpcore_rtn_t     *dump_rtn;
+    unsigned int        flags;
+
+    char               *buf;
+    unsigned long       nr_buf;
+
+    struct dump_zpool  *zpool;
+    uint64_t            zsize;  /* bytes of .xen_pages_zlib written */
+};
+
+static int
+page_is_zero(const char *page)
+{
+    const unsigned long *p = (const unsigned long *)page;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        if ( p[i] )
+            return 0;
+    return 1;
+}
+
+/* Skip length bytes of output, which then read back as zeroes. */
+static int
+dump_hole(struct dump_pages *dp, uint64_t length)
+{
+    unsigned int chunk;
+    int sts;
+
+    while ( length )
+    {
+        chunk = length > (1U << 30) ? (1U << 30) : length;
+        sts = dp->dump_rtn(dp->xch, dp->args, NULL, chunk);
+        if ( sts != 0 )
+            return sts;
+        length -= chunk;
+    }
+    return 0;
+}
+
+static int
+dump_pages_write(struct dump_pages *dp)
+{
+    xc_interface *xch = dp->xch;
+    unsigned long i, run;
+    int zero, sts;
+
+    if ( !(dp->flags & XC_DUMPCORE_SPARSE) )
+        return dp->dump_rtn(xch, dp->args, dp->buf, dp->nr_buf * PAGE_SIZE);
+
+    for ( i = 0; i < dp->nr_buf; i += run )
+    {
+        zero = page_is_zero(dp->buf + i * PAGE_SIZE);
+        for ( run = 1; i + run < dp->nr_buf; run++ )
+            if ( page_is_zero(dp->buf + (i + run) * PAGE_SIZE) != zero )
+                break;
+        sts = dp->dump_rtn(xch, dp->args,
+                           zero ? NULL : dp->buf + i * PAGE_SIZE,
+                           run * PAGE_SIZE);
+        if ( sts != 0 )
+            return sts;
+    }
+    return 0;
+}
+
+static void *
+dump_zthread(void *arg)
+{
+    struct dump_zpool *pool = arg;
+    struct dump_zslot *slot;
+
+    pthread_mutex_lock(&pool->lock);
+    for ( ; ; )
+    {
+        slot = &pool->slots[pool->next];
+        if ( slot->state != ZSLOT_FULL )
+        {
+            if ( pool->exiting )
+                break;
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        slot->state = ZSLOT_BUSY;
+        pool->next = (pool->next + 1) % pool->nr_slots;
+        pthread_mutex_unlock(&pool->lock);
+
+        slot->zlen = compressBound(slot->nr_pages * PAGE_SIZE);
+        slot->err = compress2(slot->out, &slot->zlen,
+                              (unsigned char *)slot->in,
+                              slot->nr_pages * PAGE_SIZE, Z_BEST_SPEED);
+
+        pthread_mutex_lock(&pool->lock);
+        slot->state = ZSLOT_DONE;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Wait for the oldest block to be compressed and write it out. */
+static int
+dump_zpool_write_one(struct dump_pages *dp)
+{
+    xc_interface *xch = dp->xch;
+    struct dump_zpool *pool = dp->zpool;
+    struct dump_zslot *slot = &pool->slots[pool->write];
+    struct xen_dumpcore_zblock zblock;
+    int sts;
+
+    pthread_mutex_lock(&pool->lock);
+    while ( slot->state != ZSLOT_DONE )
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    if ( slot->err != Z_OK )
+    {
+        ERROR("Could not compress dump pages: zlib error %d", slot->err);
+        return -1;
+    }
+
+    zblock.nr_pages = slot->nr_pages;
+    zblock.zlen = slot->zlen;
+    sts = dp->dump_rtn(xch, dp->args, (char *)&zblock, sizeof(zblock));
+    if ( sts != 0 )
+        return sts;
+    sts = dp->dump_rtn(xch, dp->args, (char *)slot->out, slot->zlen);
+    if ( sts != 0 )
+        return sts;
+    dp->zsize += sizeof(zblock) + slot->zlen;
+
+    slot->state = ZSLOT_FREE;
+    pool->write = (pool->write + 1) % pool->nr_slots;
+    return 0;
+}
+
+/* Hand the block being filled to the threads and start on the next one. */
+static int
+dump_zpool_submit(struct dump_pages *dp)
+{
+    struct dump_zpool *pool = dp->zpool;
+    struct dump_zslot *slot = &pool->slots[pool->fill];
+    int sts;
+
+    pthread_mutex_lock(&pool->lock);
+    slot->nr_pages = dp->nr_buf;
+    slot->state = ZSLOT_FULL;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->fill = (pool->fill + 1) % pool->nr_slots;
+    if ( pool->fill == pool->write )
+    {
+        sts = dump_zpool_write_one(dp);
+        if ( sts != 0 )
+            return sts;
+    }
+
+    dp->buf = pool->slots[pool->fill].in;
+    dp->nr_buf = 0;
+    return 0;
+}
+
+static void
+dump_zpool_free(struct dump_zpool *pool)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->exiting = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for ( i = 0; i < pool->nr_threads; i++ )
+        pthread_join(pool->threads[i], NULL);
+
+    for ( i = 0; i < pool->nr_slots; i++ )
+    {
+        free(pool->slots[i].in);
+        free(pool->slots[i].out);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static struct dump_zpool *
+dump_zpool_init(xc_interface *xch)
+{
+    struct dump_zpool *pool;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int i;
+
+    pool = calloc(1, sizeof(*pool));
+    if ( pool == NULL )
+    {
+        PERROR("Could not allocate compression pool");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    if ( cpus < 1 )
+        cpus = 1;
+    if ( cpus > DUMP_ZTHREADS_MAX )
+        cpus = DUMP_ZTHREADS_MAX;
+
+    /* Two blocks per thread keeps them busy while we write. */
+    pool->nr_slots = 2 * cpus;
+    for ( i = 0; i < pool->nr_slots; i++ )
+    {
+        pool->slots[i].in = malloc(DUMP_ZBLOCK_PAGES * PAGE_SIZE);
+        pool->slots[i].out =
+            malloc(compressBound(DUMP_ZBLOCK_PAGES * PAGE_SIZE));
+        if ( pool->slots[i].in == NULL || pool->slots[i].out == NULL )
+        {
+            PERROR("Could not allocate compression buffers");
+            goto err;
+        }
+    }
+
+    for ( i = 0; i < cpus; i++ )
+    {
+        if ( pthread_create(&pool->threads[i], NULL, dump_zthread, pool) )
+            break;
+        pool->nr_threads++;
+    }
+    if ( pool->nr_threads == 0 )
+    {
+        PERROR("Could not start compression threads");
+        goto err;
+    }
+
+    return pool;
+
+ err:
+    dump_zpool_free(pool);
+    return NULL;
+}
+
+/* Queue one page of .xen_pages{,_zlib} for writing. */
+static int
+dump_pages_add(struct dump_pages *dp, const char *page)
+{
+    unsigned long max = dp->zpool ? DUMP_ZBLOCK_PAGES : DUMP_INCREMENT;
+    int sts;
+
+    memcpy(dp->buf + dp->nr_buf * PAGE_SIZE, page, PAGE_SIZE);
+    if ( ++dp->nr_buf < max )
+        return 0;
+
+    if ( dp->zpool )
+        return dump_zpool_submit(dp);
+
+    sts = dump_pages_write(dp);
+    dp->nr_buf = 0;
+    return sts;
+}
+
+/* Write out everything still queued. */
+static int
+dump_pages_flush(struct dump_pages *dp)
+{
+    struct dump_zpool *pool = dp->zpool;
+    int sts;
+
+    if ( pool == NULL )
+    {
+        sts = dump_pages_write(dp);
+        dp->nr_buf = 0;
+        return sts;
+    }
+
+    if ( dp->nr_buf )
+    {
+        sts = dump_zpool_submit(dp);
+        if ( sts != 0 )
+            return sts;
+    }
+    while ( pool->write != pool->fill )
+    {
+        sts = dump_zpool_write_one(dp);
+        if ( sts != 0 )
+            return sts;
+    }
+    return 0;
+}
+
+static int
+dumpcore(xc_interface *xch,
+         uint32_t domid,
+         void *args,
+         dumpcore_rtn_t dump_rtn,
+         dumpcore_fixup_rtn_t fixup_rtn,
+         unsigned int flags)
 {
     xc_dominfo_t info;
     shared_info_any_t *live_shinfo = NULL;
@@ -447,7 +794,8 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     struct domain_info_context *dinfo = &_dinfo;
 
     int nr_vcpus = 0;
-    char *dump_mem, *dump_mem_start = NULL;
+    char *dump_mem_start = NULL;
+    struct dump_pages dp = {};
     vcpu_guest_context_any_t *ctxt = NULL;
     struct xc_core_arch_context arch_ctxt;
     char dummy[PAGE_SIZE];
@@ -456,8 +804,15 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
 
     unsigned long i;
     unsigned long j;
+    unsigned long k;
     unsigned long nr_pages;
 
+    xen_pfn_t batch_gmfn[DUMP_MAP_BATCH];
+    uint64_t batch_pfn[DUMP_MAP_BATCH];
+    int batch_err[DUMP_MAP_BATCH];
+    unsigned long nr_batch;
+    char *batch_mem;
+
     xc_core_memory_map_t *memory_map = NULL;
     unsigned int nr_memory_map;
     unsigned int map_idx;
@@ -472,11 +827,15 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     uint64_t filesz;
     uint64_t offset;
     uint64_t fixup;
+    uint64_t p2m_offset = 0;
 
     struct xc_core_strtab *strtab = NULL;
     uint16_t strtab_idx;
+    uint16_t pages_idx;
+    uint16_t p2m_idx;
     struct xc_core_section_headers *sheaders = NULL;
     Elf64_Shdr *shdr;
+    int compress = !!(flags & XC_DUMPCORE_COMPRESS);
  
     if ( get_guest_width(xch, domid, &dinfo->guest_width) != 0 )
     {
@@ -485,10 +844,27 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     }
 
     xc_core_arch_context_init(&arch_ctxt);
-    if ( (dump_mem_start = malloc(DUMP_INCREMENT*PAGE_SIZE)) == NULL )
+    dp.xch = xch;
+    dp.args = args;
+    dp.dump_rtn = dump_rtn;
+    dp.flags = flags;
+    if ( compress )
     {
-        PERROR("Could not allocate dump_mem");
-        goto out;
+        dp.zpool = dump_zpool_init(xch);
+        if ( dp.zpool == NULL )
+            goto out;
+        dp.buf = dp.zpool->slots[0].in;
+    }
+    else
+    {
+        if ( posix_memalign((void **)&dump_mem_start, PAGE_SIZE,
+                            DUMP_INCREMENT * PAGE_SIZE) )
+        {
+            dump_mem_start = NULL;
+            PERROR("Could not allocate dump_mem");
+            goto out;
+        }
+        dp.buf = dump_mem_start;
     }
 
     if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 )
@@ -687,8 +1063,12 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     for ( i = 1; i < sheaders->num; i++ )
         sheaders->shdrs[i].sh_offset += fixup;
     offset += fixup;
-    dummy_len = ROUNDUP(offset, PAGE_SHIFT) - offset; /* padding length */
-    offset += dummy_len;
+    dummy_len = 0;
+    if ( !compress )
+    {
+        dummy_len = ROUNDUP(offset, PAGE_SHIFT) - offset; /* padding length */
+        offset += dummy_len;
+    }
 
     /* pages */
     shdr = xc_core_shdr_get(xch,sheaders);
@@ -697,12 +1077,21 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         PERROR("could not get section headers for .xen_pages");
         goto out;
     }
-    filesz = (uint64_t)nr_pages * PAGE_SIZE;
-    sts = xc_core_shdr_set(xch, shdr, strtab, XEN_DUMPCORE_SEC_PAGES, SHT_PROGBITS,
-                           offset, filesz, PAGE_SIZE, PAGE_SIZE);
+    pages_idx = shdr - sheaders->shdrs;
+    if ( !compress )
+    {
+        filesz = (uint64_t)nr_pages * PAGE_SIZE;
+        sts = xc_core_shdr_set(xch, shdr, strtab, XEN_DUMPCORE_SEC_PAGES,
+                               SHT_PROGBITS, offset, filesz,
+                               PAGE_SIZE, PAGE_SIZE);
+        offset += filesz;
+    }
+    else
+        /* offset and size are filled in below and after the dump. */
+        sts = xc_core_shdr_set(xch, shdr, strtab, XEN_DUMPCORE_SEC_PAGES_ZLIB,
+                               SHT_PROGBITS, 0, 0, PAGE_SIZE, 0);
     if ( sts != 0 )
         goto out;
-    offset += filesz;
 
     /* p2m/pfn table */
     shdr = xc_core_shdr_get(xch,sheaders);
@@ -711,6 +1100,7 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         PERROR("Could not get section header for .xen_{p2m, pfn} table");
         goto out;
     }
+    p2m_idx = shdr - sheaders->shdrs;
     if ( !auto_translated_physmap )
     {
         filesz = (uint64_t)nr_pages * sizeof(p2m_array[0]);
@@ -736,6 +1126,18 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     sheaders->shdrs[strtab_idx].sh_offset = offset;
     sheaders->shdrs[strtab_idx].sh_size = filesz;
 
+    /*
+     * The size of the compressed pages is only known once they have been
+     * written, so they go last, after the string table.
+     */
+    if ( compress )
+    {
+        offset += filesz;
+        dummy_len = ROUNDUP(offset, PAGE_SHIFT) - offset;
+        offset += dummy_len;
+        sheaders->shdrs[pages_idx].sh_offset = offset;
+    }
+
     /* write out elf header */
     ehdr.e_shnum = sheaders->num;
     ehdr.e_shstrndx = strtab_idx;
@@ -788,6 +1190,23 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     if ( sts != 0 )
         goto out;
 
+    if ( compress )
+    {
+        /*
+         * The p2m/pfn table is only complete once the pages have been
+         * walked: leave room for it, to be filled in at the end.
+         */
+        p2m_offset = sheaders->shdrs[p2m_idx].sh_offset;
+        sts = dump_hole(&dp, sheaders->shdrs[p2m_idx].sh_size);
+        if ( sts != 0 )
+            goto out;
+
+        /* elf section header string table: .shstrtab */
+        sts = dump_rtn(xch, args, strtab->strings, strtab->length);
+        if ( sts != 0 )
+            goto out;
+    }
+
     /* Pad the output data to page alignment. */
     memset(dummy, 0, PAGE_SIZE);
     sts = dump_rtn(xch, args, dummy, dummy_len);
@@ -796,7 +1215,7 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
 
     /* dump pages: .xen_pages */
     j = 0;
-    dump_mem = dump_mem_start;
+    nr_batch = 0;
     for ( map_idx = 0; map_idx < nr_memory_map; map_idx++ )
     {
         uint64_t pfn_start;
@@ -804,21 +1223,51 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
 
         pfn_start = memory_map[map_idx].addr >> PAGE_SHIFT;
         pfn_end = pfn_start + (memory_map[map_idx].size >> PAGE_SHIFT);
-        for ( i = pfn_start; i < pfn_end; i++ )
+        for ( i = pfn_start; i < pfn_end + 1; i++ )
         {
             uint64_t gmfn;
-            void *vaddr;
-            
-            if ( j >= nr_pages )
+
+            /*
+             * Map and copy the batch once it is full, at the end of the
+             * range or when it would take us past nr_pages.  Pages which
+             * cannot be mapped are skipped and do not take up a slot.
+             */
+            if ( nr_batch &&
+                 (i == pfn_end || nr_batch == DUMP_MAP_BATCH ||
+                  j + nr_batch >= nr_pages) )
             {
-                /*
-                 * When live dump-mode (-L option) is specified,
-                 * guest domain may increase memory.
-                 */
-                IPRINTF("exceeded nr_pages (%ld) losing pages", nr_pages);
-                goto copy_done;
+                batch_mem = xc_map_foreign_bulk(xch, domid, PROT_READ,
+                                                batch_gmfn, batch_err,
+                                                nr_batch);
+                for ( k = 0; batch_mem != NULL && k < nr_batch; k++ )
+                {
+                    if ( batch_err[k] )
+                        continue;
+
+                    if ( !auto_translated_physmap )
+                    {
+                        p2m_array[j].pfn = batch_pfn[k];
+                        p2m_array[j].gmfn = batch_gmfn[k];
+                    }
+                    else
+                        pfn_array[j] = batch_pfn[k];
+
+                    sts = dump_pages_add(&dp, batch_mem + k * PAGE_SIZE);
+                    if ( sts != 0 )
+                    {
+                        munmap(batch_mem, nr_batch * PAGE_SIZE);
+                        goto out;
+                    }
+                    j++;
+                }
+                if ( batch_mem != NULL )
+                    munmap(batch_mem, nr_batch * PAGE_SIZE);
+                nr_batch = 0;
             }
 
+            if ( i == pfn_end )
+                break;
+
             if ( !auto_translated_physmap )
             {
                 if ( dinfo->guest_width >= sizeof(unsigned long) )
@@ -836,9 +1285,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     if ( gmfn == (uint32_t)INVALID_P2M_ENTRY )
                        continue;
                 }
-
-                p2m_array[j].pfn = i;
-                p2m_array[j].gmfn = gmfn;
             }
             else
             {
@@ -846,42 +1292,34 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     continue;
 
                 gmfn = i;
-                pfn_array[j] = i;
             }
 
-            vaddr = xc_map_foreign_range(
-                xch, domid, PAGE_SIZE, PROT_READ, gmfn);
-            if ( vaddr == NULL )
-                continue;
-            memcpy(dump_mem, vaddr, PAGE_SIZE);
-            munmap(vaddr, PAGE_SIZE);
-            dump_mem += PAGE_SIZE;
-            if ( (j + 1) % DUMP_INCREMENT == 0 )
+            if ( j >= nr_pages )
             {
-                sts = dump_rtn(
-                    xch, args, dump_mem_start, dump_mem - dump_mem_start);
-                if ( sts != 0 )
-                    goto out;
-                dump_mem = dump_mem_start;
+                /*
+                 * When live dump-mode (-L option) is specified,
+                 * guest domain may increase memory.
+                 */
+                IPRINTF("exceeded nr_pages (%ld) losing pages", nr_pages);
+                goto copy_done;
             }
 
-            j++;
+            batch_pfn[nr_batch] = i;
+            batch_gmfn[nr_batch] = gmfn;
+            nr_batch++;
         }
     }
 
 copy_done:
-    sts = dump_rtn(xch, args, dump_mem_start, dump_mem - dump_mem_start);
-    if ( sts != 0 )
-        goto out;
     if ( j < nr_pages )
     {
         /* When live dump-mode (-L option) is specified,
          * guest domain may reduce memory. pad with zero pages.
          */
         IPRINTF("j (%ld) != nr_pages (%ld)", j, nr_pages);
-        memset(dump_mem_start, 0, PAGE_SIZE);
+        memset(dummy, 0, PAGE_SIZE);
         for (; j < nr_pages; j++) {
-            sts = dump_rtn(xch, args, dump_mem_start, PAGE_SIZE);
+            sts = dump_pages_add(&dp, dummy);
             if ( sts != 0 )
                 goto out;
             if ( !auto_translated_physmap )
@@ -893,6 +1331,33 @@ copy_done:
                 pfn_array[j] = XC_CORE_INVALID_PFN;
         }
     }
+    sts = dump_pages_flush(&dp);
+    if ( sts != 0 )
+        goto out;
+
+    if ( compress )
+    {
+        /* p2m/pfn table: .xen_p2m/.xen_pfn */
+        if ( !auto_translated_physmap )
+            sts = fixup_rtn(xch, args, p2m_offset, (char *)p2m_array,
+                            sizeof(p2m_array[0]) * nr_pages);
+        else
+            sts = fixup_rtn(xch, args, p2m_offset, (char *)pfn_array,
+                            sizeof(pfn_array[0]) * nr_pages);
+        if ( sts != 0 )
+            goto out;
+
+        /* .xen_pages_zlib section header, now that its size is known */
+        sheaders->shdrs[pages_idx].sh_size = dp.zsize;
+        sts = fixup_rtn(xch, args,
+                        ehdr.e_shoff + pages_idx * sizeof(*shdr),
+                        (char *)&sheaders->shdrs[pages_idx], sizeof(*shdr));
+        if ( sts != 0 )
+            goto out;
+
+        sts = 0;
+        goto out;
+    }
 
     /* p2m/pfn table: .xen_p2m/.xen_pfn */
     if ( !auto_translated_physmap )
@@ -928,6 +1393,8 @@ out:
         free(ctxt);
     if ( dump_mem_start != NULL )
         free(dump_mem_start);
+    if ( dp.zpool != NULL )
+        dump_zpool_free(dp.zpool);
     if ( live_shinfo != NULL )
         munmap(live_shinfo, PAGE_SIZE);
     xc_core_arch_context_free(&arch_ctxt);
@@ -935,9 +1402,19 @@ out:
     return sts;
 }
 
+int
+xc_domain_dumpcore_via_callback(xc_interface *xch,
+                                uint32_t domid,
+                                void *args,
+                                dumpcore_rtn_t dump_rtn)
+{
+    return dumpcore(xch, domid, args, dump_rtn, NULL, 0);
+}
+
 /* Callback args for writing to a local dump file. */
 struct dump_args {
-    int     fd;
+    int             fd;
+    unsigned long   unflushed;  /* bytes written since the last discard */
 };
 
 /* Callback routine for writing to a local dump file. */
@@ -946,28 +1423,68 @@ static int local_file_dump(xc_interface *xch,
 {
     struct dump_args *da = args;
 
+    /* A NULL buffer is a run of zeroes: leave a hole in the file. */
+    if ( buffer == NULL )
+    {
+        if ( lseek(da->fd, length, SEEK_CUR) == (off_t)-1 )
+        {
+            PERROR("Failed to seek over a hole");
+            return -errno;
+        }
+        return 0;
+    }
+
     if ( write_exact(da->fd, buffer, length) == -1 )
     {
         PERROR("Failed to write buffer");
         return -errno;
     }
 
-    if ( length >= (DUMP_INCREMENT * PAGE_SIZE) )
+    da->unflushed += length;
+    if ( da->unflushed >= (DUMP_INCREMENT * PAGE_SIZE) )
     {
         // Now dumping pages -- make sure we discard clean pages from
         // the cache after each write
         discard_file_cache(xch, da->fd, 0 /* no flush */);
+        da->unflushed = 0;
+    }
+
+    return 0;
+}
+
+/* Fixup routine for a local dump file. */
+static int local_file_fixup(xc_interface *xch, void *args,
+                            uint64_t offset, char *buffer, size_t length)
+{
+    struct dump_args *da = args;
+    ssize_t len;
+
+    while ( length )
+    {
+        len = pwrite(da->fd, buffer, length, offset);
+        if ( len < 0 && errno == EINTR )
+            continue;
+        if ( len <= 0 )
+        {
+            PERROR("Failed to rewrite dump at offset %llu",
+                   (unsigned long long)offset);
+            return -errno;
+        }
+        buffer += len;
+        offset += len;
+        length -= len;
     }
 
     return 0;
 }
 
 int
-xc_domain_dumpcore(xc_interface *xch,
-                   uint32_t domid,
-                   const char *corename)
+xc_domain_dumpcore_flags(xc_interface *xch,
+                         uint32_t domid,
+                         const char *corename,
+                         unsigned int flags)
 {
-    struct dump_args da;
+    struct dump_args da = { .unflushed = 0 };
     int sts;
 
     if ( (da.fd = open(corename, O_CREAT|O_RDWR|O_TRUNC, S_IWUSR|S_IRUSR)) < 0 )
@@ -976,8 +1493,8 @@ xc_domain_dumpcore(xc_interface *xch,
         return -errno;
     }
 
-    sts = xc_domain_dumpcore_via_callback(
-        xch, domid, &da, &local_file_dump);
+    sts = dumpcore(xch, domid, &da, &local_file_dump, &local_file_fixup,
+                   flags);
 
     /* flush and discard any remaining portion of the file from cache */
     discard_file_cache(xch, da.fd, 1/* flush first*/);
@@ -987,6 +1504,14 @@ xc_domain_dumpcore(xc_interface *xch,
     return sts;
 }
 
+int
+xc_domain_dumpcore(xc_interface *xch,
+                   uint32_t domid,
+                   const char *corename)
+{
+    return xc_domain_dumpcore_flags(xch, domid, corename, 0);
+}
+
 /*
  * Local variables:
  * mode: C
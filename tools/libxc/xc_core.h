@@ -32,6 +32,7 @@
 #define XEN_DUMPCORE_SEC_P2M                    ".xen_p2m"
 #define XEN_DUMPCORE_SEC_PFN                    ".xen_pfn"
 #define XEN_DUMPCORE_SEC_PAGES                  ".xen_pages"
+#define XEN_DUMPCORE_SEC_PAGES_ZLIB             ".xen_pages_zlib"
 
 /* elf note name */
 #define XEN_DUMPCORE_ELFNOTE_NAME               "Xen"
@@ -112,6 +113,16 @@ struct xen_dumpcore_p2m {
     uint64_t    gmfn;
 };
 
+/*
+ * .xen_pages_zlib replaces .xen_pages in a compressed dump.  It holds the
+ * same pages in the same order, as a sequence of blocks each made of this
+ * header followed by zlen bytes of zlib data inflating to nr_pages pages.
+ */
+struct xen_dumpcore_zblock {
+    uint32_t    nr_pages;
+    uint32_t    zlen;
+};
+
 
 struct xc_core_strtab;
 struct xc_core_section_headers;
@@ -299,6 +299,46 @@ int xc_set_broken_page_p2m(xc_interface *xch,
     return ret ? -1 : 0;
 }
 
+int xc_domain_transfer_pages(xc_interface *xch,
+                             uint32_t source,
+                             uint32_t target,
+                             unsigned int nr,
+                             uint64_t *gfns,
+                             int *errs)
+{
+    int ret;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(gfns, nr * sizeof(*gfns), XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    DECLARE_HYPERCALL_BOUNCE(errs, nr * sizeof(*errs), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, gfns) ||
+         xc_hypercall_bounce_pre(xch, errs) )
+    {
+        PERROR("Could not bounce buffers for page transfer");
+        ret = -1;
+        goto out;
+    }
+
+    domctl.cmd = XEN_DOMCTL_transfer_pages;
+    domctl.domain = (domid_t)source;
+    domctl.u.transfer_pages.target = (domid_t)target;
+    domctl.u.transfer_pages.nr = nr;
+    domctl.u.transfer_pages.done = 0;
+    set_xen_guest_handle(domctl.u.transfer_pages.gfns, gfns);
+    set_xen_guest_handle(domctl.u.transfer_pages.errs, errs);
+
+    /* Xen returns early when it wants to preempt: pick up where it left. */
+    do {
+        ret = do_domctl(xch, &domctl);
+    } while ( (ret == 0) && (domctl.u.transfer_pages.done < nr) );
+
+ out:
+    xc_hypercall_bounce_post(xch, gfns);
+    xc_hypercall_bounce_post(xch, errs);
+
+    return ret ? -1 : 0;
+}
+
 /* get info from hvm guest for save */
 int xc_domain_hvm_getcontext(xc_interface *xch,
                              uint32_t domid,
@@ -470,6 +510,41 @@ int xc_shadow_control(xc_interface *xch,
     return (rc == 0) ? domctl.u.shadow_op.pages : rc;
 }
 
+int xc_shadow_control_list(xc_interface *xch,
+                           uint32_t domid,
+                           unsigned int sop,
+                           xc_hypercall_buffer_t *dirty_list,
+                           unsigned long entries,
+                           uint64_t *cursor,
+                           xc_shadow_op_stats_t *stats)
+{
+    int rc;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(dirty_list);
+
+    memset(&domctl, 0, sizeof(domctl));
+
+    domctl.cmd = XEN_DOMCTL_shadow_op;
+    domctl.domain = (domid_t)domid;
+    domctl.u.shadow_op.op     = sop;
+    domctl.u.shadow_op.pages  = entries;
+    domctl.u.shadow_op.cursor = *cursor;
+    set_xen_guest_handle(domctl.u.shadow_op.dirty_list, dirty_list);
+
+    rc = do_domctl(xch, &domctl);
+    if ( rc < 0 )
+        return rc;
+
+    /* Statistics are only gathered when a round starts. */
+    if ( stats && (*cursor == 0) )
+        memcpy(stats, &domctl.u.shadow_op.stats,
+               sizeof(xc_shadow_op_stats_t));
+
+    *cursor = domctl.u.shadow_op.cursor;
+
+    return domctl.u.shadow_op.pages;
+}
+
 int xc_domain_setmaxmem(xc_interface *xch,
                         uint32_t domid,
                         unsigned int max_memkb)
@@ -0,0 +1,379 @@
+/******************************************************************************
+ * xc_domain_fork.c
+ *
+ * Create a domain as a copy-on-write clone of a paused HVM template.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * The memory of the template is added to the physmap of the new domain
+ * with XENMEM_sharing_op_range_add_physmap, a chunk at a time.  Pages which
+ * cannot be shared (mapped by the device model, ...) are copied instead.
+ * The communication pages get fresh, zeroed pages, exactly as on restore,
+ * and the mem_event rings private copies.  Then the HVM context, the TSC
+ * settings and the HVM params are copied over.
+ */
+
+#include <inttypes.h>
+
+#include "xg_private.h"
+#include "xc_dom.h"
+
+#include <xen/hvm/params.h>
+#include <xen/mem_event.h>
+
+#define FORK_CHUNK 1024
+
+/* Params copied verbatim, the same ones a save image carries */
+static const int fork_params[] = {
+    HVM_PARAM_IDENT_PT,
+    HVM_PARAM_VM86_TSS,
+    HVM_PARAM_ACPI_IOPORTS_LOCATION,
+    HVM_PARAM_VIRIDIAN,
+    HVM_PARAM_PAE_ENABLED,
+    HVM_PARAM_PAGING_RING_PFN,
+    HVM_PARAM_ACCESS_RING_PFN,
+    HVM_PARAM_SHARING_RING_PFN,
+    HVM_PARAM_MEM_EVENT_RING_PAGES,
+    HVM_PARAM_IOREQ_PFN,
+    HVM_PARAM_BUFIOREQ_PFN,
+    HVM_PARAM_STORE_PFN,
+    HVM_PARAM_CONSOLE_PFN,
+};
+
+/* Pages which start zeroed, as after a restore */
+static const int fork_zeroed[] = {
+    HVM_PARAM_IOREQ_PFN,
+    HVM_PARAM_BUFIOREQ_PFN,
+    HVM_PARAM_STORE_PFN,
+    HVM_PARAM_CONSOLE_PFN,
+};
+
+/* Rings of HVM_PARAM_MEM_EVENT_RING_PAGES pages each, copied privately */
+static const int fork_rings[] = {
+    HVM_PARAM_PAGING_RING_PFN,
+    HVM_PARAM_ACCESS_RING_PFN,
+    HVM_PARAM_SHARING_RING_PFN,
+};
+
+/*
+ * Give the new domain private copies of the template gfns in pfns[].
+ * Gfns the template does not have are left alone.  Without a template
+ * (tdom < 0) the copies are zeroed instead.
+ */
+static int fork_copy_pages(xc_interface *xch, int tdom, uint32_t dom,
+                           xen_pfn_t *pfns, unsigned int nr)
+{
+    int *err = NULL;
+    unsigned int *src_idx = NULL;
+    char *src = NULL, *dst = NULL;
+    unsigned int i, n = 0;
+    int rc = -1;
+
+    err = malloc(nr * sizeof(*err));
+    src_idx = malloc(nr * sizeof(*src_idx));
+    if ( !err || !src_idx )
+        goto out;
+
+    if ( tdom >= 0 )
+    {
+        src = xc_map_foreign_bulk(xch, tdom, PROT_READ, pfns, err, nr);
+        if ( !src )
+            goto out;
+        /* Squeeze out the gfns the template does not have, noting where
+         * the others are in the (read only) template mapping. */
+        for ( i = 0; i < nr; i++ )
+        {
+            if ( err[i] )
+                continue;
+            pfns[n] = pfns[i];
+            src_idx[n++] = i;
+        }
+    }
+    else
+        n = nr;
+
+    rc = 0;
+    if ( !n )
+        goto out;
+
+    rc = xc_domain_populate_physmap_exact(xch, dom, n, 0, 0, pfns);
+    if ( rc )
+    {
+        PERROR("Failed to populate %u pages of dom%u", n, dom);
+        goto out;
+    }
+
+    rc = -1;
+    dst = xc_map_foreign_bulk(xch, dom, PROT_READ | PROT_WRITE, pfns, err, n);
+    if ( !dst )
+        goto out;
+    for ( i = 0; i < n; i++ )
+    {
+        if ( err[i] )
+        {
+            ERROR("Failed to map gfn %"PRI_xen_pfn" of dom%u", pfns[i], dom);
+            goto out;
+        }
+        if ( src )
+            memcpy(dst + i * PAGE_SIZE, src + src_idx[i] * PAGE_SIZE,
+                   PAGE_SIZE);
+        else
+            memset(dst + i * PAGE_SIZE, 0, PAGE_SIZE);
+    }
+    rc = 0;
+
+ out:
+    if ( dst )
+        munmap(dst, n * PAGE_SIZE);
+    if ( src )
+        munmap(src, nr * PAGE_SIZE);
+    free(src_idx);
+    free(err);
+    return rc;
+}
+
+/* Private pages for the comms pages and rings, before anything is shared */
+static int fork_special_pages(xc_interface *xch, uint32_t tdom, uint32_t dom)
+{
+    xen_pfn_t pfns[MEM_EVENT_RING_MAX_PAGES];
+    unsigned long pfn, nr_ring_pages = 0;
+    unsigned int i, j;
+
+    xc_get_hvm_param(xch, tdom, HVM_PARAM_MEM_EVENT_RING_PAGES,
+                     &nr_ring_pages);
+    if ( nr_ring_pages == 0 )
+        nr_ring_pages = 1;
+    if ( nr_ring_pages > MEM_EVENT_RING_MAX_PAGES )
+        nr_ring_pages = MEM_EVENT_RING_MAX_PAGES;
+
+    for ( i = 0; i < sizeof(fork_zeroed) / sizeof(fork_zeroed[0]); i++ )
+    {
+        if ( xc_get_hvm_param(xch, tdom, fork_zeroed[i], &pfn) || !pfn )
+            continue;
+        pfns[0] = pfn;
+        if ( fork_copy_pages(xch, -1, dom, pfns, 1) )
+            return -1;
+    }
+
+    for ( i = 0; i < sizeof(fork_rings) / sizeof(fork_rings[0]); i++ )
+    {
+        if ( xc_get_hvm_param(xch, tdom, fork_rings[i], &pfn) || !pfn )
+            continue;
+        for ( j = 0; j < nr_ring_pages; j++ )
+            pfns[j] = pfn + j;
+        if ( fork_copy_pages(xch, tdom, dom, pfns, nr_ring_pages) )
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Copy the gfns of a chunk which could not be shared */
+static int fork_fill_holes(xc_interface *xch, uint32_t tdom, uint32_t dom,
+                           unsigned long first, unsigned int nr)
+{
+    xen_pfn_t pfns[FORK_CHUNK];
+    int err[FORK_CHUNK];
+    unsigned int i, n = 0;
+    void *map;
+
+    if ( nr == 0 )
+        return 0;
+
+    for ( i = 0; i < nr; i++ )
+        pfns[i] = first + i;
+
+    map = xc_map_foreign_bulk(xch, dom, PROT_READ, pfns, err, nr);
+    if ( !map )
+        return -1;
+    munmap(map, nr * PAGE_SIZE);
+
+    for ( i = 0; i < nr; i++ )
+        if ( err[i] )
+            pfns[n++] = first + i;
+
+    return n ? fork_copy_pages(xch, tdom, dom, pfns, n) : 0;
+}
+
+static int fork_memory(xc_interface *xch, uint32_t tdom, uint32_t dom)
+{
+    unsigned long first, last, max_gpfn;
+    uint64_t nr_shared;
+    unsigned int nr;
+    int rc;
+
+    rc = xc_domain_maximum_gpfn(xch, tdom);
+    if ( rc < 0 )
+        return -1;
+    max_gpfn = rc;
+
+    for ( first = 0; first <= max_gpfn; first += FORK_CHUNK )
+    {
+        last = first + FORK_CHUNK - 1;
+        if ( last > max_gpfn )
+            last = max_gpfn;
+        nr = last - first + 1;
+
+        if ( xc_memshr_range_add_physmap(xch, tdom, dom, first, last, first,
+                                         &nr_shared) )
+        {
+            PERROR("Failed to share gfns %#lx-%#lx with dom%u",
+                   first, last, dom);
+            return -1;
+        }
+
+        if ( nr_shared < nr && fork_fill_holes(xch, tdom, dom, first, nr) )
+        {
+            PERROR("Failed to copy gfns %#lx-%#lx to dom%u", first, last, dom);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int xc_domain_fork(xc_interface *xch, uint32_t template_domid, uint32_t dom,
+                   unsigned int store_evtchn, unsigned long *store_mfn,
+                   domid_t store_domid, unsigned long *console_mfn,
+                   domid_t console_domid)
+{
+    xc_dominfo_t tinfo, info;
+    uint8_t *hvm_buf = NULL;
+    int hvm_size;
+    uint32_t tsc_mode, gtsc_khz, incarnation;
+    uint64_t elapsed_nsec;
+    unsigned long value, store_pfn = 0, console_pfn = 0;
+    unsigned int i;
+    int rc = -1;
+
+    if ( xc_domain_getinfo(xch, template_domid, 1, &tinfo) != 1 ||
+         tinfo.domid != template_domid ||
+         xc_domain_getinfo(xch, dom, 1, &info) != 1 || info.domid != dom )
+    {
+        ERROR("Could not get info on dom%u or dom%u", template_domid, dom);
+        return -1;
+    }
+
+    if ( !tinfo.hvm || !info.hvm )
+    {
+        ERROR("Only HVM domains can be forked");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( !tinfo.paused && !tinfo.shutdown )
+    {
+        ERROR("Template dom%u must be paused", template_domid);
+        errno = EBUSY;
+        return -1;
+    }
+
+    if ( tinfo.max_vcpu_id > info.max_vcpu_id )
+    {
+        ERROR("dom%u has fewer vcpus than template dom%u", dom, template_domid);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( xc_memshr_control(xch, template_domid, 1) ||
+         xc_memshr_control(xch, dom, 1) )
+    {
+        PERROR("Could not enable sharing");
+        return -1;
+    }
+
+    if ( fork_special_pages(xch, template_domid, dom) ||
+         fork_memory(xch, template_domid, dom) )
+        goto out;
+
+    for ( i = 0; i < sizeof(fork_params) / sizeof(fork_params[0]); i++ )
+    {
+        if ( xc_get_hvm_param(xch, template_domid, fork_params[i], &value) )
+        {
+            PERROR("Could not get HVM param %d", fork_params[i]);
+            goto out;
+        }
+        if ( fork_params[i] == HVM_PARAM_STORE_PFN )
+            store_pfn = value;
+        else if ( fork_params[i] == HVM_PARAM_CONSOLE_PFN )
+            console_pfn = value;
+        if ( value && xc_set_hvm_param(xch, dom, fork_params[i], value) )
+        {
+            PERROR("Could not set HVM param %d", fork_params[i]);
+            goto out;
+        }
+    }
+
+    if ( xc_set_hvm_param(xch, dom, HVM_PARAM_STORE_EVTCHN, store_evtchn) )
+    {
+        PERROR("Could not set the store event channel");
+        goto out;
+    }
+    *store_mfn = store_pfn;
+    *console_mfn = console_pfn;
+
+    if ( xc_domain_get_tsc_info(xch, template_domid, &tsc_mode, &elapsed_nsec,
+                                &gtsc_khz, &incarnation) ||
+         xc_domain_set_tsc_info(xch, dom, tsc_mode, elapsed_nsec, gtsc_khz,
+                                incarnation) )
+    {
+        PERROR("Could not copy the TSC settings");
+        goto out;
+    }
+
+    hvm_size = xc_domain_hvm_getcontext(xch, template_domid, NULL, 0);
+    if ( hvm_size <= 0 )
+    {
+        PERROR("Could not get the HVM context size");
+        goto out;
+    }
+    hvm_buf = malloc(hvm_size);
+    if ( !hvm_buf )
+        goto out;
+    hvm_size = xc_domain_hvm_getcontext(xch, template_domid, hvm_buf,
+                                        hvm_size);
+    if ( hvm_size <= 0 ||
+         xc_domain_hvm_setcontext(xch, dom, hvm_buf, hvm_size) )
+    {
+        PERROR("Could not copy the HVM context");
+        goto out;
+    }
+
+    if ( xc_dom_gnttab_hvm_seed(xch, dom, console_pfn, store_pfn,
+                                console_domid, store_domid) )
+    {
+        ERROR("Could not seed the grant table");
+        goto out;
+    }
+
+    DPRINTF("dom%u forked from dom%u\n", dom, template_domid);
+    rc = 0;
+
+ out:
+    free(hvm_buf);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-set-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -38,6 +38,8 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <inttypes.h>
+#include <zlib.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
@@ -60,14 +62,26 @@ struct restore_ctx {
     int completed; /* Set when a consistent image is available */
     int last_checkpoint; /* Set when we should commit to the current checkpoint when it completes. */
     int compressing; /* Set when sender signals that pages would be sent compressed (for Remus) */
+    int local; /* Same-host migration: pages are taken from local_src */
+    uint32_t local_src; /* The suspended domain the pages are taken from */
+    unsigned long local_moved, local_copied; /* Stats for local migration */
+    struct {
+        int enabled;        /* The stream is framed as records */
+        int raw;            /* Past the END record of the current checkpoint */
+        uint32_t type;      /* Type of the current record */
+        uint32_t flags;     /* XC_SR_RFLAG_* of the current record */
+        uint64_t length;    /* Body length of the current record */
+        uint64_t remaining; /* Body bytes not yet consumed */
+        uint32_t crc;       /* Running CRC32 of the consumed body */
+    } rec;
     struct domain_info_context dinfo;
 };
 
 #define HEARTBEAT_MS 1000
 
 #ifndef __MINIOS__
-static ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
-                       int fd, void* buf, size_t size)
+static ssize_t rdexact_fd(xc_interface *xch, struct restore_ctx *ctx,
+                          int fd, void* buf, size_t size)
 {
     size_t offset = 0;
     ssize_t len;
@@ -110,11 +124,282 @@ static ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
     return 0;
 }
 
-#define RDEXACT(fd,buf,size) rdexact(xch, ctx, fd, buf, size)
+#define RDEXACT_FD(fd,buf,size) rdexact_fd(xch, ctx, fd, buf, size)
 #else
-#define RDEXACT read_exact
+#define RDEXACT_FD(fd,buf,size) read_exact(fd, buf, size)
 #endif
 
+/*
+ * Record stream support.  Records are consumed as they arrive rather than
+ * being buffered whole: the body is handed to the legacy parser through
+ * rdexact(), and the padding and checksum are checked as soon as the last
+ * body byte has been read, i.e. before anything from the record is applied
+ * to the domain.
+ */
+static int rec_finish(xc_interface *xch, struct restore_ctx *ctx, int fd)
+{
+    uint8_t pad[XC_SR_ALIGN];
+    struct xc_sr_rtrl rtrl;
+
+    if ( RDEXACT_FD(fd, pad, XC_SR_PAD(ctx->rec.length)) )
+    {
+        PERROR("Error reading record padding");
+        return -1;
+    }
+
+    if ( !(ctx->rec.flags & XC_SR_RFLAG_CSUM) )
+        return 0;
+
+    if ( RDEXACT_FD(fd, &rtrl, sizeof(rtrl)) )
+    {
+        PERROR("Error reading record trailer");
+        return -1;
+    }
+
+    if ( rtrl.csum != ctx->rec.crc )
+    {
+        ERROR("Checksum mismatch in record type %#x length %"PRIu64
+              " (got %#x, expected %#x)", ctx->rec.type, ctx->rec.length,
+              ctx->rec.crc, rtrl.csum);
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int rec_read(xc_interface *xch, struct restore_ctx *ctx,
+                    int fd, void *buf, size_t size)
+{
+    if ( size > ctx->rec.remaining )
+    {
+        ERROR("Read of %zu bytes overruns record type %#x", size,
+              ctx->rec.type);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( RDEXACT_FD(fd, buf, size) )
+        return -1;
+
+    if ( ctx->rec.flags & XC_SR_RFLAG_CSUM )
+        ctx->rec.crc = crc32(ctx->rec.crc, buf, size);
+    ctx->rec.remaining -= size;
+
+    return ctx->rec.remaining ? 0 : rec_finish(xch, ctx, fd);
+}
+
+/* Read the next record header, skipping optional records we don't know. */
+static int rec_next(xc_interface *xch, struct restore_ctx *ctx, int fd)
+{
+    struct xc_sr_rhdr rhdr;
+    uint8_t scratch[PAGE_SIZE];
+    size_t n;
+
+    for ( ; ; )
+    {
+        if ( RDEXACT_FD(fd, &rhdr, sizeof(rhdr)) )
+        {
+            PERROR("Error reading record header");
+            return -1;
+        }
+
+        if ( rhdr.length > XC_SR_MAX_RECORD )
+        {
+            ERROR("Record type %#x too long (%"PRIu64" bytes)",
+                  rhdr.type, rhdr.length);
+            errno = EINVAL;
+            return -1;
+        }
+
+        ctx->rec.type = rhdr.type;
+        ctx->rec.flags = rhdr.flags;
+        ctx->rec.length = ctx->rec.remaining = rhdr.length;
+        ctx->rec.crc = crc32(0L, Z_NULL, 0);
+
+        switch ( rhdr.type )
+        {
+        case XC_SR_REC_P2M_FRAMES:
+        case XC_SR_REC_PAGE_DATA:
+        case XC_SR_REC_CHUNK:
+        case XC_SR_REC_VCPU_CONTEXT:
+        case XC_SR_REC_HVM_CONTEXT:
+        case XC_SR_REC_TAIL_DATA:
+            if ( ctx->rec.remaining )
+                return 0;
+            if ( rec_finish(xch, ctx, fd) )
+                return -1;
+            continue;
+
+        case XC_SR_REC_END:
+            break;
+
+        default:
+            if ( !(rhdr.type & XC_SR_REC_OPTIONAL) )
+            {
+                ERROR("Unknown record type %#x", rhdr.type);
+                errno = EINVAL;
+                return -1;
+            }
+            DPRINTF("Skipping optional record type %#x (%"PRIu64" bytes)\n",
+                    rhdr.type, rhdr.length);
+            break;
+        }
+
+        while ( ctx->rec.remaining )
+        {
+            n = MIN(ctx->rec.remaining, (uint64_t)sizeof(scratch));
+            if ( rec_read(xch, ctx, fd, scratch, n) )
+                return -1;
+        }
+        if ( !rhdr.length && rec_finish(xch, ctx, fd) )
+            return -1;
+
+        if ( rhdr.type == XC_SR_REC_END )
+        {
+            ctx->rec.raw = 1;
+            return 0;
+        }
+    }
+}
+
+static int rdexact(xc_interface *xch, struct restore_ctx *ctx,
+                   int fd, void *buf, size_t size)
+{
+    size_t n;
+
+    if ( !ctx->rec.enabled || ctx->rec.raw )
+        return RDEXACT_FD(fd, buf, size);
+
+    while ( size )
+    {
+        if ( !ctx->rec.remaining )
+        {
+            if ( rec_next(xch, ctx, fd) )
+                return -1;
+            /* Anything after the END record is unframed. */
+            if ( ctx->rec.raw )
+                return RDEXACT_FD(fd, buf, size);
+        }
+
+        n = MIN(size, ctx->rec.remaining);
+        if ( rec_read(xch, ctx, fd, buf, n) )
+            return -1;
+        buf = (uint8_t *)buf + n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+#define RDEXACT(fd,buf,size) rdexact(xch, ctx, fd, buf, size)
+
+/*
+ * Read the start of the stream.  A record stream opens with a header whose
+ * first word can never be the low half of a legacy p2m_size; for a legacy
+ * stream that word is the start of p2m_size itself.
+ */
+static int read_stream_start(xc_interface *xch, struct restore_ctx *ctx,
+                             int fd, unsigned long *p2m_size)
+{
+    struct xc_sr_hdr hdr;
+
+    if ( RDEXACT_FD(fd, &hdr.marker, sizeof(hdr.marker)) )
+        return -1;
+
+    if ( hdr.marker != XC_SR_MARKER )
+    {
+        memcpy(p2m_size, &hdr.marker, sizeof(hdr.marker));
+        return RDEXACT_FD(fd, (uint8_t *)p2m_size + sizeof(hdr.marker),
+                          sizeof(*p2m_size) - sizeof(hdr.marker));
+    }
+
+    if ( RDEXACT_FD(fd, &hdr.id, sizeof(hdr) - sizeof(hdr.marker)) )
+        return -1;
+
+    if ( hdr.id != XC_SR_ID || hdr.version != XC_SR_VERSION )
+    {
+        ERROR("Unsupported record stream (id %#x, version %u)",
+              hdr.id, hdr.version);
+        errno = EINVAL;
+        return -1;
+    }
+
+    DPRINTF("%s: record stream, version %u\n", __func__, hdr.version);
+    ctx->rec.enabled = 1;
+
+    return RDEXACT(fd, p2m_size, sizeof(*p2m_size));
+}
+
+/* Consume the END record which closes a checkpoint, if not already read. */
+static int rec_checkpoint_end(xc_interface *xch, struct restore_ctx *ctx,
+                              int fd)
+{
+    if ( !ctx->rec.enabled || ctx->rec.raw )
+        return 0;
+
+    if ( ctx->rec.remaining )
+    {
+        ERROR("%"PRIu64" unread bytes in record type %#x at end of checkpoint",
+              ctx->rec.remaining, ctx->rec.type);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( rec_next(xch, ctx, fd) )
+        return -1;
+
+    if ( !ctx->rec.raw )
+    {
+        ERROR("Expected END record, got type %#x", ctx->rec.type);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * xc_tmem_restore() and friends read straight from a file descriptor, so
+ * in a record stream the rest of the chunk is spooled to a temporary file.
+ */
+static int restore_tmem(xc_interface *xch, struct restore_ctx *ctx,
+                        uint32_t dom, int fd, int extra)
+{
+    uint8_t buf[PAGE_SIZE];
+    FILE *spool;
+    size_t n;
+    int rc = -1;
+
+    if ( !ctx->rec.enabled )
+        return extra ? xc_tmem_restore_extra(xch, dom, fd)
+                     : xc_tmem_restore(xch, dom, fd);
+
+    if ( !(spool = tmpfile()) )
+    {
+        PERROR("Couldn't create tmem spool file");
+        return -1;
+    }
+
+    while ( ctx->rec.remaining )
+    {
+        n = MIN(ctx->rec.remaining, (uint64_t)sizeof(buf));
+        if ( rec_read(xch, ctx, fd, buf, n) ||
+             write_exact(fileno(spool), buf, n) )
+            goto out;
+    }
+
+    if ( lseek(fileno(spool), 0, SEEK_SET) )
+        goto out;
+
+    rc = extra ? xc_tmem_restore_extra(xch, dom, fileno(spool))
+               : xc_tmem_restore(xch, dom, fileno(spool));
+
+ out:
+    fclose(spool);
+    return rc;
+}
+
 #define SUPERPAGE_PFN_SHIFT  9
 #define SUPERPAGE_NR_PFNS    (1UL << SUPERPAGE_PFN_SHIFT)
 #define SUPERPAGE(_pfn) ((_pfn) & (~(SUPERPAGE_NR_PFNS-1)))
@@ -668,14 +953,21 @@ static int buffer_tail(xc_interface *xch, struct restore_ctx *ctx,
                        uint64_t *vcpumap, int ext_vcpucontext,
                        int vcpuextstate, uint32_t vcpuextstate_size)
 {
+    int rc;
+
     if ( buf->ishvm )
-        return buffer_tail_hvm(xch, ctx, &buf->u.hvm, fd, max_vcpu_id, vcpumap,
-                               ext_vcpucontext, vcpuextstate,
-                               vcpuextstate_size);
+        rc = buffer_tail_hvm(xch, ctx, &buf->u.hvm, fd, max_vcpu_id, vcpumap,
+                             ext_vcpucontext, vcpuextstate,
+                             vcpuextstate_size);
     else
-        return buffer_tail_pv(xch, ctx, &buf->u.pv, fd, max_vcpu_id, vcpumap,
-                              ext_vcpucontext, vcpuextstate,
-                              vcpuextstate_size);
+        rc = buffer_tail_pv(xch, ctx, &buf->u.pv, fd, max_vcpu_id, vcpumap,
+                            ext_vcpucontext, vcpuextstate,
+                            vcpuextstate_size);
+
+    if ( rc == 0 )
+        rc = rec_checkpoint_end(xch, ctx, fd);
+
+    return rc;
 }
 
 static void tailbuf_free_hvm(struct tailbuf_hvm *buf)
@@ -736,6 +1028,7 @@ typedef struct {
     uint64_t paging_ring_pfn;
     uint64_t access_ring_pfn;
     uint64_t sharing_ring_pfn;
+    uint64_t ring_pages;
     uint64_t vm86_tss;
     uint64_t console_pfn;
     uint64_t acpi_ioport_location;
@@ -848,6 +1141,16 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         // DPRINTF("sharing ring pfn address: %llx\n", buf->sharing_ring_pfn);
         return pagebuf_get_one(xch, ctx, buf, fd, dom);
 
+    case XC_SAVE_ID_HVM_RING_PAGES:
+        /* Skip padding 4 bytes then read the mem event ring size. */
+        if ( RDEXACT(fd, &buf->ring_pages, sizeof(uint32_t)) ||
+             RDEXACT(fd, &buf->ring_pages, sizeof(uint64_t)) )
+        {
+            PERROR("error read the mem event ring size");
+            return -1;
+        }
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
     case XC_SAVE_ID_HVM_VM86_TSS:
         /* Skip padding 4 bytes then read the vm86 TSS location. */
         if ( RDEXACT(fd, &buf->vm86_tss, sizeof(uint32_t)) ||
@@ -861,14 +1164,14 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
 
     case XC_SAVE_ID_TMEM:
         DPRINTF("xc_domain_restore start tmem\n");
-        if ( xc_tmem_restore(xch, dom, fd) ) {
+        if ( restore_tmem(xch, ctx, dom, fd, 0) ) {
             PERROR("error reading/restoring tmem");
             return -1;
         }
         return pagebuf_get_one(xch, ctx, buf, fd, dom);
 
     case XC_SAVE_ID_TMEM_EXTRA:
-        if ( xc_tmem_restore_extra(xch, dom, fd) ) {
+        if ( restore_tmem(xch, ctx, dom, fd, 1) ) {
             PERROR("error reading/restoring tmem extra");
             return -1;
         }
@@ -900,6 +1203,21 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         // DPRINTF("console pfn location: %llx\n", buf->console_pfn);
         return pagebuf_get_one(xch, ctx, buf, fd, dom);
 
+    case XC_SAVE_ID_LOCAL_SOURCE:
+        if ( RDEXACT(fd, &ctx->local_src, sizeof(uint32_t)) )
+        {
+            PERROR("error read the local source domain");
+            return -1;
+        }
+        if ( !ctx->hvm || (ctx->local_src == dom) )
+        {
+            ERROR("Bad local source domain %"PRIu32, ctx->local_src);
+            return -1;
+        }
+        ctx->local = 1;
+        DPRINTF("Taking pages over from domain %"PRIu32"\n", ctx->local_src);
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
     case XC_SAVE_ID_LAST_CHECKPOINT:
         ctx->last_checkpoint = 1;
         // DPRINTF("last checkpoint indication received");
@@ -1063,6 +1381,9 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
     buf->nr_physpages = buf->nr_pages = 0;
     buf->compbuf_pos = buf->compbuf_size = 0;
 
+    /* A further checkpoint starts with a record again. */
+    ctx->rec.raw = 0;
+
     do {
         rc = pagebuf_get_one(xch, ctx, buf, fd, dom);
     } while (rc > 0);
@@ -1073,6 +1394,137 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
     return rc;
 }
 
+/*
+ * Same-host migration: take the pages of a batch over from the suspended
+ * source domain.  Pages Xen will not move (shared, or mapped by someone
+ * else) are copied across directly, and pfns the source does not have are
+ * marked as not present so that apply_batch() leaves them alone.  Any
+ * other failure to move a page fails the restore: the page may be gone.
+ */
+static int take_over_batch(xc_interface *xch, uint32_t dom,
+                           struct restore_ctx *ctx, pagebuf_t *pagebuf,
+                           int curbatch, int j)
+{
+    uint64_t gfns[MAX_BATCH_SIZE];
+    xen_pfn_t src_pfns[MAX_BATCH_SIZE], dst_pfns[MAX_BATCH_SIZE];
+    int errs[MAX_BATCH_SIZE], idx[MAX_BATCH_SIZE], pos[MAX_BATCH_SIZE];
+    char *src = NULL, *dst = NULL;
+    unsigned long pfn, pagetype;
+    int i, n, nr_copy;
+    int rc = -1;
+
+    for ( i = n = 0; i < j; i++ )
+    {
+        pfn      = pagebuf->pfn_types[i + curbatch] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = pagebuf->pfn_types[i + curbatch] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( (pagetype != XEN_DOMCTL_PFINFO_XALLOC) ||
+             (ctx->p2m[pfn] != INVALID_P2M_ENTRY) )
+            continue;
+
+        gfns[n] = pfn;
+        idx[n++] = i + curbatch;
+    }
+
+    if ( n == 0 )
+        return 0;
+
+    if ( xc_domain_transfer_pages(xch, ctx->local_src, dom, n, gfns, errs) )
+    {
+        PERROR("Failed to take pages over from domain %"PRIu32,
+               ctx->local_src);
+        return -1;
+    }
+
+    /* Note the pages now ours; copy the busy ones. */
+    for ( i = nr_copy = 0; i < n; i++ )
+    {
+        switch ( errs[i] )
+        {
+        case 0:
+            ctx->p2m[gfns[i]] = gfns[i];
+            ctx->nr_pfns++;
+            ctx->local_moved++;
+            continue;
+        case -ENOENT:
+            /* Not present in the source. */
+            pagebuf->pfn_types[idx[i]] = gfns[i] | XEN_DOMCTL_PFINFO_XTAB;
+            continue;
+        case -EBUSY:
+            break;
+        default:
+            errno = -errs[i];
+            PERROR("Failed to take pfn %#"PRIx64" over from domain %"PRIu32,
+                   gfns[i], ctx->local_src);
+            return -1;
+        }
+        src_pfns[nr_copy] = gfns[i];
+        idx[nr_copy++] = idx[i];
+    }
+
+    if ( nr_copy == 0 )
+        return 0;
+
+    src = xc_map_foreign_bulk(xch, ctx->local_src, PROT_READ,
+                              src_pfns, errs, nr_copy);
+    if ( src == NULL )
+    {
+        PERROR("Failed to map pages of domain %"PRIu32, ctx->local_src);
+        return -1;
+    }
+
+    for ( i = n = 0; i < nr_copy; i++ )
+    {
+        if ( errs[i] )
+        {
+            errno = -errs[i];
+            PERROR("Failed to map pfn %#lx of domain %"PRIu32,
+                   (unsigned long)src_pfns[i], ctx->local_src);
+            goto out;
+        }
+        dst_pfns[n] = src_pfns[i];
+        pos[n++] = i;
+    }
+
+    if ( xc_domain_populate_physmap_exact(xch, dom, n, 0, 0, dst_pfns) )
+    {
+        PERROR("Failed to allocate memory for batch");
+        goto out;
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        ctx->p2m[dst_pfns[i]] = dst_pfns[i];
+        ctx->nr_pfns++;
+    }
+
+    dst = xc_map_foreign_bulk(xch, dom, PROT_WRITE, dst_pfns, errs, n);
+    if ( dst == NULL )
+    {
+        PERROR("map batch failed");
+        goto out;
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( errs[i] )
+        {
+            ERROR("Failed to map pfn %lx", (unsigned long)dst_pfns[i]);
+            goto out;
+        }
+        memcpy(dst + i * PAGE_SIZE, src + pos[i] * PAGE_SIZE, PAGE_SIZE);
+    }
+    ctx->local_copied += n;
+
+    rc = 0;
+
+ out:
+    if ( dst )
+        munmap(dst, n * PAGE_SIZE);
+    munmap(src, nr_copy * PAGE_SIZE);
+    return rc;
+}
+
 static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                        xen_pfn_t* region_mfn, unsigned long* pfn_type, int pae_extended_cr3,
                        struct xc_mmu* mmu,
@@ -1098,6 +1550,9 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     if (j > MAX_BATCH_SIZE)
         j = MAX_BATCH_SIZE;
 
+    if ( ctx->local && take_over_batch(xch, dom, ctx, pagebuf, curbatch, j) )
+        return -1;
+
     /* First pass for this batch: work out how much memory to alloc, and detect superpages */
     nr_mfns = scount = 0;
     for ( i = 0; i < j; i++ )
@@ -1482,7 +1937,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         goto out;
     }
 
-    if ( RDEXACT(io_fd, &dinfo->p2m_size, sizeof(unsigned long)) )
+    if ( read_stream_start(xch, ctx, io_fd, &dinfo->p2m_size) )
     {
         PERROR("read: p2m_size");
         goto out;
@@ -1611,6 +2066,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                 xc_set_hvm_param(xch, dom, HVM_PARAM_ACCESS_RING_PFN, pagebuf.access_ring_pfn);
             if ( pagebuf.sharing_ring_pfn )
                 xc_set_hvm_param(xch, dom, HVM_PARAM_SHARING_RING_PFN, pagebuf.sharing_ring_pfn);
+            if ( pagebuf.ring_pages )
+                xc_set_hvm_param(xch, dom, HVM_PARAM_MEM_EVENT_RING_PAGES, pagebuf.ring_pages);
             if ( pagebuf.vm86_tss )
                 xc_set_hvm_param(xch, dom, HVM_PARAM_VM86_TSS, pagebuf.vm86_tss);
             if ( pagebuf.console_pfn )
@@ -1695,6 +2152,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
 
     // DPRINTF("Received all pages (%d races)\n", nraces);
 
+    if ( ctx->local )
+        DPRINTF("Took %lu pages over from domain %"PRIu32", copied %lu\n",
+                ctx->local_moved, ctx->local_src, ctx->local_copied);
+
     if ( !ctx->completed ) {
 
         if ( buffer_tail(xch, ctx, &tailbuf, io_fd, max_vcpu_id, vcpumap,
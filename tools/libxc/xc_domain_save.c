@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 
 #include "xc_private.h"
 #include "xc_bitops.h"
@@ -34,6 +36,8 @@
 
 #include <xen/hvm/params.h>
 
+#include <zlib.h>
+
 /*
 ** Default values for important tuning parameters. Can override by passing
 ** non-zero replacement values to xc_domain_save().
@@ -44,6 +48,20 @@
 #define DEF_MAX_ITERS   29   /* limit us to 30 times round loop   */
 #define DEF_MAX_FACTOR   3   /* never send more than 3x p2m_size  */
 
+/* State for writing a record stream (XCFLAGS_STREAM_RECORDS). */
+struct sr_writer {
+    int enabled;        /* Frame the stream as records */
+    int csum;           /* Append a CRC32 to each record */
+    int open;           /* A record is being written */
+    int buffered;       /* ...and its body is staged in buf */
+    uint32_t type;      /* Type of the open record */
+    uint32_t crc;       /* Running CRC32 of the open record */
+    uint64_t length;    /* Announced body length of an unbuffered record */
+    uint64_t remaining; /* ...and how much of it is still due */
+    uint8_t *buf;       /* Staging area for buffered records */
+    size_t len, size;
+};
+
 struct save_ctx {
     unsigned long hvirt_start; /* virtual starting address of the hypervisor */
     unsigned int pt_levels; /* #levels of page tables used by the current guest */
@@ -52,6 +70,9 @@ struct save_ctx {
     xen_pfn_t *live_m2p; /* Live mapping of system MFN to PFN table. */
     unsigned long m2p_mfn0;
     struct domain_info_context dinfo;
+    struct sr_writer sr;
+    int no_dirty_list; /* Xen lacks XEN_DOMCTL_SHADOW_OP_{CLEAN,PEEK}_LIST */
+    unsigned long dirty_hint; /* pages seen dirty by the last log read */
 };
 
 /* buffer for output */
@@ -218,18 +239,352 @@ static inline int write_uncached(xc_interface *xch,
         return noncached_write(xch, ob, fd, buf, len);
 }
 
-static int write_compressed(xc_interface *xch, comp_ctx *compress_ctx,
+/*
+ * Zero-copy page output.  Rather than copying mapped guest pages into the
+ * output buffer, the pages of a batch are queued as iovecs pointing into
+ * the foreign mapping and handed to writev() before the mapping is torn
+ * down.  vmsplice() is no use here: the privcmd mapping cannot be pinned
+ * by get_user_pages(), and the guest may reuse a page as soon as it is
+ * unmapped.
+ */
+#define IOVQ_MAX MAX_BATCH_SIZE
+
+struct iovq {
+    struct iovec iov[IOVQ_MAX];
+    int cnt;
+};
+
+static int iovq_flush(xc_interface *xch, struct iovq *q,
+                      struct outbuf *ob, int fd)
+{
+    struct iovec *iov = q->iov;
+    int cnt = q->cnt;
+    ssize_t len;
+
+    /* Anything already buffered goes first. */
+    if ( outbuf_flush(xch, ob, fd) < 0 )
+        return -1;
+
+    while ( cnt )
+    {
+        len = writev(fd, iov, cnt);
+        if ( len < 0 )
+        {
+            if ( errno == EINTR || errno == EAGAIN )
+                continue;
+            return -1;
+        }
+
+        ob->write_count += len;
+        while ( cnt && len >= iov->iov_len )
+        {
+            len -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if ( cnt )
+        {
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+
+    q->cnt = 0;
+
+    if ( ob->write_count >= (MAX_PAGECACHE_USAGE * PAGE_SIZE) )
+    {
+        /* Time to discard cache - dont care if this fails */
+        int saved_errno = errno;
+        discard_file_cache(xch, fd, 0 /* no flush */);
+        errno = saved_errno;
+        ob->write_count = 0;
+    }
+
+    return 0;
+}
+
+static int iovq_add(xc_interface *xch, struct iovq *q,
+                    struct outbuf *ob, int fd, void *buf, size_t len)
+{
+    struct iovec *last = q->cnt ? &q->iov[q->cnt - 1] : NULL;
+
+    if ( last && (char *)last->iov_base + last->iov_len == buf )
+    {
+        last->iov_len += len;
+        return 0;
+    }
+
+    if ( q->cnt == IOVQ_MAX && iovq_flush(xch, q, ob, fd) )
+        return -1;
+
+    q->iov[q->cnt].iov_base = buf;
+    q->iov[q->cnt].iov_len = len;
+    q->cnt++;
+
+    return 0;
+}
+
+/* CPU time (user and system) consumed by this process so far. */
+static uint64_t cpu_time_us(void)
+{
+    struct rusage ru;
+
+    if ( getrusage(RUSAGE_SELF, &ru) )
+        return 0;
+
+    return tv_to_us(&ru.ru_utime) + tv_to_us(&ru.ru_stime);
+}
+
+/*
+ * Record stream helpers.  Small records are staged in memory by
+ * sr_rec_open() and go out in one piece at sr_rec_end(); page data is
+ * streamed with a length announced up front by sr_rec_begin().  With
+ * records disabled all of these reduce to the legacy writes.
+ */
+static int sr_write_hdr(xc_interface *xch, struct sr_writer *sr,
+                        uint64_t length, int dobuf, struct outbuf *ob, int fd)
+{
+    struct xc_sr_rhdr rhdr = {
+        .type = sr->type,
+        .flags = sr->csum ? XC_SR_RFLAG_CSUM : 0,
+        .length = length,
+    };
+
+    return write_buffer(xch, dobuf, ob, fd, &rhdr, sizeof(rhdr));
+}
+
+static void sr_account(struct sr_writer *sr, const void *buf, size_t len)
+{
+    if ( sr->csum )
+        sr->crc = crc32(sr->crc, buf, len);
+}
+
+static int sr_rec_open(xc_interface *xch, struct sr_writer *sr, uint32_t type)
+{
+    if ( !sr->enabled )
+        return 0;
+
+    if ( sr->open )
+    {
+        ERROR("Record %#x opened inside record %#x", type, sr->type);
+        return -1;
+    }
+
+    sr->open = sr->buffered = 1;
+    sr->type = type;
+    sr->crc = crc32(0L, Z_NULL, 0);
+    sr->len = 0;
+
+    return 0;
+}
+
+static int sr_rec_begin(xc_interface *xch, struct sr_writer *sr, uint32_t type,
+                        uint64_t length, int dobuf, struct outbuf *ob, int fd)
+{
+    if ( !sr->enabled )
+        return 0;
+
+    if ( sr_rec_open(xch, sr, type) )
+        return -1;
+
+    sr->buffered = 0;
+    sr->length = sr->remaining = length;
+
+    return sr_write_hdr(xch, sr, length, dobuf, ob, fd);
+}
+
+static int sr_rec_end(xc_interface *xch, struct sr_writer *sr,
+                      int dobuf, struct outbuf *ob, int fd)
+{
+    static const uint8_t zero[XC_SR_ALIGN];
+    struct xc_sr_rtrl rtrl = { 0 };
+    uint64_t length;
+
+    if ( !sr->enabled )
+        return 0;
+
+    if ( sr->buffered )
+    {
+        length = sr->len;
+        if ( sr_write_hdr(xch, sr, length, dobuf, ob, fd) ||
+             (length && write_buffer(xch, dobuf, ob, fd, sr->buf, length)) )
+            return -1;
+    }
+    else if ( sr->remaining )
+    {
+        ERROR("Record %#x is %"PRIu64" bytes short", sr->type, sr->remaining);
+        return -1;
+    }
+    else
+        length = sr->length;
+
+    if ( XC_SR_PAD(length) &&
+         write_buffer(xch, dobuf, ob, fd, (void *)zero, XC_SR_PAD(length)) )
+        return -1;
+
+    if ( sr->csum )
+    {
+        rtrl.csum = sr->crc;
+        if ( write_buffer(xch, dobuf, ob, fd, &rtrl, sizeof(rtrl)) )
+            return -1;
+    }
+
+    sr->open = 0;
+
+    return 0;
+}
+
+/* Append to the open record (if any) and write through unless staged. */
+static int sr_write(xc_interface *xch, struct sr_writer *sr,
+                    int dobuf, struct outbuf *ob, int fd,
+                    const void *buf, size_t len)
+{
+    if ( sr->open )
+    {
+        sr_account(sr, buf, len);
+
+        if ( sr->buffered )
+        {
+            if ( sr->len + len > sr->size )
+            {
+                size_t size = MAX(sr->len + len, 2 * sr->size);
+                uint8_t *tmp = realloc(sr->buf, size);
+
+                if ( !tmp )
+                {
+                    ERROR("Couldn't grow record buffer to %zu bytes", size);
+                    return -1;
+                }
+                sr->buf = tmp;
+                sr->size = size;
+            }
+            memcpy(sr->buf + sr->len, buf, len);
+            sr->len += len;
+            return 0;
+        }
+
+        if ( len > sr->remaining )
+        {
+            ERROR("Record %#x overrun by %zu bytes", sr->type,
+                  (size_t)(len - sr->remaining));
+            return -1;
+        }
+        sr->remaining -= len;
+    }
+
+    return write_buffer(xch, dobuf, ob, fd, (void *)buf, len);
+}
+
+static int sr_write_uncached(xc_interface *xch, struct sr_writer *sr,
+                             int dobuf, struct outbuf *ob, int fd,
+                             void *buf, size_t len)
+{
+    char bounce[PAGE_SIZE];
+    size_t off, n;
+
+    if ( sr->open )
+    {
+        if ( sr->buffered || len > sr->remaining )
+        {
+            ERROR("Page data outside a streamed record");
+            return -1;
+        }
+        sr->remaining -= len;
+
+        /*
+         * Unless output is buffered the guest is still running, and a page
+         * it dirties between being checksummed and being written would
+         * fail verification.  Checksum and send a private copy instead.
+         */
+        if ( sr->csum && !dobuf )
+        {
+            for ( off = 0; off < len; off += n )
+            {
+                n = MIN(len - off, sizeof(bounce));
+                memcpy(bounce, (char *)buf + off, n);
+                sr_account(sr, bounce, n);
+                if ( noncached_write(xch, ob, fd, bounce, n) != n )
+                    return -1;
+            }
+            return len;
+        }
+
+        sr_account(sr, buf, len);
+    }
+
+    return write_uncached(xch, dobuf, ob, fd, buf, len);
+}
+
+/* Queue page data for a zero-copy write, see struct iovq. */
+static int sr_queue(xc_interface *xch, struct sr_writer *sr, struct iovq *q,
+                    struct outbuf *ob, int fd, void *buf, size_t len)
+{
+    if ( sr->open )
+    {
+        if ( sr->buffered || len > sr->remaining )
+        {
+            ERROR("Page data outside a streamed record");
+            return -1;
+        }
+        sr_account(sr, buf, len);
+        sr->remaining -= len;
+    }
+
+    return iovq_add(xch, q, ob, fd, buf, len);
+}
+
+/* Unbuffered write made outside of the page copying loop. */
+#define wrdirect(fd, buf, len) sr_write(xch, &ctx->sr, 0, NULL, (fd), (buf), (len))
+
+/* Write one self-contained metadata chunk, framed as a record if enabled. */
+static int write_chunk(xc_interface *xch, struct sr_writer *sr,
+                       int dobuf, struct outbuf *ob, int fd,
+                       const void *buf, size_t len)
+{
+    if ( sr_rec_open(xch, sr, XC_SR_REC_CHUNK) ||
+         sr_write(xch, sr, dobuf, ob, fd, buf, len) ||
+         sr_rec_end(xch, sr, dobuf, ob, fd) )
+        return -1;
+
+    return 0;
+}
+
+/* Write the stream header which tells the restorer to expect records. */
+static int sr_write_stream_hdr(xc_interface *xch, struct sr_writer *sr, int fd)
+{
+    struct xc_sr_hdr hdr = {
+        .marker = XC_SR_MARKER,
+        .id = XC_SR_ID,
+        .version = XC_SR_VERSION,
+    };
+
+    if ( !sr->enabled )
+        return 0;
+
+    return write_exact(fd, &hdr, sizeof(hdr));
+}
+
+static int write_compressed(xc_interface *xch, struct sr_writer *sr,
+                            comp_ctx *compress_ctx,
                             int dobuf, struct outbuf* ob, int fd)
 {
     int rc = 0;
     int header = sizeof(int) + sizeof(unsigned long);
+    int trailer = 0;
     int marker = XC_SAVE_ID_COMPRESSED_DATA;
     unsigned long compbuf_len = 0;
 
+    /* Leave room to frame the compressed data in place as a record. */
+    if ( sr->enabled )
+    {
+        header += sizeof(struct xc_sr_rhdr);
+        trailer = XC_SR_ALIGN + sizeof(struct xc_sr_rtrl);
+    }
+
     do
     {
         /* check for available space (atleast 8k) */
-        if ((ob->pos + header + XC_PAGE_SIZE * 2) > ob->size)
+        if ((ob->pos + header + trailer + XC_PAGE_SIZE * 2) > ob->size)
         {
             if (outbuf_flush(xch, ob, fd) < 0)
             {
@@ -240,24 +595,44 @@ static int write_compressed(xc_interface *xch, comp_ctx *compress_ctx,
 
         rc = xc_compression_compress_pages(xch, compress_ctx,
                                            ob->buf + ob->pos + header,
-                                           ob->size - ob->pos - header,
+                                           ob->size - ob->pos - header - trailer,
                                            &compbuf_len);
         if (!rc)
             return 0;
 
-        if (outbuf_hardwrite(xch, ob, fd, &marker, sizeof(marker)) < 0)
+        if (sr_rec_begin(xch, sr, XC_SR_REC_CHUNK,
+                         sizeof(marker) + sizeof(compbuf_len) + compbuf_len,
+                         1, ob, fd) < 0)
+        {
+            PERROR("Error when writing record header (errno %d)", errno);
+            return -1;
+        }
+
+        if (sr_write(xch, sr, 1, ob, fd, &marker, sizeof(marker)) < 0)
         {
             PERROR("Error when writing marker (errno %d)", errno);
             return -1;
         }
 
-        if (outbuf_hardwrite(xch, ob, fd, &compbuf_len, sizeof(compbuf_len)) < 0)
+        if (sr_write(xch, sr, 1, ob, fd, &compbuf_len, sizeof(compbuf_len)) < 0)
         {
             PERROR("Error when writing compbuf_len (errno %d)", errno);
             return -1;
         }
 
+        if (sr->enabled)
+        {
+            sr_account(sr, ob->buf + ob->pos, compbuf_len);
+            sr->remaining -= compbuf_len;
+        }
         ob->pos += (size_t) compbuf_len;
+
+        if (sr_rec_end(xch, sr, 1, ob, fd) < 0)
+        {
+            PERROR("Error when writing record trailer (errno %d)", errno);
+            return -1;
+        }
+
         if (!dobuf && outbuf_flush(xch, ob, fd) < 0)
         {
             ERROR("Error when writing compressed chunk");
@@ -348,6 +723,85 @@ static int analysis_phase(xc_interface *xch, uint32_t domid, struct save_ctx *ct
     return -1;
 }
 
+/* Entries in the buffer used to read the log-dirty state as a list. */
+#define DIRTY_LIST_ENTRIES 4096
+
+/*
+ * Read the log-dirty state into 'bitmap'.  Once few pages are being
+ * dirtied, the list form of the shadow op is used so that the cost follows
+ * the number of dirty pages rather than the size of the guest; bitmaps are
+ * used while the dirty set is dense and when Xen lacks the list ops.
+ *
+ * A clean replaces the bitmap.  A peek only guarantees the bits from
+ * 'start' up, and from a list it only sets bits: that is enough as the log
+ * only grows between cleans, but the caller must clear the bitmap itself
+ * after each clean.
+ */
+static int read_dirty_log(xc_interface *xch, struct save_ctx *ctx,
+                          uint32_t dom, int clean,
+                          xc_hypercall_buffer_t *bitmap,
+                          xc_hypercall_buffer_t *dirty_list,
+                          unsigned long start, xc_shadow_op_stats_t *stats)
+{
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(bitmap);
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(dirty_list);
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    unsigned long *map = bitmap->hbuf;
+    uint64_t *pfns = dirty_list->hbuf;
+    xc_shadow_op_stats_t lstats;
+    uint64_t cursor = clean ? 0 : start;
+    unsigned long total = 0;
+    int i, rc;
+
+    if ( !ctx->no_dirty_list && (ctx->dirty_hint < dinfo->p2m_size / 64) )
+    {
+        if ( clean )
+            memset(map, 0, bitmap_size(dinfo->p2m_size));
+
+        do {
+            rc = xc_shadow_control_list(
+                xch, dom, clean ? XEN_DOMCTL_SHADOW_OP_CLEAN_LIST
+                                : XEN_DOMCTL_SHADOW_OP_PEEK_LIST,
+                HYPERCALL_BUFFER(dirty_list), DIRTY_LIST_ENTRIES,
+                &cursor, stats);
+            if ( rc < 0 )
+                break;
+            for ( i = 0; i < rc; i++ )
+                if ( pfns[i] < dinfo->p2m_size )
+                    set_bit(pfns[i], map);
+            total += rc;
+        } while ( cursor != XEN_DOMCTL_SHADOW_LIST_DONE );
+
+        if ( rc >= 0 )
+        {
+            ctx->dirty_hint = total;
+            return 0;
+        }
+
+        if ( total || (clean && (cursor != 0)) )
+        {
+            PERROR("Error reading dirty page list");
+            return -1;
+        }
+
+        DPRINTF("Dirty page lists unavailable (errno %d), using bitmaps\n",
+                errno);
+        ctx->no_dirty_list = 1;
+    }
+
+    if ( xc_shadow_control(xch, dom, clean ? XEN_DOMCTL_SHADOW_OP_CLEAN
+                                           : XEN_DOMCTL_SHADOW_OP_PEEK,
+                           HYPERCALL_BUFFER(bitmap), dinfo->p2m_size,
+                           NULL, 0, &lstats) != dinfo->p2m_size )
+        return -1;
+
+    ctx->dirty_hint = lstats.dirty_count;
+    if ( stats )
+        *stats = lstats;
+
+    return 0;
+}
+
 static int suspend_and_state(int (*suspend)(void*), void* data,
                              xc_interface *xch, int io_fd, int dom,
                              xc_dominfo_t *info)
@@ -728,17 +1182,17 @@ static xen_pfn_t *map_and_save_p2m_table(xc_interface *xch,
         if ( domctl.u.vcpuextstate.xfeature_mask )
             tot_sz += chunk3_sz + 8;
 
-        if ( write_exact(io_fd, &signature, sizeof(signature)) ||
-             write_exact(io_fd, &tot_sz, sizeof(tot_sz)) ||
-             write_exact(io_fd, "vcpu", 4) ||
-             write_exact(io_fd, &chunk1_sz, sizeof(chunk1_sz)) ||
-             write_exact(io_fd, &ctxt, chunk1_sz) ||
-             write_exact(io_fd, "extv", 4) ||
-             write_exact(io_fd, &chunk2_sz, sizeof(chunk2_sz)) ||
+        if ( wrdirect(io_fd, &signature, sizeof(signature)) ||
+             wrdirect(io_fd, &tot_sz, sizeof(tot_sz)) ||
+             wrdirect(io_fd, "vcpu", 4) ||
+             wrdirect(io_fd, &chunk1_sz, sizeof(chunk1_sz)) ||
+             wrdirect(io_fd, &ctxt, chunk1_sz) ||
+             wrdirect(io_fd, "extv", 4) ||
+             wrdirect(io_fd, &chunk2_sz, sizeof(chunk2_sz)) ||
              (domctl.u.vcpuextstate.xfeature_mask) ?
-                (write_exact(io_fd, "xcnt", 4) ||
-                write_exact(io_fd, &chunk3_sz, sizeof(chunk3_sz)) ||
-                write_exact(io_fd, &xcnt_size, 4)) :
+                (wrdirect(io_fd, "xcnt", 4) ||
+                wrdirect(io_fd, &chunk3_sz, sizeof(chunk3_sz)) ||
+                wrdirect(io_fd, &xcnt_size, 4)) :
                 0 )
         {
             PERROR("write: extended info");
@@ -746,7 +1200,7 @@ static xen_pfn_t *map_and_save_p2m_table(xc_interface *xch,
         }
     }
 
-    if ( write_exact(io_fd, p2m_frame_list, 
+    if ( wrdirect(io_fd, p2m_frame_list, 
                      P2M_FL_ENTRIES * sizeof(xen_pfn_t)) )
     {
         PERROR("write: p2m_frame_list");
@@ -776,7 +1230,8 @@ static xen_pfn_t *map_and_save_p2m_table(xc_interface *xch,
 }
 
 /* must be done AFTER suspend_and_state() */
-static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
+static int save_tsc_info(xc_interface *xch, struct save_ctx *ctx,
+                         uint32_t dom, int io_fd)
 {
     int marker = XC_SAVE_ID_TSC_INFO;
     uint32_t tsc_mode, khz, incarn;
@@ -784,15 +1239,86 @@ static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
 
     if ( xc_domain_get_tsc_info(xch, dom, &tsc_mode,
                                 &nsec, &khz, &incarn) < 0  ||
-         write_exact(io_fd, &marker, sizeof(marker)) ||
-         write_exact(io_fd, &tsc_mode, sizeof(tsc_mode)) ||
-         write_exact(io_fd, &nsec, sizeof(nsec)) ||
-         write_exact(io_fd, &khz, sizeof(khz)) ||
-         write_exact(io_fd, &incarn, sizeof(incarn)) )
+         sr_rec_open(xch, &ctx->sr, XC_SR_REC_CHUNK) ||
+         wrdirect(io_fd, &marker, sizeof(marker)) ||
+         wrdirect(io_fd, &tsc_mode, sizeof(tsc_mode)) ||
+         wrdirect(io_fd, &nsec, sizeof(nsec)) ||
+         wrdirect(io_fd, &khz, sizeof(khz)) ||
+         wrdirect(io_fd, &incarn, sizeof(incarn)) ||
+         sr_rec_end(xch, &ctx->sr, 0, NULL, io_fd) )
         return -1;
     return 0;
 }
 
+/*
+ * Save tmem state.  xc_tmem_save() and friends write straight to a file
+ * descriptor, so for a record stream the state is spooled to a temporary
+ * file and sent on as a single chunk record.
+ */
+static int save_tmem(xc_interface *xch, struct save_ctx *ctx, uint32_t dom,
+                     int io_fd, int live, int extra)
+{
+    char buf[PAGE_SIZE];
+    FILE *spool;
+    off_t len;
+    ssize_t n;
+    int rc;
+
+    if ( !ctx->sr.enabled )
+        return extra ? xc_tmem_save_extra(xch, dom, io_fd,
+                                          XC_SAVE_ID_TMEM_EXTRA)
+                     : xc_tmem_save(xch, dom, io_fd, live, XC_SAVE_ID_TMEM);
+
+    if ( !(spool = tmpfile()) )
+    {
+        PERROR("Couldn't create tmem spool file");
+        return -1;
+    }
+
+    rc = extra ? xc_tmem_save_extra(xch, dom, fileno(spool),
+                                    XC_SAVE_ID_TMEM_EXTRA)
+               : xc_tmem_save(xch, dom, fileno(spool), live, XC_SAVE_ID_TMEM);
+    if ( rc < 0 )
+        goto out;
+
+    len = lseek(fileno(spool), 0, SEEK_CUR);
+    if ( len <= 0 )
+        goto out;
+
+    if ( lseek(fileno(spool), 0, SEEK_SET) ||
+         sr_rec_begin(xch, &ctx->sr, XC_SR_REC_CHUNK, len, 0, NULL, io_fd) )
+    {
+        rc = -1;
+        goto out;
+    }
+
+    while ( len )
+    {
+        n = read(fileno(spool), buf, MIN(len, (off_t)sizeof(buf)));
+        if ( n <= 0 )
+        {
+            if ( n < 0 && errno == EINTR )
+                continue;
+            PERROR("Error reading tmem spool file");
+            rc = -1;
+            goto out;
+        }
+        if ( wrdirect(io_fd, buf, n) )
+        {
+            rc = -1;
+            goto out;
+        }
+        len -= n;
+    }
+
+    if ( sr_rec_end(xch, &ctx->sr, 0, NULL, io_fd) )
+        rc = -1;
+
+ out:
+    fclose(spool);
+    return rc;
+}
+
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
@@ -804,6 +1330,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     int rc = 1, frc, i, j, last_iter = 0, iter = 0;
     int live  = (flags & XCFLAGS_LIVE);
     int debug = (flags & XCFLAGS_DEBUG);
+    int local = (flags & XCFLAGS_LOCAL);
     int superpages = !!hvm;
     int race = 0, sent_last_iter, skip_this_iter = 0;
     unsigned int sent_this_iter = 0;
@@ -820,6 +1347,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     unsigned long *pfn_batch = NULL;
     int *pfn_err = NULL;
 
+    /* Zero-copy page output, and private copies of page-table pages. */
+    struct iovq *iovq = NULL;
+    char *ptpages = NULL;
+    unsigned int nr_pt;
+    int zerocopy;
+    uint64_t cpu_start = cpu_time_us(), cpu_used;
+
     /* A copy of one frame of guest memory. */
     char page[PAGE_SIZE];
 
@@ -838,6 +1372,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
        - to fixup by sending at the end if not already resent; */
     DECLARE_HYPERCALL_BUFFER(unsigned long, to_skip);
     DECLARE_HYPERCALL_BUFFER(unsigned long, to_send);
+    DECLARE_HYPERCALL_BUFFER(uint64_t, dirty_list);
     unsigned long *to_fix = NULL;
 
     struct time_stats time_stats;
@@ -901,6 +1436,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     memset(ctx, 0, sizeof(*ctx));
 
+    ctx->sr.enabled = !!(flags & XCFLAGS_STREAM_RECORDS);
+    ctx->sr.csum = ctx->sr.enabled && (flags & XCFLAGS_STREAM_CHECKSUM);
+
     /* If no explicit control parameters given, use defaults */
     max_iters  = max_iters  ? : DEF_MAX_ITERS;
     max_factor = max_factor ? : DEF_MAX_FACTOR;
@@ -941,6 +1479,21 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto out;
     }
 
+    /* Nothing is known about the dirty rate yet: all pages are dirty in the
+     * first round, so read bitmaps until a round tells otherwise. */
+    ctx->dirty_hint = dinfo->p2m_size;
+
+    if ( local && (!hvm || callbacks->checkpoint) )
+    {
+        DPRINTF("Local migration needs a non-checkpointed HVM guest, "
+                "copying pages instead\n");
+        local = 0;
+    }
+
+    /* The receiver takes the pages over, so it must find the guest stopped. */
+    if ( local )
+        live = 0;
+
     /* Domain is still running at this point */
     if ( live )
     {
@@ -1004,8 +1557,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     to_send = xc_hypercall_buffer_alloc_pages(xch, to_send, NRPAGES(bitmap_size(dinfo->p2m_size)));
     to_skip = xc_hypercall_buffer_alloc_pages(xch, to_skip, NRPAGES(bitmap_size(dinfo->p2m_size)));
     to_fix  = calloc(1, bitmap_size(dinfo->p2m_size));
+    dirty_list = xc_hypercall_buffer_alloc_pages(xch, dirty_list, NRPAGES(DIRTY_LIST_ENTRIES * sizeof(*dirty_list)));
 
-    if ( !to_send || !to_fix || !to_skip )
+    if ( !to_send || !to_fix || !to_skip || !dirty_list )
     {
         ERROR("Couldn't allocate to_send array");
         goto out;
@@ -1044,6 +1598,21 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     memset(pfn_type, 0,
            ROUNDUP(MAX_BATCH_SIZE * sizeof(*pfn_type), PAGE_SHIFT));
 
+    if ( !(flags & XCFLAGS_BUFFERED_PAGES) )
+    {
+        iovq = calloc(1, sizeof(*iovq));
+        if ( !hvm )
+            ptpages = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+        if ( !iovq || (!hvm && !ptpages) )
+        {
+            DPRINTF("No memory for zero-copy output, copying pages\n");
+            free(iovq);
+            free(ptpages);
+            iovq = NULL;
+            ptpages = NULL;
+        }
+    }
+
     /* Setup the mfn_to_pfn table mapping */
     if ( !(ctx->live_m2p = xc_map_m2p(xch, ctx->max_mfn, PROT_READ, &ctx->m2p_mfn0)) )
     {
@@ -1052,7 +1621,14 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     }
 
     /* Start writing out the saved-domain record. */
-    if ( write_exact(io_fd, &dinfo->p2m_size, sizeof(unsigned long)) )
+    if ( sr_write_stream_hdr(xch, &ctx->sr, io_fd) ||
+         sr_rec_open(xch, &ctx->sr, XC_SR_REC_P2M_FRAMES) )
+    {
+        PERROR("write: stream header");
+        goto out;
+    }
+
+    if ( wrdirect(io_fd, &dinfo->p2m_size, sizeof(unsigned long)) )
     {
         PERROR("write: p2m_size");
         goto out;
@@ -1087,27 +1663,55 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         DPRINTF("Had %d unexplained entries in p2m table\n", err);
     }
 
+    if ( sr_rec_end(xch, &ctx->sr, 0, NULL, io_fd) )
+    {
+        PERROR("write: p2m frames record");
+        goto out;
+    }
+
     print_stats(xch, dom, 0, &time_stats, &shadow_stats, 0);
 
-    tmem_saved = xc_tmem_save(xch, dom, io_fd, live, XC_SAVE_ID_TMEM);
+    tmem_saved = save_tmem(xch, ctx, dom, io_fd, live, 0);
     if ( tmem_saved == -1 )
     {
         PERROR("Error when writing to state file (tmem)");
         goto out;
     }
 
-    if ( !live && save_tsc_info(xch, dom, io_fd) < 0 )
+    if ( !live && save_tsc_info(xch, ctx, dom, io_fd) < 0 )
     {
         PERROR("Error when writing to state file (tsc)");
         goto out;
     }
 
   copypages:
-#define wrexact(fd, buf, len) write_buffer(xch, last_iter, ob, (fd), (buf), (len))
-#define wruncached(fd, live, buf, len) write_uncached(xch, last_iter, ob, (fd), (buf), (len))
-#define wrcompressed(fd) write_compressed(xch, compress_ctx, last_iter, ob, (fd))
+#define wrexact(fd, buf, len) sr_write(xch, &ctx->sr, last_iter, ob, (fd), (buf), (len))
+#define wruncached(fd, live, buf, len) sr_write_uncached(xch, &ctx->sr, last_iter, ob, (fd), (buf), (len))
+#define wrcompressed(fd) write_compressed(xch, &ctx->sr, compress_ctx, last_iter, ob, (fd))
+#define wrchunk(fd, buf, len) write_chunk(xch, &ctx->sr, last_iter, ob, (fd), (buf), (len))
+#define rec_open(type) sr_rec_open(xch, &ctx->sr, (type))
+#define rec_begin(type, len) sr_rec_begin(xch, &ctx->sr, (type), (len), last_iter, ob, io_fd)
+#define rec_end() sr_rec_end(xch, &ctx->sr, last_iter, ob, io_fd)
+#define wrpages(buf, len)                                               \
+    (zerocopy ? sr_queue(xch, &ctx->sr, iovq, ob, io_fd, (buf), (len))   \
+              : (wruncached(io_fd, live, (buf), (len)) == (len) ? 0 : -1))
 
     ob = &ob_pagebuf; /* Holds pfn_types, pages/compressed pages */
+
+    if ( local )
+    {
+        struct {
+            int id;
+            uint32_t domid;
+        } chunk = { XC_SAVE_ID_LOCAL_SOURCE, dom };
+
+        if ( wrchunk(io_fd, &chunk, sizeof(chunk)) )
+        {
+            PERROR("Error when writing to state file (local source)");
+            goto out;
+        }
+    }
+
     /* Now write out each data page, canonicalising page tables as we go... */
     for ( ; ; )
     {
@@ -1125,18 +1729,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         skip_this_iter = 0;
         N = 0;
 
+        /* Peeks from a dirty list only add to to_skip. */
+        memset(to_skip, 0, bitmap_size(dinfo->p2m_size));
+
         while ( N < dinfo->p2m_size )
         {
             xc_report_progress_step(xch, N, dinfo->p2m_size);
 
             if ( !last_iter )
             {
-                /* Slightly wasteful to peek the whole array every time,
-                   but this is fast enough for the moment. */
-                frc = xc_shadow_control(
-                    xch, dom, XEN_DOMCTL_SHADOW_OP_PEEK, HYPERCALL_BUFFER(to_skip),
-                    dinfo->p2m_size, NULL, 0, NULL);
-                if ( frc != dinfo->p2m_size )
+                /* Only the pages from N on matter to this batch. */
+                if ( read_dirty_log(xch, ctx, dom, 0, HYPERCALL_BUFFER(to_skip),
+                                    HYPERCALL_BUFFER(dirty_list), N, NULL) )
                 {
                     ERROR("Error peeking shadow bitmap");
                     goto out;
@@ -1163,15 +1767,17 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     DPRINTF("\n");
                 }
 
+                /* for sparse bitmaps, word-by-word may save time */
+                if ( !debug && !to_send[N >> ORDER_LONG] &&
+                     (completed || !last_iter || !to_fix[N >> ORDER_LONG]) )
+                {
+                    /* to the end of the word: incremented again in for loop! */
+                    N |= BITS_PER_LONG - 1;
+                    continue;
+                }
+
                 if ( completed )
                 {
-                    /* for sparse bitmaps, word-by-word may save time */
-                    if ( !to_send[N >> ORDER_LONG] )
-                    {
-                        /* incremented again in for loop! */
-                        N += BITS_PER_LONG - 1;
-                        continue;
-                    }
 
                     if ( !test_bit(n, to_send) )
                         continue;
@@ -1248,6 +1854,15 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             if ( batch == 0 )
                 goto skip; /* vanishingly unlikely... */
 
+            if ( local )
+            {
+                /* The receiver takes the pages from the domain itself. */
+                for ( j = 0; j < batch; j++ )
+                    pfn_type[j] = XEN_DOMCTL_PFINFO_XALLOC | pfn_batch[j];
+                region_base = NULL;
+                goto write_batch;
+            }
+
             region_base = xc_map_foreign_bulk(
                 xch, dom, PROT_READ, pfn_type, pfn_err, batch);
             if ( region_base == NULL )
@@ -1325,6 +1940,30 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 continue; /* bail on this batch: no valid pages */
             }
 
+          write_batch:
+            if ( ctx->sr.enabled )
+            {
+                uint64_t len = sizeof(unsigned int) +
+                    sizeof(unsigned long) * batch;
+
+                for ( j = 0; !compressing && j < batch; j++ )
+                {
+                    unsigned long pagetype =
+                        pfn_type[j] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+                    if ( pagetype != XEN_DOMCTL_PFINFO_XTAB &&
+                         pagetype != XEN_DOMCTL_PFINFO_BROKEN &&
+                         pagetype != XEN_DOMCTL_PFINFO_XALLOC )
+                        len += PAGE_SIZE;
+                }
+
+                if ( rec_begin(XC_SR_REC_PAGE_DATA, len) )
+                {
+                    PERROR("Error when writing to state file (2')");
+                    goto out;
+                }
+            }
+
             if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
             {
                 PERROR("Error when writing to state file (2)");
@@ -1343,12 +1982,24 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 while ( --j >= 0 )
                     pfn_type[j] = ((unsigned long *)pfn_type)[j];
 
+            /*
+             * Write the pages straight from the mapping unless they must be
+             * copied: a checkpointed save buffers the last iteration while
+             * the guest runs on, and a checksummed record of a running guest
+             * needs a stable copy of each page.
+             */
+            zerocopy = iovq && !compressing &&
+                       !(last_iter && callbacks->checkpoint) &&
+                       !(ctx->sr.csum && !last_iter);
+            nr_pt = 0;
+
             /* entering this loop, pfn_type is now in pfns (Not mfns) */
             run = 0;
             for ( j = 0; j < batch; j++ )
             {
                 unsigned long pfn, pagetype;
                 void *spage = (char *)region_base + (PAGE_SIZE*j);
+                char *ptpage;
 
                 pfn      = pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
                 pagetype = pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
@@ -1359,9 +2010,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                        run of pages we may have previously acumulated */
                     if ( !compressing && run )
                     {
-                        if ( wruncached(io_fd, live,
-                                       (char*)region_base+(PAGE_SIZE*(j-run)), 
-                                       PAGE_SIZE*run) != PAGE_SIZE*run )
+                        if ( wrpages((char*)region_base+(PAGE_SIZE*(j-run)),
+                                     PAGE_SIZE*run) )
                         {
                             PERROR("Error when writing to state file (4a)"
                                   " (errno %d)", errno);
@@ -1386,8 +2036,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                      (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
                 {
                     /* We have a pagetable page: need to rewrite it. */
+                    ptpage = zerocopy ? ptpages + PAGE_SIZE * nr_pt++ : page;
                     race = 
-                        canonicalize_pagetable(ctx, pagetype, pfn, spage, page); 
+                        canonicalize_pagetable(ctx, pagetype, pfn, spage, ptpage); 
 
                     if ( race && !live )
                     {
@@ -1400,7 +2051,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     {
                         int c_err;
                         /* Mark pagetable page to be sent uncompressed */
-                        c_err = xc_compression_add_page(xch, compress_ctx, page,
+                        c_err = xc_compression_add_page(xch, compress_ctx, ptpage,
                                                         pfn, 1 /* raw page */);
                         if (c_err == -2) /* OOB PFN */
                         {
@@ -1429,8 +2080,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                             }
                         }
                     }
-                    else if ( wruncached(io_fd, live, page,
-                                         PAGE_SIZE) != PAGE_SIZE )
+                    else if ( wrpages(ptpage, PAGE_SIZE) )
                     {
                         PERROR("Error when writing to state file (4b)"
                               " (errno %d)", errno);
@@ -1474,9 +2124,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             if ( run )
             {
                 /* write out the last accumulated run of pages */
-                if ( wruncached(io_fd, live,
-                               (char*)region_base+(PAGE_SIZE*(j-run)), 
-                               PAGE_SIZE*run) != PAGE_SIZE*run )
+                if ( wrpages((char*)region_base+(PAGE_SIZE*(j-run)),
+                             PAGE_SIZE*run) )
                 {
                     PERROR("Error when writing to state file (4c)"
                           " (errno %d)", errno);
@@ -1484,9 +2133,24 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 }                        
             }
 
+            /* Queued pages must be out before the mapping goes away. */
+            if ( zerocopy && iovq_flush(xch, iovq, ob, io_fd) )
+            {
+                PERROR("Error when writing to state file (4c')"
+                      " (errno %d)", errno);
+                goto out;
+            }
+
+            if ( rec_end() )
+            {
+                PERROR("Error when writing to state file (4d)");
+                goto out;
+            }
+
             sent_this_iter += batch;
 
-            munmap(region_base, batch*PAGE_SIZE);
+            if ( region_base )
+                munmap(region_base, batch*PAGE_SIZE);
 
         } /* end of this while loop for this iteration */
 
@@ -1503,6 +2167,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             DPRINTF("Total pages sent= %ld (%.2fx)\n",
                     total_sent, ((float)total_sent)/dinfo->p2m_size );
             DPRINTF("(of which %ld were fixups)\n", needed_to_fix  );
+
+            cpu_used = cpu_time_us() - cpu_start;
+            DPRINTF("Save used %"PRIu64"ms of CPU, %"PRIu64"ms per GB of "
+                    "pages (%s)\n", cpu_used / 1000,
+                    total_sent ? cpu_used * ((1U << 30) / PAGE_SIZE) /
+                                 ((uint64_t)total_sent * 1000) : 0,
+                    iovq ? "zero-copy" : "buffered");
         }
 
         if ( last_iter && debug )
@@ -1513,7 +2184,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             DPRINTF("Entering debug resend-all mode\n");
 
             /* send "-1" to put receiver into debug mode */
-            if ( wrexact(io_fd, &id, sizeof(int)) )
+            if ( wrchunk(io_fd, &id, sizeof(int)) )
             {
                 PERROR("Error when writing to state file (6)");
                 goto out;
@@ -1543,13 +2214,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
                 DPRINTF("SUSPEND shinfo %08lx\n", info.shared_info_frame);
                 if ( (tmem_saved > 0) &&
-                     (xc_tmem_save_extra(xch,dom,io_fd,XC_SAVE_ID_TMEM_EXTRA) == -1) )
+                     (save_tmem(xch, ctx, dom, io_fd, live, 1) == -1) )
                 {
                         PERROR("Error when writing to state file (tmem)");
                         goto out;
                 }
 
-                if ( save_tsc_info(xch, dom, io_fd) < 0 )
+                if ( save_tsc_info(xch, ctx, dom, io_fd) < 0 )
                 {
                     PERROR("Error when writing to state file (tsc)");
                     goto out;
@@ -1558,9 +2229,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
             }
 
-            if ( xc_shadow_control(xch, dom,
-                                   XEN_DOMCTL_SHADOW_OP_CLEAN, HYPERCALL_BUFFER(to_send),
-                                   dinfo->p2m_size, NULL, 0, &shadow_stats) != dinfo->p2m_size )
+            if ( read_dirty_log(xch, ctx, dom, 1, HYPERCALL_BUFFER(to_send),
+                                HYPERCALL_BUFFER(dirty_list), 0, &shadow_stats) )
             {
                 PERROR("Error flushing shadow PT");
                 goto out;
@@ -1606,7 +2276,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         }
 
         memcpy(chunk.vcpumap, vcpumap, vcpumap_sz(info.max_vcpu_id));
-        if ( wrexact(io_fd, &chunk, offsetof(struct chunk, vcpumap)
+        if ( wrchunk(io_fd, &chunk, offsetof(struct chunk, vcpumap)
                      + vcpumap_sz(info.max_vcpu_id)) )
         {
             PERROR("Error when writing to state file");
@@ -1626,7 +2296,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         chunk.data = vm_generationid_addr;
 
         if ( (chunk.data != 0) &&
-             wrexact(io_fd, &chunk, sizeof(chunk)) )
+             wrchunk(io_fd, &chunk, sizeof(chunk)) )
         {
             PERROR("Error when writing the generation id buffer location for guest");
             goto out;
@@ -1638,7 +2308,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                          (unsigned long *)&chunk.data);
 
         if ( (chunk.data != 0) &&
-             wrexact(io_fd, &chunk, sizeof(chunk)) )
+             wrchunk(io_fd, &chunk, sizeof(chunk)) )
         {
             PERROR("Error when writing the ident_pt for EPT guest");
             goto out;
@@ -1650,7 +2320,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                          (unsigned long *)&chunk.data);
 
         if ( (chunk.data != 0) &&
-             wrexact(io_fd, &chunk, sizeof(chunk)) )
+             wrchunk(io_fd, &chunk, sizeof(chunk)) )
         {
             PERROR("Error when writing the paging ring pfn for guest");
             goto out;
@@ -1662,7 +2332,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                          (unsigned long *)&chunk.data);
 
         if ( (chunk.data != 0) &&
-             wrexact(io_fd, &chunk, sizeof(chunk)) )
+             wrchunk(io_fd, &chunk, sizeof(chunk)) )
         {
             PERROR("Error when writing the access ring pfn for guest");
             goto out;
@@ -1674,19 +2344,31 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                          (unsigned long *)&chunk.data);
 
         if ( (chunk.data != 0) &&
-             wrexact(io_fd, &chunk, sizeof(chunk)) )
+             wrchunk(io_fd, &chunk, sizeof(chunk)) )
         {
             PERROR("Error when writing the sharing ring pfn for guest");
             goto out;
         }
 
+        chunk.id = XC_SAVE_ID_HVM_RING_PAGES;
+        chunk.data = 0;
+        xc_get_hvm_param(xch, dom, HVM_PARAM_MEM_EVENT_RING_PAGES,
+                         (unsigned long *)&chunk.data);
+
+        if ( (chunk.data != 0) &&
+             wrchunk(io_fd, &chunk, sizeof(chunk)) )
+        {
+            PERROR("Error when writing the mem event ring size for guest");
+            goto out;
+        }
+
         chunk.id = XC_SAVE_ID_HVM_VM86_TSS;
         chunk.data = 0;
         xc_get_hvm_param(xch, dom, HVM_PARAM_VM86_TSS,
                          (unsigned long *)&chunk.data);
 
         if ( (chunk.data != 0) &&
-             wrexact(io_fd, &chunk, sizeof(chunk)) )
+             wrchunk(io_fd, &chunk, sizeof(chunk)) )
         {
             PERROR("Error when writing the vm86 TSS for guest");
             goto out;
@@ -1698,7 +2380,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                          (unsigned long *)&chunk.data);
 
         if ( (chunk.data != 0) &&
-             wrexact(io_fd, &chunk, sizeof(chunk)) )
+             wrchunk(io_fd, &chunk, sizeof(chunk)) )
         {
             PERROR("Error when writing the console pfn for guest");
             goto out;
@@ -1709,7 +2391,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         xc_get_hvm_param(xch, dom, HVM_PARAM_ACPI_IOPORTS_LOCATION,
                          (unsigned long *)&chunk.data);
 
-        if ((chunk.data != 0) && wrexact(io_fd, &chunk, sizeof(chunk)))
+        if ((chunk.data != 0) && wrchunk(io_fd, &chunk, sizeof(chunk)))
         {
             PERROR("Error when writing the firmware ioport version");
             goto out;
@@ -1721,7 +2403,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                          (unsigned long *)&chunk.data);
 
         if ( (chunk.data != 0) &&
-             wrexact(io_fd, &chunk, sizeof(chunk)) )
+             wrchunk(io_fd, &chunk, sizeof(chunk)) )
         {
             PERROR("Error when writing the viridian flag");
             goto out;
@@ -1739,9 +2421,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             PERROR("Error calling toolstack_save");
             goto out;
         }
-        wrexact(io_fd, &id, sizeof(id));
-        wrexact(io_fd, &len, sizeof(len));
-        wrexact(io_fd, buf, len);
+        if ( rec_open(XC_SR_REC_CHUNK) ||
+             wrexact(io_fd, &id, sizeof(id)) ||
+             wrexact(io_fd, &len, sizeof(len)) ||
+             wrexact(io_fd, buf, len) ||
+             rec_end() )
+        {
+            PERROR("Error when writing toolstack data");
+            free(buf);
+            goto out;
+        }
         free(buf);
     }
 
@@ -1752,7 +2441,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
          * last checkpoint.
          */
         i = XC_SAVE_ID_LAST_CHECKPOINT;
-        if ( wrexact(io_fd, &i, sizeof(int)) )
+        if ( wrchunk(io_fd, &i, sizeof(int)) )
         {
             PERROR("Error when writing last checkpoint chunk");
             goto out;
@@ -1771,7 +2460,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     if (!compressing && (flags & XCFLAGS_CHECKPOINT_COMPRESS))
     {
         i = XC_SAVE_ID_ENABLE_COMPRESSION;
-        if ( wrexact(io_fd, &i, sizeof(int)) )
+        if ( wrchunk(io_fd, &i, sizeof(int)) )
         {
             PERROR("Error when writing enable_compression marker");
             goto out;
@@ -1780,7 +2469,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     /* Zero terminate */
     i = 0;
-    if ( wrexact(io_fd, &i, sizeof(int)) )
+    if ( wrchunk(io_fd, &i, sizeof(int)) )
     {
         PERROR("Error when writing to state file (6')");
         goto out;
@@ -1798,7 +2487,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                          (unsigned long *)&magic_pfns[1]);
         xc_get_hvm_param(xch, dom, HVM_PARAM_STORE_PFN,
                          (unsigned long *)&magic_pfns[2]);
-        if ( wrexact(io_fd, magic_pfns, sizeof(magic_pfns)) )
+        if ( rec_open(XC_SR_REC_HVM_CONTEXT) ||
+             wrexact(io_fd, magic_pfns, sizeof(magic_pfns)) )
         {
             PERROR("Error when writing to state file (7)");
             goto out;
@@ -1818,12 +2508,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             goto out;
         }
         
-        if ( wrexact(io_fd, hvm_buf, rec_size) )
+        if ( wrexact(io_fd, hvm_buf, rec_size) || rec_end() )
         {
             PERROR("write HVM info failed!");
             goto out;
         }
-        
+
+        if ( rec_open(XC_SR_REC_END) || rec_end() )
+        {
+            PERROR("Error when writing end record");
+            goto out;
+        }
+
         /* HVM guests are done now */
         rc = 0;
         goto out;
@@ -1842,7 +2538,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 j++;
         }
 
-        if ( wrexact(io_fd, &j, sizeof(unsigned int)) )
+        if ( rec_open(XC_SR_REC_TAIL_DATA) ||
+             wrexact(io_fd, &j, sizeof(unsigned int)) )
         {
             PERROR("Error when writing to state file (6a)");
             goto out;
@@ -1864,6 +2561,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 j = 0;
             }
         }
+
+        if ( rec_end() )
+        {
+            PERROR("Error when writing to state file (6c)");
+            goto out;
+        }
     }
 
     if ( xc_vcpu_getcontext(xch, dom, 0, &ctxt) )
@@ -1934,7 +2637,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 FOLD_CR3(mfn_to_pfn(UNFOLD_CR3(ctxt.x64.ctrlreg[1])));
         }
 
-        if ( wrexact(io_fd, &ctxt, ((dinfo->guest_width==8) 
+        if ( rec_open(XC_SR_REC_VCPU_CONTEXT) ||
+             wrexact(io_fd, &ctxt, ((dinfo->guest_width==8) 
                                         ? sizeof(ctxt.x64) 
                                         : sizeof(ctxt.x32))) )
         {
@@ -1971,7 +2675,14 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         }
 
         if ( !domctl.u.vcpuextstate.xfeature_mask )
+        {
+            if ( rec_end() )
+            {
+                PERROR("Error when writing to state file (3)");
+                goto out;
+            }
             continue;
+        }
 
         /* Getting eXtended states data */
         buffer = xc_hypercall_buffer_alloc(xch, buffer, domctl.u.vcpuextstate.size);
@@ -2000,6 +2711,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             goto out;
         }
         xc_hypercall_buffer_free(xch, buffer);
+
+        if ( rec_end() )
+        {
+            PERROR("Error when writing to state file (3)");
+            goto out;
+        }
     }
 
     /*
@@ -2008,12 +2725,20 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     memcpy(page, live_shinfo, PAGE_SIZE);
     SET_FIELD(((shared_info_any_t *)page), 
               arch.pfn_to_mfn_frame_list_list, 0);
-    if ( wrexact(io_fd, page, PAGE_SIZE) )
+    if ( rec_open(XC_SR_REC_TAIL_DATA) ||
+         wrexact(io_fd, page, PAGE_SIZE) ||
+         rec_end() )
     {
         PERROR("Error when writing to state file (1)");
         goto out;
     }
 
+    if ( rec_open(XC_SR_REC_END) || rec_end() )
+    {
+        PERROR("Error when writing end record");
+        goto out;
+    }
+
     /* Flush last write and check for errors. */
     if ( fsync(io_fd) && errno != EINVAL )
     {
@@ -2080,9 +2805,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         DPRINTF("SUSPEND shinfo %08lx\n", info.shared_info_frame);
         print_stats(xch, dom, 0, &time_stats, &shadow_stats, 1);
 
-        if ( xc_shadow_control(xch, dom,
-                               XEN_DOMCTL_SHADOW_OP_CLEAN, HYPERCALL_BUFFER(to_send),
-                               dinfo->p2m_size, NULL, 0, &shadow_stats) != dinfo->p2m_size )
+        if ( read_dirty_log(xch, ctx, dom, 1, HYPERCALL_BUFFER(to_send),
+                            HYPERCALL_BUFFER(dirty_list), 0, &shadow_stats) )
         {
             PERROR("Error flushing shadow PT");
         }
@@ -2117,11 +2841,15 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     xc_hypercall_buffer_free_pages(xch, to_send, NRPAGES(bitmap_size(dinfo->p2m_size)));
     xc_hypercall_buffer_free_pages(xch, to_skip, NRPAGES(bitmap_size(dinfo->p2m_size)));
+    xc_hypercall_buffer_free_pages(xch, dirty_list, NRPAGES(DIRTY_LIST_ENTRIES * sizeof(*dirty_list)));
 
     free(pfn_type);
     free(pfn_batch);
     free(pfn_err);
     free(to_fix);
+    free(ctx->sr.buf);
+    free(iovq);
+    free(ptpages);
 
     DPRINTF("Save exit of domid %u with rc=%d\n", dom, rc);
 
@@ -30,6 +30,7 @@
 #include <xen/hvm/hvm_info_table.h>
 #include <xen/hvm/params.h>
 #include <xen/hvm/e820.h>
+#include <xen/mem_event.h>
 
 #include <xen/libelf/libelf.h>
 
@@ -38,15 +39,16 @@
 #define SUPERPAGE_1GB_SHIFT   18
 #define SUPERPAGE_1GB_NR_PFNS (1UL << SUPERPAGE_1GB_SHIFT)
 
+/* Each mem event ring gets room to grow to its maximum size */
 #define SPECIALPAGE_PAGING   0
-#define SPECIALPAGE_ACCESS   1
-#define SPECIALPAGE_SHARING  2
-#define SPECIALPAGE_BUFIOREQ 3
-#define SPECIALPAGE_XENSTORE 4
-#define SPECIALPAGE_IOREQ    5
-#define SPECIALPAGE_IDENT_PT 6
-#define SPECIALPAGE_CONSOLE  7
-#define NR_SPECIAL_PAGES     8
+#define SPECIALPAGE_ACCESS   (SPECIALPAGE_PAGING + MEM_EVENT_RING_MAX_PAGES)
+#define SPECIALPAGE_SHARING  (SPECIALPAGE_ACCESS + MEM_EVENT_RING_MAX_PAGES)
+#define SPECIALPAGE_BUFIOREQ (SPECIALPAGE_SHARING + MEM_EVENT_RING_MAX_PAGES)
+#define SPECIALPAGE_XENSTORE (SPECIALPAGE_BUFIOREQ + 1)
+#define SPECIALPAGE_IOREQ    (SPECIALPAGE_BUFIOREQ + 2)
+#define SPECIALPAGE_IDENT_PT (SPECIALPAGE_BUFIOREQ + 3)
+#define SPECIALPAGE_CONSOLE  (SPECIALPAGE_BUFIOREQ + 4)
+#define NR_SPECIAL_PAGES     (SPECIALPAGE_BUFIOREQ + 5)
 #define special_pfn(x) (0xff000u - NR_SPECIAL_PAGES + (x))
 
 static int modules_init(struct xc_hvm_build_args *args,
@@ -477,6 +479,8 @@ static int setup_guest(xc_interface *xch,
                      special_pfn(SPECIALPAGE_ACCESS));
     xc_set_hvm_param(xch, dom, HVM_PARAM_SHARING_RING_PFN,
                      special_pfn(SPECIALPAGE_SHARING));
+    xc_set_hvm_param(xch, dom, HVM_PARAM_MEM_EVENT_RING_PAGES,
+                     MEM_EVENT_RING_MAX_PAGES);
 
     /*
      * Identity-map page table is required for running with CR0.PG=0 when
@@ -24,7 +24,8 @@
 #include "xc_private.h"
 
 int xc_mem_event_control(xc_interface *xch, domid_t domain_id, unsigned int op,
-                         unsigned int mode, uint32_t *port)
+                         unsigned int mode, unsigned int nr_ring_pages,
+                         uint32_t *port)
 {
     DECLARE_DOMCTL;
     int rc;
@@ -33,6 +34,7 @@ int xc_mem_event_control(xc_interface *xch, domid_t domain_id, unsigned int op,
     domctl.domain = domain_id;
     domctl.u.mem_event_op.op = op;
     domctl.u.mem_event_op.mode = mode;
+    domctl.u.mem_event_op.nr_ring_pages = nr_ring_pages;
     
     rc = do_domctl(xch, &domctl);
     if ( !rc && port )
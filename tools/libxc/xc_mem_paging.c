@@ -26,6 +26,12 @@
 
 int xc_mem_paging_enable(xc_interface *xch, domid_t domain_id,
                          uint32_t *port)
+{
+    return xc_mem_paging_enable_ring(xch, domain_id, 1, port);
+}
+
+int xc_mem_paging_enable_ring(xc_interface *xch, domid_t domain_id,
+                              unsigned int nr_ring_pages, uint32_t *port)
 {
     if ( !port )
     {
@@ -36,7 +42,7 @@ int xc_mem_paging_enable(xc_interface *xch, domid_t domain_id,
     return xc_mem_event_control(xch, domain_id,
                                 XEN_DOMCTL_MEM_EVENT_OP_PAGING_ENABLE,
                                 XEN_DOMCTL_MEM_EVENT_OP_PAGING,
-                                port);
+                                nr_ring_pages, port);
 }
 
 int xc_mem_paging_disable(xc_interface *xch, domid_t domain_id)
@@ -44,7 +50,7 @@ int xc_mem_paging_disable(xc_interface *xch, domid_t domain_id)
     return xc_mem_event_control(xch, domain_id,
                                 XEN_DOMCTL_MEM_EVENT_OP_PAGING_DISABLE,
                                 XEN_DOMCTL_MEM_EVENT_OP_PAGING,
-                                NULL);
+                                0, NULL);
 }
 
 int xc_mem_paging_nominate(xc_interface *xch, domid_t domain_id, unsigned long gfn)
@@ -99,6 +105,14 @@ int xc_mem_paging_load(xc_interface *xch, domid_t domain_id,
     return rc;
 }
 
+int xc_mem_paging_resume(xc_interface *xch, domid_t domain_id)
+{
+    return xc_mem_event_memop(xch, domain_id,
+                                XENMEM_paging_op_resume,
+                                XENMEM_paging_op,
+                                0, NULL);
+}
+
 
 /*
  * Local variables:
@@ -55,7 +55,7 @@ int xc_memshr_ring_enable(xc_interface *xch,
     return xc_mem_event_control(xch, domid,
                                 XEN_DOMCTL_MEM_EVENT_OP_SHARING_ENABLE,
                                 XEN_DOMCTL_MEM_EVENT_OP_SHARING,
-                                port);
+                                1, port);
 }
 
 int xc_memshr_ring_disable(xc_interface *xch, 
@@ -64,7 +64,7 @@ int xc_memshr_ring_disable(xc_interface *xch,
     return xc_mem_event_control(xch, domid,
                                 XEN_DOMCTL_MEM_EVENT_OP_SHARING_DISABLE,
                                 XEN_DOMCTL_MEM_EVENT_OP_SHARING,
-                                NULL);
+                                0, NULL);
 }
 
 static int xc_memshr_memop(xc_interface *xch, domid_t domid, 
@@ -182,6 +182,98 @@ int xc_memshr_add_to_physmap(xc_interface *xch,
     return xc_memshr_memop(xch, source_domain, &mso);
 }
 
+int xc_memshr_range_share(xc_interface *xch,
+                          domid_t source_domain,
+                          domid_t client_domain,
+                          unsigned long first_gfn,
+                          unsigned long last_gfn,
+                          unsigned long client_gfn,
+                          uint64_t *nr_shared)
+{
+    int rc;
+    xen_mem_sharing_op_t mso;
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_range_share;
+
+    mso.u.range.first_gfn     = first_gfn;
+    mso.u.range.last_gfn      = last_gfn;
+    mso.u.range.client_gfn    = client_gfn;
+    mso.u.range.client_domain = client_domain;
+
+    rc = xc_memshr_memop(xch, source_domain, &mso);
+
+    if ( !rc && nr_shared )
+        *nr_shared = mso.u.range.nr_shared;
+
+    return rc;
+}
+
+int xc_memshr_range_add_physmap(xc_interface *xch,
+                                domid_t source_domain,
+                                domid_t client_domain,
+                                unsigned long first_gfn,
+                                unsigned long last_gfn,
+                                unsigned long client_gfn,
+                                uint64_t *nr_shared)
+{
+    int rc;
+    xen_mem_sharing_op_t mso;
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_range_add_physmap;
+
+    mso.u.range.first_gfn     = first_gfn;
+    mso.u.range.last_gfn      = last_gfn;
+    mso.u.range.client_gfn    = client_gfn;
+    mso.u.range.client_domain = client_domain;
+
+    rc = xc_memshr_memop(xch, source_domain, &mso);
+
+    if ( !rc && nr_shared )
+        *nr_shared = mso.u.range.nr_shared;
+
+    return rc;
+}
+
+int xc_memshr_batch_share(xc_interface *xch,
+                          domid_t source_domain,
+                          domid_t client_domain,
+                          xen_mem_sharing_pair_t *pairs,
+                          unsigned long nr_pairs,
+                          uint64_t *nr_shared)
+{
+    int rc;
+    xen_mem_sharing_op_t mso;
+    DECLARE_HYPERCALL_BOUNCE(pairs, nr_pairs * sizeof(*pairs),
+                             XC_HYPERCALL_BUFFER_BOUNCE_IN);
+
+    if ( xc_hypercall_bounce_pre(xch, pairs) )
+    {
+        PERROR("Could not bounce memory for XENMEM_sharing_op_batch_share");
+        return -1;
+    }
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_batch_share;
+
+    set_xen_guest_handle(mso.u.batch.pairs, pairs);
+    mso.u.batch.nr_pairs      = nr_pairs;
+    mso.u.batch.client_domain = client_domain;
+
+    rc = xc_memshr_memop(xch, source_domain, &mso);
+
+    xc_hypercall_bounce_post(xch, pairs);
+
+    if ( !rc && nr_shared )
+        *nr_shared = mso.u.batch.nr_shared;
+
+    return rc;
+}
+
 int xc_memshr_domain_resume(xc_interface *xch,
                             domid_t domid)
 {
@@ -233,6 +325,27 @@ int xc_memshr_audit(xc_interface *xch)
     return do_memory_op(xch, XENMEM_sharing_op, &mso, sizeof(mso));
 }
 
+int xc_memshr_stats(xc_interface *xch,
+                    domid_t domid,
+                    xen_domctl_mem_sharing_stats_t *stats)
+{
+    DECLARE_DOMCTL;
+    struct xen_domctl_mem_sharing_op *op;
+    int rc;
+
+    domctl.cmd = XEN_DOMCTL_mem_sharing_op;
+    domctl.interface_version = XEN_DOMCTL_INTERFACE_VERSION;
+    domctl.domain = domid;
+    op = &(domctl.u.mem_sharing_op);
+    op->op = XEN_DOMCTL_MEM_SHARING_STATS;
+
+    rc = do_domctl(xch, &domctl);
+    if ( !rc )
+        *stats = op->u.stats;
+
+    return rc;
+}
+
 long xc_sharing_freed_pages(xc_interface *xch)
 {
     return do_memory_op(xch, XENMEM_get_sharing_freed_pages, NULL, 0);
@@ -435,6 +435,25 @@ int xc_domain_dumpcore_via_callback(xc_interface *xch,
                                     void *arg,
                                     dumpcore_rtn_t dump_rtn);
 
+/*
+ * xc_domain_dumpcore_flags - as xc_domain_dumpcore, with XC_DUMPCORE_*
+ * flags.
+ *
+ * XC_DUMPCORE_SPARSE leaves a hole in the file for every all-zero page.
+ * The layout is unchanged, so the dump reads exactly as a full one.
+ *
+ * XC_DUMPCORE_COMPRESS compresses the pages on a pool of worker threads
+ * and stores them in a .xen_pages_zlib section instead of .xen_pages.
+ * Tools that only know the uncompressed format cannot read such dumps.
+ */
+#define XC_DUMPCORE_SPARSE      (1 << 0)
+#define XC_DUMPCORE_COMPRESS    (1 << 1)
+
+int xc_domain_dumpcore_flags(xc_interface *xch,
+                             uint32_t domid,
+                             const char *corename,
+                             unsigned int flags);
+
 /*
  * This function sets the maximum number of vcpus that a domain may create.
  *
@@ -585,6 +604,25 @@ int xc_set_broken_page_p2m(xc_interface *xch,
                            uint32_t domid,
                            unsigned long pfn);
 
+/**
+ * This function moves the pages at a list of gfns of a shut down HVM
+ * domain to the same gfns of another HVM domain, without copying them.
+ * Pages which cannot be moved are left with the source.
+ * @parm xch a handle to an open hypervisor interface
+ * @parm source the domain id to take the pages from
+ * @parm target the domain id to give the pages to
+ * @parm nr the number of gfns
+ * @parm gfns the gfns to move
+ * @parm errs set to 0 for each page moved, or to a -errno value
+ * @return 0 on success, -1 on failure
+ */
+int xc_domain_transfer_pages(xc_interface *xch,
+                             uint32_t source,
+                             uint32_t target,
+                             unsigned int nr,
+                             uint64_t *gfns,
+                             int *errs);
+
 /**
  * This function returns information about the context of a hvm domain
  * @parm xch a handle to an open hypervisor interface
@@ -671,6 +709,29 @@ int xc_shadow_control(xc_interface *xch,
                       uint32_t mode,
                       xc_shadow_op_stats_t *stats);
 
+/**
+ * Retrieve dirty pfns as a list, using XEN_DOMCTL_SHADOW_OP_CLEAN_LIST or
+ * XEN_DOMCTL_SHADOW_OP_PEEK_LIST.  A round is started by passing *cursor
+ * as 0 and continued by calling again with the updated cursor until it
+ * reads XEN_DOMCTL_SHADOW_LIST_DONE.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain whose log-dirty state to read
+ * @parm sop XEN_DOMCTL_SHADOW_OP_CLEAN_LIST or XEN_DOMCTL_SHADOW_OP_PEEK_LIST
+ * @parm dirty_list hypercall buffer of at least entries uint64_t
+ * @parm entries the number of pfns dirty_list can hold
+ * @parm cursor in: where to continue from, out: where to continue next
+ * @parm stats if not NULL and *cursor is 0, filled with the log statistics
+ * @return the number of pfns written to dirty_list, or -1 on error
+ */
+int xc_shadow_control_list(xc_interface *xch,
+                           uint32_t domid,
+                           unsigned int sop,
+                           xc_hypercall_buffer_t *dirty_list,
+                           unsigned long entries,
+                           uint64_t *cursor,
+                           xc_shadow_op_stats_t *stats);
+
 int xc_sedf_domain_set(xc_interface *xch,
                        uint32_t domid,
                        uint64_t period, uint64_t slice,
@@ -1899,7 +1960,8 @@ int xc_tmem_restore_extra(xc_interface *xch, int dom, int fd);
  * mem_event operations. Internal use only.
  */
 int xc_mem_event_control(xc_interface *xch, domid_t domain_id, unsigned int op,
-                         unsigned int mode, uint32_t *port);
+                         unsigned int mode, unsigned int nr_ring_pages,
+                         uint32_t *port);
 int xc_mem_event_memop(xc_interface *xch, domid_t domain_id, 
                         unsigned int op, unsigned int mode,
                         uint64_t gfn, void *buffer);
@@ -1911,6 +1973,13 @@ int xc_mem_event_memop(xc_interface *xch, domid_t domain_id,
  * support is considered experimental.
  */
 int xc_mem_paging_enable(xc_interface *xch, domid_t domain_id, uint32_t *port);
+/*
+ * The ring spans nr_ring_pages gfns from HVM_PARAM_PAGING_RING_PFN on, and
+ * at most HVM_PARAM_MEM_EVENT_RING_PAGES of them.  Fails with E2BIG if
+ * fewer pages were reserved for the ring.
+ */
+int xc_mem_paging_enable_ring(xc_interface *xch, domid_t domain_id,
+                              unsigned int nr_ring_pages, uint32_t *port);
 int xc_mem_paging_disable(xc_interface *xch, domid_t domain_id);
 int xc_mem_paging_nominate(xc_interface *xch, domid_t domain_id,
                            unsigned long gfn);
@@ -1918,13 +1987,19 @@ int xc_mem_paging_evict(xc_interface *xch, domid_t domain_id, unsigned long gfn)
 int xc_mem_paging_prep(xc_interface *xch, domid_t domain_id, unsigned long gfn);
 int xc_mem_paging_load(xc_interface *xch, domid_t domain_id, 
                         unsigned long gfn, void *buffer);
+/* Process all responses on the paging ring */
+int xc_mem_paging_resume(xc_interface *xch, domid_t domain_id);
 
 /** 
  * Access tracking operations.
  * Supported only on Intel EPT 64 bit processors.
  */
 int xc_mem_access_enable(xc_interface *xch, domid_t domain_id, uint32_t *port);
+/* As xc_mem_paging_enable_ring, for HVM_PARAM_ACCESS_RING_PFN */
+int xc_mem_access_enable_ring(xc_interface *xch, domid_t domain_id,
+                              unsigned int nr_ring_pages, uint32_t *port);
 int xc_mem_access_disable(xc_interface *xch, domid_t domain_id);
+/* Process all responses on the access ring, gfn is ignored */
 int xc_mem_access_resume(xc_interface *xch, domid_t domain_id,
                          unsigned long gfn);
 
@@ -2082,6 +2157,44 @@ int xc_memshr_add_to_physmap(xc_interface *xch,
                     domid_t client_domain,
                     unsigned long client_gfn);
 
+/* Nominate and share many pairs of pages with a single hypercall.
+ *
+ * xc_memshr_range_share shares source gfns first_gfn..last_gfn (inclusive)
+ * with the client gfns starting at client_gfn, xc_memshr_batch_share shares
+ * an arbitrary list of pairs.  Pairs which are not sharable (not populated,
+ * mmio, referenced by other subsystems, ...) are skipped, the number of
+ * pairs actually shared is returned in nr_shared.  Pairs which are already
+ * backed by the same frame count as shared.
+ *
+ * May fail with
+ *  EINVAL if sharing is not enabled on either domain or the range is invalid.
+ *  ENOMEM if internal data structures cannot be allocated, in which case
+ *  some pairs may have been shared already.
+ */
+int xc_memshr_range_share(xc_interface *xch,
+                          domid_t source_domain,
+                          domid_t client_domain,
+                          unsigned long first_gfn,
+                          unsigned long last_gfn,
+                          unsigned long client_gfn,
+                          uint64_t *nr_shared);
+int xc_memshr_batch_share(xc_interface *xch,
+                          domid_t source_domain,
+                          domid_t client_domain,
+                          xen_mem_sharing_pair_t *pairs,
+                          unsigned long nr_pairs,
+                          uint64_t *nr_shared);
+/* Like xc_memshr_range_share, but the source pages are added to the
+ * physmap of the client domain as xc_memshr_add_to_physmap does.  Client
+ * gfns which are already populated are skipped. */
+int xc_memshr_range_add_physmap(xc_interface *xch,
+                                domid_t source_domain,
+                                domid_t client_domain,
+                                unsigned long first_gfn,
+                                unsigned long last_gfn,
+                                unsigned long client_gfn,
+                                uint64_t *nr_shared);
+
 /* Debug calls: return the number of pages referencing the shared frame backing
  * the input argument. Should be one or greater. 
  *
@@ -2108,6 +2221,15 @@ int xc_memshr_debug_gref(xc_interface *xch,
  */
 int xc_memshr_audit(xc_interface *xch);
 
+/* Returns the sharing counters of the domain and of the host, see
+ * struct xen_domctl_mem_sharing_stats.  Unlike the audit, this is cheap
+ * enough to be polled: the hypervisor keeps the counters up to date as
+ * pages are shared and unshared.  Works on any domain, sharing enabled or
+ * not. */
+int xc_memshr_stats(xc_interface *xch,
+                    domid_t domid,
+                    xen_domctl_mem_sharing_stats_t *stats);
+
 /* Stats reporting.
  *
  * At any point in time, the following equality should hold for a host:
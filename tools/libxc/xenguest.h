@@ -28,6 +28,16 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+/* Write a record based stream, optionally with per-record checksums. */
+#define XCFLAGS_STREAM_RECORDS  (1 << 5)
+#define XCFLAGS_STREAM_CHECKSUM (1 << 6)
+/* Copy guest pages through the output buffer rather than writing them
+ * straight from the foreign mapping (mostly for comparison). */
+#define XCFLAGS_BUFFERED_PAGES  (1 << 7)
+/* Same-host migration of an HVM guest: the restorer takes the pages over
+ * from the suspended source domain instead of reading them from the
+ * stream.  Implies a non-live save. */
+#define XCFLAGS_LOCAL           (1 << 8)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -104,6 +114,9 @@ struct restore_callbacks {
  * This function will restore a saved domain.
  *
  * Domain is restored in a suspended state ready to be unpaused.
+ * Both the legacy stream and the record stream written with
+ * XCFLAGS_STREAM_RECORDS are accepted; the format is detected from the
+ * start of the stream.
  *
  * @parm xch a handle to an open hypervisor interface
  * @parm fd the file descriptor to restore a domain from
@@ -136,6 +149,29 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
  */
 #define XC_DEVICE_MODEL_RESTORE_FILE "/var/lib/xen/qemu-resume"
 
+/**
+ * This function turns an empty HVM domain into a copy-on-write clone of a
+ * paused template domain.
+ *
+ * The template's memory is shared with the new domain, pages which cannot
+ * be shared are copied.  The HVM context, TSC settings and HVM params are
+ * copied as well, while the store and console pages start zeroed, as on
+ * restore.  Guests with PV drivers should be forked from a suspended
+ * template so that they reconnect their devices, again as on restore.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm template_domid the id of the paused template domain
+ * @parm dom the id of the new domain, created but not built
+ * @parm store_evtchn the store event channel for this domain to use
+ * @parm store_mfn returned with the mfn of the store page
+ * @parm console_mfn returned with the mfn of the console page
+ * @return 0 on success, -1 on failure
+ */
+int xc_domain_fork(xc_interface *xch, uint32_t template_domid, uint32_t dom,
+                   unsigned int store_evtchn, unsigned long *store_mfn,
+                   domid_t store_domid, unsigned long *console_mfn,
+                   domid_t console_domid);
+
 /**
  * This function will create a domain for a paravirtualized Linux
  * using file names pointing to kernel and ramdisk
@@ -238,6 +238,50 @@
  *                        present in extended-info header)
  *
  *  Shared Info Page    : 4096 bytes of shared info page
+ *
+ *
+ * RECORD STREAM FORMAT
+ * ====================
+ *
+ * When XCFLAGS_STREAM_RECORDS is passed to xc_domain_save the chunks
+ * described above are framed as typed, length-prefixed records.  The
+ * receiver can then read (and verify) a whole record at a time, skip
+ * records it does not understand, and find the end of each checkpoint
+ * without having to parse its contents.
+ *
+ * STREAM HEADER (once, before the first record):
+ *
+ *   uint32_t         : marker == XC_SR_MARKER (never a valid p2m_size)
+ *   uint32_t         : id == XC_SR_ID
+ *   uint32_t         : version == XC_SR_VERSION
+ *   uint32_t         : flags, currently zero
+ *
+ * RECORD:
+ *
+ *   uint32_t         : type, one of XC_SR_REC_*
+ *   uint32_t         : flags, XC_SR_RFLAG_*
+ *   uint64_t         : length of the body in bytes
+ *   bytes            : body, zero padded to a multiple of XC_SR_ALIGN
+ *   uint32_t         : CRC32 of the unpadded body (iff XC_SR_RFLAG_CSUM)
+ *   uint32_t         : zero (iff XC_SR_RFLAG_CSUM)
+ *
+ * The body of a record holds exactly the bytes which the legacy stream
+ * carries at that point:
+ *
+ *   P2M_FRAMES       : p2m_size, plus for PV the extended-info and the
+ *                      p2m frame list
+ *   PAGE_DATA        : one +ve chunk (batch size, PFN array, page data)
+ *   CHUNK            : one -ve XC_SAVE_ID_* chunk, or the 0 terminator
+ *   VCPU_CONTEXT     : (PV-only) basic, extended and XSAVE state of one
+ *                      VCPU
+ *   HVM_CONTEXT      : (HVM-only) magic PFNs and the Xen HVM context
+ *   TAIL_DATA        : (PV-only) unmapped PFN list, or shared info page
+ *   END              : end of the checkpoint.  A device model record
+ *                      appended by the toolstack follows unframed, and
+ *                      a further checkpoint (Remus) starts with a record.
+ *
+ * A receiver must fail on a record type it does not know unless
+ * XC_SR_REC_OPTIONAL is set in the type, in which case it is skipped.
  */
 
 #define XC_SAVE_ID_ENABLE_VERIFY_MODE -1 /* Switch to validation phase. */
@@ -259,6 +303,49 @@
 #define XC_SAVE_ID_HVM_ACCESS_RING_PFN  -16
 #define XC_SAVE_ID_HVM_SHARING_RING_PFN -17
 #define XC_SAVE_ID_TOOLSTACK          -18 /* Optional toolstack specific info */
+/* Same-host migration: pages come from this (suspended) domain.  Every
+ * page in the stream is then XEN_DOMCTL_PFINFO_XALLOC, with no data. */
+#define XC_SAVE_ID_LOCAL_SOURCE       -19
+#define XC_SAVE_ID_HVM_RING_PAGES     -20 /* Pages reserved per mem event ring */
+
+/* Record stream framing, see RECORD STREAM FORMAT above. */
+#define XC_SR_MARKER         0xffffffffU
+#define XC_SR_ID             0x32525358U /* "XSR2" */
+#define XC_SR_VERSION        1
+
+#define XC_SR_REC_END           0x00000000U
+#define XC_SR_REC_P2M_FRAMES    0x00000001U
+#define XC_SR_REC_PAGE_DATA     0x00000002U
+#define XC_SR_REC_CHUNK         0x00000003U
+#define XC_SR_REC_VCPU_CONTEXT  0x00000004U
+#define XC_SR_REC_HVM_CONTEXT   0x00000005U
+#define XC_SR_REC_TAIL_DATA     0x00000006U
+#define XC_SR_REC_OPTIONAL      0x80000000U
+
+#define XC_SR_RFLAG_CSUM     (1U << 0)
+
+#define XC_SR_ALIGN          8
+#define XC_SR_PAD(_l)        (-(_l) & (XC_SR_ALIGN - 1))
+/* Upper bound on a record body; tmem and toolstack chunks are the largest. */
+#define XC_SR_MAX_RECORD     (1ULL << 32)
+
+struct xc_sr_hdr {
+    uint32_t marker;
+    uint32_t id;
+    uint32_t version;
+    uint32_t flags;
+};
+
+struct xc_sr_rhdr {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t length;
+};
+
+struct xc_sr_rtrl {
+    uint32_t csum;
+    uint32_t _res;
+};
 
 /*
 ** We process save/restore/migrate in batches of pages; the below
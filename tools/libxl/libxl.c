@@ -582,6 +582,39 @@ int libxl_domain_info(libxl_ctx *ctx, libxl_dominfo *info_r,
     return 0;
 }
 
+int libxl_domain_sharinginfo(libxl_ctx *ctx, libxl_sharinginfo *info_r,
+                             uint32_t domid)
+{
+    GC_INIT(ctx);
+    xen_domctl_mem_sharing_stats_t stats;
+    int i, rc = 0;
+
+    if (xc_memshr_stats(ctx->xch, domid, &stats)) {
+        rc = errno == ESRCH ? ERROR_INVAL : ERROR_FAIL;
+        LOGE(ERROR, "getting sharing statistics of domain %u", domid);
+        goto out;
+    }
+
+    info_r->shared_memkb = PAGE_TO_MEMKB(stats.shared_pages);
+    info_r->saved_memkb = PAGE_TO_MEMKB(stats.saved_pages);
+    info_r->host_shared_memkb = PAGE_TO_MEMKB(stats.nr_shared_mfns);
+    info_r->host_saved_memkb = PAGE_TO_MEMKB(stats.nr_saved_mfns);
+    info_r->rmap_hash_frames = stats.rmap_hash_frames;
+    info_r->rmap_to_hash = stats.rmap_to_hash;
+    info_r->rmap_to_hash_failed = stats.rmap_to_hash_failed;
+    info_r->rmap_to_list = stats.rmap_to_list;
+
+    info_r->num_fanout = XEN_DOMCTL_MEM_SHARING_FANOUT_BUCKETS;
+    info_r->fanout = libxl__calloc(NOGC, info_r->num_fanout,
+                                   sizeof(*info_r->fanout));
+    for (i = 0; i < info_r->num_fanout; i++)
+        info_r->fanout[i] = stats.fanout[i];
+
+out:
+    GC_FREE;
+    return rc;
+}
+
 static int cpupool_info(libxl__gc *gc,
                         libxl_cpupoolinfo *info,
                         uint32_t poolid,
@@ -779,6 +812,9 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->local = flags & LIBXL_SUSPEND_LOCAL;
+    dss->checksum = flags & LIBXL_SUSPEND_CHECKSUM;
+    dss->records = dss->checksum || (flags & LIBXL_SUSPEND_RECORDS);
 
     libxl__domain_suspend(egc, dss);
     return AO_INPROGRESS;
@@ -805,7 +841,8 @@ int libxl_domain_core_dump(libxl_ctx *ctx, uint32_t domid,
     AO_CREATE(ctx, domid, ao_how);
     int ret, rc;
 
-    ret = xc_domain_dumpcore(ctx->xch, domid, filename);
+    ret = xc_domain_dumpcore_flags(ctx->xch, domid, filename,
+                                   XC_DUMPCORE_SPARSE);
     if (ret<0) {
         LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "core dumping domain %d to %s",
                      domid, filename);
@@ -4738,6 +4775,8 @@ static int32_t tmem_setop_from_string(char *set_name)
         return TMEMC_SET_CAP;
     else if (!strcmp(set_name, "compress"))
         return TMEMC_SET_COMPRESS;
+    else if (!strcmp(set_name, "codec"))
+        return TMEMC_SET_CODEC;
     else
         return -1;
 }
@@ -4749,9 +4788,18 @@ int libxl_tmem_set(libxl_ctx *ctx, uint32_t domid, char* name, uint32_t set)
 
     if (subop == -1) {
         LIBXL__LOG_ERRNOVAL(ctx, LIBXL__LOG_ERROR, -1,
-            "Invalid set, valid sets are <weight|cap|compress>");
+            "Invalid set, valid sets are <weight|cap|compress|codec>");
         return ERROR_INVAL;
     }
+    if (subop == TMEMC_SET_CODEC) {
+        switch (set) {
+        case LIBXL_TMEM_CODEC_LZO: set = TMEM_CODEC_LZO; break;
+        case LIBXL_TMEM_CODEC_LZ4: set = TMEM_CODEC_LZ4; break;
+        default:
+            LIBXL__LOG(ctx, LIBXL__LOG_ERROR, "Invalid tmem codec %u", set);
+            return ERROR_INVAL;
+        }
+    }
     rc = xc_tmem_control(ctx->xch, -1, subop, domid, set, 0, 0, NULL);
     if (rc < 0) {
         LIBXL__LOG_ERRNOVAL(ctx, LIBXL__LOG_ERROR, rc,
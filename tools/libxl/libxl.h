@@ -74,6 +74,24 @@
  */
 #define LIBXL_HAVE_FIRMWARE_PASSTHROUGH 1
 
+/*
+ * LIBXL_HAVE_DOMAIN_CREATE_FORK indicates that libxl_domain_create_fork
+ * is present in the library.
+ */
+#define LIBXL_HAVE_DOMAIN_CREATE_FORK 1
+
+/*
+ * LIBXL_HAVE_TMEM_CODEC indicates that libxl_tmem_set accepts "codec"
+ * with one of the LIBXL_TMEM_CODEC_* values.
+ */
+#define LIBXL_HAVE_TMEM_CODEC 1
+
+/*
+ * LIBXL_HAVE_SHARINGINFO indicates that libxl_domain_sharinginfo and
+ * libxl_sharinginfo are present in the library.
+ */
+#define LIBXL_HAVE_SHARINGINFO 1
+
 /*
  * libxl ABI compatibility
  *
@@ -499,6 +517,16 @@ int libxl_domain_create_restore(libxl_ctx *ctx, libxl_domain_config *d_config,
                                 const libxl_asyncop_how *ao_how,
                                 const libxl_asyncprogress_how *aop_console_how)
                                 LIBXL_EXTERNAL_CALLERS_ONLY;
+int libxl_domain_create_fork(libxl_ctx *ctx, libxl_domain_config *d_config,
+                             uint32_t *domid, uint32_t template_domid,
+                             const libxl_asyncop_how *ao_how,
+                             const libxl_asyncprogress_how *aop_console_how)
+                             LIBXL_EXTERNAL_CALLERS_ONLY;
+  /* Creates an HVM domain whose memory is shared copy-on-write with
+   * template_domid, which must be paused, and which resumes from the
+   * state the template was paused in.  d_config should describe the
+   * same virtual hardware as the template's configuration.
+   */
   /* A progress report will be made via ao_console_how, of type
    * domain_create_console_available, when the domain's primary
    * console is available and can be connected to.
@@ -513,6 +541,15 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+/* Same-host migration: hand the memory of an HVM domain over to the
+ * restoring domain instead of copying it.  The domain cannot be resumed
+ * once the receiver has taken its memory. */
+#define LIBXL_SUSPEND_LOCAL 4
+/* Write the record based stream format (see xg_save_restore.h), optionally
+ * with a CRC32 on every record.  CHECKSUM implies RECORDS.  Restore detects
+ * the format on its own. */
+#define LIBXL_SUSPEND_RECORDS 8
+#define LIBXL_SUSPEND_CHECKSUM 16
 
 /* @param suspend_cancel [from xenctrl.h:xc_domain_resume( @param fast )]
  *   If this parameter is true, use co-operative resume. The guest
@@ -606,6 +643,10 @@ int libxl_primary_console_get_tty(libxl_ctx *ctx, uint32_t domid_vm, char **path
 /* May be called with info_r == NULL to check for domain's existance */
 int libxl_domain_info(libxl_ctx*, libxl_dominfo *info_r,
                       uint32_t domid);
+/* Memory sharing statistics, cheap enough to be polled for every domain.
+ * Returns ERROR_INVAL if the domain does not exist. */
+int libxl_domain_sharinginfo(libxl_ctx*, libxl_sharinginfo *info_r,
+                             uint32_t domid);
 
 /* These functions each return (on success) an array of elements,
  * and the length via the int* out parameter.  These arrays and
@@ -912,6 +953,9 @@ uint32_t libxl_vm_get_start_time(libxl_ctx *ctx, uint32_t domid);
 char *libxl_tmem_list(libxl_ctx *ctx, uint32_t domid, int use_long);
 int libxl_tmem_freeze(libxl_ctx *ctx, uint32_t domid);
 int libxl_tmem_thaw(libxl_ctx *ctx, uint32_t domid);
+/* values for libxl_tmem_set(ctx, domid, "codec", set) */
+#define LIBXL_TMEM_CODEC_LZO 0
+#define LIBXL_TMEM_CODEC_LZ4 1
 int libxl_tmem_set(libxl_ctx *ctx, uint32_t domid, char* name,
                    uint32_t set);
 int libxl_tmem_shared_auth(libxl_ctx *ctx, uint32_t domid, char* uuid,
@@ -675,7 +675,7 @@ static void initiate_domain_create(libxl__egc *egc,
     libxl_device_disk *bootdisk =
         d_config->num_disks > 0 ? &d_config->disks[0] : NULL;
 
-    if (restore_fd >= 0) {
+    if (restore_fd >= 0 || dcs->fork_domid != DOMID_INVALID) {
         LOG(DEBUG, "restoring, not running bootloader\n");
         domcreate_bootloader_done(egc, &dcs->bl, 0);
     } else  {
@@ -714,6 +714,70 @@ static void domcreate_console_available(libxl__egc *egc,
                                         dcs->aop_console_how.for_event));
 }
 
+/*
+ * Fork the new domain from the paused template dcs->fork_domid.  The
+ * template's device model writes its state to the file the new device
+ * model is started from, as on restore.
+ */
+static void domcreate_fork(libxl__egc *egc, libxl__domain_create_state *dcs)
+{
+    STATE_AO_GC(dcs->ao);
+    libxl__domain_suspend_state *dss;
+    uint8_t *buf = NULL;
+    uint32_t len = 0;
+    int rc;
+
+    /* convenience aliases */
+    const uint32_t domid = dcs->guest_domid;
+    const uint32_t template_domid = dcs->fork_domid;
+    libxl_domain_build_info *const info = &dcs->guest_config->b_info;
+    libxl__domain_build_state *const state = &dcs->build_state;
+
+    if (info->type != LIBXL_DOMAIN_TYPE_HVM ||
+        libxl__domain_type(gc, template_domid) != LIBXL_DOMAIN_TYPE_HVM) {
+        LOG(ERROR, "only HVM domains can be forked");
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    rc = libxl__build_pre(gc, domid, info, state);
+    if (rc)
+        goto out;
+
+    GCNEW(dss);
+    dss->ao = ao;
+    dss->domid = template_domid;
+    dss->dm_savefile = GCSPRINTF(XC_DEVICE_MODEL_RESTORE_FILE".%d", domid);
+
+    rc = libxl__domain_suspend_device_model(gc, dss);
+    if (rc) {
+        LOG(ERROR, "failed to save the device model of template domain %u",
+            template_domid);
+        goto out;
+    }
+    libxl__domain_resume_device_model(gc, template_domid);
+
+    if (libxl__toolstack_save(template_domid, &buf, &len, dss) ||
+        libxl__toolstack_restore(domid, buf, len, &dcs->shs)) {
+        LOG(ERROR, "failed to copy the toolstack state of domain %u",
+            template_domid);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    if (xc_domain_fork(CTX->xch, template_domid, domid, state->store_port,
+                       &state->store_mfn, state->store_domid,
+                       &state->console_mfn, state->console_domid)) {
+        LOGE(ERROR, "forking domain %u from %u", domid, template_domid);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+ out:
+    free(buf);
+    libxl__xc_domain_restore_done(egc, dcs, rc, 0, 0);
+}
+
 static void domcreate_bootloader_done(libxl__egc *egc,
                                       libxl__bootloader_state *bl,
                                       int rc)
@@ -749,6 +813,11 @@ static void domcreate_bootloader_done(libxl__egc *egc,
     dcs->dmss.dm.callback = domcreate_devmodel_started;
     dcs->dmss.callback = domcreate_devmodel_started;
 
+    if (dcs->fork_domid != DOMID_INVALID) {
+        domcreate_fork(egc, dcs);
+        return;
+    }
+
     if ( restore_fd < 0 ) {
         rc = libxl__domain_build(gc, &d_config->b_info, domid, state);
         domcreate_rebuild_done(egc, dcs, rc);
@@ -878,14 +947,18 @@ out:
 
     esave = errno;
 
-    flags = fcntl(fd, F_GETFL);
-    if (flags == -1) {
-        LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "unable to get flags on restore fd");
-    } else {
-        flags &= ~O_NONBLOCK;
-        if (fcntl(fd, F_SETFL, flags) == -1)
-            LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "unable to put restore fd"
-                         " back to blocking mode");
+    /* There is no restore fd when forking */
+    if (fd >= 0) {
+        flags = fcntl(fd, F_GETFL);
+        if (flags == -1) {
+            LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR,
+                             "unable to get flags on restore fd");
+        } else {
+            flags &= ~O_NONBLOCK;
+            if (fcntl(fd, F_SETFL, flags) == -1)
+                LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "unable to put restore"
+                                 " fd back to blocking mode");
+        }
     }
 
     errno = esave;
@@ -1230,7 +1303,8 @@ static void domain_create_cb(libxl__egc *egc,
 
 static int do_domain_create(libxl_ctx *ctx, libxl_domain_config *d_config,
                             uint32_t *domid,
-                            int restore_fd, const libxl_asyncop_how *ao_how,
+                            int restore_fd, uint32_t fork_domid,
+                            const libxl_asyncop_how *ao_how,
                             const libxl_asyncprogress_how *aop_console_how)
 {
     AO_CREATE(ctx, 0, ao_how);
@@ -1240,6 +1314,7 @@ static int do_domain_create(libxl_ctx *ctx, libxl_domain_config *d_config,
     cdcs->dcs.ao = ao;
     cdcs->dcs.guest_config = d_config;
     cdcs->dcs.restore_fd = restore_fd;
+    cdcs->dcs.fork_domid = fork_domid;
     cdcs->dcs.callback = domain_create_cb;
     libxl__ao_progress_gethow(&cdcs->dcs.aop_console_how, aop_console_how);
     cdcs->domid_out = domid;
@@ -1267,7 +1342,7 @@ int libxl_domain_create_new(libxl_ctx *ctx, libxl_domain_config *d_config,
                             const libxl_asyncop_how *ao_how,
                             const libxl_asyncprogress_how *aop_console_how)
 {
-    return do_domain_create(ctx, d_config, domid, -1,
+    return do_domain_create(ctx, d_config, domid, -1, DOMID_INVALID,
                             ao_how, aop_console_how);
 }
 
@@ -1276,7 +1351,16 @@ int libxl_domain_create_restore(libxl_ctx *ctx, libxl_domain_config *d_config,
                                 const libxl_asyncop_how *ao_how,
                             const libxl_asyncprogress_how *aop_console_how)
 {
-    return do_domain_create(ctx, d_config, domid, restore_fd,
+    return do_domain_create(ctx, d_config, domid, restore_fd, DOMID_INVALID,
+                            ao_how, aop_console_how);
+}
+
+int libxl_domain_create_fork(libxl_ctx *ctx, libxl_domain_config *d_config,
+                             uint32_t *domid, uint32_t template_domid,
+                             const libxl_asyncop_how *ao_how,
+                             const libxl_asyncprogress_how *aop_console_how)
+{
+    return do_domain_create(ctx, d_config, domid, -1, template_domid,
                             ao_how, aop_console_how);
 }
 
@@ -1297,7 +1297,10 @@ void libxl__domain_suspend(libxl__egc *egc, libxl__domain_suspend_state *dss)
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
           | (debug ? XCFLAGS_DEBUG : 0)
-          | (dss->hvm ? XCFLAGS_HVM : 0);
+          | (dss->hvm ? XCFLAGS_HVM : 0)
+          | (dss->local ? XCFLAGS_LOCAL : 0)
+          | (dss->records ? XCFLAGS_STREAM_RECORDS : 0)
+          | (dss->checksum ? XCFLAGS_STREAM_CHECKSUM : 0);
 
     dss->suspend_eventchn = -1;
     dss->guest_responded = 0;
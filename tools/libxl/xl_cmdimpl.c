@@ -3348,6 +3348,7 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 }
 
 static void migrate_domain(uint32_t domid, const char *rune, int debug,
+                           int local, int stream_flags,
                            const char *override_config_file)
 {
     pid_t child = -1;
@@ -3376,6 +3377,9 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
+    if (local)
+        flags |= LIBXL_SUSPEND_LOCAL;
+    flags |= stream_flags;
     rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
@@ -3443,6 +3447,8 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
                                        rune);
         if (rc) goto failed_badly;
 
+        if (local) goto failed_local;
+
         fprintf(stderr, "migration sender: Trying to resume at our end.\n");
 
         if (common_domname) {
@@ -3469,10 +3475,17 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
  failed_resume:
     close(send_fd);
     migration_child_report(recv_fd);
+    if (local) goto failed_local;
     fprintf(stderr, "Migration failed, resuming at sender.\n");
     libxl_domain_resume(ctx, domid, 0, 0);
     exit(-ERROR_FAIL);
 
+ failed_local:
+    fprintf(stderr, "Migration failed.  The domain may have handed its memory"
+            " over to the\n target already, so it is left suspended rather"
+            " than resumed.\n");
+    exit(-ERROR_FAIL);
+
  failed_badly:
     fprintf(stderr,
  "** Migration failed during final handshake **\n"
@@ -3768,9 +3781,13 @@ int main_migrate(int argc, char **argv)
     const char *ssh_command = "ssh";
     char *rune = NULL;
     char *host;
-    int opt, daemonize = 1, monitor = 1, debug = 0;
+    int opt, daemonize = 1, monitor = 1, debug = 0, local = 0;
+    int stream_flags = 0;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
+        {"local", 0, 0, 0x101},
+        {"records", 0, 0, 0x102},
+        {"checksum", 0, 0, 0x103},
         COMMON_LONG_OPTS,
         {0, 0, 0, 0}
     };
@@ -3792,6 +3809,15 @@ int main_migrate(int argc, char **argv)
     case 0x100:
         debug = 1;
         break;
+    case 0x101:
+        local = 1;
+        break;
+    case 0x102:
+        stream_flags |= LIBXL_SUSPEND_RECORDS;
+        break;
+    case 0x103:
+        stream_flags |= LIBXL_SUSPEND_CHECKSUM;
+        break;
     }
 
     domid = find_domain(argv[optind]);
@@ -3807,7 +3833,7 @@ int main_migrate(int argc, char **argv)
             return 1;
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, debug, local, stream_flags, config_filename);
     return 0;
 }
 
@@ -4673,23 +4699,67 @@ int main_info(int argc, char **argv)
     return 0;
 }
 
-static void sharing(const libxl_dominfo *info, int nb_domain)
+static void sharing_host(const libxl_sharinginfo *sinfo)
 {
     int i;
 
-    printf("Name                                        ID   Mem Shared\n");
+    printf("\nShared frames: %"PRIu64" MiB, saving %"PRIu64" MiB\n",
+           sinfo->host_shared_memkb / 1024, sinfo->host_saved_memkb / 1024);
+    printf("Reverse maps: %"PRIu64" hash tables, %"PRIu64" list to hash "
+           "conversions (%"PRIu64" failed), %"PRIu64" hash to list\n",
+           sinfo->rmap_hash_frames, sinfo->rmap_to_hash,
+           sinfo->rmap_to_hash_failed, sinfo->rmap_to_list);
+
+    printf("\nPages per frame      Frames\n");
+    for (i = 0; i < sinfo->num_fanout; i++) {
+        char range[32];
+
+        if (i == sinfo->num_fanout - 1)
+            snprintf(range, sizeof(range), "%u+", 1u << i);
+        else if (i == 0)
+            snprintf(range, sizeof(range), "1");
+        else
+            snprintf(range, sizeof(range), "%u-%u", 1u << i,
+                     (1u << (i + 1)) - 1);
+        printf("%-15s %11"PRIu64"\n", range, sinfo->fanout[i]);
+    }
+}
+
+static void sharing(const libxl_dominfo *info, int nb_domain, int stats)
+{
+    libxl_sharinginfo sinfo;
+    int i, have_sinfo = 0;
+
+    printf("Name                                        ID   Mem Shared Saved\n");
 
     for (i = 0; i < nb_domain; i++) {
         char *domname;
         unsigned shutdown_reason;
         domname = libxl_domid_to_name(ctx, info[i].domid);
         shutdown_reason = info[i].shutdown ? info[i].shutdown_reason : 0;
-        printf("%-40s %5d %5lu  %5lu\n",
+        printf("%-40s %5d %5lu  %5lu",
                 domname,
                 info[i].domid,
                 (unsigned long) (info[i].current_memkb / 1024),
                 (unsigned long) (info[i].shared_memkb / 1024));
         free(domname);
+
+        /* The host wide counters are the same for every domain: keep
+         * the last ones for the summary. */
+        if (have_sinfo)
+            libxl_sharinginfo_dispose(&sinfo);
+        libxl_sharinginfo_init(&sinfo);
+        have_sinfo = !libxl_domain_sharinginfo(ctx, &sinfo, info[i].domid);
+        if (have_sinfo)
+            printf(" %5lu\n", (unsigned long) (sinfo.saved_memkb / 1024));
+        else
+            printf("     -\n");
+    }
+
+    if (have_sinfo) {
+        if (stats)
+            sharing_host(&sinfo);
+        libxl_sharinginfo_dispose(&sinfo);
     }
 }
 
@@ -4698,10 +4768,17 @@ int main_sharing(int argc, char **argv)
     int opt = 0;
     libxl_dominfo info_buf;
     libxl_dominfo *info, *info_free = NULL;
-    int nb_domain, rc;
+    int nb_domain, rc, stats = 0;
+    static struct option opts[] = {
+        {"stats", 0, 0, 's'},
+        COMMON_LONG_OPTS,
+        {0, 0, 0, 0}
+    };
 
-    SWITCH_FOREACH_OPT(opt, "", NULL, "sharing", 0) {
-        /* No options */
+    SWITCH_FOREACH_OPT(opt, "s", opts, "sharing", 0) {
+    case 's':
+        stats = 1;
+        break;
     }
 
     if (optind >= argc) {
@@ -4730,7 +4807,7 @@ int main_sharing(int argc, char **argv)
         return 2;
     }
 
-    sharing(info, nb_domain);
+    sharing(info, nb_domain, stats);
 
     if (info_free)
         libxl_dominfo_list_free(info_free, nb_domain);
@@ -6114,12 +6191,12 @@ int main_tmem_set(int argc, char **argv)
 {
     uint32_t domid;
     const char *dom = NULL;
-    uint32_t weight = 0, cap = 0, compress = 0;
-    int opt_w = 0, opt_c = 0, opt_p = 0;
+    uint32_t weight = 0, cap = 0, compress = 0, codec = 0;
+    int opt_w = 0, opt_c = 0, opt_p = 0, opt_z = 0;
     int all = 0;
     int opt;
 
-    SWITCH_FOREACH_OPT(opt, "aw:c:p:", NULL, "tmem-set", 0) {
+    SWITCH_FOREACH_OPT(opt, "aw:c:p:z:", NULL, "tmem-set", 0) {
     case 'a':
         all = 1;
         break;
@@ -6135,6 +6212,18 @@ int main_tmem_set(int argc, char **argv)
         compress = strtol(optarg, NULL, 10);
         opt_p = 1;
         break;
+    case 'z':
+        if (!strcmp(optarg, "lzo"))
+            codec = LIBXL_TMEM_CODEC_LZO;
+        else if (!strcmp(optarg, "lz4"))
+            codec = LIBXL_TMEM_CODEC_LZ4;
+        else {
+            fprintf(stderr, "Unknown codec '%s'.\n\n", optarg);
+            help("tmem-set");
+            return 1;
+        }
+        opt_z = 1;
+        break;
     }
 
     dom = argv[optind];
@@ -6149,7 +6238,7 @@ int main_tmem_set(int argc, char **argv)
     else
         domid = find_domain(dom);
 
-    if (!opt_w && !opt_c && !opt_p) {
+    if (!opt_w && !opt_c && !opt_p && !opt_z) {
         fprintf(stderr, "No set value specified.\n\n");
         help("tmem-set");
         return 1;
@@ -6161,6 +6250,8 @@ int main_tmem_set(int argc, char **argv)
         libxl_tmem_set(ctx, domid, "cap", cap);
     if (opt_p)
         libxl_tmem_set(ctx, domid, "compress", compress);
+    if (opt_z)
+        libxl_tmem_set(ctx, domid, "codec", codec);
 
     return 0;
 }
@@ -154,7 +154,12 @@ struct cmd_spec cmd_table[] = {
       "                migrate-receive [-d -e]\n"
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
-      "--debug         Print huge (!) amount of debug during the migration process."
+      "--debug         Print huge (!) amount of debug during the migration process.\n"
+      "--local         <host> is this machine: hand the memory of an HVM domain\n"
+      "                over instead of copying it.\n"
+      "--records       Send the record based stream format.\n"
+      "--checksum      Send the record based stream format with a checksum\n"
+      "                on every record."
     },
     { "dump-core",
       &main_dump_core, 0, 1,
@@ -231,7 +236,8 @@ struct cmd_spec cmd_table[] = {
     { "sharing",
       &main_sharing, 0, 0,
       "Get information about page sharing",
-      "[Domain]", 
+      "[options] [Domain]",
+      "-s, --stats        Show the host wide sharing statistics",
     },
     { "sched-credit",
       &main_sched_credit, 0, 1,
@@ -383,11 +389,12 @@ struct cmd_spec cmd_table[] = {
     { "tmem-set",
       &main_tmem_set, 0, 1,
       "Change tmem settings",
-      "[<Domain>|-a] [-w[=WEIGHT]|-c[=CAP]|-p[=COMPRESS]]",
+      "[<Domain>|-a] [-w[=WEIGHT]|-c[=CAP]|-p[=COMPRESS]|-z[=CODEC]]",
       "  -a                             Operate on all tmem\n"
       "  -w WEIGHT                      Weight (int)\n"
       "  -c CAP                         Cap (int)\n"
-      "  -p COMPRESS                    Compress (int)",
+      "  -p COMPRESS                    Compress (int)\n"
+      "  -z CODEC                       Compressor (lzo|lz4)",
     },
     { "tmem-shared-auth",
       &main_tmem_shared_auth, 0, 1,
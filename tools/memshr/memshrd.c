@@ -0,0 +1,721 @@
+/******************************************************************************
+ *
+ * xen-memshrd: finds identical pages in the memory of running domains and
+ * shares them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every pass maps the memory of the selected domains read-only, a batch at
+ * a time, and hashes each page into a table which is rebuilt from scratch
+ * on every pass, so stale entries never outlive a pass.  When a page hashes
+ * to an entry of another page, both pages are nominated, compared byte for
+ * byte and shared.  Nominating first makes the pages read-only for the
+ * guests, so a write racing with the comparison invalidates the handles and
+ * the share fails instead of merging different contents.
+ *
+ * Writing to a shared page needs a fresh page in Xen.  If there is none,
+ * the vcpu is paused and a request is put on the domain's sharing ring.
+ * The daemon then stops sharing the gfn for good, backs off from the
+ * domain for a while, and lets the vcpu retry once the host has free
+ * memory again.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <xenctrl.h>
+#include <xen/mem_event.h>
+
+#include "xc_bitops.h"
+#include "memshr-priv.h"
+#include "page-hash.h"
+
+#define MAX_DOMAINS     255
+#define SCAN_BATCH      256
+#define PAGE_SIZE_4K    4096
+
+#define BACKOFF_MIN     5
+#define BACKOFF_MAX     300
+
+struct scan_domain {
+    domid_t domid;
+    int gone;
+    /* gfns 0..max_gpfn are scanned */
+    unsigned long max_gpfn;
+    /* gfns whose unshare failed for lack of memory, never shared again */
+    unsigned long *hot;
+    time_t backoff_until;
+    unsigned int backoff;
+
+    /* sharing ring, for unshare failures */
+    void *ring_page;
+    mem_event_back_ring_t back_ring;
+    evtchn_port_or_error_t port;
+
+    unsigned long scanned;
+    unsigned long shared;
+    unsigned long enomem;
+};
+
+/* loc is (gfn << 8) | (domain index + 1), 0 marks a free slot */
+struct hash_slot {
+    uint64_t hash;
+    uint64_t loc;
+};
+
+#define LOC(idx, gfn)   (((uint64_t)(gfn) << 8) | ((idx) + 1))
+#define LOC_IDX(loc)    ((int)((loc) & 0xff) - 1)
+#define LOC_GFN(loc)    ((unsigned long)((loc) >> 8))
+
+struct scan_stats {
+    unsigned long passes;
+    unsigned long candidates;
+    unsigned long mismatches;
+    unsigned long shared;
+};
+
+static xc_interface *xch;
+static xc_evtchn *xce;
+static struct scan_domain domains[MAX_DOMAINS];
+static int nr_domains;
+
+static struct hash_slot *table;
+static unsigned long table_size;
+
+static struct scan_stats stats;
+
+/* pages per second */
+static unsigned long scan_rate = 20000;
+/* percentage of one cpu */
+static unsigned int cpu_budget = 10;
+/* seconds between passes */
+static unsigned int interval = 60;
+
+static volatile sig_atomic_t interrupted;
+static volatile sig_atomic_t report_requested;
+
+static void usage(void)
+{
+    printf("usage:\n\n");
+
+    printf("  xen-memshrd [options] <domain_id>...\n\n");
+
+    printf("options:\n");
+    printf(" -r <pages>     --rate=<pages>           pages scanned per second, default %lu.\n", scan_rate);
+    printf(" -c <percent>   --cpu=<percent>          cpu time the scanner may use, default %u.\n", cpu_budget);
+    printf(" -i <seconds>   --interval=<seconds>     pause between passes, default %u.\n", interval);
+    printf(" -o             --once                   exit after one pass.\n");
+    printf(" -f             --foreground             do not daemonize, log to stderr.\n");
+    printf(" -h             --help                   this output.\n");
+}
+
+static void close_handler(int sig)
+{
+    interrupted = sig;
+}
+
+static void report_handler(int sig)
+{
+    report_requested = 1;
+}
+
+static double now(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Sharing ring setup, as done by the other mem_event listeners */
+static int ring_init(struct scan_domain *sd)
+{
+    unsigned long ring_pfn;
+    xen_pfn_t mmap_pfn;
+    uint32_t remote_port;
+    int rc;
+
+    if ( xc_get_hvm_param(xch, sd->domid, HVM_PARAM_SHARING_RING_PFN,
+                          &ring_pfn) )
+        return -1;
+
+    mmap_pfn = ring_pfn;
+    sd->ring_page = xc_map_foreign_batch(xch, sd->domid,
+                                         PROT_READ | PROT_WRITE, &mmap_pfn, 1);
+    if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+    {
+        if ( sd->ring_page )
+            munmap(sd->ring_page, PAGE_SIZE_4K);
+        mmap_pfn = ring_pfn;
+        if ( xc_domain_populate_physmap_exact(xch, sd->domid, 1, 0, 0,
+                                              &mmap_pfn) )
+        {
+            sd->ring_page = NULL;
+            return -1;
+        }
+        mmap_pfn = ring_pfn;
+        sd->ring_page = xc_map_foreign_batch(xch, sd->domid,
+                                             PROT_READ | PROT_WRITE,
+                                             &mmap_pfn, 1);
+        if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+        {
+            if ( sd->ring_page )
+                munmap(sd->ring_page, PAGE_SIZE_4K);
+            sd->ring_page = NULL;
+            return -1;
+        }
+    }
+
+    if ( xc_memshr_ring_enable(xch, sd->domid, &remote_port) )
+        goto err;
+
+    rc = xc_evtchn_bind_interdomain(xce, sd->domid, remote_port);
+    if ( rc < 0 )
+    {
+        xc_memshr_ring_disable(xch, sd->domid);
+        goto err;
+    }
+    sd->port = rc;
+
+    SHARED_RING_INIT((mem_event_sring_t *)sd->ring_page);
+    BACK_RING_INIT(&sd->back_ring, (mem_event_sring_t *)sd->ring_page,
+                   PAGE_SIZE_4K);
+
+    mmap_pfn = ring_pfn;
+    if ( xc_domain_decrease_reservation_exact(xch, sd->domid, 1, 0,
+                                              &mmap_pfn) )
+        EPRINTF("dom%u: failed to remove ring from guest physmap\n",
+                sd->domid);
+
+    return 0;
+
+ err:
+    munmap(sd->ring_page, PAGE_SIZE_4K);
+    sd->ring_page = NULL;
+    return -1;
+}
+
+static void ring_teardown(struct scan_domain *sd)
+{
+    if ( !sd->ring_page )
+        return;
+
+    if ( !sd->gone )
+        xc_memshr_ring_disable(xch, sd->domid);
+    xc_evtchn_unbind(xce, sd->port);
+    munmap(sd->ring_page, PAGE_SIZE_4K);
+    sd->ring_page = NULL;
+}
+
+static int domain_init(struct scan_domain *sd, domid_t domid)
+{
+    xc_dominfo_t info;
+    int max_gpfn;
+
+    sd->domid = domid;
+
+    if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 ||
+         info.domid != domid )
+    {
+        EPRINTF("dom%u does not exist\n", domid);
+        return -1;
+    }
+    if ( !info.hvm )
+    {
+        EPRINTF("dom%u: sharing needs an HVM domain\n", domid);
+        return -1;
+    }
+
+    max_gpfn = xc_domain_maximum_gpfn(xch, domid);
+    if ( max_gpfn < 0 )
+    {
+        EPRINTF("dom%u: cannot get the maximum gpfn\n", domid);
+        return -1;
+    }
+    sd->max_gpfn = max_gpfn;
+
+    sd->hot = bitmap_alloc(sd->max_gpfn + 1);
+    if ( !sd->hot )
+        return -1;
+
+    if ( xc_memshr_control(xch, domid, 1) )
+    {
+        EPRINTF("dom%u: cannot enable sharing: %s\n", domid, strerror(errno));
+        return -1;
+    }
+
+    /* Without the ring Xen pauses the vcpu until memory turns up */
+    if ( ring_init(sd) )
+        EPRINTF("dom%u: no sharing ring, unshare failures are not seen\n",
+                domid);
+
+    return 0;
+}
+
+static int table_alloc(void)
+{
+    unsigned long pages = 0;
+    int i;
+
+    for ( i = 0; i < nr_domains; i++ )
+        pages += domains[i].max_gpfn + 1;
+
+    /* At most half full */
+    for ( table_size = 1024; table_size < 2 * pages; table_size <<= 1 )
+        ;
+
+    table = calloc(table_size, sizeof(*table));
+    return table ? 0 : -1;
+}
+
+/*
+ * Returns the slot for hash: either the one that holds it, or the free
+ * slot where it should be inserted.
+ */
+static struct hash_slot *table_lookup(uint64_t hash)
+{
+    unsigned long i = hash & (table_size - 1);
+
+    while ( table[i].loc && table[i].hash != hash )
+        i = (i + 1) & (table_size - 1);
+
+    return &table[i];
+}
+
+/* Map a single page read-only and compare it against buf */
+static int page_compare(struct scan_domain *sd, unsigned long gfn,
+                        const void *buf)
+{
+    void *p;
+    int rc;
+
+    p = xc_map_foreign_range(xch, sd->domid, PAGE_SIZE_4K, PROT_READ, gfn);
+    if ( !p )
+        return -1;
+    rc = memcmp(p, buf, PAGE_SIZE_4K) ? 1 : 0;
+    munmap(p, PAGE_SIZE_4K);
+    return rc;
+}
+
+/*
+ * Share the page at client_gfn with the one recorded in slot.  Returns 1 if
+ * the pages were shared, 0 if they were already, and -1 if they could not
+ * be shared, in which case slot is pointed at the client page so later
+ * pages with its contents are compared against it.
+ */
+static int try_share(struct hash_slot *slot, int client_idx,
+                     unsigned long client_gfn)
+{
+    struct scan_domain *sd = &domains[LOC_IDX(slot->loc)];
+    struct scan_domain *cd = &domains[client_idx];
+    unsigned long source_gfn = LOC_GFN(slot->loc);
+    uint64_t sh, ch;
+    void *buf;
+    int rc;
+
+    stats.candidates++;
+
+    if ( xc_memshr_nominate_gfn(xch, sd->domid, source_gfn, &sh) )
+        goto replace;
+    if ( xc_memshr_nominate_gfn(xch, cd->domid, client_gfn, &ch) )
+        return -1;
+    if ( sh == ch )
+        return 0;
+
+    /* Both pages are read-only for the guests now, compare them */
+    buf = xc_map_foreign_range(xch, sd->domid, PAGE_SIZE_4K, PROT_READ,
+                               source_gfn);
+    if ( !buf )
+        goto replace;
+    rc = page_compare(cd, client_gfn, buf);
+    munmap(buf, PAGE_SIZE_4K);
+    if ( rc )
+    {
+        stats.mismatches++;
+        goto replace;
+    }
+
+    if ( xc_memshr_share_gfns(xch, sd->domid, source_gfn, sh,
+                              cd->domid, client_gfn, ch) )
+        goto replace;
+
+    cd->shared++;
+    stats.shared++;
+    return 1;
+
+ replace:
+    slot->loc = LOC(client_idx, client_gfn);
+    return -1;
+}
+
+/* Drain the sharing ring of a domain, see the comment at the top */
+static void handle_enomem(struct scan_domain *sd)
+{
+    mem_event_back_ring_t *back_ring = &sd->back_ring;
+    mem_event_request_t req;
+    mem_event_response_t rsp;
+    xc_physinfo_t physinfo;
+    int i, nr = 0;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        if ( req.gfn <= sd->max_gpfn )
+            set_bit(req.gfn, sd->hot);
+        sd->enomem++;
+        nr++;
+
+        memset(&rsp, 0, sizeof(rsp));
+        rsp.gfn = req.gfn;
+        rsp.vcpu_id = req.vcpu_id;
+        rsp.flags = req.flags;
+        memcpy(RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt),
+               &rsp, sizeof(rsp));
+        back_ring->rsp_prod_pvt++;
+    }
+
+    if ( !nr )
+        return;
+
+    sd->backoff = sd->backoff ? sd->backoff * 2 : BACKOFF_MIN;
+    if ( sd->backoff > BACKOFF_MAX )
+        sd->backoff = BACKOFF_MAX;
+    sd->backoff_until = time(NULL) + sd->backoff;
+    EPRINTF("dom%u: %d unshare failures for lack of memory, backing off "
+            "for %us\n", sd->domid, nr, sd->backoff);
+
+    /* Retrying right away would fail again, give the host a second */
+    for ( i = 0; i < 100 && !interrupted; i++ )
+    {
+        memset(&physinfo, 0, sizeof(physinfo));
+        if ( xc_physinfo(xch, &physinfo) || physinfo.free_pages )
+            break;
+        usleep(10000);
+    }
+
+    RING_PUSH_RESPONSES(back_ring);
+    if ( xc_memshr_domain_resume(xch, sd->domid) )
+        EPRINTF("dom%u: resume failed: %s\n", sd->domid, strerror(errno));
+}
+
+static void poll_events(int timeout_ms)
+{
+    struct pollfd fd = { .fd = xc_evtchn_fd(xce), .events = POLLIN };
+    evtchn_port_or_error_t port;
+    int i;
+
+    if ( poll(&fd, 1, timeout_ms) <= 0 )
+        return;
+
+    while ( (port = xc_evtchn_pending(xce)) >= 0 )
+    {
+        xc_evtchn_unmask(xce, port);
+        for ( i = 0; i < nr_domains; i++ )
+            if ( domains[i].ring_page && domains[i].port == port )
+                handle_enomem(&domains[i]);
+        if ( poll(&fd, 1, 0) <= 0 )
+            break;
+    }
+}
+
+static void report(void)
+{
+    xc_dominfo_t info;
+    long freed;
+    int i;
+
+    for ( i = 0; i < nr_domains; i++ )
+    {
+        struct scan_domain *sd = &domains[i];
+
+        if ( sd->gone )
+            continue;
+        if ( xc_domain_getinfo(xch, sd->domid, 1, &info) != 1 ||
+             info.domid != sd->domid )
+            continue;
+        DPRINTF("dom%u: %lu shared pages, %lu pages scanned, %lu shared by "
+                "us, %lu unshare failures\n", sd->domid,
+                info.nr_shared_pages, sd->scanned, sd->shared, sd->enomem);
+    }
+
+    freed = xc_sharing_freed_pages(xch);
+    DPRINTF("%lu passes, %lu candidates, %lu mismatches, %lu pages shared; "
+            "host saves %ld MiB (%ld pages in %ld shared frames)\n",
+            stats.passes, stats.candidates, stats.mismatches, stats.shared,
+            freed >> 8, freed, xc_sharing_used_frames(xch));
+}
+
+static void wait_events(int timeout_ms)
+{
+    poll_events(timeout_ms);
+
+    if ( report_requested )
+    {
+        report_requested = 0;
+        report();
+    }
+}
+
+/*
+ * Sleep long enough to stay within the scan rate and the cpu budget, while
+ * still answering unshare failures.
+ */
+static void throttle(double start, double cpu_start, unsigned long scanned)
+{
+    double wall = now(CLOCK_MONOTONIC) - start;
+    double cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+    double delay = 0;
+
+    if ( scan_rate && (double)scanned / scan_rate > wall )
+        delay = (double)scanned / scan_rate - wall;
+    if ( cpu_budget && cpu * 100 / cpu_budget - wall > delay )
+        delay = cpu * 100 / cpu_budget - wall;
+
+    wait_events(delay * 1000);
+}
+
+static void domain_check(struct scan_domain *sd)
+{
+    xc_dominfo_t info;
+
+    if ( xc_domain_getinfo(xch, sd->domid, 1, &info) != 1 ||
+         info.domid != sd->domid || info.dying )
+    {
+        DPRINTF("dom%u is gone\n", sd->domid);
+        sd->gone = 1;
+        ring_teardown(sd);
+    }
+}
+
+static void scan_domain(int idx, double start, double cpu_start,
+                        unsigned long *scanned)
+{
+    struct scan_domain *sd = &domains[idx];
+    xen_pfn_t gfns[SCAN_BATCH];
+    int err[SCAN_BATCH];
+    uint64_t hashes[SCAN_BATCH];
+    struct hash_slot *slot;
+    unsigned long gfn, first;
+    unsigned int i, n;
+    char *map;
+
+    for ( first = 0; first <= sd->max_gpfn && !interrupted; first += n )
+    {
+        if ( time(NULL) < sd->backoff_until )
+            return;
+
+        n = 0;
+        for ( gfn = first; gfn <= sd->max_gpfn && n < SCAN_BATCH; gfn++ )
+            gfns[n++] = gfn;
+
+        map = xc_map_foreign_bulk(xch, sd->domid, PROT_READ, gfns, err, n);
+        if ( !map )
+        {
+            domain_check(sd);
+            if ( sd->gone )
+                return;
+            continue;
+        }
+
+        for ( i = 0; i < n; i++ )
+            if ( !err[i] && !test_bit(gfns[i], sd->hot) )
+                hashes[i] = page_hash(map + i * PAGE_SIZE_4K);
+        /* Pages must not be mapped while they are being nominated */
+        munmap(map, n * PAGE_SIZE_4K);
+
+        for ( i = 0; i < n; i++ )
+        {
+            if ( err[i] || test_bit(gfns[i], sd->hot) )
+                continue;
+
+            sd->scanned++;
+            slot = table_lookup(hashes[i]);
+            if ( !slot->loc )
+            {
+                slot->hash = hashes[i];
+                slot->loc = LOC(idx, gfns[i]);
+            }
+            else if ( slot->loc != LOC(idx, gfns[i]) )
+                try_share(slot, idx, gfns[i]);
+        }
+
+        *scanned += n;
+        throttle(start, cpu_start, *scanned);
+    }
+
+    /* A full pass without trouble, start over with a short backoff */
+    if ( first > sd->max_gpfn )
+        sd->backoff = 0;
+}
+
+static void scan_pass(void)
+{
+    double start = now(CLOCK_MONOTONIC);
+    double cpu_start = now(CLOCK_PROCESS_CPUTIME_ID);
+    unsigned long scanned = 0;
+    int i;
+
+    memset(table, 0, table_size * sizeof(*table));
+
+    for ( i = 0; i < nr_domains && !interrupted; i++ )
+        if ( !domains[i].gone )
+            scan_domain(i, start, cpu_start, &scanned);
+
+    stats.passes++;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sigaction act;
+    int ch, i, rc = 1, once = 0, foreground = 0;
+    unsigned long domid;
+    double next;
+    static const char sopts[] = "hr:c:i:of";
+    static const struct option lopts[] = {
+        {"help", 0, NULL, 'h'},
+        {"rate", 1, NULL, 'r'},
+        {"cpu", 1, NULL, 'c'},
+        {"interval", 1, NULL, 'i'},
+        {"once", 0, NULL, 'o'},
+        {"foreground", 0, NULL, 'f'},
+        { }
+    };
+
+    while ( (ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'r':
+            scan_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            cpu_budget = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            once = 1;
+            break;
+        case 'f':
+            foreground = 1;
+            break;
+        case 'h':
+        case '?':
+            usage();
+            return 1;
+        }
+    }
+
+    if ( optind == argc || argc - optind > MAX_DOMAINS )
+    {
+        usage();
+        return 1;
+    }
+
+    openlog("xen-memshrd", LOG_PID | (foreground ? LOG_PERROR : 0),
+            LOG_DAEMON);
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    xce = xc_evtchn_open(NULL, 0);
+    if ( !xch || !xce )
+    {
+        EPRINTF("cannot open the hypervisor interfaces\n");
+        return 2;
+    }
+
+    for ( ; optind < argc; optind++ )
+    {
+        domid = strtoul(argv[optind], NULL, 0);
+        if ( domain_init(&domains[nr_domains], domid) )
+            goto out;
+        nr_domains++;
+    }
+
+    if ( table_alloc() )
+    {
+        EPRINTF("cannot allocate the hash table\n");
+        goto out;
+    }
+
+    DPRINTF("scanning %d domains with %s hashing, %lu pages/s, %u%% cpu\n",
+            nr_domains, page_hash_init(), scan_rate, cpu_budget);
+
+    if ( !foreground && daemon(0, 0) )
+    {
+        EPRINTF("daemon: %s\n", strerror(errno));
+        goto out;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = close_handler;
+    sigaction(SIGHUP, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+    act.sa_handler = report_handler;
+    sigaction(SIGUSR1, &act, NULL);
+
+    while ( !interrupted )
+    {
+        scan_pass();
+        report();
+        if ( once )
+            break;
+
+        next = now(CLOCK_MONOTONIC) + interval;
+        while ( !interrupted && now(CLOCK_MONOTONIC) < next )
+            wait_events(1000);
+
+        for ( i = 0; i < nr_domains; i++ )
+            if ( !domains[i].gone )
+                domain_check(&domains[i]);
+    }
+    rc = 0;
+
+ out:
+    for ( i = 0; i < nr_domains; i++ )
+        ring_teardown(&domains[i]);
+    free(table);
+    xc_evtchn_close(xce);
+    xc_interface_close(xch);
+    closelog();
+
+    return rc;
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,119 @@
+/******************************************************************************
+ *
+ * Page content hashing for the memory sharing scanner.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The hash only has to find candidates, every match is compared byte for
+ * byte before pages are shared, so speed matters far more than quality.
+ * Both implementations run four independent lanes over interleaved words
+ * to keep the multiplier or crc unit busy, and fold the lanes at the end.
+ */
+
+#include <stddef.h>
+#include "page-hash.h"
+
+#define PAGE_WORDS  (4096 / sizeof(uint64_t))
+
+#define PRIME1  0x9e3779b185ebca87ULL
+#define PRIME2  0xc2b2ae3d27d4eb4fULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fold(uint64_t a, uint64_t b, uint64_t c, uint64_t d)
+{
+    uint64_t h;
+
+    h = rotl64(a, 1) + rotl64(b, 7) + rotl64(c, 12) + rotl64(d, 18);
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    return h;
+}
+
+static uint64_t page_hash_generic(const void *page)
+{
+    const uint64_t *w = page;
+    uint64_t a = PRIME1, b = PRIME2, c = 0, d = -PRIME1;
+    size_t i;
+
+    for ( i = 0; i < PAGE_WORDS; i += 4 )
+    {
+        a = rotl64(a + w[i] * PRIME2, 31) * PRIME1;
+        b = rotl64(b + w[i + 1] * PRIME2, 31) * PRIME1;
+        c = rotl64(c + w[i + 2] * PRIME2, 31) * PRIME1;
+        d = rotl64(d + w[i + 3] * PRIME2, 31) * PRIME1;
+    }
+
+    return fold(a, b, c, d);
+}
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+
+/* SSE4.2 crc32: one word per cycle per lane, on any cpu since Nehalem */
+__attribute__((target("sse4.2")))
+static uint64_t page_hash_crc32(const void *page)
+{
+    const uint64_t *w = page;
+    uint64_t a = 0, b = 1, c = 2, d = 3;
+    size_t i;
+
+    for ( i = 0; i < PAGE_WORDS; i += 4 )
+    {
+        a = __builtin_ia32_crc32di(a, w[i]);
+        b = __builtin_ia32_crc32di(b, w[i + 1]);
+        c = __builtin_ia32_crc32di(c, w[i + 2]);
+        d = __builtin_ia32_crc32di(d, w[i + 3]);
+    }
+
+    /* Each lane is a 32 bit crc, spread them over the whole result */
+    return fold(a << 32 | b, b << 32 | c, c << 32 | d, d << 32 | a);
+}
+
+static int cpu_has_sse4_2(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if ( !__get_cpuid(1, &eax, &ebx, &ecx, &edx) )
+        return 0;
+    return !!(ecx & bit_SSE4_2);
+}
+#endif
+
+static uint64_t (*hash_fn)(const void *) = page_hash_generic;
+
+const char *page_hash_init(void)
+{
+#if defined(__x86_64__)
+    if ( cpu_has_sse4_2() )
+    {
+        hash_fn = page_hash_crc32;
+        return "crc32";
+    }
+#endif
+    hash_fn = page_hash_generic;
+    return "generic";
+}
+
+uint64_t page_hash(const void *page)
+{
+    return hash_fn(page);
+}
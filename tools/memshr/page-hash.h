@@ -0,0 +1,29 @@
+/******************************************************************************
+ *
+ * Page content hashing for the memory sharing scanner.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef __PAGE_HASH_H__
+#define __PAGE_HASH_H__
+
+#include <stdint.h>
+
+/* Pick the fastest implementation the cpu supports, returns its name */
+extern const char *page_hash_init(void);
+/* 64-bit hash of a 4k page, equal pages always hash equal */
+extern uint64_t page_hash(const void *page);
+
+#endif /* __PAGE_HASH_H__ */
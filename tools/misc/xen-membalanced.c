@@ -0,0 +1,703 @@
+/******************************************************************************
+ *
+ * xen-membalanced: moves memory between domains according to their memory
+ * pressure, by driving their balloon targets.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every interval the daemon samples each guest:
+ *  - memory/meminfo, as written by xenballoond in the guest, for
+ *    Committed_AS, the memory the guest's workload has asked for;
+ *  - memory/vmstat, for the pages swapped in and out since the last round;
+ *  - optionally tmem, whose persistent puts are pages the guest swapped to
+ *    frontswap;
+ *  - the balloon target and the memory the domain really holds, which
+ *    tells whether the balloon driver kept up with the last target.
+ *
+ * A guest wants its Committed_AS plus some headroom, and more when it is
+ * swapping.  Wants are bounded by the guest's guaranteed minimum and its
+ * static maximum.  When the host cannot satisfy all wants, each guest gets
+ * its minimum plus a share of the rest proportional to what it wants above
+ * its minimum.  Targets then only move by more than the hysteresis, by at
+ * most one step per round, and only shrink after a guest has wanted less
+ * for several rounds in a row.  Shrinks are applied before grows, and grows
+ * never hand out more than the host has free above the reserve.
+ *
+ * Each round can be recorded to a trace, and a trace can be replayed in
+ * place of the live system to try out a policy offline.  The replay keeps
+ * the recorded pressure and applies the targets the policy computes.
+ *
+ * Trace lines:
+ *   H <round> <host free kB>
+ *   D <round> <domid> <target kB> <current kB> <max kB> <min kB>
+ *     <committed kB> <swapped pages, cumulative>
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <xenstore.h>
+#include <libxl.h>
+
+#define MAX_DOMAINS     256
+#define BUFSZ           512
+
+#define DPRINTF(_f, _a...) syslog(LOG_INFO, _f, ##_a)
+#define EPRINTF(_f, _a...) syslog(LOG_ERR, "%s: " _f, __func__, ##_a)
+
+#define MB(_kb)         ((_kb) >> 10)
+
+struct bal_domain {
+    uint32_t domid;
+    int seen;
+
+    /* sampled, in kB as taken by libxl_set_memory_target */
+    uint64_t target;
+    uint64_t current;
+    uint64_t max;
+    uint64_t min;
+    /* Committed_AS, 0 if the guest does not report it */
+    uint64_t committed;
+    /* pages swapped in and out, and put to persistent tmem */
+    uint64_t swap;
+    uint64_t swapped;
+    int have_swap;
+
+    uint64_t want;
+    unsigned int down_rounds;
+
+    /* for the summary */
+    unsigned long changes;
+    unsigned long deficit_rounds;
+    uint64_t moved;
+};
+
+static struct bal_domain domains[MAX_DOMAINS];
+static int nr_domains;
+
+static libxl_ctx *ctx;
+static xentoollog_logger_stdiostream *logger;
+static struct xs_handle *xsh;
+
+static FILE *record_file;
+static FILE *replay_file;
+static char replay_line[BUFSZ];
+static uint64_t replay_host_kb;
+
+/* seconds between rounds */
+static unsigned int interval = 5;
+/* guaranteed minimum of a guest, in MiB, unless memory/balance-min says */
+static unsigned long min_mb = 256;
+/* kept free on the host, in MiB */
+static unsigned long reserve_mb = 128;
+/* wanted on top of Committed_AS, in percent */
+static unsigned int headroom = 10;
+/* smallest target change, in MiB */
+static unsigned long hysteresis_mb = 32;
+/* largest target change per round, in MiB */
+static unsigned long step_mb = 256;
+/* rounds a guest must want less before it is shrunk */
+static unsigned int down_delay = 3;
+static int use_tmem;
+static int dry_run;
+
+static volatile sig_atomic_t interrupted;
+
+static void usage(void)
+{
+    printf("usage:\n\n");
+
+    printf("  xen-membalanced [options]\n\n");
+
+    printf("options:\n");
+    printf(" -i <seconds>   --interval=<seconds>     time between rounds, default %u.\n", interval);
+    printf(" -m <MiB>       --min=<MiB>              guaranteed memory of a guest, default %lu.\n", min_mb);
+    printf(" -r <MiB>       --reserve=<MiB>          memory kept free on the host, default %lu.\n", reserve_mb);
+    printf(" -H <percent>   --headroom=<percent>     memory wanted above Committed_AS, default %u.\n", headroom);
+    printf(" -y <MiB>       --hysteresis=<MiB>       smallest target change, default %lu.\n", hysteresis_mb);
+    printf(" -s <MiB>       --step=<MiB>             largest target change per round, default %lu.\n", step_mb);
+    printf(" -d <rounds>    --down-delay=<rounds>    rounds of lower demand before shrinking, default %u.\n", down_delay);
+    printf(" -t             --tmem                   count tmem persistent puts as swapping.\n");
+    printf(" -n             --dry-run                log the targets, do not set them.\n");
+    printf(" -w <file>      --record=<file>          record every round to a trace.\n");
+    printf(" -S <file>      --simulate=<file>        replay a trace instead of the live system.\n");
+    printf(" -o             --once                   exit after one round.\n");
+    printf(" -f             --foreground             do not daemonize, log to stderr.\n");
+    printf(" -h             --help                   this output.\n");
+}
+
+static void close_handler(int sig)
+{
+    interrupted = sig;
+}
+
+static struct bal_domain *domain_get(uint32_t domid)
+{
+    struct bal_domain *d;
+    int i;
+
+    for ( i = 0; i < nr_domains; i++ )
+        if ( domains[i].domid == domid )
+            return &domains[i];
+    if ( nr_domains == MAX_DOMAINS )
+        return NULL;
+    d = &domains[nr_domains++];
+    memset(d, 0, sizeof(*d));
+    d->domid = domid;
+    return d;
+}
+
+/* Forget the domains which were not seen this round */
+static void domains_prune(void)
+{
+    int i, j;
+
+    for ( i = j = 0; i < nr_domains; i++ )
+        if ( domains[i].seen )
+            domains[j++] = domains[i];
+    nr_domains = j;
+}
+
+/* The number following key in buf, as in "key: 123" or "key 123" */
+static uint64_t parse_field(const char *buf, const char *key)
+{
+    const char *p = buf ? strstr(buf, key) : NULL;
+
+    if ( p == NULL )
+        return 0;
+    p += strlen(key);
+    while ( *p == ':' || *p == ' ' || *p == '\t' )
+        p++;
+    return strtoull(p, NULL, 10);
+}
+
+static char *xs_read_domain(uint32_t domid, const char *node)
+{
+    char path[BUFSZ];
+    unsigned int len;
+
+    snprintf(path, sizeof(path), "/local/domain/%u/memory/%s", domid, node);
+    return xs_read(xsh, XBT_NULL, path, &len);
+}
+
+static int xs_read_domain_kb(uint32_t domid, const char *node, uint64_t *kb)
+{
+    char *s = xs_read_domain(domid, node);
+
+    if ( s == NULL )
+        return -1;
+    *kb = strtoull(s, NULL, 10);
+    free(s);
+    return 0;
+}
+
+/* Pages each tmem client put to persistent pools, from TMEMC_LIST */
+static uint64_t tmem_persistent_puts(const char *list, uint32_t domid)
+{
+    char key[32];
+    const char *p;
+
+    if ( list == NULL )
+        return 0;
+    snprintf(key, sizeof(key), "C=CI:%u,", domid);
+    if ( (p = strstr(list, key)) == NULL )
+        return 0;
+    return parse_field(strstr(p, ",Pp:"), ",Pp");
+}
+
+static int collect_live(uint64_t *free_kb)
+{
+    libxl_dominfo *info;
+    struct bal_domain *d;
+    char *meminfo, *vmstat, *tmem = NULL, *s;
+    uint64_t videoram, swap;
+    uint32_t memkb;
+    int i, nr;
+
+    if ( libxl_get_free_memory(ctx, &memkb) )
+    {
+        EPRINTF("cannot get the host free memory\n");
+        return -1;
+    }
+    *free_kb = memkb;
+
+    if ( (info = libxl_list_domain(ctx, &nr)) == NULL )
+    {
+        EPRINTF("cannot list the domains\n");
+        return -1;
+    }
+    if ( use_tmem )
+        tmem = libxl_tmem_list(ctx, (uint32_t)-1, 0);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( info[i].domid == 0 || info[i].dying || info[i].shutdown )
+            continue;
+
+        /* opted out */
+        s = xs_read_domain(info[i].domid, "balance");
+        if ( s != NULL && !strcmp(s, "0") )
+        {
+            free(s);
+            continue;
+        }
+        free(s);
+
+        if ( (d = domain_get(info[i].domid)) == NULL )
+            break;
+
+        /* memory/target does not include the video memory, libxl does */
+        if ( xs_read_domain_kb(d->domid, "target", &d->target) ||
+             xs_read_domain_kb(d->domid, "static-max", &d->max) )
+            continue;
+        if ( xs_read_domain_kb(d->domid, "videoram", &videoram) )
+            videoram = 0;
+        d->target += videoram;
+        d->current = info[i].current_memkb;
+        if ( xs_read_domain_kb(d->domid, "balance-min", &d->min) )
+            d->min = (uint64_t)min_mb << 10;
+
+        meminfo = xs_read_domain(d->domid, "meminfo");
+        d->committed = parse_field(meminfo, "Committed_AS");
+        free(meminfo);
+
+        vmstat = xs_read_domain(d->domid, "vmstat");
+        swap = parse_field(vmstat, "pswpin") + parse_field(vmstat, "pswpout");
+        free(vmstat);
+        swap += tmem_persistent_puts(tmem, d->domid);
+
+        d->swapped = (d->have_swap && swap >= d->swap) ? swap - d->swap : 0;
+        d->swap = swap;
+        d->have_swap = 1;
+        d->seen = 1;
+    }
+
+    free(tmem);
+    libxl_dominfo_list_free(info, nr);
+    return 0;
+}
+
+/*
+ * Reads the lines of the next round of the trace.  The targets and the
+ * current memory of the domains are the simulated ones, and the host free
+ * memory follows from them.
+ */
+static int collect_replay(uint64_t *free_kb)
+{
+    struct bal_domain *d, rec;
+    unsigned long round, r;
+    uint64_t host_free = 0, used = 0, swap;
+    int first = !replay_host_kb, have_host = 0, i;
+
+    while ( replay_line[0] != 'H' && replay_line[0] != 'D' )
+        if ( !fgets(replay_line, sizeof(replay_line), replay_file) )
+            return -1;
+
+    round = strtoul(replay_line + 1, NULL, 10);
+    do {
+        if ( replay_line[0] == 'H' &&
+             sscanf(replay_line, "H %lu %"SCNu64, &r, &host_free) == 2 )
+        {
+            if ( r != round )
+                break;
+            have_host = 1;
+        }
+        else if ( replay_line[0] == 'D' &&
+                  sscanf(replay_line, "D %lu %u %"SCNu64" %"SCNu64" %"SCNu64
+                         " %"SCNu64" %"SCNu64" %"SCNu64, &r, &rec.domid,
+                         &rec.target, &rec.current, &rec.max, &rec.min,
+                         &rec.committed, &swap) == 8 )
+        {
+            if ( r != round )
+                break;
+            if ( (d = domain_get(rec.domid)) == NULL )
+                continue;
+            /* a new domain starts where the trace has it */
+            if ( !d->have_swap )
+            {
+                d->target = rec.target;
+                d->current = rec.current;
+            }
+            d->max = rec.max;
+            d->min = rec.min;
+            d->committed = rec.committed;
+            d->swapped = (d->have_swap && swap >= d->swap) ? swap - d->swap : 0;
+            d->swap = swap;
+            d->have_swap = 1;
+            d->seen = 1;
+        }
+    } while ( fgets(replay_line, sizeof(replay_line), replay_file) ||
+              (replay_line[0] = '\0') );
+
+    for ( i = 0; i < nr_domains; i++ )
+        if ( domains[i].seen )
+            used += domains[i].current;
+    if ( first )
+    {
+        if ( !have_host )
+            return -1;
+        replay_host_kb = host_free + used;
+    }
+    *free_kb = replay_host_kb > used ? replay_host_kb - used : 0;
+    return 0;
+}
+
+static void record_round(unsigned long round, uint64_t free_kb)
+{
+    struct bal_domain *d;
+    int i;
+
+    fprintf(record_file, "H %lu %"PRIu64"\n", round, free_kb);
+    for ( i = 0; i < nr_domains; i++ )
+    {
+        d = &domains[i];
+        fprintf(record_file, "D %lu %u %"PRIu64" %"PRIu64" %"PRIu64
+                " %"PRIu64" %"PRIu64" %"PRIu64"\n", round, d->domid,
+                d->target, d->current, d->max, d->min, d->committed, d->swap);
+    }
+    fflush(record_file);
+}
+
+/* Sets each domain's want, shared out of what the host can give */
+static void compute_wants(uint64_t free_kb)
+{
+    uint64_t reserve = (uint64_t)reserve_mb << 10;
+    uint64_t step = (uint64_t)step_mb << 10;
+    uint64_t pool = 0, sum_min = 0, sum_want = 0, grow;
+    struct bal_domain *d;
+    int i;
+
+    for ( i = 0; i < nr_domains; i++ )
+    {
+        d = &domains[i];
+        if ( d->min > d->max )
+            d->min = d->max;
+
+        if ( d->committed )
+            d->want = d->committed * (100 + headroom) / 100;
+        else
+            d->want = d->target;
+        /* swapping means Committed_AS undersells the working set */
+        if ( d->swapped )
+        {
+            grow = d->swapped * 4;
+            if ( grow > step )
+                grow = step;
+            if ( d->want < d->target + grow )
+                d->want = d->target + grow;
+        }
+        if ( d->want < d->min )
+            d->want = d->min;
+        if ( d->want > d->max )
+            d->want = d->max;
+
+        pool += d->current;
+        sum_min += d->min;
+        sum_want += d->want;
+    }
+
+    pool += free_kb > reserve ? free_kb - reserve : 0;
+    if ( sum_want <= pool )
+        return;
+
+    /* everyone gets their minimum, and a fair share of what is left */
+    for ( i = 0; i < nr_domains; i++ )
+    {
+        d = &domains[i];
+        if ( pool <= sum_min )
+            d->want = d->min;
+        else
+            d->want = d->min + (d->want - d->min) * (pool - sum_min) /
+                               (sum_want - sum_min);
+    }
+}
+
+static int set_target(struct bal_domain *d, uint64_t target)
+{
+    if ( replay_file == NULL && !dry_run &&
+         libxl_set_memory_target(ctx, d->domid, target, 0, 0) )
+    {
+        EPRINTF("cannot set the target of domain %u to %"PRIu64" kB\n",
+                d->domid, target);
+        return -1;
+    }
+
+    DPRINTF("domain %u: target %"PRIu64" -> %"PRIu64" MiB "
+            "(committed %"PRIu64" MiB, swapped %"PRIu64" pages)\n",
+            d->domid, MB(d->target), MB(target), MB(d->committed),
+            d->swapped);
+    d->changes++;
+    d->moved += target > d->target ? target - d->target : d->target - target;
+    d->target = target;
+    /* in a replay the balloon keeps up at once */
+    if ( replay_file != NULL )
+        d->current = target;
+    return 0;
+}
+
+static void apply_targets(uint64_t free_kb)
+{
+    uint64_t reserve = (uint64_t)reserve_mb << 10;
+    uint64_t hysteresis = (uint64_t)hysteresis_mb << 10;
+    uint64_t step = (uint64_t)step_mb << 10;
+    uint64_t budget = free_kb > reserve ? free_kb - reserve : 0;
+    uint64_t target;
+    struct bal_domain *d;
+    int i;
+
+    /* shrink first, their memory comes back to the host over time */
+    for ( i = 0; i < nr_domains; i++ )
+    {
+        d = &domains[i];
+        if ( d->want >= d->target || d->target - d->want < hysteresis )
+        {
+            d->down_rounds = 0;
+            continue;
+        }
+        if ( ++d->down_rounds < down_delay )
+            continue;
+        /* the balloon has not given back what it was asked to yet */
+        if ( d->current > d->target + hysteresis )
+            continue;
+        target = d->target - d->want > step ? d->target - step : d->want;
+        set_target(d, target);
+    }
+
+    for ( i = 0; i < nr_domains; i++ )
+    {
+        d = &domains[i];
+        if ( d->want <= d->target )
+            continue;
+        d->down_rounds = 0;
+        /* a guest below its guaranteed minimum is always topped up */
+        if ( d->target >= d->min )
+        {
+            if ( d->want - d->target < hysteresis )
+                continue;
+            /* the balloon has not taken what it was given yet */
+            if ( d->current + hysteresis < d->target )
+                continue;
+        }
+        target = d->want - d->target > step ? d->target + step : d->want;
+        if ( target < d->min )
+            target = d->min;
+        if ( target - d->target > budget )
+            target = d->target + budget;
+        if ( target == d->target )
+            continue;
+        budget -= target - d->target;
+        set_target(d, target);
+    }
+
+    for ( i = 0; i < nr_domains; i++ )
+        if ( domains[i].committed > domains[i].target )
+            domains[i].deficit_rounds++;
+}
+
+static void summary(unsigned long rounds, uint64_t free_sum)
+{
+    struct bal_domain *d;
+    int i;
+
+    printf("%lu rounds, host free memory %"PRIu64" MiB on average\n",
+           rounds, rounds ? MB(free_sum / rounds) : 0);
+    printf("domain  target MiB  changes  moved MiB  short rounds\n");
+    for ( i = 0; i < nr_domains; i++ )
+    {
+        d = &domains[i];
+        printf("%6u  %10"PRIu64"  %7lu  %9"PRIu64"  %12lu\n", d->domid,
+               MB(d->target), d->changes, MB(d->moved), d->deficit_rounds);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct sigaction act;
+    int ch, i, rc = 1, once = 0, foreground = 0;
+    unsigned long round = 0;
+    uint64_t free_kb = 0, free_sum = 0;
+    static const char sopts[] = "hi:m:r:H:y:s:d:tnw:S:of";
+    static const struct option lopts[] = {
+        {"help", 0, NULL, 'h'},
+        {"interval", 1, NULL, 'i'},
+        {"min", 1, NULL, 'm'},
+        {"reserve", 1, NULL, 'r'},
+        {"headroom", 1, NULL, 'H'},
+        {"hysteresis", 1, NULL, 'y'},
+        {"step", 1, NULL, 's'},
+        {"down-delay", 1, NULL, 'd'},
+        {"tmem", 0, NULL, 't'},
+        {"dry-run", 0, NULL, 'n'},
+        {"record", 1, NULL, 'w'},
+        {"simulate", 1, NULL, 'S'},
+        {"once", 0, NULL, 'o'},
+        {"foreground", 0, NULL, 'f'},
+        { }
+    };
+
+    while ( (ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'i':
+            interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            min_mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            reserve_mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'H':
+            headroom = strtoul(optarg, NULL, 0);
+            break;
+        case 'y':
+            hysteresis_mb = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            step_mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            down_delay = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            use_tmem = 1;
+            break;
+        case 'n':
+            dry_run = 1;
+            break;
+        case 'w':
+            if ( (record_file = fopen(optarg, "w")) == NULL )
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            if ( (replay_file = fopen(optarg, "r")) == NULL )
+            {
+                perror(optarg);
+                return 1;
+            }
+            foreground = 1;
+            break;
+        case 'h':
+        case '?':
+            usage();
+            return 1;
+        }
+    }
+
+    if ( optind != argc || step_mb == 0 )
+    {
+        usage();
+        return 1;
+    }
+
+    openlog("xen-membalanced", LOG_PID | (foreground ? LOG_PERROR : 0),
+            LOG_DAEMON);
+
+    if ( replay_file == NULL )
+    {
+        logger = xtl_createlogger_stdiostream(stderr, XTL_ERROR, 0);
+        if ( logger == NULL ||
+             libxl_ctx_alloc(&ctx, LIBXL_VERSION, 0,
+                             (xentoollog_logger *)logger) )
+        {
+            EPRINTF("cannot open libxl\n");
+            goto out;
+        }
+        if ( (xsh = xs_daemon_open()) == NULL )
+        {
+            EPRINTF("cannot open xenstore\n");
+            goto out;
+        }
+
+        if ( !foreground && daemon(0, 0) )
+        {
+            EPRINTF("daemon: %s\n", strerror(errno));
+            goto out;
+        }
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = close_handler;
+    sigaction(SIGHUP, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+
+    while ( !interrupted )
+    {
+        for ( i = 0; i < nr_domains; i++ )
+            domains[i].seen = 0;
+        if ( replay_file != NULL ? collect_replay(&free_kb)
+                                 : collect_live(&free_kb) )
+        {
+            if ( replay_file != NULL )
+                break;
+        }
+        else
+        {
+            domains_prune();
+            if ( record_file != NULL )
+                record_round(round, free_kb);
+            compute_wants(free_kb);
+            apply_targets(free_kb);
+            free_sum += free_kb;
+            round++;
+        }
+
+        if ( once )
+            break;
+        if ( replay_file == NULL )
+            sleep(interval);
+    }
+
+    if ( replay_file != NULL )
+        summary(round, free_sum);
+    rc = 0;
+
+ out:
+    if ( xsh )
+        xs_daemon_close(xsh);
+    libxl_ctx_free(ctx);
+    if ( logger )
+        xtl_logger_destroy((xentoollog_logger *)logger);
+    if ( record_file )
+        fclose(record_file);
+    if ( replay_file )
+        fclose(replay_file);
+    closelog();
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-set-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -118,6 +118,12 @@ void parse_global(char *s)
     unsigned long long pcd_tot_csize = parse(s,"Gz");
     unsigned long long deduped_puts = parse(s,"Gd");
     unsigned long long tot_good_eph_puts = parse(s,"Ep");
+    unsigned long long read_locks = parse(s,"Gr");
+    unsigned long long read_contended = parse(s,"Gc");
+    unsigned long long write_locks = parse(s,"Gw");
+    unsigned long long write_contended = parse(s,"Gx");
+    unsigned long long prealloc_hits = parse(s,"Ph");
+    unsigned long long prealloc_misses = parse(s,"Pu");
 
     printf("total tmem ops=%llu (errors=%llu) -- tmem pages avail=%llu\n",
            total_ops, errored_ops, avail_pages);
@@ -151,6 +157,10 @@ void parse_global(char *s)
            evicted_pgs, evict_attempts, relinq_pgs, relinq_attempts,
            max_evicts_per_relinq, total_flush_pool,
            global_eph_count, global_eph_max);
+    printf("locks: global read=%llu (contended=%llu) write=%llu "
+           "(contended=%llu) preallocated=%llu/%llu\n",
+           read_locks, read_contended, write_locks, write_contended,
+           prealloc_hits, prealloc_hits + prealloc_misses);
 }
 
 #define PARSE_CYC_COUNTER(s,x,prefix) unsigned long long \
@@ -187,12 +197,23 @@ void parse_time_stats(char *s)
     PRINTF_CYC_COUNTER(decompress,"decompression cycles:");
 }
 
+/* indexed by TMEM_CODEC_* */
+static const char *codec_names[] = { "lzo", "lz4" };
+
+static const char *codec_name(unsigned long codec)
+{
+    if ( codec >= sizeof(codec_names) / sizeof(codec_names[0]) )
+        return "?";
+    return codec_names[codec];
+}
+
 void parse_client(char *s)
 {
     unsigned long cli_id = parse(s,"CI");
     unsigned long weight = parse(s,"ww");
     unsigned long cap = parse(s,"ca");
     unsigned long compress = parse(s,"co");
+    unsigned long codec = parse(s,"cz");
     unsigned long frozen = parse(s,"fr");
     unsigned long long eph_count = parse(s,"Ec");
     unsigned long long max_eph_count = parse(s,"Em");
@@ -205,12 +226,12 @@ void parse_client(char *s)
     unsigned long long succ_pers_puts = parse(s,"Pp");
     unsigned long long succ_pers_gets = parse(s,"Gp");
 
-    printf("domid%lu: weight=%lu,cap=%lu,compress=%d,frozen=%d,"
+    printf("domid%lu: weight=%lu,cap=%lu,compress=%d,codec=%s,frozen=%d,"
            "total_cycles=%llu,succ_eph_gets=%llu,"
            "succ_pers_puts=%llu,succ_pers_gets=%llu,"
            "eph_count=%llu,max_eph=%llu,"
            "compression ratio=%lu%% (samples=%llu,poor=%llu,nomem=%llu)\n",
-           cli_id, weight, cap, compress?1:0, frozen?1:0,
+           cli_id, weight, cap, compress?1:0, codec_name(codec), frozen?1:0,
            total_cycles, succ_eph_gets, succ_pers_puts, succ_pers_gets, 
            eph_count, max_eph_count,
            compressed_pages ?  (long)((compressed_sum_size*100LL) /
@@ -241,6 +262,19 @@ void parse_pool(char *s)
     unsigned long long flushs = parse(s,"ft");
     unsigned long long flush_objs_found = parse(s,"os");
     unsigned long long flush_objs = parse(s,"ot");
+    unsigned long long lookups = parse(s,"Lk");
+    unsigned long long lookup_retries = parse(s,"Lr");
+    unsigned long long lookup_locked = parse(s,"Ll");
+    unsigned long long obj_contended = parse(s,"Lc");
+    unsigned long long write_locks = parse(s,"Lw");
+    unsigned long long write_contended = parse(s,"Lx");
+    unsigned long codec = parse(s,"Zc");
+    unsigned long long compress_puts = parse(s,"Zp");
+    unsigned long long compress_poor = parse(s,"Zn");
+    unsigned long long compress_bytes = parse(s,"Zb");
+    unsigned long long compress_cycles = parse(s,"Zy");
+    unsigned long long decompress_gets = parse(s,"Zg");
+    unsigned long long decompress_cycles = parse(s,"Zd");
 
     parse_string(s,"PT",pool_type,2);
     pool_type[2] = '\0';
@@ -249,7 +283,11 @@ void parse_pool(char *s)
     printf("domid%lu,id%lu[%s]:pgp=%llu(max=%llu) obj=%llu(%llu) "
            "objnode=%llu(%llu) puts=%llu/%llu/%llu(dup=%llu/%llu) "
            "gets=%llu/%llu(%llu%%) "
-           "flush=%llu/%llu flobj=%llu/%llu\n",
+           "flush=%llu/%llu flobj=%llu/%llu "
+           "lookups=%llu(retried=%llu,locked=%llu,obj_contended=%llu) "
+           "writes=%llu(contended=%llu) "
+           "%s=%llu%%(pages=%llu,poor=%llu,cyc/pg=%llu) "
+           "decomp=%llu(cyc/pg=%llu)\n",
            cli_id, pool_id, pool_type,
            pgp_count, max_pgp_count, obj_count, max_obj_count,
            objnode_count, max_objnode_count,
@@ -257,7 +295,17 @@ void parse_pool(char *s)
            dup_puts_flushed, dup_puts_replaced,
            found_gets, gets,
            gets ? (found_gets*100LL)/gets : 0,
-           flushs_found, flushs, flush_objs_found, flush_objs);
+           flushs_found, flushs, flush_objs_found, flush_objs,
+           lookups, lookup_retries, lookup_locked, obj_contended,
+           write_locks, write_contended,
+           codec_name(codec),
+           compress_puts ? (compress_bytes*100LL) /
+                           (compress_puts*PAGE_SIZE) : 0,
+           compress_puts, compress_poor,
+           (compress_puts + compress_poor) ?
+               compress_cycles / (compress_puts + compress_poor) : 0,
+           decompress_gets,
+           decompress_gets ? decompress_cycles / decompress_gets : 0);
 
 }
 
@@ -285,6 +333,19 @@ void parse_shared_pool(char *s)
     unsigned long long flushs = parse(s,"ft");
     unsigned long long flush_objs_found = parse(s,"os");
     unsigned long long flush_objs = parse(s,"ot");
+    unsigned long long lookups = parse(s,"Lk");
+    unsigned long long lookup_retries = parse(s,"Lr");
+    unsigned long long lookup_locked = parse(s,"Ll");
+    unsigned long long obj_contended = parse(s,"Lc");
+    unsigned long long write_locks = parse(s,"Lw");
+    unsigned long long write_contended = parse(s,"Lx");
+    unsigned long codec = parse(s,"Zc");
+    unsigned long long compress_puts = parse(s,"Zp");
+    unsigned long long compress_poor = parse(s,"Zn");
+    unsigned long long compress_bytes = parse(s,"Zb");
+    unsigned long long compress_cycles = parse(s,"Zy");
+    unsigned long long decompress_gets = parse(s,"Zg");
+    unsigned long long decompress_cycles = parse(s,"Zd");
 
     parse_string(s,"PT",pool_type,2);
     pool_type[2] = '\0';
@@ -293,7 +354,11 @@ void parse_shared_pool(char *s)
            "pgp=%llu(max=%llu) obj=%llu(%llu) "
            "objnode=%llu(%llu) puts=%llu/%llu/%llu(dup=%llu/%llu) "
            "gets=%llu/%llu(%llu%%) "
-           "flush=%llu/%llu flobj=%llu/%llu\n",
+           "flush=%llu/%llu flobj=%llu/%llu "
+           "lookups=%llu(retried=%llu,locked=%llu,obj_contended=%llu) "
+           "writes=%llu(contended=%llu) "
+           "%s=%llu%%(pages=%llu,poor=%llu,cyc/pg=%llu) "
+           "decomp=%llu(cyc/pg=%llu)\n",
            pool_id, pool_type, uid0, uid1, buf,
            pgp_count, max_pgp_count, obj_count, max_obj_count,
            objnode_count, max_objnode_count,
@@ -301,7 +366,17 @@ void parse_shared_pool(char *s)
            dup_puts_flushed, dup_puts_replaced,
            found_gets, gets,
            gets ? (found_gets*100LL)/gets : 0,
-           flushs_found, flushs, flush_objs_found, flush_objs);
+           flushs_found, flushs, flush_objs_found, flush_objs,
+           lookups, lookup_retries, lookup_locked, obj_contended,
+           write_locks, write_contended,
+           codec_name(codec),
+           compress_puts ? (compress_bytes*100LL) /
+                           (compress_puts*PAGE_SIZE) : 0,
+           compress_puts, compress_poor,
+           (compress_puts + compress_poor) ?
+               compress_cycles / (compress_puts + compress_poor) : 0,
+           decompress_gets,
+           decompress_gets ? decompress_cycles / decompress_gets : 0);
 }
 
 int main(int ac, char **av)
@@ -23,6 +23,11 @@ static int usage(const char* prog)
     printf("  nominate <domid> <gfn>  - Nominate a page for sharing.\n");
     printf("  share <domid> <gfn> <handle> <source> <source-gfn> <source-handle>\n");
     printf("                          - Share two pages.\n");
+    printf("  range-share <source> <client> <first-gfn> <last-gfn> [<client-gfn>]\n");
+    printf("                          - Share a range of pages, at the same gfns\n");
+    printf("                            in the client unless client-gfn is given.\n");
+    printf("  batch-share <source> <client> <source-gfn>:<client-gfn>...\n");
+    printf("                          - Share a list of pairs of pages.\n");
     printf("  unshare <domid> <gfn>   - Unshare a page by grabbing a writable map.\n");
     printf("  add-to-physmap <domid> <gfn> <source> <source-gfn> <source-handle>\n");
     printf("                          - Populate a page in a domain with a shared page.\n");
@@ -115,6 +120,58 @@ int main(int argc, const char** argv)
         source_handle = strtol(argv[7], NULL, 0);
         R(xc_memshr_share_gfns(xch, source_domid, source_gfn, source_handle, domid, gfn, handle));
     }
+    else if( !strcasecmp(cmd, "range-share") )
+    {
+        domid_t source_domid, client_domid;
+        unsigned long first_gfn, last_gfn, client_gfn;
+        uint64_t nr_shared;
+
+        if( argc != 6 && argc != 7 )
+            return usage(argv[0]);
+
+        source_domid = strtol(argv[2], NULL, 0);
+        client_domid = strtol(argv[3], NULL, 0);
+        first_gfn = strtoul(argv[4], NULL, 0);
+        last_gfn = strtoul(argv[5], NULL, 0);
+        client_gfn = (argc == 7) ? strtoul(argv[6], NULL, 0) : first_gfn;
+        R(xc_memshr_range_share(xch, source_domid, client_domid, first_gfn,
+                                last_gfn, client_gfn, &nr_shared));
+        printf("shared = %llu of %lu\n", (unsigned long long) nr_shared,
+               last_gfn - first_gfn + 1);
+    }
+    else if( !strcasecmp(cmd, "batch-share") )
+    {
+        domid_t source_domid, client_domid;
+        xen_mem_sharing_pair_t *pairs;
+        unsigned long i, nr_pairs;
+        uint64_t nr_shared;
+        char *end;
+
+        if( argc < 5 )
+            return usage(argv[0]);
+
+        source_domid = strtol(argv[2], NULL, 0);
+        client_domid = strtol(argv[3], NULL, 0);
+        nr_pairs = argc - 4;
+        pairs = calloc(nr_pairs, sizeof(*pairs));
+        if( !pairs )
+            return 1;
+        for( i = 0; i < nr_pairs; i++ )
+        {
+            pairs[i].source_gfn = strtoul(argv[i + 4], &end, 0);
+            if( *end != ':' )
+            {
+                free(pairs);
+                return usage(argv[0]);
+            }
+            pairs[i].client_gfn = strtoul(end + 1, NULL, 0);
+        }
+        R(xc_memshr_batch_share(xch, source_domid, client_domid, pairs,
+                                nr_pairs, &nr_shared));
+        printf("shared = %llu of %lu\n", (unsigned long long) nr_shared,
+               nr_pairs);
+        free(pairs);
+    }
     else if( !strcasecmp(cmd, "unshare") )
     {
         domid_t domid;
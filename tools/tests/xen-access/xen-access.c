@@ -101,6 +101,7 @@ typedef struct mem_event {
     mem_event_back_ring_t back_ring;
     uint32_t evtchn_port;
     void *ring_page;
+    unsigned int nr_ring_pages;
     spinlock_t ring_lock;
 } mem_event_t;
 
@@ -178,7 +179,8 @@ int xenaccess_teardown(xc_interface *xch, xenaccess_t *xenaccess)
 
     /* Tear down domain xenaccess in Xen */
     if ( xenaccess->mem_event.ring_page )
-        munmap(xenaccess->mem_event.ring_page, PAGE_SIZE);
+        munmap(xenaccess->mem_event.ring_page,
+               xenaccess->mem_event.nr_ring_pages * PAGE_SIZE);
 
     if ( mem_access_enable )
     {
@@ -233,7 +235,9 @@ xenaccess_t *xenaccess_init(xc_interface **xch_r, domid_t domain_id)
     xenaccess_t *xenaccess = 0;
     xc_interface *xch;
     int rc;
-    unsigned long ring_pfn, mmap_pfn;
+    unsigned long ring_pfn, nr_pages = 0;
+    xen_pfn_t mmap_pfn[MEM_EVENT_RING_MAX_PAGES];
+    unsigned int i;
 
     xch = xc_interface_open(NULL, NULL, 0);
     if ( !xch )
@@ -255,30 +259,56 @@ xenaccess_t *xenaccess_init(xc_interface **xch_r, domid_t domain_id)
     /* Initialise lock */
     mem_event_ring_lock_init(&xenaccess->mem_event);
 
-    /* Map the ring page */
+    /* Map the ring pages, as many as the domain builder reserved */
     xc_get_hvm_param(xch, xenaccess->mem_event.domain_id, 
                         HVM_PARAM_ACCESS_RING_PFN, &ring_pfn);
-    mmap_pfn = ring_pfn;
+    xc_get_hvm_param(xch, xenaccess->mem_event.domain_id,
+                        HVM_PARAM_MEM_EVENT_RING_PAGES, &nr_pages);
+    if ( nr_pages == 0 )
+        nr_pages = 1;
+    if ( nr_pages > MEM_EVENT_RING_MAX_PAGES )
+        nr_pages = MEM_EVENT_RING_MAX_PAGES;
+    xenaccess->mem_event.nr_ring_pages = nr_pages;
+
+    for ( i = 0; i < nr_pages; i++ )
+        mmap_pfn[i] = ring_pfn + i;
     xenaccess->mem_event.ring_page = 
         xc_map_foreign_batch(xch, xenaccess->mem_event.domain_id, 
-                                PROT_READ | PROT_WRITE, &mmap_pfn, 1);
-    if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+                                PROT_READ | PROT_WRITE, mmap_pfn, nr_pages);
+    for ( i = 0; i < nr_pages; i++ )
+        if ( mmap_pfn[i] & XEN_DOMCTL_PFINFO_XTAB )
+            break;
+    if ( i < nr_pages )
     {
-        /* Map failed, populate ring page */
-        rc = xc_domain_populate_physmap_exact(xenaccess->xc_handle, 
-                                              xenaccess->mem_event.domain_id,
-                                              1, 0, 0, &ring_pfn);
-        if ( rc != 0 )
+        /* Map failed, populate ring pages */
+        if ( xenaccess->mem_event.ring_page )
+            munmap(xenaccess->mem_event.ring_page, nr_pages * PAGE_SIZE);
+        xenaccess->mem_event.ring_page = NULL;
+
+        for ( i = 0; i < nr_pages; i++ )
         {
-            PERROR("Failed to populate ring gfn\n");
-            goto err;
+            if ( !(mmap_pfn[i] & XEN_DOMCTL_PFINFO_XTAB) )
+                continue;
+            mmap_pfn[i] = ring_pfn + i;
+            rc = xc_domain_populate_physmap_exact(xenaccess->xc_handle, 
+                                                  xenaccess->mem_event.domain_id,
+                                                  1, 0, 0, &mmap_pfn[i]);
+            if ( rc != 0 )
+            {
+                PERROR("Failed to populate ring gfn\n");
+                goto err;
+            }
         }
 
-        mmap_pfn = ring_pfn;
+        for ( i = 0; i < nr_pages; i++ )
+            mmap_pfn[i] = ring_pfn + i;
         xenaccess->mem_event.ring_page = 
             xc_map_foreign_batch(xch, xenaccess->mem_event.domain_id, 
-                                    PROT_READ | PROT_WRITE, &mmap_pfn, 1);
-        if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+                                    PROT_READ | PROT_WRITE, mmap_pfn, nr_pages);
+        for ( i = 0; i < nr_pages; i++ )
+            if ( mmap_pfn[i] & XEN_DOMCTL_PFINFO_XTAB )
+                break;
+        if ( i < nr_pages )
         {
             PERROR("Could not map the ring page\n");
             goto err;
@@ -286,8 +316,9 @@ xenaccess_t *xenaccess_init(xc_interface **xch_r, domid_t domain_id)
     }
 
     /* Initialise Xen */
-    rc = xc_mem_access_enable(xenaccess->xc_handle, xenaccess->mem_event.domain_id,
-                             &xenaccess->mem_event.evtchn_port);
+    rc = xc_mem_access_enable_ring(xenaccess->xc_handle,
+                                   xenaccess->mem_event.domain_id, nr_pages,
+                                   &xenaccess->mem_event.evtchn_port);
     if ( rc != 0 )
     {
         switch ( errno ) {
@@ -330,11 +361,13 @@ xenaccess_t *xenaccess_init(xc_interface **xch_r, domid_t domain_id)
     SHARED_RING_INIT((mem_event_sring_t *)xenaccess->mem_event.ring_page);
     BACK_RING_INIT(&xenaccess->mem_event.back_ring,
                    (mem_event_sring_t *)xenaccess->mem_event.ring_page,
-                   PAGE_SIZE);
+                   nr_pages * PAGE_SIZE);
 
     /* Now that the ring is set, remove it from the guest's physmap */
+    for ( i = 0; i < nr_pages; i++ )
+        mmap_pfn[i] = ring_pfn + i;
     if ( xc_domain_decrease_reservation_exact(xch, 
-                    xenaccess->mem_event.domain_id, 1, 0, &ring_pfn) )
+                    xenaccess->mem_event.domain_id, nr_pages, 0, mmap_pfn) )
         PERROR("Failed to remove ring from guest physmap");
 
     /* Get platform info */
@@ -429,23 +462,11 @@ static int put_response(mem_event_t *mem_event, mem_event_response_t *rsp)
     return 0;
 }
 
-static int xenaccess_resume_page(xenaccess_t *paging, mem_event_response_t *rsp)
+/* Tell Xen that all responses on the ring are ready, in one call */
+static int xenaccess_resume_pages(xenaccess_t *paging)
 {
-    int ret;
-
-    /* Put the page info on the ring */
-    ret = put_response(&paging->mem_event, rsp);
-    if ( ret != 0 )
-        goto out;
-
-    /* Tell Xen page is ready */
-    ret = xc_mem_access_resume(paging->xc_handle, paging->mem_event.domain_id,
-                               rsp->gfn);
-    ret = xc_evtchn_notify(paging->mem_event.xce_handle,
-                           paging->mem_event.port);
-
- out:
-    return ret;
+    return xc_mem_access_resume(paging->xc_handle,
+                                paging->mem_event.domain_id, 0);
 }
 
 void usage(char* progname)
@@ -474,6 +495,7 @@ int main(int argc, char *argv[])
     int required = 0;
     int int3 = 0;
     int shutting_down = 0;
+    int nr_responses = 0;
 
     char* progname = argv[0];
     argv++;
@@ -677,13 +699,26 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "UNKNOWN REASON CODE %d\n", req.reason);
             }
 
-            rc = xenaccess_resume_page(xenaccess, &rsp);
+            /* Put the page info on the ring */
+            rc = put_response(&xenaccess->mem_event, &rsp);
             if ( rc != 0 )
             {
-                ERROR("Error resuming page");
+                ERROR("Error putting response");
                 interrupted = -1;
                 continue;
             }
+            nr_responses++;
+        }
+
+        if ( nr_responses )
+        {
+            rc = xenaccess_resume_pages(xenaccess);
+            if ( rc != 0 )
+            {
+                ERROR("Error resuming pages");
+                interrupted = -1;
+            }
+            nr_responses = 0;
         }
 
         if ( shutting_down )
@@ -0,0 +1,476 @@
+/*
+ * This file is subject to the terms and conditions of the GNU General
+ * Public License.  See the file "COPYING" in the main directory of
+ * this archive for more details.
+ *
+ * Rewrite a legacy save image (as written by xc_domain_save without
+ * XCFLAGS_STREAM_RECORDS) as a record stream, see xg_save_restore.h.
+ * The legacy stream is walked chunk by chunk and each chunk is framed as
+ * the record the saver itself would have produced, so the result restores
+ * exactly like a natively written record stream.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <xg_private.h>
+#include <xg_save_restore.h>
+
+struct conv {
+    int in, out;
+    int csum;
+    int hvm;
+
+    /* Stream state needed to find chunk boundaries. */
+    struct domain_info_context dinfo;
+    size_t vcpu_size;
+    unsigned int max_vcpu_id;
+    uint64_t vcpumap[XC_SR_MAX_VCPUS/64];
+    int enable_compression;
+    int compressing;
+    int last_checkpoint;
+
+    /* The record being built. */
+    uint32_t type;
+    uint8_t *buf;
+    size_t len, size;
+};
+
+/* Returns 1 on EOF before the first byte if eof_ok, 0 on success. */
+static int rd(struct conv *c, void *buf, size_t len, int eof_ok)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while ( off < len )
+    {
+        n = read(c->in, (uint8_t *)buf + off, len - off);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 )
+            err(1, "read");
+        if ( n == 0 )
+        {
+            if ( eof_ok && off == 0 )
+                return 1;
+            errx(1, "unexpected end of input");
+        }
+        off += n;
+    }
+
+    return 0;
+}
+
+static void wr(struct conv *c, const void *buf, size_t len)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while ( off < len )
+    {
+        n = write(c->out, (const uint8_t *)buf + off, len - off);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            err(1, "write");
+        off += n;
+    }
+}
+
+static void rec_open(struct conv *c, uint32_t type)
+{
+    c->type = type;
+    c->len = 0;
+}
+
+static void *grow(struct conv *c, size_t len)
+{
+    void *p;
+
+    if ( c->len + len > XC_SR_MAX_RECORD )
+        errx(1, "record type %#x too long", c->type);
+
+    if ( c->len + len > c->size )
+    {
+        size_t size = MAX(c->size * 2, c->len + len);
+
+        if ( !(p = realloc(c->buf, size)) )
+            err(1, "realloc");
+        c->buf = p;
+        c->size = size;
+    }
+
+    p = c->buf + c->len;
+    c->len += len;
+
+    return p;
+}
+
+/* Append len bytes of input to the current record and return them. */
+static void *take(struct conv *c, size_t len)
+{
+    void *p = grow(c, len);
+
+    rd(c, p, len, 0);
+
+    return p;
+}
+
+static void rec_close(struct conv *c)
+{
+    static const uint8_t zero[XC_SR_ALIGN];
+    struct xc_sr_rhdr rhdr = {
+        .type = c->type,
+        .flags = c->csum ? XC_SR_RFLAG_CSUM : 0,
+        .length = c->len,
+    };
+    struct xc_sr_rtrl rtrl = { 0 };
+
+    wr(c, &rhdr, sizeof(rhdr));
+    wr(c, c->buf, c->len);
+    wr(c, zero, XC_SR_PAD(c->len));
+    if ( c->csum )
+    {
+        rtrl.csum = crc32(crc32(0L, Z_NULL, 0), c->buf, c->len);
+        wr(c, &rtrl, sizeof(rtrl));
+    }
+}
+
+static void copy_raw(struct conv *c, size_t len)
+{
+    uint8_t buf[PAGE_SIZE];
+    size_t n;
+
+    while ( len )
+    {
+        n = MIN(len, sizeof(buf));
+        rd(c, buf, n, 0);
+        wr(c, buf, n);
+        len -= n;
+    }
+}
+
+static void copy_to_eof(struct conv *c)
+{
+    uint8_t buf[PAGE_SIZE];
+    ssize_t n;
+
+    while ( (n = read(c->in, buf, sizeof(buf))) != 0 )
+    {
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 )
+            err(1, "read");
+        wr(c, buf, n);
+    }
+}
+
+static void convert_header(struct conv *c)
+{
+    struct domain_info_context *dinfo = &c->dinfo;
+    vcpu_guest_context_any_t ctxt;
+    xen_pfn_t p2m_fl_zero;
+    uint32_t tot_bytes, chunk_bytes;
+    char sig[4];
+    int extv = 0;
+    uint32_t xcnt_size = 0;
+
+    rec_open(c, XC_SR_REC_P2M_FRAMES);
+    memcpy(&dinfo->p2m_size, take(c, sizeof(unsigned long)),
+           sizeof(unsigned long));
+
+    dinfo->guest_width = sizeof(unsigned long);
+    c->vcpu_size = sizeof(unsigned long) == 8 ? sizeof(ctxt.x64)
+                                              : sizeof(ctxt.x32);
+
+    if ( c->hvm )
+    {
+        rec_close(c);
+        return;
+    }
+
+    memcpy(&p2m_fl_zero, take(c, sizeof(long)), sizeof(long));
+    if ( p2m_fl_zero == ~0UL )
+    {
+        memcpy(&tot_bytes, take(c, sizeof(tot_bytes)), sizeof(tot_bytes));
+        while ( tot_bytes )
+        {
+            memcpy(sig, take(c, sizeof(sig)), sizeof(sig));
+            memcpy(&chunk_bytes, take(c, sizeof(chunk_bytes)),
+                   sizeof(chunk_bytes));
+            if ( tot_bytes < chunk_bytes + 8 )
+                errx(1, "bad extended-info chunk size %u", chunk_bytes);
+            tot_bytes -= chunk_bytes + 8;
+
+            if ( !strncmp(sig, "vcpu", 4) )
+            {
+                if ( chunk_bytes == sizeof(ctxt.x32) )
+                    dinfo->guest_width = 4;
+                else if ( chunk_bytes == sizeof(ctxt.x64) )
+                    dinfo->guest_width = 8;
+                else
+                    errx(1, "bad extended-info context size %u",
+                         chunk_bytes);
+                c->vcpu_size = chunk_bytes;
+            }
+            else if ( !strncmp(sig, "extv", 4) )
+                extv = 1;
+            else if ( !strncmp(sig, "xcnt", 4) && chunk_bytes >= 4 )
+            {
+                memcpy(&xcnt_size, take(c, 4), 4);
+                chunk_bytes -= 4;
+            }
+            take(c, chunk_bytes);
+        }
+        take(c, sizeof(xen_pfn_t));
+    }
+
+    take(c, (P2M_FL_ENTRIES - 1) * sizeof(xen_pfn_t));
+    rec_close(c);
+
+    c->vcpu_size += (extv ? 128 : 0) + xcnt_size;
+}
+
+/*
+ * Convert the body of one checkpoint.  Returns 1 if the input ends cleanly
+ * before the body starts, which is only allowed when eof_ok is set.
+ */
+static int convert_body(struct conv *c, int eof_ok)
+{
+    unsigned long *pfn_types;
+    unsigned long pagetype;
+    unsigned long compbuf_size;
+    uint32_t len;
+    int count, i, npages;
+
+    for ( ; ; )
+    {
+        if ( rd(c, &count, sizeof(count), eof_ok) )
+            return 1;
+        eof_ok = 0;
+
+        rec_open(c, count > 0 ? XC_SR_REC_PAGE_DATA : XC_SR_REC_CHUNK);
+        memcpy(grow(c, sizeof(count)), &count, sizeof(count));
+
+        switch ( count )
+        {
+        case 0:
+            rec_close(c);
+            return 0;
+
+        case XC_SAVE_ID_ENABLE_VERIFY_MODE:
+            break;
+
+        case XC_SAVE_ID_LAST_CHECKPOINT:
+            c->last_checkpoint = 1;
+            break;
+
+        case XC_SAVE_ID_ENABLE_COMPRESSION:
+            c->enable_compression = 1;
+            break;
+
+        case XC_SAVE_ID_VCPU_INFO:
+            memcpy(&c->max_vcpu_id, take(c, sizeof(c->max_vcpu_id)),
+                   sizeof(c->max_vcpu_id));
+            if ( c->max_vcpu_id >= XC_SR_MAX_VCPUS )
+                errx(1, "bad max_vcpu_id %u", c->max_vcpu_id);
+            memcpy(c->vcpumap, take(c, vcpumap_sz(c->max_vcpu_id)),
+                   vcpumap_sz(c->max_vcpu_id));
+            break;
+
+        case XC_SAVE_ID_HVM_IDENT_PT:
+        case XC_SAVE_ID_HVM_VM86_TSS:
+        case XC_SAVE_ID_HVM_CONSOLE_PFN:
+        case XC_SAVE_ID_HVM_ACPI_IOPORTS_LOCATION:
+        case XC_SAVE_ID_HVM_VIRIDIAN:
+        case XC_SAVE_ID_HVM_GENERATION_ID_ADDR:
+        case XC_SAVE_ID_HVM_PAGING_RING_PFN:
+        case XC_SAVE_ID_HVM_ACCESS_RING_PFN:
+        case XC_SAVE_ID_HVM_SHARING_RING_PFN:
+            /* 4 bytes of padding and a 64-bit value. */
+            take(c, sizeof(uint32_t) + sizeof(uint64_t));
+            break;
+
+        case XC_SAVE_ID_TSC_INFO:
+            take(c, 3 * sizeof(uint32_t) + sizeof(uint64_t));
+            break;
+
+        case XC_SAVE_ID_LOCAL_SOURCE:
+            take(c, sizeof(uint32_t));
+            break;
+
+        case XC_SAVE_ID_TOOLSTACK:
+            memcpy(&len, take(c, sizeof(len)), sizeof(len));
+            take(c, len);
+            break;
+
+        case XC_SAVE_ID_COMPRESSED_DATA:
+            memcpy(&compbuf_size, take(c, sizeof(compbuf_size)),
+                   sizeof(compbuf_size));
+            take(c, compbuf_size);
+            break;
+
+        case XC_SAVE_ID_TMEM:
+        case XC_SAVE_ID_TMEM_EXTRA:
+            errx(1, "tmem chunks cannot be converted, the stream carries "
+                 "no length for them");
+
+        default:
+            if ( count < 0 || count > MAX_BATCH_SIZE )
+                errx(1, "bad chunk %d", count);
+
+            pfn_types = take(c, count * sizeof(unsigned long));
+            for ( i = npages = 0; i < count; i++ )
+            {
+                pagetype = pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+                if ( pagetype != XEN_DOMCTL_PFINFO_XTAB &&
+                     pagetype != XEN_DOMCTL_PFINFO_BROKEN &&
+                     pagetype != XEN_DOMCTL_PFINFO_XALLOC )
+                    npages++;
+            }
+            if ( !c->compressing )
+                take(c, (size_t)npages * PAGE_SIZE);
+            break;
+        }
+
+        rec_close(c);
+    }
+}
+
+static void convert_tail_hvm(struct conv *c)
+{
+    char qemusig[21];
+    uint32_t len;
+
+    rec_open(c, XC_SR_REC_HVM_CONTEXT);
+    take(c, 3 * sizeof(uint64_t));
+    memcpy(&len, take(c, sizeof(len)), sizeof(len));
+    take(c, len);
+    rec_close(c);
+
+    rec_open(c, XC_SR_REC_END);
+    rec_close(c);
+
+    /* The device model record follows unframed. */
+    rd(c, qemusig, sizeof(qemusig), 0);
+    wr(c, qemusig, sizeof(qemusig));
+
+    if ( !memcmp(qemusig, "QemuDeviceModelRecord", sizeof(qemusig)) )
+    {
+        copy_to_eof(c);
+        return;
+    }
+
+    if ( memcmp(qemusig, "DeviceModelRecord0002", sizeof(qemusig)) &&
+         memcmp(qemusig, "RemusDeviceModelState", sizeof(qemusig)) )
+        errx(1, "bad device model signature");
+
+    rd(c, &len, sizeof(len), 0);
+    wr(c, &len, sizeof(len));
+    copy_raw(c, len);
+}
+
+static void convert_tail_pv(struct conv *c)
+{
+    unsigned int pfncount, i;
+
+    rec_open(c, XC_SR_REC_TAIL_DATA);
+    memcpy(&pfncount, take(c, sizeof(pfncount)), sizeof(pfncount));
+    if ( pfncount > (1U << 28) )
+        errx(1, "bad pfn count %u", pfncount);
+    take(c, pfncount * sizeof(unsigned long));
+    rec_close(c);
+
+    for ( i = 0; i <= c->max_vcpu_id; i++ )
+    {
+        if ( !(c->vcpumap[i/64] & (1ULL << (i%64))) )
+            continue;
+        rec_open(c, XC_SR_REC_VCPU_CONTEXT);
+        take(c, c->vcpu_size);
+        rec_close(c);
+    }
+
+    rec_open(c, XC_SR_REC_TAIL_DATA);
+    take(c, PAGE_SIZE);
+    rec_close(c);
+
+    rec_open(c, XC_SR_REC_END);
+    rec_close(c);
+}
+
+static void usage(const char *prog)
+{
+    errx(1, "usage: %s [-c] [-H] <infile> <outfile>\n"
+         "  -c  add a checksum to every record\n"
+         "  -H  the image is of an HVM guest", prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct conv c;
+    struct xc_sr_hdr hdr = {
+        .marker = XC_SR_MARKER,
+        .id = XC_SR_ID,
+        .version = XC_SR_VERSION,
+        .flags = 0,
+    };
+    int opt, first;
+
+    memset(&c, 0, sizeof(c));
+    c.vcpumap[0] = 1;
+
+    while ( (opt = getopt(argc, argv, "cH")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'c':
+            c.csum = 1;
+            break;
+        case 'H':
+            c.hvm = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( argc - optind != 2 )
+        usage(argv[0]);
+
+    if ( (c.in = open(argv[optind], O_RDONLY)) < 0 )
+        err(1, "%s", argv[optind]);
+    if ( (c.out = open(argv[optind + 1], O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0 )
+        err(1, "%s", argv[optind + 1]);
+
+    wr(&c, &hdr, sizeof(hdr));
+    convert_header(&c);
+
+    for ( first = 1; ; first = 0 )
+    {
+        if ( convert_body(&c, !first) )
+            break;
+
+        if ( c.hvm )
+            convert_tail_hvm(&c);
+        else
+            convert_tail_pv(&c);
+
+        if ( c.last_checkpoint )
+            break;
+        if ( first )
+            c.compressing = c.enable_compression;
+    }
+
+    if ( close(c.out) )
+        err(1, "%s", argv[optind + 1]);
+    free(c.buf);
+
+    return 0;
+}
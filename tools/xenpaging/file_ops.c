@@ -20,23 +20,24 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <xc_private.h>
+#include "file_ops.h"
 
-static int file_op(int fd, void *page, int i,
-                   ssize_t (*fn)(int, void *, size_t))
+static int file_io(int fd, void *buf, size_t size, off_t offset,
+                   ssize_t (*fn)(int, void *, size_t, off_t))
 {
-    off_t offset = i;
-    int total = 0;
-    int bytes;
-
-    offset = lseek(fd, offset << PAGE_SHIFT, SEEK_SET);
-    if ( offset == (off_t)-1 )
-        return -1;
+    size_t total = 0;
+    ssize_t bytes;
 
-    while ( total < PAGE_SIZE )
+    while ( total < size )
     {
-        bytes = fn(fd, page + total, PAGE_SIZE - total);
+        bytes = fn(fd, buf + total, size - total, offset + total);
         if ( bytes <= 0 )
             return -1;
 
@@ -46,19 +47,178 @@ static int file_op(int fd, void *page, int i,
     return 0;
 }
 
-static ssize_t my_write(int fd, void *buf, size_t count)
+static int file_op(int fd, void *buf, int i, int nr,
+                   ssize_t (*fn)(int, void *, size_t, off_t))
+{
+    return file_io(fd, buf, (size_t)nr << PAGE_SHIFT, (off_t)i << PAGE_SHIFT, fn);
+}
+
+static ssize_t my_pwrite(int fd, void *buf, size_t count, off_t offset)
 {
-    return write(fd, buf, count);
+    return pwrite(fd, buf, count, offset);
 }
 
 int read_page(int fd, void *page, int i)
 {
-    return file_op(fd, page, i, &read);
+    return file_op(fd, page, i, 1, &pread);
 }
 
 int write_page(int fd, void *page, int i)
 {
-    return file_op(fd, page, i, &my_write);
+    return file_op(fd, page, i, 1, &my_pwrite);
+}
+
+/* Read nr pages from consecutive slots, starting at slot i */
+int read_pages(int fd, void *buf, int i, int nr)
+{
+    return file_op(fd, buf, i, nr, &pread);
+}
+
+/* Write nr scattered pages to consecutive slots with a single request */
+int write_pages(int fd, void **pages, int i, int nr)
+{
+    struct iovec iov[FILE_OPS_MAX_IOV];
+    off_t offset = (off_t)i << PAGE_SHIFT;
+    ssize_t bytes, rest;
+    int j, done = 0, cnt;
+
+    while ( done < nr )
+    {
+        cnt = nr - done;
+        if ( cnt > FILE_OPS_MAX_IOV )
+            cnt = FILE_OPS_MAX_IOV;
+        for ( j = 0; j < cnt; j++ )
+        {
+            iov[j].iov_base = pages[done + j];
+            iov[j].iov_len = PAGE_SIZE;
+        }
+
+        bytes = pwritev(fd, iov, cnt, offset + ((off_t)done << PAGE_SHIFT));
+        if ( bytes <= 0 )
+            return -1;
+
+        /* Finish a partially written page on its own */
+        rest = bytes & (PAGE_SIZE - 1);
+        if ( rest )
+        {
+            j = bytes >> PAGE_SHIFT;
+            if ( file_io(fd, pages[done + j] + rest, PAGE_SIZE - rest,
+                         offset + ((off_t)done << PAGE_SHIFT) + bytes,
+                         &my_pwrite) )
+                return -1;
+            bytes += PAGE_SIZE - rest;
+        }
+
+        done += bytes >> PAGE_SHIFT;
+    }
+
+    return 0;
+}
+
+/*
+ * Asynchronous page reads, served by a few threads so that several faults
+ * can wait for the disk at the same time.  Completions are collected with
+ * file_aio_reap(); the descriptor returned by file_aio_init() becomes
+ * readable whenever there is something to reap.
+ */
+static pthread_mutex_t aio_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_cond = PTHREAD_COND_INITIALIZER;
+static struct file_aio *aio_queue, **aio_queue_tail = &aio_queue;
+static struct file_aio *aio_done;
+static int aio_pipe[2] = { -1, -1 };
+
+static void *file_aio_thread(void *arg)
+{
+    struct file_aio *aio;
+
+    while ( 1 )
+    {
+        pthread_mutex_lock(&aio_mutex);
+        while ( !aio_queue )
+            pthread_cond_wait(&aio_cond, &aio_mutex);
+        aio = aio_queue;
+        aio_queue = aio->next;
+        if ( !aio_queue )
+            aio_queue_tail = &aio_queue;
+        pthread_mutex_unlock(&aio_mutex);
+
+        aio->err = read_pages(aio->fd, aio->buffer, aio->slot, aio->nr) ?
+            (errno ? errno : EIO) : 0;
+
+        pthread_mutex_lock(&aio_mutex);
+        aio->next = aio_done;
+        aio_done = aio;
+        pthread_mutex_unlock(&aio_mutex);
+
+        /* A full pipe already wakes up the reaper */
+        if ( write(aio_pipe[1], "", 1) < 0 && errno != EAGAIN )
+            break;
+    }
+
+    return NULL;
+}
+
+int file_aio_init(int threads)
+{
+    pthread_t thread;
+    int i;
+
+    if ( pipe2(aio_pipe, O_NONBLOCK | O_CLOEXEC) < 0 )
+        return -1;
+
+    for ( i = 0; i < threads; i++ )
+    {
+        if ( pthread_create(&thread, NULL, file_aio_thread, NULL) != 0 )
+            break;
+        pthread_detach(thread);
+    }
+
+    /* Callers fall back to synchronous reads */
+    if ( i == 0 )
+    {
+        close(aio_pipe[0]);
+        close(aio_pipe[1]);
+        aio_pipe[0] = aio_pipe[1] = -1;
+        return -1;
+    }
+
+    return aio_pipe[0];
+}
+
+void file_aio_submit(struct file_aio *aio)
+{
+    aio->next = NULL;
+    aio->err = 0;
+
+    pthread_mutex_lock(&aio_mutex);
+    *aio_queue_tail = aio;
+    aio_queue_tail = &aio->next;
+    pthread_mutex_unlock(&aio_mutex);
+    pthread_cond_signal(&aio_cond);
+}
+
+/* Returns the completed requests in the order they finished */
+struct file_aio *file_aio_reap(void)
+{
+    struct file_aio *aio, *next, *done = NULL;
+    char buf[64];
+
+    while ( read(aio_pipe[0], buf, sizeof(buf)) > 0 )
+        ;
+
+    pthread_mutex_lock(&aio_mutex);
+    aio = aio_done;
+    aio_done = NULL;
+    pthread_mutex_unlock(&aio_mutex);
+
+    for ( ; aio; aio = next )
+    {
+        next = aio->next;
+        aio->next = done;
+        done = aio;
+    }
+
+    return done;
 }
 
 
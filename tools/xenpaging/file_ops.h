@@ -25,8 +25,25 @@
 #define __FILE_OPS_H__
 
 
+#define FILE_OPS_MAX_IOV 64
+
+struct file_aio {
+    int fd;
+    int slot;
+    int nr;
+    void *buffer;
+    int err;
+    struct file_aio *next;
+};
+
 int read_page(int fd, void *page, int i);
 int write_page(int fd, void *page, int i);
+int read_pages(int fd, void *buf, int i, int nr);
+int write_pages(int fd, void **pages, int i, int nr);
+
+int file_aio_init(int threads);
+void file_aio_submit(struct file_aio *aio);
+struct file_aio *file_aio_reap(void);
 
 
 #endif
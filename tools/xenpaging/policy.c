@@ -0,0 +1,131 @@
+/******************************************************************************
+ *
+ * Xen domain paging policy selection.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "policy.h"
+
+
+static struct xenpaging_policy *policies[] = {
+    &policy_default,
+    &policy_clock,
+    NULL
+};
+
+static struct xenpaging_policy *policy;
+
+
+struct xenpaging_policy *policy_lookup(const char *name)
+{
+    int i;
+
+    if ( !name )
+        return policies[0];
+
+    for ( i = 0; policies[i]; i++ )
+        if ( strcmp(policies[i]->name, name) == 0 )
+            return policies[i];
+
+    return NULL;
+}
+
+const char *policy_name(void)
+{
+    return policy ? policy->name : NULL;
+}
+
+int policy_init(struct xenpaging *paging)
+{
+    policy = policy_lookup(paging->policy_name);
+    if ( !policy )
+    {
+        errno = EINVAL;
+        return -EINVAL;
+    }
+
+    return policy->init(paging);
+}
+
+void policy_teardown(void)
+{
+    if ( policy && policy->teardown )
+        policy->teardown();
+    policy = NULL;
+}
+
+unsigned long policy_choose_victim(struct xenpaging *paging)
+{
+    return policy->choose_victim(paging);
+}
+
+void policy_notify_paged_out(unsigned long gfn)
+{
+    policy->notify_paged_out(gfn);
+}
+
+void policy_notify_paged_in(unsigned long gfn)
+{
+    policy->notify_paged_in(gfn);
+}
+
+void policy_notify_paged_in_nomru(unsigned long gfn)
+{
+    policy->notify_paged_in_nomru(gfn);
+}
+
+void policy_notify_dropped(unsigned long gfn)
+{
+    policy->notify_dropped(gfn);
+}
+
+void policy_notify_accessed(unsigned long gfn)
+{
+    if ( policy->notify_accessed )
+        policy->notify_accessed(gfn);
+}
+
+int policy_wants_samples(void)
+{
+    return policy->sample != NULL;
+}
+
+int policy_sample(unsigned long *gfns, int max)
+{
+    if ( !policy->sample )
+        return 0;
+    return policy->sample(gfns, max);
+}
+
+/* Estimated working set in pages, or 0 if the policy does not track it */
+unsigned long policy_working_set(void)
+{
+    if ( !policy->working_set )
+        return 0;
+    return policy->working_set();
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -28,12 +28,45 @@
 #include "xenpaging.h"
 
 
+/*
+ * A paging policy decides which gfn is paged out next.  xenpaging tells it
+ * about every page-out, page-in and dropped page.  Policies that implement
+ * sample() are also given access samples: sample() hands back a batch of
+ * resident gfns whose access xenpaging revokes, and notify_accessed() is
+ * called once the guest touches one of them again.  Optional hooks may be
+ * NULL.
+ */
+struct xenpaging_policy {
+    const char *name;
+    int (*init)(struct xenpaging *paging);
+    void (*teardown)(void);
+    unsigned long (*choose_victim)(struct xenpaging *paging);
+    void (*notify_paged_out)(unsigned long gfn);
+    void (*notify_paged_in)(unsigned long gfn);
+    void (*notify_paged_in_nomru)(unsigned long gfn);
+    void (*notify_dropped)(unsigned long gfn);
+    void (*notify_accessed)(unsigned long gfn);
+    int (*sample)(unsigned long *gfns, int max);
+    unsigned long (*working_set)(void);
+};
+
+extern struct xenpaging_policy policy_default;
+extern struct xenpaging_policy policy_clock;
+
+struct xenpaging_policy *policy_lookup(const char *name);
+const char *policy_name(void);
+
 int policy_init(struct xenpaging *paging);
+void policy_teardown(void);
 unsigned long policy_choose_victim(struct xenpaging *paging);
 void policy_notify_paged_out(unsigned long gfn);
 void policy_notify_paged_in(unsigned long gfn);
 void policy_notify_paged_in_nomru(unsigned long gfn);
 void policy_notify_dropped(unsigned long gfn);
+void policy_notify_accessed(unsigned long gfn);
+int policy_wants_samples(void);
+int policy_sample(unsigned long *gfns, int max);
+unsigned long policy_working_set(void);
 
 #endif // __XEN_PAGING_POLICY_H__
 
@@ -0,0 +1,300 @@
+/******************************************************************************
+ *
+ * Xen domain paging CLOCK-Pro style policy.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every gfn is either hot (part of the estimated working set) or cold, and
+ * carries a referenced bit.  A single clock hand sweeps over all gfns:
+ * referenced pages lose their bit and cold ones are promoted to hot while
+ * there is room, unreferenced hot pages are demoted to cold, and the first
+ * unreferenced cold page is the victim.
+ *
+ * Evicted pages stay in a test period for a while.  A page that faults
+ * back during its test period was evicted too early: it comes back hot and
+ * the hot target grows.  A test period that expires without a fault
+ * shrinks the hot target again, as in CLOCK-Pro.
+ *
+ * The referenced bits are fed by access sampling: sample() hands out
+ * unreferenced resident pages just ahead of the hand, xenpaging revokes
+ * access to them and notify_accessed() marks them referenced once the
+ * guest touches them.
+ */
+
+
+#include "policy.h"
+
+
+#define DEFAULT_TEST_SIZE (1024 * 16)
+#define MAX_WATCHED       (1024 * 8)
+
+#define CLOCK_REF     (1 << 0)  /* referenced since the hand last passed */
+#define CLOCK_HOT     (1 << 1)  /* member of the working set */
+#define CLOCK_OUT     (1 << 2)  /* paged out */
+#define CLOCK_TEST    (1 << 3)  /* paged out, still in its test period */
+#define CLOCK_PINNED  (1 << 4)  /* never page out */
+#define CLOCK_TRIED   (1 << 5)  /* nominated, not yet paged out */
+#define CLOCK_WATCHED (1 << 6)  /* access revoked by the sampler */
+
+
+static unsigned char *state;
+static unsigned long max_pages;
+static unsigned long hand;
+static unsigned long nr_hot;
+static unsigned long nr_ws;
+static unsigned long hot_target;
+static unsigned long nr_watched;
+static unsigned long *test_ring;
+static unsigned int test_size;
+static unsigned int i_test;
+static unsigned int tried_cleared;
+
+
+static int clock_init(struct xenpaging *paging)
+{
+    unsigned int i;
+
+    max_pages = paging->max_pages;
+
+    state = calloc(max_pages, sizeof(*state));
+    if ( !state )
+        return -ENOMEM;
+
+    /* The test period covers as many pages as the MRU list would */
+    if ( paging->policy_mru_size > 0 )
+        test_size = paging->policy_mru_size;
+    else
+        test_size = paging->policy_mru_size = DEFAULT_TEST_SIZE;
+
+    test_ring = malloc(sizeof(*test_ring) * test_size);
+    if ( !test_ring )
+    {
+        free(state);
+        state = NULL;
+        return -ENOMEM;
+    }
+    for ( i = 0; i < test_size; i++ )
+        test_ring[i] = INVALID_MFN;
+
+    /* Don't page out page 0 */
+    state[0] |= CLOCK_PINNED;
+
+    /* Start in the middle to avoid paging during BIOS startup */
+    hand = max_pages / 2;
+    hot_target = max_pages / 2;
+    nr_hot = nr_ws = nr_watched = 0;
+    i_test = tried_cleared = 0;
+
+    return 0;
+}
+
+static void clock_teardown(void)
+{
+    free(state);
+    free(test_ring);
+    state = NULL;
+    test_ring = NULL;
+}
+
+#define in_ws(s) (((s) & (CLOCK_HOT | CLOCK_REF)) != 0)
+
+/* Update the state of gfn and keep the counters in step */
+static void clock_set(unsigned long gfn, unsigned char set, unsigned char clear)
+{
+    unsigned char old = state[gfn];
+    unsigned char new = (old & ~clear) | set;
+
+    nr_hot += !!(new & CLOCK_HOT) - !!(old & CLOCK_HOT);
+    nr_watched += !!(new & CLOCK_WATCHED) - !!(old & CLOCK_WATCHED);
+    nr_ws += in_ws(new) - in_ws(old);
+    state[gfn] = new;
+}
+
+static unsigned long clock_choose_victim(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    unsigned long i, gfn;
+    unsigned char s;
+
+    /* The first revolution may only clear referenced bits */
+    for ( i = 0; i < 2 * max_pages; i++ )
+    {
+        if ( ++hand >= max_pages )
+            hand = 0;
+        gfn = hand;
+        s = state[gfn];
+
+        if ( s & (CLOCK_OUT | CLOCK_PINNED | CLOCK_TRIED) )
+            continue;
+
+        if ( s & CLOCK_REF )
+        {
+            if ( !(s & CLOCK_HOT) && nr_hot < hot_target )
+                clock_set(gfn, CLOCK_HOT, CLOCK_REF);
+            else
+                clock_set(gfn, 0, CLOCK_REF);
+            continue;
+        }
+
+        /* Unreferenced for a whole revolution, no longer hot */
+        if ( s & CLOCK_HOT )
+        {
+            clock_set(gfn, 0, CLOCK_HOT);
+            continue;
+        }
+
+        state[gfn] |= CLOCK_TRIED;
+        return gfn;
+    }
+
+    /* No more pages, wait in poll */
+    paging->use_poll_timeout = 1;
+    /* Force retry of nominated gfns every few seconds */
+    if ( ++tried_cleared > 123 )
+    {
+        for ( gfn = 0; gfn < max_pages; gfn++ )
+            state[gfn] &= ~CLOCK_TRIED;
+        tried_cleared = 0;
+        DPRINTF("clearing tried, hand %lx", hand);
+    }
+    return INVALID_MFN;
+}
+
+static void clock_notify_paged_out(unsigned long gfn)
+{
+    unsigned long old_gfn;
+
+    clock_set(gfn, CLOCK_OUT | CLOCK_TEST,
+              CLOCK_REF | CLOCK_HOT | CLOCK_TRIED | CLOCK_WATCHED);
+
+    /* The oldest test period ends, the page was not needed again */
+    old_gfn = test_ring[i_test];
+    if ( old_gfn != INVALID_MFN && old_gfn != gfn &&
+         (state[old_gfn] & CLOCK_TEST) )
+    {
+        state[old_gfn] &= ~CLOCK_TEST;
+        if ( hot_target > 0 )
+            hot_target--;
+    }
+    test_ring[i_test] = gfn;
+    i_test = (i_test + 1) % test_size;
+}
+
+static void clock_handle_paged_in(unsigned long gfn, int do_mru)
+{
+    unsigned char set = 0;
+
+    /*
+     * Without the referenced bit the page is a candidate again right
+     * away, which allows page-out if the target grows again.
+     */
+    if ( do_mru )
+        set |= CLOCK_REF;
+
+    /* Evicted too early: the page is part of the working set */
+    if ( state[gfn] & CLOCK_TEST )
+    {
+        if ( hot_target < max_pages )
+            hot_target++;
+        if ( do_mru )
+            set |= CLOCK_HOT;
+    }
+
+    clock_set(gfn, set, CLOCK_OUT | CLOCK_TEST);
+}
+
+static void clock_notify_paged_in(unsigned long gfn)
+{
+    clock_handle_paged_in(gfn, 1);
+}
+
+static void clock_notify_paged_in_nomru(unsigned long gfn)
+{
+    clock_handle_paged_in(gfn, 0);
+}
+
+static void clock_notify_dropped(unsigned long gfn)
+{
+    clock_set(gfn, 0, CLOCK_OUT | CLOCK_TEST);
+}
+
+static void clock_notify_accessed(unsigned long gfn)
+{
+    if ( gfn >= max_pages )
+        return;
+
+    if ( state[gfn] & CLOCK_OUT )
+        clock_set(gfn, 0, CLOCK_WATCHED);
+    else
+        clock_set(gfn, CLOCK_REF, CLOCK_WATCHED);
+}
+
+/* Hand out unreferenced pages the clock hand is about to look at */
+static int clock_sample(unsigned long *gfns, int max)
+{
+    unsigned long i, gfn = hand;
+    int num = 0;
+
+    for ( i = 0; i < max_pages && num < max; i++ )
+    {
+        if ( nr_watched >= MAX_WATCHED )
+            break;
+
+        if ( ++gfn >= max_pages )
+            gfn = 0;
+
+        if ( state[gfn] & (CLOCK_REF | CLOCK_OUT | CLOCK_PINNED |
+                           CLOCK_TRIED | CLOCK_WATCHED) )
+            continue;
+
+        clock_set(gfn, CLOCK_WATCHED, 0);
+        gfns[num++] = gfn;
+    }
+
+    return num;
+}
+
+/* Hot pages plus cold pages referenced since the hand last passed them */
+static unsigned long clock_working_set(void)
+{
+    return nr_ws;
+}
+
+struct xenpaging_policy policy_clock = {
+    .name                  = "clock",
+    .init                  = clock_init,
+    .teardown              = clock_teardown,
+    .choose_victim         = clock_choose_victim,
+    .notify_paged_out      = clock_notify_paged_out,
+    .notify_paged_in       = clock_notify_paged_in,
+    .notify_paged_in_nomru = clock_notify_paged_in_nomru,
+    .notify_dropped        = clock_notify_dropped,
+    .notify_accessed       = clock_notify_accessed,
+    .sample                = clock_sample,
+    .working_set           = clock_working_set,
+};
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,342 @@
+/******************************************************************************
+ *
+ * Offline evaluation of xenpaging policies on recorded fault traces.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The guest references recorded in a trace (faults and sampled accesses)
+ * are replayed against a simulated domain that starts fully populated.
+ * Whenever more pages are resident than the recorded target allows, the
+ * policy picks victims, and every reference to a simulated paged out page
+ * counts as a fault.  Evictions recorded in the trace only show what the
+ * recording policy did and are not replayed.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <xc_private.h>
+
+#include "xc_bitops.h"
+#include "policy.h"
+#include "xenpaging.h"
+
+#define MAX_POLICIES 8
+
+struct trace_event {
+    char event;
+    unsigned long val;
+};
+
+struct replay_result {
+    unsigned long refs;
+    unsigned long faults;
+    unsigned long evictions;
+    unsigned long stalls;
+    unsigned long working_set;
+};
+
+static struct trace_event *events;
+static unsigned long nr_events;
+static unsigned long recorded_faults;
+static unsigned long recorded_evictions;
+
+static void usage(void)
+{
+    printf("usage:\n\n");
+
+    printf("  xenpaging-replay [options] <trace>\n\n");
+
+    printf("options:\n");
+    printf(" -p <name>      --policy=<name>          policy to evaluate, may be repeated;\n");
+    printf("                                         defaults to all policies.\n");
+    printf(" -m <pages>     --max_pages=<pages>      override max_pages from the trace.\n");
+    printf(" -t <pages>     --target=<pages>         fixed target, ignores recorded targets.\n");
+    printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -h             --help                   this output.\n");
+}
+
+static int load_trace(const char *name, unsigned long *max_pages)
+{
+    FILE *f;
+    char line[128];
+    char event;
+    unsigned long val, size = 0;
+    struct trace_event *tmp;
+
+    f = fopen(name, "r");
+    if ( !f )
+    {
+        perror(name);
+        return -1;
+    }
+
+    while ( fgets(line, sizeof(line), f) )
+    {
+        if ( line[0] == '#' )
+        {
+            char *p = strstr(line, "max_pages ");
+            if ( p && !*max_pages )
+                *max_pages = strtoul(p + strlen("max_pages "), NULL, 16);
+            continue;
+        }
+
+        if ( sscanf(line, "%c %lx", &event, &val) != 2 )
+            continue;
+
+        if ( nr_events == size )
+        {
+            size = size ? size * 2 : 4096;
+            tmp = realloc(events, size * sizeof(*events));
+            if ( !tmp )
+            {
+                fclose(f);
+                return -1;
+            }
+            events = tmp;
+        }
+
+        events[nr_events].event = event;
+        events[nr_events].val = val;
+        nr_events++;
+
+        if ( event == XENPAGING_TRACE_FAULT )
+            recorded_faults++;
+        else if ( event == XENPAGING_TRACE_PAGE_OUT )
+            recorded_evictions++;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int replay(struct xenpaging *paging, struct replay_result *res)
+{
+    unsigned long *out;
+    unsigned long i, gfn, victim;
+    unsigned long max_pages = paging->max_pages;
+    unsigned long resident = max_pages;
+    unsigned long target = paging->target_tot_pages;
+    int fixed_target = target != 0;
+
+    memset(res, 0, sizeof(*res));
+
+    out = bitmap_alloc(max_pages);
+    if ( !out )
+        return -1;
+
+    paging->num_paged_out = 0;
+    if ( policy_init(paging) != 0 )
+    {
+        free(out);
+        return -1;
+    }
+
+    for ( i = 0; i < nr_events; i++ )
+    {
+        gfn = events[i].val;
+
+        switch ( events[i].event )
+        {
+        case XENPAGING_TRACE_TARGET:
+            if ( fixed_target )
+                break;
+            target = gfn;
+            /* No target, xenpaging pages everything back in */
+            if ( !target )
+            {
+                for ( gfn = 0; gfn < max_pages; gfn++ )
+                    if ( test_and_clear_bit(gfn, out) )
+                        policy_notify_paged_in_nomru(gfn);
+                resident = max_pages;
+                paging->num_paged_out = 0;
+            }
+            break;
+
+        case XENPAGING_TRACE_FAULT:
+        case XENPAGING_TRACE_ACCESS:
+            if ( gfn >= max_pages )
+                break;
+            res->refs++;
+            if ( test_and_clear_bit(gfn, out) )
+            {
+                res->faults++;
+                resident++;
+                if ( paging->num_paged_out > paging->policy_mru_size )
+                    policy_notify_paged_in(gfn);
+                else
+                    policy_notify_paged_in_nomru(gfn);
+                paging->num_paged_out--;
+            }
+            else
+                policy_notify_accessed(gfn);
+            break;
+
+        case XENPAGING_TRACE_DROP:
+            if ( gfn < max_pages && test_and_clear_bit(gfn, out) )
+            {
+                policy_notify_dropped(gfn);
+                paging->num_paged_out--;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        /* Evict down to the target, as xenpaging would */
+        while ( target && resident > target )
+        {
+            victim = policy_choose_victim(paging);
+            if ( victim == INVALID_MFN || victim >= max_pages ||
+                 test_and_set_bit(victim, out) )
+            {
+                res->stalls++;
+                break;
+            }
+            policy_notify_paged_out(victim);
+            paging->num_paged_out++;
+            resident--;
+            res->evictions++;
+        }
+    }
+
+    res->working_set = policy_working_set();
+    policy_teardown();
+    free(out);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct xenpaging paging;
+    struct replay_result res;
+    const char *names[MAX_POLICIES];
+    unsigned long max_pages = 0, target = 0;
+    int i, ch, nr_names = 0, mru_size = 0;
+    static const char sopts[] = "hp:m:t:r:";
+    static const struct option lopts[] = {
+        {"help", 0, NULL, 'h'},
+        {"policy", 1, NULL, 'p'},
+        {"max_pages", 1, NULL, 'm'},
+        {"target", 1, NULL, 't'},
+        {"mru_size", 1, NULL, 'r'},
+        { }
+    };
+
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1)
+    {
+        switch(ch) {
+        case 'p':
+            if ( !policy_lookup(optarg) )
+            {
+                printf("Unknown policy %s\n", optarg);
+                return 1;
+            }
+            if ( nr_names < MAX_POLICIES )
+                names[nr_names++] = optarg;
+            break;
+        case 'm':
+            max_pages = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            target = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            mru_size = atoi(optarg);
+            break;
+        case 'h':
+        case '?':
+            usage();
+            return 1;
+        }
+    }
+
+    if ( optind != argc - 1 )
+    {
+        usage();
+        return 1;
+    }
+
+    if ( load_trace(argv[optind], &max_pages) )
+        return 1;
+
+    if ( !max_pages )
+    {
+        printf("max_pages missing from trace, use -m\n");
+        return 1;
+    }
+
+    if ( !nr_names )
+    {
+        names[nr_names++] = policy_default.name;
+        names[nr_names++] = policy_clock.name;
+    }
+
+    memset(&paging, 0, sizeof(paging));
+    /* Only used for logging */
+    paging.xc_handle = xc_interface_open(NULL, NULL, XC_OPENFLAG_DUMMY);
+    if ( !paging.xc_handle )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+    paging.max_pages = max_pages;
+
+    printf("%lu events, %lu recorded faults, %lu recorded evictions\n",
+           nr_events, recorded_faults, recorded_evictions);
+    printf("%-10s %10s %10s %10s %8s %10s\n",
+           "policy", "refs", "faults", "evictions", "fault%", "ws");
+
+    for ( i = 0; i < nr_names; i++ )
+    {
+        paging.policy_name = (char *)names[i];
+        paging.policy_mru_size = mru_size;
+        paging.target_tot_pages = target;
+
+        if ( replay(&paging, &res) )
+        {
+            printf("%-10s replay failed\n", names[i]);
+            continue;
+        }
+
+        printf("%-10s %10lu %10lu %10lu %7.2f%% %10lu\n",
+               names[i], res.refs, res.faults, res.evictions,
+               res.refs ? 100.0 * res.faults / res.refs : 0.0,
+               res.working_set);
+        if ( res.stalls )
+            printf("%-10s %lu times no victim was found\n", "", res.stalls);
+    }
+
+    /* A dummy interface holds no hypervisor handle and is never closed */
+    free(events);
+    return 0;
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
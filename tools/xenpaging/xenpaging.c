@@ -28,6 +28,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sys/time.h>
 #include <xc_private.h>
 #include <xenstore.h>
 #include <getopt.h>
@@ -35,14 +36,45 @@
 #include "xc_bitops.h"
 #include "file_ops.h"
 #include "policy.h"
+#include "zcache.h"
 #include "xenpaging.h"
 
 /* Defines number of mfns a guest should use at a time, in KiB */
 #define WATCH_TARGETPAGES "memory/target-tot_pages"
+/* Number of gfns whose access is revoked per sampling round */
+#define XENPAGING_SAMPLE_BATCH 256
+#define XENPAGING_SAMPLE_INTERVAL 100
+/* Most pages evicted with one pagefile write */
+#define XENPAGING_EVICT_BATCH 64
+/* Pagefile reads in flight, and threads serving them */
+#define XENPAGING_PAGEIN_DEPTH 16
+#define XENPAGING_PAGEIN_THREADS 4
+/* Further faults on a page being read that are answered with it */
+#define XENPAGING_PAGEIN_WAITERS 8
+#define XENPAGING_READAHEAD 7
+#define XENPAGING_MAX_READAHEAD 31
+/* Readahead pages kept in memory */
+#define XENPAGING_READAHEAD_CACHE 4096
+
+/* A page-in waiting for the pagefile */
+struct pagein_io {
+    struct file_aio aio;
+    int busy;
+    int dropped;
+    unsigned long gfn;
+    int slot;
+    unsigned long gfns[XENPAGING_MAX_READAHEAD + 1];
+    int nr_waiters;
+    mem_event_request_t waiters[XENPAGING_PAGEIN_WAITERS];
+};
+
+static struct pagein_io pagein_ios[XENPAGING_PAGEIN_DEPTH];
+static void *writeback_buffer;
 static char *watch_target_tot_pages;
 static char *dom_path;
 static char watch_token[16];
 static char *filename;
+static char *trace_filename;
 static int interrupted;
 
 static void unlink_pagefile(void)
@@ -60,6 +92,12 @@ static void close_handler(int sig)
     unlink_pagefile();
 }
 
+static void xenpaging_trace(struct xenpaging *paging, char event, unsigned long val)
+{
+    if ( paging->trace )
+        fprintf(paging->trace, "%c %lx\n", event, val);
+}
+
 static void xenpaging_mem_paging_flush_ioemu_cache(struct xenpaging *paging)
 {
     struct xs_handle *xsh = paging->xs_handle;
@@ -77,7 +115,8 @@ static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
     xc_evtchn *xce = paging->mem_event.xce_handle;
     char **vec, *val;
     unsigned int num;
-    struct pollfd fd[2];
+    struct pollfd fd[3];
+    int nfds = 2;
     int port;
     int rc;
     int timeout;
@@ -88,9 +127,17 @@ static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
     fd[1].fd = xs_fileno(paging->xs_handle);
     fd[1].events = POLLIN | POLLERR;
 
+    /* and for completed pagefile reads */
+    if ( paging->aio_fd >= 0 )
+    {
+        fd[2].fd = paging->aio_fd;
+        fd[2].events = POLLIN | POLLERR;
+        nfds++;
+    }
+
     /* No timeout while page-out is still in progress */
     timeout = paging->use_poll_timeout ? 100 : 0;
-    rc = poll(fd, 2, timeout);
+    rc = poll(fd, nfds, timeout);
     if ( rc < 0 )
     {
         if (errno == EINTR)
@@ -133,6 +180,7 @@ static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
                         if ( target_tot_pages < 0 || target_tot_pages > paging->max_pages )
                             target_tot_pages = paging->max_pages;
                         paging->target_tot_pages = target_tot_pages;
+                        xenpaging_trace(paging, XENPAGING_TRACE_TARGET, target_tot_pages);
                         /* Disable poll() delay while new target is not yet reached */
                         paging->use_poll_timeout = 0;
                         DPRINTF("new target_tot_pages %d\n", target_tot_pages);
@@ -180,17 +228,17 @@ static int xenpaging_get_tot_pages(struct xenpaging *paging)
     return domain_info.tot_pages;
 }
 
-static void *init_page(void)
+static void *init_pages(int nr)
 {
     void *buffer;
 
     /* Allocated page memory */
-    errno = posix_memalign(&buffer, PAGE_SIZE, PAGE_SIZE);
+    errno = posix_memalign(&buffer, PAGE_SIZE, nr * PAGE_SIZE);
     if ( errno != 0 )
         return NULL;
 
     /* Lock buffer in memory so it can't be paged out */
-    if ( mlock(buffer, PAGE_SIZE) < 0 )
+    if ( mlock(buffer, nr * PAGE_SIZE) < 0 )
     {
         free(buffer);
         buffer = NULL;
@@ -210,6 +258,11 @@ static void usage(void)
     printf(" -f <file>      --pagefile=<file>        pagefile to use. This option is required.\n");
     printf(" -m <max_memkb> --max_memkb=<max_memkb>  maximum amount of memory to handle.\n");
     printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -p <name>      --policy=<name>          victim selection policy: default or clock.\n");
+    printf(" -s <ms>        --sample_interval=<ms>   milliseconds between access samples, 0 disables.\n");
+    printf(" -t <file>      --trace=<file>           record a fault trace for xenpaging-replay.\n");
+    printf(" -c <kb>        --cache=<kb>             keep up to kb of compressed pages in memory.\n");
+    printf(" -a <num>       --readahead=<num>        read up to num pages evicted together on a fault.\n");
     printf(" -v             --verbose                enable debug output.\n");
     printf(" -h             --help                   this output.\n");
 }
@@ -217,13 +270,18 @@ static void usage(void)
 static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
 {
     int ch;
-    static const char sopts[] = "hvd:f:m:r:";
+    static const char sopts[] = "hvd:f:m:r:p:s:t:c:a:";
     static const struct option lopts[] = {
         {"help", 0, NULL, 'h'},
         {"verbose", 0, NULL, 'v'},
         {"domain", 1, NULL, 'd'},
         {"pagefile", 1, NULL, 'f'},
         {"mru_size", 1, NULL, 'm'},
+        {"policy", 1, NULL, 'p'},
+        {"sample_interval", 1, NULL, 's'},
+        {"trace", 1, NULL, 't'},
+        {"cache", 1, NULL, 'c'},
+        {"readahead", 1, NULL, 'a'},
         { }
     };
 
@@ -243,6 +301,31 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
         case 'r':
             paging->policy_mru_size = atoi(optarg);
             break;
+        case 'p':
+            if ( !policy_lookup(optarg) )
+            {
+                printf("Unknown policy %s\n", optarg);
+                usage();
+                return 1;
+            }
+            paging->policy_name = strdup(optarg);
+            break;
+        case 's':
+            paging->sample_interval = atoi(optarg);
+            break;
+        case 't':
+            trace_filename = strdup(optarg);
+            break;
+        case 'c':
+            paging->cache_kb = atoi(optarg);
+            break;
+        case 'a':
+            paging->readahead = atoi(optarg);
+            if ( paging->readahead < 0 )
+                paging->readahead = 0;
+            if ( paging->readahead > XENPAGING_MAX_READAHEAD )
+                paging->readahead = XENPAGING_MAX_READAHEAD;
+            break;
         case 'v':
             paging->debug = 1;
             break;
@@ -273,6 +356,161 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
     return 0;
 }
 
+/* Set up the access ring used to sample the working set of the guest */
+/* Map all pages the domain builder reserved for a ring, and populate
+ * those a previous helper removed from the guest physmap
+ */
+static int xenpaging_map_ring(struct xenpaging *paging,
+                              struct mem_event *mem_event, int param)
+{
+    xc_interface *xch = paging->xc_handle;
+    xen_pfn_t pfns[MEM_EVENT_RING_MAX_PAGES];
+    unsigned long ring_pfn, nr_pages = 0;
+    unsigned int i, missing = 0;
+    int rc;
+
+    xc_get_hvm_param(xch, mem_event->domain_id, param, &ring_pfn);
+    xc_get_hvm_param(xch, mem_event->domain_id,
+                     HVM_PARAM_MEM_EVENT_RING_PAGES, &nr_pages);
+    if ( nr_pages == 0 )
+        nr_pages = 1;
+    if ( nr_pages > MEM_EVENT_RING_MAX_PAGES )
+        nr_pages = MEM_EVENT_RING_MAX_PAGES;
+
+    mem_event->ring_pfn = ring_pfn;
+    mem_event->nr_ring_pages = nr_pages;
+
+    for ( i = 0; i < nr_pages; i++ )
+        pfns[i] = ring_pfn + i;
+    mem_event->ring_page =
+        xc_map_foreign_batch(xch, mem_event->domain_id,
+                                PROT_READ | PROT_WRITE, pfns, nr_pages);
+
+    for ( i = 0; i < nr_pages; i++ )
+    {
+        if ( !(pfns[i] & XEN_DOMCTL_PFINFO_XTAB) )
+            continue;
+
+        /* Map failed, populate ring page */
+        pfns[i] = ring_pfn + i;
+        rc = xc_domain_populate_physmap_exact(xch, mem_event->domain_id,
+                                              1, 0, 0, &pfns[i]);
+        if ( rc != 0 )
+        {
+            PERROR("Failed to populate ring gfn %lx\n", ring_pfn + i);
+            goto err;
+        }
+        missing++;
+    }
+
+    if ( missing )
+    {
+        if ( mem_event->ring_page )
+            munmap(mem_event->ring_page, nr_pages * PAGE_SIZE);
+
+        for ( i = 0; i < nr_pages; i++ )
+            pfns[i] = ring_pfn + i;
+        mem_event->ring_page =
+            xc_map_foreign_batch(xch, mem_event->domain_id,
+                                    PROT_READ | PROT_WRITE, pfns, nr_pages);
+        for ( i = 0; i < nr_pages; i++ )
+            if ( pfns[i] & XEN_DOMCTL_PFINFO_XTAB )
+                break;
+        if ( i < nr_pages )
+        {
+            PERROR("Could not map the ring page\n");
+            goto err;
+        }
+    }
+
+    if ( !mem_event->ring_page )
+    {
+        PERROR("Could not map the ring page\n");
+        return -1;
+    }
+
+    return 0;
+
+ err:
+    if ( mem_event->ring_page )
+        munmap(mem_event->ring_page, nr_pages * PAGE_SIZE);
+    mem_event->ring_page = NULL;
+    return -1;
+}
+
+/* Set up the shared ring once Xen has been told about it */
+static void xenpaging_init_ring(struct xenpaging *paging,
+                                struct mem_event *mem_event)
+{
+    xc_interface *xch = paging->xc_handle;
+    xen_pfn_t pfns[MEM_EVENT_RING_MAX_PAGES];
+    unsigned int i;
+
+    SHARED_RING_INIT((mem_event_sring_t *)mem_event->ring_page);
+    BACK_RING_INIT(&mem_event->back_ring,
+                   (mem_event_sring_t *)mem_event->ring_page,
+                   mem_event->nr_ring_pages * PAGE_SIZE);
+
+    /* Now that the ring is set, remove it from the guest's physmap */
+    for ( i = 0; i < mem_event->nr_ring_pages; i++ )
+        pfns[i] = mem_event->ring_pfn + i;
+    if ( xc_domain_decrease_reservation_exact(xch, mem_event->domain_id,
+                                              mem_event->nr_ring_pages,
+                                              0, pfns) )
+        PERROR("Failed to remove ring from guest physmap");
+
+    DPRINTF("ring of %u pages with %u entries\n", mem_event->nr_ring_pages,
+            RING_SIZE(&mem_event->back_ring));
+}
+
+static int xenpaging_access_init(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct mem_event *access = &paging->access_event;
+    int rc;
+
+    access->domain_id = paging->mem_event.domain_id;
+    access->xce_handle = paging->mem_event.xce_handle;
+
+    /* Map the ring pages */
+    if ( xenpaging_map_ring(paging, access, HVM_PARAM_ACCESS_RING_PFN) )
+        return -1;
+
+    rc = xc_mem_access_enable_ring(xch, access->domain_id,
+                                   access->nr_ring_pages,
+                                   &access->evtchn_port);
+    if ( rc != 0 )
+    {
+        if ( errno == ENODEV )
+            ERROR("access sampling requires EPT");
+        else
+            PERROR("Error enabling mem_access");
+        goto err;
+    }
+
+    /* Bind event notification on the paging event channel handle */
+    rc = xc_evtchn_bind_interdomain(access->xce_handle, access->domain_id,
+                                    access->evtchn_port);
+    if ( rc < 0 )
+    {
+        PERROR("Failed to bind access event channel");
+        xc_mem_access_disable(xch, access->domain_id);
+        goto err;
+    }
+
+    access->port = rc;
+
+    /* Initialise ring */
+    xenpaging_init_ring(paging, access);
+
+    return 0;
+
+ err:
+    munmap(access->ring_page, access->nr_ring_pages * PAGE_SIZE);
+    access->ring_page = NULL;
+    return -1;
+}
+
 static struct xenpaging *xenpaging_init(int argc, char *argv[])
 {
     struct xenpaging *paging;
@@ -280,14 +518,17 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
     xc_interface *xch = NULL;
     xentoollog_logger *dbg = NULL;
     char *p;
-    int rc;
-    unsigned long ring_pfn, mmap_pfn;
+    int i, rc;
 
     /* Allocate memory */
     paging = calloc(1, sizeof(struct xenpaging));
     if ( !paging )
         goto err;
 
+    paging->sample_interval = XENPAGING_SAMPLE_INTERVAL;
+    paging->readahead = XENPAGING_READAHEAD;
+    paging->aio_fd = -1;
+
     /* Get cmdline options and domain_id */
     if ( xenpaging_getopts(paging, argc, argv) )
         goto err;
@@ -338,39 +579,15 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
 
-    /* Map the ring page */
-    xc_get_hvm_param(xch, paging->mem_event.domain_id, 
-                        HVM_PARAM_PAGING_RING_PFN, &ring_pfn);
-    mmap_pfn = ring_pfn;
-    paging->mem_event.ring_page = 
-        xc_map_foreign_batch(xch, paging->mem_event.domain_id, 
-                                PROT_READ | PROT_WRITE, &mmap_pfn, 1);
-    if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
-    {
-        /* Map failed, populate ring page */
-        rc = xc_domain_populate_physmap_exact(paging->xc_handle, 
-                                              paging->mem_event.domain_id,
-                                              1, 0, 0, &ring_pfn);
-        if ( rc != 0 )
-        {
-            PERROR("Failed to populate ring gfn\n");
-            goto err;
-        }
+    /* Map the ring pages */
+    if ( xenpaging_map_ring(paging, &paging->mem_event,
+                            HVM_PARAM_PAGING_RING_PFN) )
+        goto err;
 
-        mmap_pfn = ring_pfn;
-        paging->mem_event.ring_page = 
-            xc_map_foreign_batch(xch, paging->mem_event.domain_id, 
-                                    PROT_READ | PROT_WRITE, &mmap_pfn, 1);
-        if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
-        {
-            PERROR("Could not map the ring page\n");
-            goto err;
-        }
-    }
-    
     /* Initialise Xen */
-    rc = xc_mem_paging_enable(xch, paging->mem_event.domain_id,
-                             &paging->mem_event.evtchn_port);
+    rc = xc_mem_paging_enable_ring(xch, paging->mem_event.domain_id,
+                                   paging->mem_event.nr_ring_pages,
+                                   &paging->mem_event.evtchn_port);
     if ( rc != 0 )
     {
         switch ( errno ) {
@@ -414,15 +631,7 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
     paging->mem_event.port = rc;
 
     /* Initialise ring */
-    SHARED_RING_INIT((mem_event_sring_t *)paging->mem_event.ring_page);
-    BACK_RING_INIT(&paging->mem_event.back_ring,
-                   (mem_event_sring_t *)paging->mem_event.ring_page,
-                   PAGE_SIZE);
-
-    /* Now that the ring is set, remove it from the guest's physmap */
-    if ( xc_domain_decrease_reservation_exact(xch, 
-                    paging->mem_event.domain_id, 1, 0, &ring_pfn) )
-        PERROR("Failed to remove ring from guest physmap");
+    xenpaging_init_ring(paging, &paging->mem_event);
 
     /* Get max_pages from guest if not provided via cmdline */
     if ( !paging->max_pages )
@@ -454,9 +663,9 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
     if ( !paging->slot_to_gfn || !paging->gfn_to_slot )
         goto err;
 
-    /* Allocate stack for known free slots in pagefile */
-    paging->free_slot_stack = calloc(paging->max_pages, sizeof(*paging->free_slot_stack));
-    if ( !paging->free_slot_stack )
+    /* Allocate eviction batch numbers of pagefile slots */
+    paging->slot_batch = calloc(paging->max_pages, sizeof(*paging->slot_batch));
+    if ( !paging->slot_batch )
         goto err;
 
     /* Initialise policy */
@@ -467,7 +676,7 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
 
-    paging->paging_buffer = init_page();
+    paging->paging_buffer = init_pages(1);
     if ( !paging->paging_buffer )
     {
         PERROR("Creating page aligned load buffer");
@@ -482,6 +691,57 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
 
+    /* Compressed tier, which also holds readahead pages */
+    rc = zcache_init(paging->max_pages, (unsigned long)paging->cache_kb << 10,
+                     paging->readahead ? XENPAGING_READAHEAD_CACHE : 0);
+    if ( rc != 0 )
+    {
+        PERROR("Error initialising page cache");
+        goto err;
+    }
+    if ( paging->cache_kb > 0 )
+    {
+        writeback_buffer = init_pages(XENPAGING_EVICT_BATCH);
+        if ( !writeback_buffer )
+        {
+            PERROR("Creating page aligned writeback buffer");
+            goto err;
+        }
+    }
+
+    /* Read from the pagefile in the background where possible */
+    paging->aio_fd = file_aio_init(XENPAGING_PAGEIN_THREADS);
+    if ( paging->aio_fd < 0 )
+        DPRINTF("No asynchronous page-in, reading synchronously\n");
+    for ( i = 0; paging->aio_fd >= 0 && i < XENPAGING_PAGEIN_DEPTH; i++ )
+    {
+        pagein_ios[i].aio.buffer = init_pages(XENPAGING_MAX_READAHEAD + 1);
+        if ( !pagein_ios[i].aio.buffer )
+        {
+            PERROR("Creating page-in buffers");
+            goto err;
+        }
+    }
+
+    if ( trace_filename )
+    {
+        paging->trace = fopen(trace_filename, "w");
+        if ( !paging->trace )
+        {
+            PERROR("failed to open trace file");
+            goto err;
+        }
+        fprintf(paging->trace, "# xenpaging trace domain %u max_pages %x policy %s\n",
+                paging->mem_event.domain_id, paging->max_pages, policy_name());
+    }
+
+    /* Sample the working set if the policy makes use of it */
+    if ( policy_wants_samples() && paging->sample_interval > 0 )
+    {
+        if ( xenpaging_access_init(paging) != 0 )
+            ERROR("Access sampling unavailable, continuing without it");
+    }
+
     return paging;
 
  err:
@@ -499,12 +759,16 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
 
         if ( paging->mem_event.ring_page )
         {
-            munmap(paging->mem_event.ring_page, PAGE_SIZE);
+            munmap(paging->mem_event.ring_page,
+                   paging->mem_event.nr_ring_pages * PAGE_SIZE);
         }
 
+        if ( paging->trace )
+            fclose(paging->trace);
+
         free(dom_path);
         free(watch_target_tot_pages);
-        free(paging->free_slot_stack);
+        free(paging->slot_batch);
         free(paging->slot_to_gfn);
         free(paging->gfn_to_slot);
         free(paging->bitmap);
@@ -523,8 +787,28 @@ static void xenpaging_teardown(struct xenpaging *paging)
     xs_unwatch(paging->xs_handle, "@releaseDomain", watch_token);
 
     paging->xc_handle = NULL;
+
+    /* Tear down access sampling, the guest gets full access back */
+    if ( paging->access_event.ring_page )
+    {
+        rc = xc_hvm_set_mem_access(xch, paging->mem_event.domain_id,
+                                   HVMMEM_access_rwx, 0, paging->max_pages);
+        if ( rc != 0 )
+            PERROR("Error restoring guest memory access");
+        munmap(paging->access_event.ring_page,
+               paging->access_event.nr_ring_pages * PAGE_SIZE);
+        rc = xc_mem_access_disable(xch, paging->mem_event.domain_id);
+        if ( rc != 0 )
+            PERROR("Error tearing down access sampling in xen");
+        rc = xc_evtchn_unbind(paging->mem_event.xce_handle,
+                              paging->access_event.port);
+        if ( rc != 0 )
+            PERROR("Error unbinding access event port");
+    }
+
     /* Tear down domain paging in Xen */
-    munmap(paging->mem_event.ring_page, PAGE_SIZE);
+    munmap(paging->mem_event.ring_page,
+           paging->mem_event.nr_ring_pages * PAGE_SIZE);
     rc = xc_mem_paging_disable(xch, paging->mem_event.domain_id);
     if ( rc != 0 )
     {
@@ -592,83 +876,303 @@ static void put_response(struct mem_event *mem_event, mem_event_response_t *rsp)
     RING_PUSH_RESPONSES(back_ring);
 }
 
-/* Evict a given gfn
+/* Feed access events into the policy and let the guest continue
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if gfn can not be evicted
+ * Returns the number of events handled otherwise
  */
-static int xenpaging_evict_page(struct xenpaging *paging, unsigned long gfn, int slot)
+static int xenpaging_access_events(struct xenpaging *paging)
 {
     xc_interface *xch = paging->xc_handle;
-    void *page;
-    xen_pfn_t victim = gfn;
-    int ret;
+    struct mem_event *access = &paging->access_event;
+    mem_event_request_t req;
+    mem_event_response_t rsp;
+    int num = 0;
 
-    DECLARE_DOMCTL;
+    while ( RING_HAS_UNCONSUMED_REQUESTS(&access->back_ring) )
+    {
+        get_request(access, &req);
 
-    /* Nominate page */
-    ret = xc_mem_paging_nominate(xch, paging->mem_event.domain_id, gfn);
-    if ( ret < 0 )
+        if ( req.reason == MEM_EVENT_REASON_VIOLATION )
+        {
+            policy_notify_accessed(req.gfn);
+            xenpaging_trace(paging, XENPAGING_TRACE_ACCESS, req.gfn);
+        }
+
+        /* Every request needs a response to free its ring slot */
+        memset(&rsp, 0, sizeof(rsp));
+        rsp.gfn = req.gfn;
+        rsp.vcpu_id = req.vcpu_id;
+        rsp.flags = req.flags;
+        rsp.p2mt = req.p2mt;
+        put_response(access, &rsp);
+        num++;
+    }
+
+    if ( num && xc_mem_access_resume(xch, access->domain_id, rsp.gfn) < 0 )
     {
-        /* unpageable gfn is indicated by EBUSY */
-        if ( errno == EBUSY )
-            ret = 1;
-        else
-            PERROR("Error nominating page %lx", gfn);
-        goto out;
+        PERROR("Error resuming access events");
+        return -1;
+    }
+
+    return num;
+}
+
+/* Revoke access to a batch of gfns picked by the policy. The first touch
+ * by the guest sends an access event and restores full access, without
+ * pausing the vcpu.
+ */
+static void xenpaging_sample(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    static struct timeval last;
+    static unsigned long last_ws;
+    struct timeval now;
+    unsigned long gfns[XENPAGING_SAMPLE_BATCH];
+    unsigned long ws;
+    int i, j, num;
+
+    gettimeofday(&now, NULL);
+    if ( (now.tv_sec - last.tv_sec) * 1000 +
+         (now.tv_usec - last.tv_usec) / 1000 < paging->sample_interval )
+        return;
+    last = now;
+
+    num = policy_sample(gfns, XENPAGING_SAMPLE_BATCH);
+    for ( i = 0; i < num; i = j )
+    {
+        /* One call per contiguous run of gfns */
+        for ( j = i + 1; j < num && gfns[j] == gfns[j - 1] + 1; j++ )
+            ;
+
+        if ( xc_hvm_set_mem_access(xch, paging->mem_event.domain_id,
+                                   HVMMEM_access_n2rwx, gfns[i], j - i) < 0 )
+        {
+            PERROR("Error revoking access to %lx", gfns[i]);
+            /* Nothing will be reported for them, treat them as in use */
+            for ( ; i < j; i++ )
+                policy_notify_accessed(gfns[i]);
+        }
     }
 
-    /* Map page */
-    page = xc_map_foreign_pages(xch, paging->mem_event.domain_id, PROT_READ, &victim, 1);
-    if ( page == NULL )
+    ws = policy_working_set();
+    if ( ws > last_ws + last_ws / 32 || ws + ws / 32 < last_ws )
     {
-        PERROR("Error mapping page %lx", gfn);
-        ret = -1;
-        goto out;
+        DPRINTF("working set estimate %lu pages\n", ws);
+        last_ws = ws;
     }
+}
 
-    /* Copy page */
-    ret = write_page(paging->fd, page, slot);
-    if ( ret < 0 )
+/* Forget a pagefile slot */
+static void free_slot(struct xenpaging *paging, int slot)
+{
+    paging->slot_to_gfn[slot] = 0;
+    paging->slot_batch[slot] = 0;
+}
+
+/* Forget where the contents of a paged out gfn are kept */
+static void release_gfn(struct xenpaging *paging, unsigned long gfn)
+{
+    int slot = paging->gfn_to_slot[gfn];
+
+    zcache_drop(gfn);
+    if ( slot >= 0 && paging->slot_to_gfn[slot] == gfn )
+        free_slot(paging, slot);
+    paging->gfn_to_slot[gfn] = -1;
+}
+
+/* Find up to nr free slots in a row, continuing after the last allocation
+ * Returns the number of slots found
+ */
+static int alloc_slots(struct xenpaging *paging, int nr, int *first)
+{
+    int i, slot = paging->slot_cursor, run = 0;
+
+    for ( i = 0; i < paging->max_pages && run < nr; i++, slot++ )
+    {
+        if ( slot >= paging->max_pages )
+        {
+            /* A run ends with the pagefile */
+            if ( run )
+                break;
+            slot = 0;
+        }
+
+        if ( paging->slot_to_gfn[slot] )
+        {
+            if ( run )
+                break;
+            continue;
+        }
+
+        if ( run++ == 0 )
+            *first = slot;
+    }
+
+    if ( run )
+        paging->slot_cursor = *first + run;
+
+    return run;
+}
+
+/* Write a batch of pages to the pagefile, one request per run of free slots */
+static int write_batch(struct xenpaging *paging, unsigned long *gfns,
+                       void **pages, int nr)
+{
+    int i, n, slot, done = 0;
+
+    /* Batch 0 marks free slots */
+    if ( ++paging->batch == 0 )
+        paging->batch++;
+
+    while ( done < nr )
+    {
+        n = alloc_slots(paging, nr - done, &slot);
+        if ( n == 0 )
+        {
+            errno = ENOSPC;
+            return -1;
+        }
+
+        if ( write_pages(paging->fd, pages + done, slot, n) < 0 )
+            return -1;
+
+        for ( i = 0; i < n; i++ )
+        {
+            paging->slot_to_gfn[slot + i] = gfns[done + i];
+            paging->gfn_to_slot[gfns[done + i]] = slot + i;
+            paging->slot_batch[slot + i] = paging->batch;
+        }
+
+        done += n;
+    }
+
+    return 0;
+}
+
+/* Move the oldest compressed pages to the pagefile while the memory tier
+ * is over its budget
+ */
+static int writeback_pages(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    unsigned long gfns[XENPAGING_EVICT_BATCH];
+    void *pages[XENPAGING_EVICT_BATCH];
+    int n;
+
+    if ( !writeback_buffer )
+        return 0;
+
+    do
     {
-        PERROR("Error copying page %lx", gfn);
-        munmap(page, PAGE_SIZE);
-        ret = -1;
-        goto out;
+        for ( n = 0; n < XENPAGING_EVICT_BATCH; n++ )
+        {
+            pages[n] = writeback_buffer + n * PAGE_SIZE;
+            if ( zcache_writeback(&gfns[n], pages[n]) )
+                break;
+        }
+
+        if ( n && write_batch(paging, gfns, pages, n) < 0 )
+        {
+            PERROR("Error writing back %d compressed pages", n);
+            return -1;
+        }
     }
+    while ( n == XENPAGING_EVICT_BATCH );
 
-    /* Release page */
-    munmap(page, PAGE_SIZE);
+    return 0;
+}
 
-    /* Tell Xen to evict page */
-    ret = xc_mem_paging_evict(xch, paging->mem_event.domain_id, gfn);
+/* Evict a batch of nominated gfns
+ * Returns < 0 on fatal error
+ * Returns the number of evicted pages otherwise
+ */
+static int evict_batch(struct xenpaging *paging, xen_pfn_t *gfns, int nr)
+{
+    xc_interface *xch = paging->xc_handle;
+    unsigned long disk_gfns[XENPAGING_EVICT_BATCH];
+    void *disk_pages[XENPAGING_EVICT_BATCH];
+    int err[XENPAGING_EVICT_BATCH];
+    unsigned long gfn;
+    void *pages;
+    int i, n = 0, num = 0;
+    int ret;
+
+    /* Map all pages at once */
+    pages = xc_map_foreign_bulk(xch, paging->mem_event.domain_id, PROT_READ,
+                                gfns, err, nr);
+    if ( pages == NULL )
+    {
+        PERROR("Error mapping %d pages", nr);
+        return -1;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( err[i] )
+        {
+            errno = -err[i];
+            PERROR("Error mapping page %lx", (unsigned long)gfns[i]);
+            munmap(pages, nr * PAGE_SIZE);
+            return -1;
+        }
+
+        /* Keep the page compressed in memory if there is room */
+        if ( zcache_store(gfns[i], pages + i * PAGE_SIZE, 1) == 0 )
+        {
+            paging->gfn_to_slot[gfns[i]] = -1;
+            continue;
+        }
+
+        disk_gfns[n] = gfns[i];
+        disk_pages[n] = pages + i * PAGE_SIZE;
+        n++;
+    }
+
+    /* Copy the rest to the pagefile, straight from the mapping */
+    ret = n ? write_batch(paging, disk_gfns, disk_pages, n) : 0;
+    munmap(pages, nr * PAGE_SIZE);
     if ( ret < 0 )
     {
-        /* A gfn in use is indicated by EBUSY */
-        if ( errno == EBUSY )
+        PERROR("Error writing %d pages", n);
+        return -1;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        gfn = gfns[i];
+
+        /* Tell Xen to evict page */
+        ret = xc_mem_paging_evict(xch, paging->mem_event.domain_id, gfn);
+        if ( ret < 0 )
         {
-                ret = 1;
+            /* A gfn in use is indicated by EBUSY */
+            if ( errno == EBUSY )
+            {
                 DPRINTF("Nominated page %lx busy", gfn);
-        } else
+                release_gfn(paging, gfn);
+                continue;
+            }
             PERROR("Error evicting page %lx", gfn);
-        goto out;
-    }
+            return -1;
+        }
 
-    DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slot);
-    /* Notify policy of page being paged out */
-    policy_notify_paged_out(gfn);
+        DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, paging->gfn_to_slot[gfn]);
+        /* Notify policy of page being paged out */
+        policy_notify_paged_out(gfn);
+        xenpaging_trace(paging, XENPAGING_TRACE_PAGE_OUT, gfn);
 
-    /* Update index */
-    paging->slot_to_gfn[slot] = gfn;
-    paging->gfn_to_slot[gfn] = slot;
+        if ( test_and_set_bit(gfn, paging->bitmap) )
+            ERROR("Page %lx has been evicted before", gfn);
 
-    /* Record number of evicted pages */
-    paging->num_paged_out++;
+        /* Record number of evicted pages */
+        paging->num_paged_out++;
+        num++;
+    }
 
-    ret = 0;
+    if ( writeback_pages(paging) < 0 )
+        return -1;
 
- out:
-    return ret;
+    return num;
 }
 
 static int xenpaging_resume_page(struct xenpaging *paging, mem_event_response_t *rsp, int notify_policy)
@@ -692,30 +1196,41 @@ static int xenpaging_resume_page(struct xenpaging *paging, mem_event_response_t
        paging->num_paged_out--;
     }
 
-    /* Tell Xen page is ready */
-    return xc_evtchn_notify(paging->mem_event.xce_handle, paging->mem_event.port);
+    /* Xen is told about the page with the rest of the batch */
+    paging->mem_event.nr_responses++;
+    return 0;
 }
 
-static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn, int i)
+/* Let Xen process all responses put on the paging ring in one go */
+static int xenpaging_flush_responses(struct xenpaging *paging)
 {
     xc_interface *xch = paging->xc_handle;
-    int ret;
-    unsigned char oom = 0;
 
-    DPRINTF("populate_page < gfn %lx pageslot %d\n", gfn, i);
+    if ( !paging->mem_event.nr_responses )
+        return 0;
 
-    /* Read page */
-    ret = read_page(paging->fd, paging->paging_buffer, i);
-    if ( ret != 0 )
+    paging->mem_event.nr_responses = 0;
+    if ( xc_mem_paging_resume(xch, paging->mem_event.domain_id) < 0 )
     {
-        PERROR("Error reading page");
-        goto out;
+        PERROR("Error resuming paged in pages");
+        return -1;
     }
 
+    return 0;
+}
+
+static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn, void *buffer)
+{
+    xc_interface *xch = paging->xc_handle;
+    int ret;
+    unsigned char oom = 0;
+
+    DPRINTF("populate_page < gfn %lx pageslot %d\n", gfn, paging->gfn_to_slot[gfn]);
+
     do
     {
         /* Tell Xen to allocate a page for the domain */
-        ret = xc_mem_paging_load(xch, paging->mem_event.domain_id, gfn, paging->paging_buffer);
+        ret = xc_mem_paging_load(xch, paging->mem_event.domain_id, gfn, buffer);
         if ( ret < 0 )
         {
             if ( errno == ENOMEM )
@@ -732,11 +1247,197 @@ static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn,
     }
     while ( ret && !interrupted );
 
-
- out:
     return ret;
 }
 
+/* Answer all requests waiting for a page that is back in the guest */
+static int pagein_done(struct xenpaging *paging, mem_event_request_t *reqs, int nr)
+{
+    xc_interface *xch = paging->xc_handle;
+    mem_event_response_t rsp;
+    int i;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        /* Prepare the response */
+        rsp.gfn = reqs[i].gfn;
+        rsp.vcpu_id = reqs[i].vcpu_id;
+        rsp.flags = reqs[i].flags;
+
+        /* Only the first response accounts for the page */
+        if ( xenpaging_resume_page(paging, &rsp, i == 0) < 0 )
+        {
+            PERROR("Error resuming page %"PRIx64"", reqs[i].gfn);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static struct pagein_io *pagein_find(unsigned long gfn)
+{
+    int i;
+
+    for ( i = 0; i < XENPAGING_PAGEIN_DEPTH; i++ )
+        if ( pagein_ios[i].busy && pagein_ios[i].gfn == gfn )
+            return &pagein_ios[i];
+
+    return NULL;
+}
+
+static struct pagein_io *pagein_get(struct xenpaging *paging)
+{
+    int i;
+
+    if ( paging->aio_fd < 0 )
+        return NULL;
+
+    for ( i = 0; i < XENPAGING_PAGEIN_DEPTH; i++ )
+        if ( !pagein_ios[i].busy )
+            return &pagein_ios[i];
+
+    return NULL;
+}
+
+/* Bring a paged out gfn back, from memory or from the pagefile
+ * Returns < 0 on fatal error
+ */
+static int pagein_start(struct xenpaging *paging, mem_event_request_t *req)
+{
+    xc_interface *xch = paging->xc_handle;
+    unsigned long gfn = req->gfn;
+    struct pagein_io *io;
+    int i, slot, lo, hi;
+
+    /* Still in memory */
+    if ( zcache_load(gfn, paging->paging_buffer) == 0 )
+        goto populate;
+
+    /* Find where in the paging file to read from */
+    slot = paging->gfn_to_slot[gfn];
+
+    /* Sanity check */
+    if ( slot < 0 || paging->slot_to_gfn[slot] != gfn )
+    {
+        ERROR("Expected gfn %lx in slot %d, but found gfn %lx\n", gfn, slot,
+              slot < 0 ? 0 : paging->slot_to_gfn[slot]);
+        return -1;
+    }
+
+    /* All readers busy, read it right here */
+    io = pagein_get(paging);
+    if ( !io )
+    {
+        if ( read_page(paging->fd, paging->paging_buffer, slot) != 0 )
+        {
+            PERROR("Error reading page");
+            return -1;
+        }
+        goto populate;
+    }
+
+    /* Read the neighbours that were evicted along with it */
+    lo = hi = slot;
+    while ( hi - lo < paging->readahead && hi + 1 < paging->max_pages &&
+            paging->slot_batch[hi + 1] == paging->slot_batch[slot] )
+        hi++;
+    while ( hi - lo < paging->readahead && lo > 0 &&
+            paging->slot_batch[lo - 1] == paging->slot_batch[slot] )
+        lo--;
+
+    io->busy = 1;
+    io->dropped = 0;
+    io->gfn = gfn;
+    io->slot = slot;
+    io->nr_waiters = 1;
+    io->waiters[0] = *req;
+    for ( i = lo; i <= hi; i++ )
+        io->gfns[i - lo] = paging->slot_to_gfn[i];
+
+    io->aio.fd = paging->fd;
+    io->aio.slot = lo;
+    io->aio.nr = hi - lo + 1;
+    file_aio_submit(&io->aio);
+
+    return 0;
+
+ populate:
+    if ( xenpaging_populate_page(paging, gfn, paging->paging_buffer) < 0 )
+    {
+        ERROR("Error populating page %lx", gfn);
+        return -1;
+    }
+    release_gfn(paging, gfn);
+
+    return pagein_done(paging, req, 1);
+}
+
+static int pagein_finish(struct xenpaging *paging, struct pagein_io *io)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct file_aio *aio = &io->aio;
+    unsigned long gfn;
+    int i, slot;
+
+    if ( aio->err )
+    {
+        errno = aio->err;
+        PERROR("Error reading page");
+        return -1;
+    }
+
+    /* Keep the readahead pages which are still paged out */
+    for ( i = 0; i < aio->nr; i++ )
+    {
+        slot = aio->slot + i;
+        gfn = io->gfns[i];
+        if ( gfn == io->gfn || paging->slot_to_gfn[slot] != gfn ||
+             !test_bit(gfn, paging->bitmap) || zcache_contains(gfn) )
+            continue;
+        zcache_store(gfn, aio->buffer + i * PAGE_SIZE, 0);
+    }
+
+    if ( io->dropped )
+    {
+        /* Notify policy of page being dropped */
+        policy_notify_dropped(io->gfn);
+    }
+    else if ( xenpaging_populate_page(paging, io->gfn,
+                  aio->buffer + (io->slot - aio->slot) * PAGE_SIZE) < 0 )
+    {
+        ERROR("Error populating page %lx", io->gfn);
+        return -1;
+    }
+    release_gfn(paging, io->gfn);
+
+    return pagein_done(paging, io->waiters, io->nr_waiters);
+}
+
+/* Finish the page-ins whose pagefile reads have completed
+ * Returns < 0 on fatal error
+ */
+static int pagein_complete(struct xenpaging *paging)
+{
+    struct file_aio *aio, *next;
+    struct pagein_io *io;
+    int rc = 0;
+
+    if ( paging->aio_fd < 0 )
+        return 0;
+
+    for ( aio = file_aio_reap(); aio; aio = next )
+    {
+        next = aio->next;
+        io = (struct pagein_io *)aio;
+        if ( rc == 0 )
+            rc = pagein_finish(paging, io);
+        io->busy = 0;
+    }
+
+    return rc;
+}
+
 /* Trigger a page-in for a batch of pages */
 static void resume_pages(struct xenpaging *paging, int num_pages)
 {
@@ -758,19 +1459,18 @@ static void resume_pages(struct xenpaging *paging, int num_pages)
         page_in_trigger();
 }
 
-/* Evict one gfn and write it to the given slot
+/* Nominate up to nr victims
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if no gfn can be evicted
+ * Returns the number of nominated gfns otherwise
  */
-static int evict_victim(struct xenpaging *paging, int slot)
+static int nominate_victims(struct xenpaging *paging, xen_pfn_t *gfns, int nr)
 {
     xc_interface *xch = paging->xc_handle;
     unsigned long gfn;
     static int num_paged_out;
-    int ret;
+    int num = 0;
 
-    do
+    while ( num < nr && !interrupted )
     {
         gfn = policy_choose_victim(paging);
         if ( gfn == INVALID_MFN )
@@ -786,73 +1486,70 @@ static int evict_victim(struct xenpaging *paging, int slot)
                 xenpaging_mem_paging_flush_ioemu_cache(paging);
                 num_paged_out = paging->num_paged_out;
             }
-            ret = ENOSPC;
-            goto out;
+            break;
         }
 
-        if ( interrupted )
+        /* Nominate page */
+        if ( xc_mem_paging_nominate(xch, paging->mem_event.domain_id, gfn) < 0 )
         {
-            ret = EINTR;
-            goto out;
+            /* unpageable gfn is indicated by EBUSY */
+            if ( errno == EBUSY )
+                continue;
+            PERROR("Error nominating page %lx", gfn);
+            return -1;
         }
 
-        ret = xenpaging_evict_page(paging, gfn, slot);
-        if ( ret < 0 )
-            goto out;
+        gfns[num++] = gfn;
     }
-    while ( ret );
-
-    if ( test_and_set_bit(gfn, paging->bitmap) )
-        ERROR("Page %lx has been evicted before", gfn);
-
-    ret = 0;
 
- out:
-    return ret;
+    return num;
 }
 
-/* Evict a batch of pages and write them to a free slot in the paging file
+/* Evict a batch of pages and write them to free slots in the paging file
  * Returns < 0 on fatal error
  * Returns 0 if no gfn can be evicted
  * Returns > 0 on successful evict
  */
 static int evict_pages(struct xenpaging *paging, int num_pages)
 {
-    xc_interface *xch = paging->xc_handle;
-    int rc, slot, num = 0;
+    xen_pfn_t gfns[XENPAGING_EVICT_BATCH];
+    int nr, nominated, rc, num = 0;
 
-    /* Reuse known free slots */
-    while ( paging->stack_count > 0 && num < num_pages )
+    while ( num < num_pages && !interrupted )
     {
-        slot = paging->free_slot_stack[--paging->stack_count];
-        rc = evict_victim(paging, slot);
-        if ( rc )
-        {
-            num = rc < 0 ? -1 : num;
-            return num;
-        }
-        num++;
-    }
+        nr = num_pages - num;
+        if ( nr > XENPAGING_EVICT_BATCH )
+            nr = XENPAGING_EVICT_BATCH;
 
-    /* Scan all slots slots for remainders */
-    for ( slot = 0; slot < paging->max_pages && num < num_pages; slot++ )
-    {
-        /* Slot is allocated */
-        if ( paging->slot_to_gfn[slot] )
-            continue;
+        nominated = nominate_victims(paging, gfns, nr);
+        if ( nominated <= 0 )
+            return nominated < 0 ? -1 : num;
 
-        rc = evict_victim(paging, slot);
-        if ( rc )
-        {
-            num = rc < 0 ? -1 : num;
-            break;
-        }
+        rc = evict_batch(paging, gfns, nominated);
+        if ( rc < 0 )
+            return -1;
+        num += rc;
 
-        num++;
+        /* The policy ran out of victims */
+        if ( nominated < nr )
+            break;
     }
+
     return num;
 }
 
+static void xenpaging_cache_stats(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct zcache_stats stats;
+
+    zcache_get_stats(&stats);
+    DPRINTF("page cache: %lu stored, %lu rejected, %lu written back, "
+            "%lu compressed hits, %lu readahead hits\n",
+            stats.stored, stats.rejected, stats.written_back,
+            stats.dirty_hits, stats.clean_hits);
+}
+
 int main(int argc, char *argv[])
 {
     struct sigaction act;
@@ -860,7 +1557,7 @@ int main(int argc, char *argv[])
     mem_event_request_t req;
     mem_event_response_t rsp;
     int num, prev_num = 0;
-    int slot;
+    struct pagein_io *io;
     int tot_pages;
     int rc;
     xc_interface *xch;
@@ -919,51 +1616,43 @@ int main(int argc, char *argv[])
             /* Check if the page has already been paged in */
             if ( test_and_clear_bit(req.gfn, paging->bitmap) )
             {
-                /* Find where in the paging file to read from */
-                slot = paging->gfn_to_slot[req.gfn];
-
-                /* Sanity check */
-                if ( paging->slot_to_gfn[slot] != req.gfn )
-                {
-                    ERROR("Expected gfn %"PRIx64" in slot %d, but found gfn %lx\n", req.gfn, slot, paging->slot_to_gfn[slot]);
-                    goto out;
-                }
-
                 if ( req.flags & MEM_EVENT_FLAG_DROP_PAGE )
                 {
-                    DPRINTF("drop_page ^ gfn %"PRIx64" pageslot %d\n", req.gfn, slot);
+                    DPRINTF("drop_page ^ gfn %"PRIx64" pageslot %d\n", req.gfn, paging->gfn_to_slot[req.gfn]);
                     /* Notify policy of page being dropped */
                     policy_notify_dropped(req.gfn);
+                    xenpaging_trace(paging, XENPAGING_TRACE_DROP, req.gfn);
+                    release_gfn(paging, req.gfn);
+
+                    if ( pagein_done(paging, &req, 1) < 0 )
+                        goto out;
                 }
                 else
                 {
-                    /* Populate the page */
-                    if ( xenpaging_populate_page(paging, req.gfn, slot) < 0 )
-                    {
-                        ERROR("Error populating page %"PRIx64"", req.gfn);
+                    xenpaging_trace(paging, XENPAGING_TRACE_FAULT, req.gfn);
+
+                    /* Populate the page, or start reading it */
+                    if ( pagein_start(paging, &req) < 0 )
                         goto out;
-                    }
                 }
-
-                /* Prepare the response */
-                rsp.gfn = req.gfn;
-                rsp.vcpu_id = req.vcpu_id;
-                rsp.flags = req.flags;
-
-                if ( xenpaging_resume_page(paging, &rsp, 1) < 0 )
+            }
+            else
+            {
+                io = pagein_find(req.gfn);
+                if ( io && (req.flags & MEM_EVENT_FLAG_DROP_PAGE) )
                 {
-                    PERROR("Error resuming page %"PRIx64"", req.gfn);
-                    goto out;
+                    DPRINTF("drop_page ^ gfn %"PRIx64" while reading it\n", req.gfn);
+                    io->dropped = 1;
+                    xenpaging_trace(paging, XENPAGING_TRACE_DROP, req.gfn);
                 }
 
-                /* Clear this pagefile slot */
-                paging->slot_to_gfn[slot] = 0;
+                /* The page is being read, answer once it is back */
+                if ( io && io->nr_waiters < XENPAGING_PAGEIN_WAITERS )
+                {
+                    io->waiters[io->nr_waiters++] = req;
+                    continue;
+                }
 
-                /* Record this free slot */
-                paging->free_slot_stack[paging->stack_count++] = slot;
-            }
-            else
-            {
                 DPRINTF("page %s populated (domain = %d; vcpu = %d;"
                         " gfn = %"PRIx64"; paused = %d; evict_fail = %d)\n",
                         req.flags & MEM_EVENT_FLAG_EVICT_FAIL ? "not" : "already",
@@ -988,6 +1677,22 @@ int main(int argc, char *argv[])
             }
         }
 
+        /* Indicate possible error */
+        rc = 1;
+
+        /* Finish page-ins whose pagefile reads completed */
+        if ( pagein_complete(paging) < 0 )
+            goto out;
+
+        /* Resume all vcpus waiting for the pages handled above */
+        if ( xenpaging_flush_responses(paging) < 0 )
+            goto out;
+
+        /* Pass guest accesses seen by the sampler on to the policy */
+        if ( paging->access_event.ring_page &&
+             xenpaging_access_events(paging) < 0 )
+            goto out;
+
         /* If interrupted, write all pages back into the guest */
         if ( interrupted == SIGTERM || interrupted == SIGINT )
         {
@@ -1055,16 +1760,23 @@ int main(int argc, char *argv[])
             paging->use_poll_timeout = 1;
         }
 
+        /* Keep sampling the working set while a target is set */
+        if ( paging->target_tot_pages && paging->access_event.ring_page )
+            xenpaging_sample(paging);
+
     }
 
     /* No error */
     rc = 0;
 
     DPRINTF("xenpaging got signal %d\n", interrupted);
+    xenpaging_cache_stats(paging);
 
  out:
     close(paging->fd);
     unlink_pagefile();
+    if ( paging->trace )
+        fclose(paging->trace);
 
     /* Tear down domain paging */
     xenpaging_teardown(paging);
@@ -38,6 +38,10 @@ struct mem_event {
     mem_event_back_ring_t back_ring;
     uint32_t evtchn_port;
     void *ring_page;
+    unsigned long ring_pfn;
+    unsigned int nr_ring_pages;
+    /* responses put on the ring but not yet seen by Xen */
+    int nr_responses;
 };
 
 struct xenpaging {
@@ -52,19 +56,46 @@ struct xenpaging {
     void *paging_buffer;
 
     struct mem_event mem_event;
+    /* access ring used for working set sampling, shares the xce_handle */
+    struct mem_event access_event;
     int fd;
     /* number of pages for which data structures were allocated */
     int max_pages;
     int num_paged_out;
     int target_tot_pages;
     int policy_mru_size;
+    char *policy_name;
+    /* milliseconds between access samples, 0 disables sampling */
+    int sample_interval;
+    FILE *trace;
     int use_poll_timeout;
     int debug;
-    int stack_count;
-    int *free_slot_stack;
+    /* eviction batch that wrote each pagefile slot, for readahead */
+    unsigned int *slot_batch;
+    unsigned int batch;
+    int slot_cursor;
+    int readahead;
+    /* KiB of compressed pages kept in memory before using the pagefile */
+    int cache_kb;
+    int aio_fd;
     unsigned long pagein_queue[XENPAGING_PAGEIN_QUEUE_SIZE];
 };
 
+/*
+ * Fault traces, one event per line with hexadecimal values, replayed by
+ * xenpaging-replay:
+ *   t <pages>  new target_tot_pages
+ *   o <gfn>    gfn was paged out
+ *   f <gfn>    guest faulted on a paged out gfn
+ *   a <gfn>    access sampling saw the guest touch gfn
+ *   d <gfn>    paged out gfn was dropped by the guest
+ */
+#define XENPAGING_TRACE_TARGET   't'
+#define XENPAGING_TRACE_PAGE_OUT 'o'
+#define XENPAGING_TRACE_FAULT    'f'
+#define XENPAGING_TRACE_ACCESS   'a'
+#define XENPAGING_TRACE_DROP     'd'
+
 extern void create_page_in_thread(struct xenpaging *paging);
 extern void page_in_trigger(void);
 
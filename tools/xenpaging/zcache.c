@@ -0,0 +1,271 @@
+/******************************************************************************
+ *
+ * Compressed in-memory tier for paged out pages.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Evicted pages are compressed into memory first and only reach the
+ * pagefile once the tier grows beyond its budget, oldest first.  Those
+ * are the dirty entries.  Clean entries are copies of pages that are also
+ * in the pagefile, brought in by readahead; they are simply dropped when
+ * there are too many of them.
+ */
+
+
+#include <zlib.h>
+#include <xc_private.h>
+
+#include "zcache.h"
+
+
+/* Pages which do not shrink to this size go to the pagefile directly */
+#define ZCACHE_MAX_LEN (PAGE_SIZE * 3 / 4)
+
+struct zcache_entry {
+    struct zcache_entry *prev, *next;
+    unsigned long gfn;
+    unsigned int len;
+    int dirty;
+    unsigned char data[0];
+};
+
+/* head is the oldest entry */
+struct zcache_list {
+    struct zcache_entry *head, *tail;
+};
+
+static struct zcache_entry **entries;
+static unsigned long nr_gfns;
+static struct zcache_list dirty_list, clean_list;
+static unsigned long dirty_budget, clean_budget;
+static unsigned char *zbuf;
+static unsigned long zbuf_len;
+static struct zcache_stats stats;
+
+
+int zcache_init(unsigned long max_pages, unsigned long dirty_bytes,
+                unsigned long clean_pages)
+{
+    dirty_budget = dirty_bytes;
+    clean_budget = clean_pages;
+    if ( !dirty_budget && !clean_budget )
+        return 0;
+
+    nr_gfns = max_pages;
+    entries = calloc(nr_gfns, sizeof(*entries));
+    zbuf_len = compressBound(PAGE_SIZE);
+    zbuf = malloc(zbuf_len);
+    if ( !entries || !zbuf )
+    {
+        free(entries);
+        free(zbuf);
+        entries = NULL;
+        zbuf = NULL;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static void zcache_unlink(struct zcache_entry *e)
+{
+    struct zcache_list *list = e->dirty ? &dirty_list : &clean_list;
+
+    if ( e->prev )
+        e->prev->next = e->next;
+    else
+        list->head = e->next;
+    if ( e->next )
+        e->next->prev = e->prev;
+    else
+        list->tail = e->prev;
+
+    if ( e->dirty )
+    {
+        stats.dirty_pages--;
+        stats.dirty_bytes -= e->len;
+    }
+    else
+        stats.clean_pages--;
+
+    entries[e->gfn] = NULL;
+}
+
+static void zcache_append(struct zcache_entry *e)
+{
+    struct zcache_list *list = e->dirty ? &dirty_list : &clean_list;
+
+    e->next = NULL;
+    e->prev = list->tail;
+    if ( list->tail )
+        list->tail->next = e;
+    else
+        list->head = e;
+    list->tail = e;
+
+    if ( e->dirty )
+    {
+        stats.dirty_pages++;
+        stats.dirty_bytes += e->len;
+    }
+    else
+        stats.clean_pages++;
+
+    entries[e->gfn] = e;
+}
+
+static int zcache_copy_out(struct zcache_entry *e, void *page)
+{
+    uLongf len = PAGE_SIZE;
+
+    if ( e->len == PAGE_SIZE )
+    {
+        memcpy(page, e->data, PAGE_SIZE);
+        return 0;
+    }
+
+    if ( uncompress(page, &len, e->data, e->len) != Z_OK || len != PAGE_SIZE )
+        return -1;
+
+    return 0;
+}
+
+/* Keep a copy of gfn; dirty copies are not in the pagefile yet */
+int zcache_store(unsigned long gfn, void *page, int dirty)
+{
+    struct zcache_entry *e;
+    uLongf zlen = zbuf_len;
+    const void *src = zbuf;
+    unsigned int len;
+
+    if ( !entries || gfn >= nr_gfns || !(dirty ? dirty_budget : clean_budget) )
+        return -1;
+
+    if ( compress2(zbuf, &zlen, page, PAGE_SIZE, Z_BEST_SPEED) != Z_OK ||
+         zlen >= PAGE_SIZE )
+    {
+        src = page;
+        zlen = PAGE_SIZE;
+    }
+    len = zlen;
+
+    if ( dirty && len > ZCACHE_MAX_LEN )
+    {
+        stats.rejected++;
+        return -1;
+    }
+
+    e = malloc(sizeof(*e) + len);
+    if ( !e )
+        return -1;
+
+    zcache_drop(gfn);
+
+    e->gfn = gfn;
+    e->len = len;
+    e->dirty = dirty;
+    memcpy(e->data, src, len);
+    zcache_append(e);
+    stats.stored++;
+
+    /* Readahead copies can always be read again */
+    while ( stats.clean_pages > clean_budget )
+    {
+        e = clean_list.head;
+        zcache_unlink(e);
+        free(e);
+    }
+
+    return 0;
+}
+
+/* Copy gfn out of the tier and forget it */
+int zcache_load(unsigned long gfn, void *page)
+{
+    struct zcache_entry *e;
+    int rc;
+
+    if ( !entries || gfn >= nr_gfns || !entries[gfn] )
+        return -1;
+
+    e = entries[gfn];
+    rc = zcache_copy_out(e, page);
+    if ( rc == 0 )
+    {
+        if ( e->dirty )
+            stats.dirty_hits++;
+        else
+            stats.clean_hits++;
+    }
+
+    zcache_unlink(e);
+    free(e);
+    return rc;
+}
+
+int zcache_contains(unsigned long gfn)
+{
+    return entries && gfn < nr_gfns && entries[gfn];
+}
+
+void zcache_drop(unsigned long gfn)
+{
+    struct zcache_entry *e;
+
+    if ( !zcache_contains(gfn) )
+        return;
+
+    e = entries[gfn];
+    zcache_unlink(e);
+    free(e);
+}
+
+/*
+ * While the dirty entries exceed their budget, hand out the oldest one so
+ * that it can be written to the pagefile.  Returns 0 if a page was copied.
+ */
+int zcache_writeback(unsigned long *gfn, void *page)
+{
+    struct zcache_entry *e = dirty_list.head;
+
+    if ( !e || stats.dirty_bytes <= dirty_budget )
+        return -1;
+
+    if ( zcache_copy_out(e, page) )
+        return -1;
+
+    *gfn = e->gfn;
+    zcache_unlink(e);
+    free(e);
+    stats.written_back++;
+    return 0;
+}
+
+void zcache_get_stats(struct zcache_stats *s)
+{
+    *s = stats;
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,57 @@
+/******************************************************************************
+ * tools/xenpaging/zcache.h
+ *
+ * Compressed in-memory tier for paged out pages.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __ZCACHE_H__
+#define __ZCACHE_H__
+
+
+struct zcache_stats {
+    unsigned long stored;
+    unsigned long rejected;
+    unsigned long written_back;
+    unsigned long dirty_hits;
+    unsigned long clean_hits;
+    unsigned long dirty_pages;
+    unsigned long dirty_bytes;
+    unsigned long clean_pages;
+};
+
+int zcache_init(unsigned long max_pages, unsigned long dirty_bytes,
+                unsigned long clean_pages);
+int zcache_store(unsigned long gfn, void *page, int dirty);
+int zcache_load(unsigned long gfn, void *page);
+int zcache_contains(unsigned long gfn);
+void zcache_drop(unsigned long gfn);
+int zcache_writeback(unsigned long *gfn, void *page);
+void zcache_get_stats(struct zcache_stats *stats);
+
+
+#endif
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
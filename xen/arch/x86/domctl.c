@@ -46,6 +46,83 @@ static int gdbsx_guest_mem_io(
     return (iop->remain ? -EFAULT : 0);
 }
 
+/* Free a page stolen from its owner which nobody would take back. */
+static void release_stolen_page(struct page_info *page)
+{
+    if ( test_and_clear_bit(_PGC_allocated, &page->count_info) )
+        put_page(page);
+}
+
+/*
+ * Move the page at gfn of the shut down domain d to the same gfn of t.
+ * On failure the page is left with d.
+ */
+static int transfer_page(struct domain *d, struct domain *t, unsigned long gfn)
+{
+    struct page_info *page;
+    p2m_type_t p2mt;
+    mfn_t mfn;
+    struct two_gfns tg;
+    int rc;
+
+    /* Sharing ops may hold both gfns too: take them in the same order. */
+    get_two_gfns(d, gfn, &p2mt, NULL, &mfn,
+                 t, gfn, NULL, NULL, NULL, 0, &tg);
+
+    rc = -ENOENT;
+    if ( !p2m_is_ram(p2mt) || !mfn_valid(mfn_x(mfn)) )
+        goto out;
+
+    /* Only plain RAM: shared and paged pages need their own handling. */
+    rc = -EBUSY;
+    if ( (p2mt != p2m_ram_rw) && (p2mt != p2m_ram_logdirty) )
+        goto out;
+
+    page = mfn_to_page(mfn_x(mfn));
+    if ( is_xen_heap_page(page) || steal_page(d, page, 0) )
+        goto out;
+
+    if ( assign_pages(t, page, 0, 0) )
+    {
+        rc = -ENOMEM;
+        if ( assign_pages(d, page, 0, 0) )
+        {
+            /* d is going away: the page goes with it. */
+            guest_physmap_remove_page(d, gfn, mfn_x(mfn), PAGE_ORDER_4K);
+            release_stolen_page(page);
+        }
+        goto out;
+    }
+
+    guest_physmap_remove_page(d, gfn, mfn_x(mfn), PAGE_ORDER_4K);
+    rc = guest_physmap_add_page(t, gfn, mfn_x(mfn), PAGE_ORDER_4K);
+    if ( !rc )
+        goto out;
+
+    /* t cannot map it: put the page back at gfn of d. */
+    if ( steal_page(t, page, 0) )
+    {
+        /* Still owned by t, which frees it when it goes away. */
+        gdprintk(XENLOG_ERR, "d%d gfn %lx lost in transfer to d%d\n",
+                 d->domain_id, gfn, t->domain_id);
+        goto out;
+    }
+    if ( assign_pages(d, page, 0, 0) )
+    {
+        /* As above, but the page is no longer mapped by d. */
+        release_stolen_page(page);
+        goto out;
+    }
+    if ( guest_physmap_add_page(d, gfn, mfn_x(mfn), PAGE_ORDER_4K) )
+        /* Left on the page list of d, which frees it when it goes away. */
+        gdprintk(XENLOG_ERR, "d%d gfn %lx lost in transfer to d%d\n",
+                 d->domain_id, gfn, t->domain_id);
+
+ out:
+    put_two_gfns(&tg);
+    return rc;
+}
+
 long arch_do_domctl(
     struct xen_domctl *domctl, struct domain *d,
     XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
@@ -1170,6 +1247,7 @@ long arch_do_domctl(
     case XEN_DOMCTL_mem_sharing_op:
     {
         ret = mem_sharing_domctl(d, &domctl->u.mem_sharing_op);
+        copyback = 1;
     }
     break;
 
@@ -1219,6 +1297,73 @@ long arch_do_domctl(
     }
     break;
 
+    case XEN_DOMCTL_transfer_pages:
+    {
+        struct xen_domctl_transfer_pages *tp = &domctl->u.transfer_pages;
+        struct domain *t;
+        uint64_t gfn;
+        int err;
+
+        ret = -ESRCH;
+        if ( (t = rcu_lock_domain_by_id(tp->target)) == NULL )
+            break;
+
+        ret = -EINVAL;
+        if ( (d == current->domain) || (t == current->domain) || (t == d) ||
+             !is_hvm_domain(d) || !is_hvm_domain(t) ||
+             !paging_mode_translate(d) || !paging_mode_translate(t) ||
+             (tp->done > tp->nr) )
+        {
+            rcu_unlock_domain(t);
+            break;
+        }
+
+        /* The caller needs the same rights over both domains. */
+        ret = xsm_domctl(XSM_OTHER, t, domctl->cmd);
+        if ( ret )
+        {
+            rcu_unlock_domain(t);
+            break;
+        }
+
+        /* The source must not run, or touch its memory, ever again. */
+        ret = -EBUSY;
+        if ( !d->is_shut_down )
+        {
+            rcu_unlock_domain(t);
+            break;
+        }
+
+        ret = 0;
+        for ( ; tp->done < tp->nr; tp->done++ )
+        {
+            if ( copy_from_guest_offset(&gfn, tp->gfns, tp->done, 1) )
+            {
+                ret = -EFAULT;
+                break;
+            }
+
+            err = transfer_page(d, t, gfn);
+
+            if ( copy_to_guest_offset(tp->errs, tp->done, &err, 1) )
+            {
+                ret = -EFAULT;
+                break;
+            }
+
+            if ( hypercall_preempt_check() )
+            {
+                tp->done++;
+                break;
+            }
+        }
+
+        flush_tlb_mask(d->domain_dirty_cpumask);
+        rcu_unlock_domain(t);
+        copyback = 1;
+    }
+    break;
+
     default:
         ret = iommu_do_domctl(domctl, d, u_domctl);
         break;
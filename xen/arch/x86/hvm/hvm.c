@@ -3940,6 +3940,16 @@ long do_hvm_op(unsigned long op, XEN_GUEST_HANDLE_PARAM(void) arg)
                 if ( a.value > SHUTDOWN_MAX )
                     rc = -EINVAL;
                 break;
+            case HVM_PARAM_MEM_EVENT_RING_PAGES:
+                /* Set by the domain builder, which reserves the pages */
+                if ( d == current->domain )
+                {
+                    rc = -EPERM;
+                    break;
+                }
+                if ( a.value > MEM_EVENT_RING_MAX_PAGES )
+                    rc = -EINVAL;
+                break;
             }
 
             if ( rc == 0 ) 
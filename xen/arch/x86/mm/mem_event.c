@@ -24,6 +24,7 @@
 #include <asm/domain.h>
 #include <xen/event.h>
 #include <xen/wait.h>
+#include <xen/vmap.h>
 #include <asm/p2m.h>
 #include <asm/mem_event.h>
 #include <asm/mem_paging.h>
@@ -40,6 +41,54 @@
 #define mem_event_ring_lock(_med)       spin_lock(&(_med)->ring_lock)
 #define mem_event_ring_unlock(_med)     spin_unlock(&(_med)->ring_lock)
 
+static void mem_event_unmap_ring(struct mem_event_domain *med)
+{
+    unsigned int i;
+
+    if ( med->ring_page )
+        vunmap(med->ring_page);
+    med->ring_page = NULL;
+
+    for ( i = 0; i < med->nr_ring_pages; i++ )
+        put_page_and_type(med->ring_pg_struct[i]);
+    med->nr_ring_pages = 0;
+}
+
+/*
+ * Take a writable reference on each ring page and map them next to each
+ * other, so that the ring macros can treat them as one area.
+ */
+static int mem_event_map_ring(struct domain *d, struct mem_event_domain *med,
+                              unsigned long ring_gfn, unsigned int nr_pages)
+{
+    unsigned long mfn[MEM_EVENT_RING_MAX_PAGES];
+    void *va;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < nr_pages; i++ )
+    {
+        rc = prepare_ring_for_helper(d, ring_gfn + i,
+                                     &med->ring_pg_struct[i], &va);
+        if ( rc < 0 )
+            goto err;
+        unmap_domain_page_global(va);
+        mfn[i] = page_to_mfn(med->ring_pg_struct[i]);
+        med->nr_ring_pages++;
+    }
+
+    rc = -ENOMEM;
+    med->ring_page = vmap(mfn, nr_pages);
+    if ( med->ring_page == NULL )
+        goto err;
+
+    return 0;
+
+ err:
+    mem_event_unmap_ring(med);
+    return rc;
+}
+
 static int mem_event_enable(
     struct domain *d,
     xen_domctl_mem_event_op_t *mec,
@@ -50,6 +99,9 @@ static int mem_event_enable(
 {
     int rc;
     unsigned long ring_gfn = d->arch.hvm_domain.params[param];
+    unsigned int nr_pages = mec->nr_ring_pages ?: 1;
+    unsigned int reserved =
+        d->arch.hvm_domain.params[HVM_PARAM_MEM_EVENT_RING_PAGES] ?: 1;
 
     /* Only one helper at a time. If the helper crashed,
      * the ring is in an undefined state and so is the guest.
@@ -62,11 +114,14 @@ static int mem_event_enable(
     if ( ring_gfn == 0 )
         return -ENOSYS;
 
+    /* The pages after the ring may be in use for something else */
+    if ( nr_pages > reserved || nr_pages > MEM_EVENT_RING_MAX_PAGES )
+        return -E2BIG;
+
     mem_event_ring_lock_init(med);
     mem_event_ring_lock(med);
 
-    rc = prepare_ring_for_helper(d, ring_gfn, &med->ring_pg_struct, 
-                                    &med->ring_page);
+    rc = mem_event_map_ring(d, med, ring_gfn, nr_pages);
     if ( rc < 0 )
         goto err;
 
@@ -85,7 +140,7 @@ static int mem_event_enable(
     /* Prepare ring buffer */
     FRONT_RING_INIT(&med->front_ring,
                     (mem_event_sring_t *)med->ring_page,
-                    PAGE_SIZE);
+                    nr_pages * PAGE_SIZE);
 
     /* Save the pause flag for this particular ring. */
     med->pause_flag = pause_flag;
@@ -97,8 +152,7 @@ static int mem_event_enable(
     return 0;
 
  err:
-    destroy_ring_for_helper(&med->ring_page, 
-                            med->ring_pg_struct);
+    mem_event_unmap_ring(med);
     mem_event_ring_unlock(med);
 
     return rc;
@@ -226,8 +280,7 @@ static int mem_event_disable(struct domain *d, struct mem_event_domain *med)
             }
         }
 
-        destroy_ring_for_helper(&med->ring_page, 
-                                med->ring_pg_struct);
+        mem_event_unmap_ring(med);
         mem_event_ring_unlock(med);
     }
 
@@ -337,8 +390,11 @@ int mem_event_get_response(struct domain *d, struct mem_event_domain *med, mem_e
     front_ring->sring->rsp_event = rsp_cons + 1;
 
     /* Kick any waiters -- since we've just consumed an event,
-     * there may be additional space available in the ring. */
-    mem_event_wake(d, med);
+     * there may be additional space available in the ring.  The
+     * callers drain all responses in one go, so only do this once
+     * the batch has been consumed. */
+    if ( !RING_HAS_UNCONSUMED_RESPONSES(front_ring) )
+        mem_event_wake(d, med);
 
     mem_event_ring_unlock(med);
 
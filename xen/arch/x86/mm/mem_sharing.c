@@ -26,6 +26,7 @@
 #include <xen/spinlock.h>
 #include <xen/mm.h>
 #include <xen/grant_table.h>
+#include <xen/guest_access.h>
 #include <xen/sched.h>
 #include <asm/page.h>
 #include <asm/string.h>
@@ -61,6 +62,13 @@ DEFINE_PER_CPU(pg_lock_data_t, __pld);
  * table constantly. */
 #define RMAP_LIGHT_SHARED_PAGE   (RMAP_HEAVY_SHARED_PAGE >> 2)
 
+/* Reverse map statistics, see struct xen_domctl_mem_sharing_stats. */
+static atomic_t rmap_hash_frames    = ATOMIC_INIT(0);
+static atomic_t rmap_to_hash        = ATOMIC_INIT(0);
+static atomic_t rmap_to_hash_failed = ATOMIC_INIT(0);
+static atomic_t rmap_to_list        = ATOMIC_INIT(0);
+static atomic_t rmap_fanout[XEN_DOMCTL_MEM_SHARING_FANOUT_BUCKETS];
+
 #if MEM_SHARING_AUDIT
 
 static struct list_head shr_audit_list;
@@ -86,8 +94,11 @@ static inline void page_sharing_dispose(struct page_info *page)
 {
     /* Unlikely given our thresholds, but we should be careful. */
     if ( unlikely(RMAP_USES_HASHTAB(page)) )
+    {
         free_xenheap_pages(page->sharing->hash_table.bucket, 
                             RMAP_HASHTAB_ORDER);
+        atomic_dec(&rmap_hash_frames);
+    }
 
     spin_lock(&shr_audit_lock);
     list_del_rcu(&page->sharing->entry);
@@ -108,8 +119,11 @@ static inline void page_sharing_dispose(struct page_info *page)
 {
     /* Unlikely given our thresholds, but we should be careful. */
     if ( unlikely(RMAP_USES_HASHTAB(page)) )
+    {
         free_xenheap_pages(page->sharing->hash_table.bucket, 
                             RMAP_HASHTAB_ORDER);
+        atomic_dec(&rmap_hash_frames);
+    }
     xfree(page->sharing);
 }
 
@@ -185,6 +199,25 @@ rmap_init(struct page_info *page)
     INIT_LIST_HEAD(&page->sharing->gfns);
 }
 
+/* Fan-out histogram bucket of a frame backing count gfns, count > 0 */
+static inline unsigned int rmap_fanout_bucket(unsigned long count)
+{
+    return min_t(unsigned int, fls(count) - 1,
+                 XEN_DOMCTL_MEM_SHARING_FANOUT_BUCKETS - 1);
+}
+
+/* Moves a frame across the histogram as its rmap changes size. A count of
+ * zero means the frame is not (or no longer) shared. */
+static inline void rmap_fanout_update(unsigned long from, unsigned long to)
+{
+    if ( from && to && (rmap_fanout_bucket(from) == rmap_fanout_bucket(to)) )
+        return;
+    if ( from )
+        atomic_dec(&rmap_fanout[rmap_fanout_bucket(from)]);
+    if ( to )
+        atomic_inc(&rmap_fanout[rmap_fanout_bucket(to)]);
+}
+
 /* Exceedingly simple "hash function" */
 #define HASH(domain, gfn)       \
     (((gfn) + (domain)) % RMAP_HASHTAB_SIZE)
@@ -199,7 +232,10 @@ rmap_list_to_hash_table(struct page_info *page)
         alloc_xenheap_pages(RMAP_HASHTAB_ORDER, 0);
 
     if ( b == NULL )
+    {
+        atomic_inc(&rmap_to_hash_failed);
         return -ENOMEM;
+    }
 
     for ( i = 0; i < RMAP_HASHTAB_SIZE; i++ )
         INIT_LIST_HEAD(b + i);
@@ -215,6 +251,8 @@ rmap_list_to_hash_table(struct page_info *page)
     page->sharing->hash_table.bucket = b;
     page->sharing->hash_table.flag   = NULL;
 
+    atomic_inc(&rmap_to_hash);
+    atomic_inc(&rmap_hash_frames);
     return 0;
 }
 
@@ -237,6 +275,9 @@ rmap_hash_table_to_list(struct page_info *page)
     }
 
     free_xenheap_pages(bucket, RMAP_HASHTAB_ORDER);
+
+    atomic_inc(&rmap_to_list);
+    atomic_dec(&rmap_hash_frames);
 }
 
 /* Generic accessors to the rmap */
@@ -257,8 +298,12 @@ rmap_count(struct page_info *pg)
 static inline void
 rmap_del(gfn_info_t *gfn_info, struct page_info *page, int convert)
 {
+    unsigned long count = rmap_count(page);
+
+    rmap_fanout_update(count, count - 1);
+
     if ( RMAP_USES_HASHTAB(page) && convert &&
-         (rmap_count(page) <= RMAP_LIGHT_SHARED_PAGE) )
+         (count <= RMAP_LIGHT_SHARED_PAGE) )
         rmap_hash_table_to_list(page);
 
     /* Regardless of rmap type, same removal operation */
@@ -270,9 +315,12 @@ static inline void
 rmap_add(gfn_info_t *gfn_info, struct page_info *page)
 {
     struct list_head *head;
+    unsigned long count = rmap_count(page);
+
+    rmap_fanout_update(count - 1, count);
 
     if ( !RMAP_USES_HASHTAB(page) &&
-         (rmap_count(page) >= RMAP_HEAVY_SHARED_PAGE) )
+         (count >= RMAP_HEAVY_SHARED_PAGE) )
         /* The conversion may fail with ENOMEM. We'll be less efficient,
          * but no reason to panic. */
         (void)rmap_list_to_hash_table(page);
@@ -386,9 +434,27 @@ static inline gfn_info_t *mem_sharing_gfn_alloc(struct page_info *page,
     /* Increment our number of shared pges. */
     atomic_inc(&d->shr_pages);
 
+    /* The first tuple owns the frame, any other saves a page. */
+    if ( page->sharing->owner == NULL )
+        page->sharing->owner = gfn_info;
+    else
+        atomic_inc(&d->shr_saved_pages);
+
     return gfn_info;
 }
 
+/* Adjusts the saved page count of the domain of a tuple that gains (delta
+ * -1) or loses (delta 1) the ownership of its frame. */
+static void mem_sharing_gfn_account(gfn_info_t *gfn_info, int delta)
+{
+    struct domain *d = rcu_lock_domain_by_id(gfn_info->domain);
+
+    /* Tuples are removed from the rmap before their domain goes away. */
+    BUG_ON(!d);
+    atomic_add(delta, &d->shr_saved_pages);
+    rcu_unlock_domain(d);
+}
+
 static inline void mem_sharing_gfn_destroy(struct page_info *page,
                                            struct domain *d,
                                            gfn_info_t *gfn_info)
@@ -398,6 +464,20 @@ static inline void mem_sharing_gfn_destroy(struct page_info *page,
 
     /* Free the gfn_info structure. */
     rmap_del(gfn_info, page, 1);
+
+    if ( page->sharing->owner != gfn_info )
+        atomic_dec(&d->shr_saved_pages);
+    else
+    {
+        /* Hand the frame over to any remaining tuple. */
+        struct rmap_iterator ri;
+
+        rmap_seed_iterator(page, &ri);
+        page->sharing->owner = rmap_iterate(page, &ri);
+        if ( page->sharing->owner != NULL )
+            mem_sharing_gfn_account(page->sharing->owner, -1);
+    }
+
     xfree(gfn_info);
 }
 
@@ -426,11 +506,16 @@ static struct page_info* mem_sharing_lookup(unsigned long mfn)
 int mem_sharing_audit(void)
 {
     int errors = 0;
+    unsigned int i;
     unsigned long count_expected;
     unsigned long count_found = 0;
+    unsigned long saved_expected, saved_found = 0;
+    unsigned long fanout[XEN_DOMCTL_MEM_SHARING_FANOUT_BUCKETS] = { 0 };
     struct list_head *ae;
+    struct domain *d;
 
     count_expected = atomic_read(&nr_shared_mfns);
+    saved_expected = atomic_read(&nr_saved_mfns);
 
     rcu_read_lock(&shr_audit_read_lock);
 
@@ -536,6 +621,20 @@ int mem_sharing_audit(void)
                               (pg->u.inuse.type_info & PGT_count_mask));
             errors++;
         }
+        if ( nr_gfns )
+        {
+            fanout[rmap_fanout_bucket(nr_gfns)]++;
+            saved_found += nr_gfns - 1;
+        }
+        if ( (pg->sharing->owner == NULL) ||
+             (rmap_retrieve(pg->sharing->owner->domain,
+                            pg->sharing->owner->gfn, pg) !=
+              pg->sharing->owner) )
+        {
+            MEM_SHARING_DEBUG("MFN=%lx is not owned by a gfn in its list\n",
+                              mfn_x(mfn));
+            errors++;
+        }
 
         mem_sharing_page_unlock(pg);
     }
@@ -549,6 +648,34 @@ int mem_sharing_audit(void)
         errors++;
     }
 
+    /* The incremental statistics have to agree with what we just found. */
+    if ( saved_found != saved_expected )
+    {
+        MEM_SHARING_DEBUG("Expected %ld saved mfns, found %ld.",
+                          saved_expected, saved_found);
+        errors++;
+    }
+
+    for ( i = 0; i < XEN_DOMCTL_MEM_SHARING_FANOUT_BUCKETS; i++ )
+        if ( fanout[i] != atomic_read(&rmap_fanout[i]) )
+        {
+            MEM_SHARING_DEBUG("Expected %d mfns in fan-out bucket %u, "
+                              "found %ld.", atomic_read(&rmap_fanout[i]),
+                              i, fanout[i]);
+            errors++;
+        }
+
+    rcu_read_lock(&domlist_read_lock);
+    for_each_domain ( d )
+        saved_found -= atomic_read(&d->shr_saved_pages);
+    rcu_read_unlock(&domlist_read_lock);
+    if ( saved_found != 0 )
+    {
+        MEM_SHARING_DEBUG("Saved mfns differ from the domain counts by %ld.",
+                          saved_found);
+        errors++;
+    }
+
     return errors;
 }
 #endif
@@ -886,6 +1013,7 @@ int mem_sharing_nominate_page(struct domain *d,
         goto out;
     }
     page->sharing->pg = page;
+    page->sharing->owner = NULL;
     rmap_init(page);
 
     /* Create the handle */
@@ -1026,6 +1154,9 @@ int mem_sharing_share_pages(struct domain *sd, unsigned long sgfn, shr_handle_t
     }
     ASSERT(list_empty(&cpage->sharing->gfns));
 
+    /* The tuple that owned the client page now saves it. */
+    mem_sharing_gfn_account(cpage->sharing->owner, 1);
+
     /* Clear the rest of the shared state */
     page_sharing_dispose(cpage);
     cpage->sharing = NULL;
@@ -1102,6 +1233,7 @@ int mem_sharing_add_to_physmap(struct domain *sd, unsigned long sgfn, shr_handle
         put_page_and_type(spage);
     } else {
         ret = 0;
+        atomic_inc(&nr_saved_mfns);
         /* There is a chance we're plugging a hole where a paged out page was */
         if ( p2m_is_paging(cmfn_type) && (cmfn_type != p2m_ram_paging_out) )
         {
@@ -1117,8 +1249,6 @@ int mem_sharing_add_to_physmap(struct domain *sd, unsigned long sgfn, shr_handle
         }
     }
 
-    atomic_inc(&nr_saved_mfns);
-
 err_unlock:
     mem_sharing_page_unlock(spage);
 err_out:
@@ -1305,6 +1435,114 @@ int relinquish_shared_pages(struct domain *d)
     return rc;
 }
 
+/* Nominate and share one pair of gfns, or add the source page to the
+ * physmap of the client if add_physmap is set.  Returns 1 if the pair was
+ * shared, 0 if it was skipped because either page cannot be shared, and a
+ * negative error if the whole operation has to be aborted. */
+static int share_gfn_pair(struct domain *d, unsigned long sgfn,
+                          struct domain *cd, unsigned long cgfn,
+                          bool_t add_physmap)
+{
+    shr_handle_t sh, ch;
+    int rc;
+
+    rc = mem_sharing_nominate_page(d, sgfn, 0, &sh);
+    if ( !rc && add_physmap )
+        rc = mem_sharing_add_to_physmap(d, sgfn, sh, cd, cgfn);
+    else if ( !rc )
+    {
+        rc = mem_sharing_nominate_page(cd, cgfn, 0, &ch);
+        if ( !rc )
+            rc = mem_sharing_share_pages(d, sgfn, sh, cd, cgfn, ch);
+    }
+
+    if ( !rc )
+        return 1;
+    if ( rc == -ENOMEM )
+        return rc;
+    return 0;
+}
+
+/* Share source gfns from range->opaque (or first_gfn) up to last_gfn.
+ * Returns -ERESTART with the progress recorded in opaque if preempted. */
+static int range_share(struct domain *d, struct domain *cd,
+                       struct mem_sharing_op_range *range,
+                       bool_t add_physmap)
+{
+    unsigned long gfn = range->opaque ?: range->first_gfn;
+    int rc;
+
+    if ( range->last_gfn < range->first_gfn ||
+         gfn < range->first_gfn || gfn > range->last_gfn )
+        return -EINVAL;
+
+    for ( ; ; )
+    {
+        rc = share_gfn_pair(d, gfn, cd,
+                            range->client_gfn + (gfn - range->first_gfn),
+                            add_physmap);
+        if ( rc < 0 )
+            break;
+        if ( rc )
+            range->nr_shared++;
+        else
+            range->nr_skipped++;
+
+        rc = 0;
+        if ( gfn++ == range->last_gfn )
+            break;
+
+        if ( hypercall_preempt_check() )
+        {
+            range->opaque = gfn;
+            return -ERESTART;
+        }
+    }
+
+    range->opaque = 0;
+    return rc;
+}
+
+/* Same as range_share, but for a guest supplied list of pairs; opaque is
+ * the index of the next pair. */
+static int batch_share(struct domain *d, struct domain *cd,
+                       struct mem_sharing_op_batch *batch)
+{
+    struct xen_mem_sharing_pair pair;
+    uint64_t i = batch->opaque;
+    int rc = 0;
+
+    if ( i > batch->nr_pairs )
+        return -EINVAL;
+
+    while ( i < batch->nr_pairs )
+    {
+        if ( copy_from_guest_offset(&pair, batch->pairs, i, 1) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        rc = share_gfn_pair(d, pair.source_gfn, cd, pair.client_gfn, 0);
+        if ( rc < 0 )
+            break;
+        if ( rc )
+            batch->nr_shared++;
+        else
+            batch->nr_skipped++;
+        rc = 0;
+
+        if ( ++i < batch->nr_pairs && hypercall_preempt_check() )
+        {
+            batch->opaque = i;
+            return -ERESTART;
+        }
+    }
+
+    batch->opaque = 0;
+    return rc;
+}
+
 int mem_sharing_memop(struct domain *d, xen_mem_sharing_op_t *mec)
 {
     int rc = 0;
@@ -1405,6 +1643,45 @@ int mem_sharing_memop(struct domain *d, xen_mem_sharing_op_t *mec)
         }
         break;
 
+        case XENMEM_sharing_op_range_share:
+        case XENMEM_sharing_op_range_add_physmap:
+        case XENMEM_sharing_op_batch_share:
+        {
+            struct domain *cd;
+            domid_t client = (mec->op == XENMEM_sharing_op_batch_share) ?
+                             mec->u.batch.client_domain :
+                             mec->u.range.client_domain;
+
+            if ( !mem_sharing_enabled(d) )
+                return -EINVAL;
+
+            rc = rcu_lock_live_remote_domain_by_id(client, &cd);
+            if ( rc )
+                return rc;
+
+            rc = xsm_mem_sharing_op(XSM_TARGET, d, cd, mec->op);
+            if ( rc )
+            {
+                rcu_unlock_domain(cd);
+                return rc;
+            }
+
+            if ( !mem_sharing_enabled(cd) )
+            {
+                rcu_unlock_domain(cd);
+                return -EINVAL;
+            }
+
+            if ( mec->op == XENMEM_sharing_op_batch_share )
+                rc = batch_share(d, cd, &mec->u.batch);
+            else
+                rc = range_share(d, cd, &mec->u.range, mec->op ==
+                                 XENMEM_sharing_op_range_add_physmap);
+
+            rcu_unlock_domain(cd);
+        }
+        break;
+
         case XENMEM_sharing_op_add_physmap:
         {
             unsigned long sgfn, cgfn;
@@ -1484,11 +1761,30 @@ int mem_sharing_domctl(struct domain *d, xen_domctl_mem_sharing_op_t *mec)
     int rc;
 
     /* Only HAP is supported */
-    if ( !hap_enabled(d) )
+    if ( !hap_enabled(d) && (mec->op != XEN_DOMCTL_MEM_SHARING_STATS) )
          return -ENODEV;
 
     switch(mec->op)
     {
+        case XEN_DOMCTL_MEM_SHARING_STATS:
+        {
+            xen_domctl_mem_sharing_stats_t *stats = &mec->u.stats;
+            unsigned int i;
+
+            stats->shared_pages = atomic_read(&d->shr_pages);
+            stats->saved_pages = atomic_read(&d->shr_saved_pages);
+            stats->nr_shared_mfns = mem_sharing_get_nr_shared_mfns();
+            stats->nr_saved_mfns = mem_sharing_get_nr_saved_mfns();
+            stats->rmap_hash_frames = atomic_read(&rmap_hash_frames);
+            stats->rmap_to_hash = atomic_read(&rmap_to_hash);
+            stats->rmap_to_hash_failed = atomic_read(&rmap_to_hash_failed);
+            stats->rmap_to_list = atomic_read(&rmap_to_list);
+            for ( i = 0; i < XEN_DOMCTL_MEM_SHARING_FANOUT_BUCKETS; i++ )
+                stats->fanout[i] = atomic_read(&rmap_fanout[i]);
+            rc = 0;
+        }
+        break;
+
         case XEN_DOMCTL_MEM_SHARING_CONTROL:
         {
             rc = 0;
@@ -22,6 +22,7 @@
 
 #include <xen/init.h>
 #include <xen/guest_access.h>
+#include <xen/event.h>
 #include <asm/paging.h>
 #include <asm/shadow.h>
 #include <asm/p2m.h>
@@ -116,17 +117,13 @@ static void paging_free_log_dirty_page(struct domain *d, mfn_t mfn)
     d->arch.paging.free_page(d, mfn_to_page(mfn));
 }
 
-void paging_free_log_dirty_bitmap(struct domain *d)
+/* Free a log-dirty trie.  Caller must hold the paging lock. */
+static void paging_free_log_dirty_trie(struct domain *d, mfn_t top)
 {
     mfn_t *l4, *l3, *l2;
     int i4, i3, i2;
 
-    if ( !mfn_valid(d->arch.paging.log_dirty.top) )
-        return;
-
-    paging_lock(d);
-
-    l4 = map_domain_page(mfn_x(d->arch.paging.log_dirty.top));
+    l4 = map_domain_page(mfn_x(top));
 
     for ( i4 = 0; i4 < LOGDIRTY_NODE_ENTRIES; i4++ )
     {
@@ -155,8 +152,28 @@ void paging_free_log_dirty_bitmap(struct domain *d)
     }
 
     unmap_domain_page(l4);
-    paging_free_log_dirty_page(d, d->arch.paging.log_dirty.top);
-    d->arch.paging.log_dirty.top = _mfn(INVALID_MFN);
+    paging_free_log_dirty_page(d, top);
+}
+
+void paging_free_log_dirty_bitmap(struct domain *d)
+{
+    if ( !mfn_valid(d->arch.paging.log_dirty.top) &&
+         !mfn_valid(d->arch.paging.log_dirty.snap) )
+        return;
+
+    paging_lock(d);
+
+    if ( mfn_valid(d->arch.paging.log_dirty.top) )
+    {
+        paging_free_log_dirty_trie(d, d->arch.paging.log_dirty.top);
+        d->arch.paging.log_dirty.top = _mfn(INVALID_MFN);
+    }
+
+    if ( mfn_valid(d->arch.paging.log_dirty.snap) )
+    {
+        paging_free_log_dirty_trie(d, d->arch.paging.log_dirty.snap);
+        d->arch.paging.log_dirty.snap = _mfn(INVALID_MFN);
+    }
 
     ASSERT(d->arch.paging.log_dirty.allocs == 0);
     d->arch.paging.log_dirty.failed_allocs = 0;
@@ -437,6 +454,190 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
     return rv;
 }
 
+/*
+ * Number of pfns covered by one entry of a level-N log-dirty node (level 1
+ * being the leaf bitmaps), and the first pfn the trie cannot describe.
+ */
+#define LOGDIRTY_SPAN_SHIFT(lvl) (PAGE_SHIFT + 3 + PAGETABLE_ORDER * ((lvl) - 1))
+#if BITS_PER_LONG == 64
+#define LOGDIRTY_PFN_LIMIT       (1UL << LOGDIRTY_SPAN_SHIFT(4))
+#else
+#define LOGDIRTY_PFN_LIMIT       (1UL << LOGDIRTY_SPAN_SHIFT(3))
+#endif
+
+/* Dirty pfns gathered on the stack before each copy to the guest list. */
+#define LOGDIRTY_LIST_BATCH      64
+
+/*
+ * Report dirty pfns as a list rather than a bitmap, so that late rounds of
+ * a live migration cost time in proportion to what was dirtied rather than
+ * to the size of the guest.
+ *
+ * CLEAN_LIST detaches the live trie as log_dirty.snap when a round starts
+ * (with the domain paused, exactly like CLEAN) and then hands it out in pfn
+ * order over as many calls as the caller needs, freeing leaves once they
+ * have been reported.  PEEK_LIST reads the live trie in place.
+ */
+static int paging_log_dirty_list(struct domain *d,
+                                 struct xen_domctl_shadow_op *sc)
+{
+    int rv = 0, clean = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN_LIST);
+    unsigned long pfn, count = 0;
+    uint64_t batch[LOGDIRTY_LIST_BATCH];
+    unsigned int nr = 0, i1;
+    mfn_t top, mfn, *node;
+    unsigned long *l1;
+
+    if ( sc->cursor == XEN_DOMCTL_SHADOW_LIST_DONE )
+    {
+        sc->pages = 0;
+        return 0;
+    }
+
+    if ( sc->cursor >= LOGDIRTY_PFN_LIMIT )
+        return -EINVAL;
+    pfn = sc->cursor;
+
+    if ( pfn == 0 )
+    {
+        if ( clean )
+            domain_pause(d);
+        paging_lock(d);
+
+        PAGING_DEBUG(LOGDIRTY, "log-dirty %s: dom %u faults=%u dirty=%u\n",
+                     (clean) ? "clean list" : "peek list",
+                     d->domain_id,
+                     d->arch.paging.log_dirty.fault_count,
+                     d->arch.paging.log_dirty.dirty_count);
+
+        sc->stats.fault_count = d->arch.paging.log_dirty.fault_count;
+        sc->stats.dirty_count = d->arch.paging.log_dirty.dirty_count;
+
+        if ( unlikely(d->arch.paging.log_dirty.failed_allocs) )
+        {
+            printk("%s: %d failed page allocs while logging dirty pages\n",
+                   __FUNCTION__, d->arch.paging.log_dirty.failed_allocs);
+            paging_unlock(d);
+            if ( clean )
+                domain_unpause(d);
+            return -ENOMEM;
+        }
+
+        if ( clean )
+        {
+            d->arch.paging.log_dirty.fault_count = 0;
+            d->arch.paging.log_dirty.dirty_count = 0;
+
+            /* Whatever an abandoned round left unreported is lost. */
+            if ( mfn_valid(d->arch.paging.log_dirty.snap) )
+                paging_free_log_dirty_trie(d, d->arch.paging.log_dirty.snap);
+            d->arch.paging.log_dirty.snap = d->arch.paging.log_dirty.top;
+            d->arch.paging.log_dirty.top = _mfn(INVALID_MFN);
+        }
+
+        paging_unlock(d);
+
+        if ( clean )
+        {
+            /* Safe because the domain is paused. */
+            d->arch.paging.log_dirty.clean_dirty_bitmap(d);
+            domain_unpause(d);
+        }
+    }
+
+    paging_lock(d);
+
+    top = clean ? d->arch.paging.log_dirty.snap : d->arch.paging.log_dirty.top;
+
+    while ( mfn_valid(top) && (pfn < LOGDIRTY_PFN_LIMIT) )
+    {
+        /* Find the leaf covering pfn, or skip the hole it falls in. */
+        node = map_domain_page(mfn_x(top));
+        mfn = node[L4_LOGDIRTY_IDX(pfn)];
+        unmap_domain_page(node);
+        if ( !mfn_valid(mfn) )
+        {
+            pfn = (pfn | ((1UL << LOGDIRTY_SPAN_SHIFT(3)) - 1)) + 1;
+            continue;
+        }
+        node = map_domain_page(mfn_x(mfn));
+        mfn = node[L3_LOGDIRTY_IDX(pfn)];
+        unmap_domain_page(node);
+        if ( !mfn_valid(mfn) )
+        {
+            pfn = (pfn | ((1UL << LOGDIRTY_SPAN_SHIFT(2)) - 1)) + 1;
+            continue;
+        }
+        node = map_domain_page(mfn_x(mfn));
+        mfn = node[L2_LOGDIRTY_IDX(pfn)];
+        if ( !mfn_valid(mfn) )
+        {
+            unmap_domain_page(node);
+            pfn = (pfn | ((1UL << LOGDIRTY_SPAN_SHIFT(1)) - 1)) + 1;
+            continue;
+        }
+
+        l1 = map_domain_page(mfn_x(mfn));
+        for ( i1 = find_next_bit(l1, 1U << LOGDIRTY_SPAN_SHIFT(1),
+                                 L1_LOGDIRTY_IDX(pfn));
+              (i1 < (1U << LOGDIRTY_SPAN_SHIFT(1))) && (count < sc->pages);
+              i1 = find_next_bit(l1, 1U << LOGDIRTY_SPAN_SHIFT(1), i1 + 1) )
+        {
+            batch[nr++] = (pfn & ~((1UL << LOGDIRTY_SPAN_SHIFT(1)) - 1)) + i1;
+            count++;
+            if ( nr == LOGDIRTY_LIST_BATCH )
+            {
+                if ( copy_to_guest_offset(sc->dirty_list, count - nr,
+                                          batch, nr) )
+                    rv = -EFAULT;
+                nr = 0;
+            }
+        }
+        unmap_domain_page(l1);
+
+        if ( i1 < (1U << LOGDIRTY_SPAN_SHIFT(1)) )
+        {
+            /* The list is full: resume from the first unreported pfn. */
+            unmap_domain_page(node);
+            pfn = (pfn & ~((1UL << LOGDIRTY_SPAN_SHIFT(1)) - 1)) + i1;
+            break;
+        }
+
+        /* The whole leaf has been reported. */
+        if ( clean )
+        {
+            paging_free_log_dirty_page(d, mfn);
+            node[L2_LOGDIRTY_IDX(pfn)] = _mfn(INVALID_MFN);
+        }
+        unmap_domain_page(node);
+        pfn = (pfn | ((1UL << LOGDIRTY_SPAN_SHIFT(1)) - 1)) + 1;
+
+        if ( rv || hypercall_preempt_check() )
+            break;
+    }
+
+    if ( nr && copy_to_guest_offset(sc->dirty_list, count - nr, batch, nr) )
+        rv = -EFAULT;
+
+    if ( !mfn_valid(top) || (pfn >= LOGDIRTY_PFN_LIMIT) )
+    {
+        /* End of the round: the snapshot has been handed out in full. */
+        if ( clean && mfn_valid(top) )
+        {
+            paging_free_log_dirty_trie(d, top);
+            d->arch.paging.log_dirty.snap = _mfn(INVALID_MFN);
+        }
+        sc->cursor = XEN_DOMCTL_SHADOW_LIST_DONE;
+    }
+    else
+        sc->cursor = pfn;
+    sc->pages = count;
+
+    paging_unlock(d);
+
+    return rv;
+}
+
 void paging_log_dirty_range(struct domain *d,
                            unsigned long begin_pfn,
                            unsigned long nr,
@@ -511,6 +712,7 @@ int paging_domain_init(struct domain *d, unsigned int domcr_flags)
      * log-dirty init code as that can be called more than once and we
      * don't want to leak any active log-dirty bitmaps */
     d->arch.paging.log_dirty.top = _mfn(INVALID_MFN);
+    d->arch.paging.log_dirty.snap = _mfn(INVALID_MFN);
 
     /* The order of the *_init calls below is important, as the later
      * ones may rewrite some common fields.  Shadow pagetables are the
@@ -591,6 +793,10 @@ int paging_domctl(struct domain *d, xen_domctl_shadow_op_t *sc,
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
         return paging_log_dirty_op(d, sc);
+
+    case XEN_DOMCTL_SHADOW_OP_CLEAN_LIST:
+    case XEN_DOMCTL_SHADOW_OP_PEEK_LIST:
+        return paging_log_dirty_list(d, sc);
     }
 
     /* Here, dispatch domctl to the appropriate paging code */
@@ -231,6 +231,14 @@ int compat_arch_memory_op(int op, XEN_GUEST_HANDLE_PARAM(void) arg)
         if ( mso.op == XENMEM_sharing_op_audit )
             return mem_sharing_audit(); 
         rc = do_mem_event_op(op, mso.domain, (void *) &mso);
+        if ( rc == -ERESTART )
+        {
+            /* Range and batch sharing record their progress in mso */
+            if ( __copy_to_guest(arg, &mso, 1) )
+                return -EFAULT;
+            return hypercall_create_continuation(__HYPERVISOR_memory_op,
+                                                 "ih", op, arg);
+        }
         if ( !rc && __copy_to_guest(arg, &mso, 1) )
             return -EFAULT;
         break;
@@ -0,0 +1,204 @@
+/*
+ *  lz4.c -- LZ4 block compressor and decompressor
+ *
+ *  A block is a sequence of (token, literals, offset, match) records:
+ *  the high nibble of the token is the literal count and the low one the
+ *  match length minus LZ4_MIN_MATCH, 15 meaning that more length bytes
+ *  follow.  Offsets are little endian 16 bit distances back into the
+ *  output.  The last record has literals only, and the format requires
+ *  the last LZ4_LAST_LITERALS bytes to be literals and the last match to
+ *  start at least LZ4_MFLIMIT bytes before the end of the block.
+ */
+
+#include <xen/types.h>
+#include <xen/string.h>
+#include <xen/lz4.h>
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT       12
+#define LZ4_RUN_MASK      15
+/* skip ahead faster the longer no match has been found */
+#define LZ4_SKIP_TRIGGER  6
+
+static inline uint32_t lz4_read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static unsigned char *lz4_put_literals(unsigned char *op,
+                                       const unsigned char *lit, size_t len,
+                                       unsigned char **token)
+{
+    *token = op++;
+    if (len >= LZ4_RUN_MASK) {
+        **token = LZ4_RUN_MASK << 4;
+        op = lz4_put_length(op, len - LZ4_RUN_MASK);
+    } else {
+        **token = len << 4;
+    }
+    memcpy(op, lit, len);
+    return op + len;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+                 unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+    uint16_t *table = wrkmem;
+    const unsigned char *ip = src, *anchor = src;
+    const unsigned char *const iend = src + src_len;
+    const unsigned char *const mflimit = iend - LZ4_MFLIMIT;
+    const unsigned char *const matchlimit = iend - LZ4_LAST_LITERALS;
+    const unsigned char *match;
+    unsigned char *op = dst, *token;
+    unsigned int h, searched;
+    size_t len;
+
+    if (src_len > LZ4_MAX_INPUT_SIZE)
+        return LZ4_E_ERROR;
+    if (src_len < LZ4_MFLIMIT + 1)
+        goto last_literals;
+
+    memset(table, 0, LZ4_MEM_COMPRESS);
+    table[lz4_hash(lz4_read32(ip))] = 0;
+    ip++;
+
+    for (;;) {
+        /* find a match, positions in the table are all behind ip */
+        searched = 1 << LZ4_SKIP_TRIGGER;
+        for (;;) {
+            if (ip > mflimit)
+                goto last_literals;
+            h = lz4_hash(lz4_read32(ip));
+            match = src + table[h];
+            table[h] = ip - src;
+            if (lz4_read32(match) == lz4_read32(ip))
+                break;
+            ip += searched++ >> LZ4_SKIP_TRIGGER;
+        }
+
+        while (ip > anchor && match > src && ip[-1] == match[-1]) {
+            ip--;
+            match--;
+        }
+
+        op = lz4_put_literals(op, anchor, ip - anchor, &token);
+        len = ip - match;
+        *op++ = len;
+        *op++ = len >> 8;
+
+        ip += LZ4_MIN_MATCH;
+        match += LZ4_MIN_MATCH;
+        anchor = ip;
+        while (ip < matchlimit && *ip == *match) {
+            ip++;
+            match++;
+        }
+        len = ip - anchor;
+        if (len >= LZ4_RUN_MASK) {
+            *token |= LZ4_RUN_MASK;
+            op = lz4_put_length(op, len - LZ4_RUN_MASK);
+        } else {
+            *token |= len;
+        }
+        anchor = ip;
+
+        if (ip > mflimit)
+            break;
+        table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - src;
+    }
+
+last_literals:
+    op = lz4_put_literals(op, anchor, iend - anchor, &token);
+    *dst_len = op - dst;
+    return LZ4_E_OK;
+}
+
+static int lz4_get_length(const unsigned char **ip, const unsigned char *iend,
+                          size_t *len)
+{
+    unsigned int s;
+
+    do {
+        if (*ip >= iend)
+            return LZ4_E_INPUT_OVERRUN;
+        s = *(*ip)++;
+        *len += s;
+    } while (s == 255);
+    return LZ4_E_OK;
+}
+
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+                        unsigned char *dst, size_t *dst_len)
+{
+    const unsigned char *ip = src;
+    const unsigned char *const iend = src + src_len;
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + *dst_len;
+    const unsigned char *match;
+    unsigned int token;
+    size_t len, offset;
+
+    for (;;) {
+        if (ip >= iend)
+            return LZ4_E_INPUT_OVERRUN;
+        token = *ip++;
+
+        len = token >> 4;
+        if (len == LZ4_RUN_MASK && lz4_get_length(&ip, iend, &len))
+            return LZ4_E_INPUT_OVERRUN;
+        if (len > (size_t)(iend - ip))
+            return LZ4_E_INPUT_OVERRUN;
+        if (len > (size_t)(oend - op))
+            return LZ4_E_OUTPUT_OVERRUN;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return LZ4_E_INPUT_OVERRUN;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return LZ4_E_LOOKBEHIND_OVERRUN;
+
+        len = token & LZ4_RUN_MASK;
+        if (len == LZ4_RUN_MASK && lz4_get_length(&ip, iend, &len))
+            return LZ4_E_INPUT_OVERRUN;
+        len += LZ4_MIN_MATCH;
+        if (len > (size_t)(oend - op))
+            return LZ4_E_OUTPUT_OVERRUN;
+
+        match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            while (len--)
+                *op++ = *match++;
+        }
+    }
+
+    *dst_len = op - dst;
+    return LZ4_E_OK;
+}
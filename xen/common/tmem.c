@@ -23,6 +23,8 @@
 #include <xen/radix-tree.h>
 #include <xen/list.h>
 #include <xen/init.h>
+#include <xen/rcupdate.h>
+#include <xen/percpu.h>
 
 #define EXPORT /* indicates code other modules are dependent upon */
 #define FORWARD
@@ -88,6 +90,9 @@ static long global_eph_count_max = 0;
 static unsigned long failed_copies;
 static unsigned long pcd_tot_tze_size = 0;
 static unsigned long pcd_tot_csize = 0;
+static unsigned long tmem_read_locks = 0, tmem_read_contended = 0;
+static unsigned long tmem_write_locks = 0, tmem_write_contended = 0;
+static unsigned long prealloc_hits = 0, prealloc_misses = 0;
 
 DECL_CYC_COUNTER(succ_get);
 DECL_CYC_COUNTER(succ_put);
@@ -124,6 +129,7 @@ struct client {
     uint32_t weight;
     uint32_t cap;
     bool_t compress;
+    uint8_t codec; /* TMEM_CODEC_* for new pools */
     bool_t frozen;
     bool_t shared_auth_required;
     /* for save/restore/migration */
@@ -161,7 +167,9 @@ struct tm_pool {
     uint64_t uuid[2]; /* 0 for private, non-zero for shared */
     uint32_t pool_id;
     rwlock_t pool_rwlock;
-    struct rb_root obj_rb_root[OBJ_HASH_BUCKETS]; /* protected by pool_rwlock */
+    struct rb_root obj_rb_root[OBJ_HASH_BUCKETS]; /* changed under pool_rwlock */
+    /* odd while obj_rb_root[] is being changed, see obj_find */
+    unsigned int obj_rb_seq[OBJ_HASH_BUCKETS];
     struct list_head share_list; /* valid if shared */
     int shared_count; /* valid if shared */
     /* for save/restore/migration */
@@ -180,6 +188,12 @@ struct tm_pool {
     unsigned long gets, found_gets;
     unsigned long flushs, flushs_found;
     unsigned long flush_objs, flush_objs_found;
+    unsigned long lookups, lookup_retries, lookup_locked;
+    unsigned long obj_contended, pool_write_locks, pool_write_contended;
+    /* compression, by the pool's current codec */
+    uint8_t codec; /* TMEM_CODEC_* */
+    unsigned long compress_puts, compress_poor, decompress_gets;
+    uint64_t compress_bytes, compress_cycles, decompress_cycles;
     DECL_SENTINEL
 };
 typedef struct tm_pool pool_t;
@@ -205,6 +219,7 @@ struct tmem_object_root {
     cli_id_t last_client;
     spinlock_t obj_spinlock;
     bool_t no_evict; /* if globally locked, pseudo-locks against eviction */
+    struct rcu_head rcu_head; /* freed after a grace period, see obj_find */
 };
 typedef struct tmem_object_root obj_t;
 
@@ -234,8 +249,9 @@ struct tmem_page_descriptor {
     pagesize_t size; /* 0 == PAGE_SIZE (pfp), -1 == data invalid,
                     else compressed data (cdata) */
     uint32_t index;
-    /* must hold pcd_tree_rwlocks[firstbyte] to use pcd pointer/siblings */
-    uint16_t firstbyte; /* NON_SHAREABLE->pfp  otherwise->pcd */
+    /* must hold pcd_tree_rwlocks[pcd_bucket] to use pcd pointer/siblings */
+    uint16_t pcd_bucket; /* NON_SHAREABLE->pfp  otherwise->pcd */
+    uint8_t codec; /* TMEM_CODEC_* of cdata */
     bool_t eviction_attempted;  /* CHANGE TO lifetimes? (settable) */
     struct list_head pcd_siblings;
     union {
@@ -261,13 +277,15 @@ struct tmem_page_content_descriptor {
     };
     struct list_head pgp_list;
     struct rb_node pcd_rb_tree_node;
+    uint64_t fingerprint; /* of the page, or of cdata if compressed */
+    uint8_t codec; /* TMEM_CODEC_* of cdata, PCD_UNCOMPRESSED otherwise */
     uint32_t pgp_ref_count;
     pagesize_t size; /* if compression_enabled -> 0<size<PAGE_SIZE (*cdata)
                      * else if tze, 0<=size<PAGE_SIZE, rounded up to mult of 8
                      * else PAGE_SIZE -> *pfp */
 };
 typedef struct tmem_page_content_descriptor pcd_t;
-struct rb_root pcd_tree_roots[256]; /* choose based on first byte of page */
+struct rb_root pcd_tree_roots[256]; /* choose based on fingerprint */
 rwlock_t pcd_tree_rwlocks[256]; /* poor man's concurrency for now */
 
 static LIST_HEAD(global_ephemeral_page_list); /* all pages in ephemeral pools */
@@ -299,6 +317,34 @@ static DEFINE_SPINLOCK(pers_lists_spinlock);
 #define ASSERT_SPINLOCK(_l) ASSERT(tmh_lock_all || spin_is_locked(_l))
 #define ASSERT_WRITELOCK(_l) ASSERT(tmh_lock_all || rw_is_write_locked(_l))
 
+/* lock acquisitions which had to wait are counted for tmemc_list */
+#define tmem_counted_read_lock(_l,_n,_c) do { \
+    (_n)++; \
+    if ( !read_trylock(_l) ) { (_c)++; read_lock(_l); } \
+} while (0)
+#define tmem_counted_write_lock(_l,_n,_c) do { \
+    (_n)++; \
+    if ( !write_trylock(_l) ) { (_c)++; write_lock(_l); } \
+} while (0)
+#define tmem_global_read_lock() do { \
+    if ( !tmh_lock_all ) \
+        tmem_counted_read_lock(&tmem_rwlock,tmem_read_locks, \
+                               tmem_read_contended); \
+} while (0)
+#define tmem_global_write_lock() do { \
+    if ( !tmh_lock_all ) \
+        tmem_counted_write_lock(&tmem_rwlock,tmem_write_locks, \
+                                tmem_write_contended); \
+} while (0)
+#define tmem_pool_write_lock(_p) do { \
+    if ( !tmh_lock_all ) \
+        tmem_counted_write_lock(&(_p)->pool_rwlock,(_p)->pool_write_locks, \
+                                (_p)->pool_write_contended); \
+} while (0)
+#define tmem_pool_write_unlock(_p) tmem_write_unlock(&(_p)->pool_rwlock)
+
+static DEFINE_RCU_READ_LOCK(tmem_rcu_lock);
+
 /* global counters (should use long_atomic_t access) */
 static long global_eph_count = 0; /* atomicity depends on eph_lists_spinlock */
 static atomic_t global_obj_count = ATOMIC_INIT(0);
@@ -348,6 +394,62 @@ static NOINLINE void tmem_free(void *p, size_t size, pool_t *pool)
         tmh_free_subpage_thispool(pool,p,size);
 }
 
+/*
+ * Puts into ephemeral pools take their object and page descriptor from a
+ * per-cpu stash filled on entry to do_tmem_put, so that the heap is not
+ * hit with pool or object locks held.  Persistent pools keep allocating
+ * both from the client's own heap, which is charged to the domain.
+ */
+struct tmem_prealloc {
+    obj_t *obj;
+    pgp_t *pgp;
+};
+static DEFINE_PER_CPU(struct tmem_prealloc, tmem_prealloc);
+
+static void tmem_preload(pool_t *pool)
+{
+    struct tmem_prealloc *pa = &this_cpu(tmem_prealloc);
+
+    if ( !is_ephemeral(pool) )
+        return;
+    if ( pa->obj == NULL )
+        pa->obj = tmem_malloc(obj_t,NULL);
+    if ( pa->pgp == NULL )
+        pa->pgp = tmem_malloc(pgp_t,NULL);
+}
+
+static obj_t *tmem_prealloc_obj(pool_t *pool)
+{
+    obj_t *obj = this_cpu(tmem_prealloc).obj;
+
+    if ( is_persistent(pool) )
+        return tmem_malloc(obj_t,pool);
+    if ( obj == NULL )
+    {
+        prealloc_misses++;
+        return tmem_malloc(obj_t,NULL);
+    }
+    this_cpu(tmem_prealloc).obj = NULL;
+    prealloc_hits++;
+    return obj;
+}
+
+static pgp_t *tmem_prealloc_pgp(pool_t *pool)
+{
+    pgp_t *pgp = this_cpu(tmem_prealloc).pgp;
+
+    if ( is_persistent(pool) )
+        return tmem_malloc(pgp_t,pool);
+    if ( pgp == NULL )
+    {
+        prealloc_misses++;
+        return tmem_malloc(pgp_t,pool);
+    }
+    this_cpu(tmem_prealloc).pgp = NULL;
+    prealloc_hits++;
+    return pgp;
+}
+
 static NOINLINE pfp_t *tmem_page_alloc(pool_t *pool)
 {
     pfp_t *pfp = NULL;
@@ -376,26 +478,35 @@ static NOINLINE void tmem_page_free(pool_t *pool, pfp_t *pfp)
 /************ PAGE CONTENT DESCRIPTOR MANIPULATION ROUTINES ***********/
 
 #define NOT_SHAREABLE ((uint16_t)-1UL)
+#define PCD_UNCOMPRESSED ((uint8_t)-1)
+#define pcd_bucket_of(_fp) ((uint8_t)(_fp))
 
-static NOINLINE int pcd_copy_to_client(tmem_cli_mfn_t cmfn, pgp_t *pgp)
+static NOINLINE int pcd_copy_to_client(tmem_cli_mfn_t cmfn, pgp_t *pgp,
+                                       pool_t *pool)
 {
-    uint8_t firstbyte = pgp->firstbyte;
+    uint8_t pcd_bucket = pgp->pcd_bucket;
     pcd_t *pcd;
     int ret;
+    uint64_t start;
 
     ASSERT(tmh_dedup_enabled());
-    tmem_read_lock(&pcd_tree_rwlocks[firstbyte]);
+    tmem_read_lock(&pcd_tree_rwlocks[pcd_bucket]);
     pcd = pgp->pcd;
     if ( pgp->size < PAGE_SIZE && pgp->size != 0 &&
          pcd->size < PAGE_SIZE && pcd->size != 0 )
-        ret = tmh_decompress_to_client(cmfn, pcd->cdata, pcd->size,
-                                       tmh_cli_buf_null);
+    {
+        start = get_cycles();
+        ret = tmh_decompress_to_client(cmfn, pcd->codec, pcd->cdata,
+                                       pcd->size, tmh_cli_buf_null);
+        pool->decompress_gets++;
+        pool->decompress_cycles += get_cycles() - start;
+    }
     else if ( tmh_tze_enabled() && pcd->size < PAGE_SIZE )
         ret = tmh_copy_tze_to_client(cmfn, pcd->tze, pcd->size);
     else
         ret = tmh_copy_to_client(cmfn, pcd->pfp, 0, 0, PAGE_SIZE,
                                  tmh_cli_buf_null);
-    tmem_read_unlock(&pcd_tree_rwlocks[firstbyte]);
+    tmem_read_unlock(&pcd_tree_rwlocks[pcd_bucket]);
     return ret;
 }
 
@@ -405,7 +516,7 @@ static NOINLINE void pcd_disassociate(pgp_t *pgp, pool_t *pool, bool_t have_pcd_
 {
     pcd_t *pcd = pgp->pcd;
     pfp_t *pfp = pgp->pcd->pfp;
-    uint16_t firstbyte = pgp->firstbyte;
+    uint16_t pcd_bucket = pgp->pcd_bucket;
     char *pcd_tze = pgp->pcd->tze;
     pagesize_t pcd_size = pcd->size;
     pagesize_t pgp_size = pgp->size;
@@ -413,20 +524,20 @@ static NOINLINE void pcd_disassociate(pgp_t *pgp, pool_t *pool, bool_t have_pcd_
     pagesize_t pcd_csize = pgp->pcd->size;
 
     ASSERT(tmh_dedup_enabled());
-    ASSERT(firstbyte != NOT_SHAREABLE);
-    ASSERT(firstbyte < 256);
+    ASSERT(pcd_bucket != NOT_SHAREABLE);
+    ASSERT(pcd_bucket < 256);
 
     if ( have_pcd_rwlock )
-        ASSERT_WRITELOCK(&pcd_tree_rwlocks[firstbyte]);
+        ASSERT_WRITELOCK(&pcd_tree_rwlocks[pcd_bucket]);
     else
-        tmem_write_lock(&pcd_tree_rwlocks[firstbyte]);
+        tmem_write_lock(&pcd_tree_rwlocks[pcd_bucket]);
     list_del_init(&pgp->pcd_siblings);
     pgp->pcd = NULL;
-    pgp->firstbyte = NOT_SHAREABLE;
+    pgp->pcd_bucket = NOT_SHAREABLE;
     pgp->size = -1;
     if ( --pcd->pgp_ref_count )
     {
-        tmem_write_unlock(&pcd_tree_rwlocks[firstbyte]);
+        tmem_write_unlock(&pcd_tree_rwlocks[pcd_bucket]);
         return;
     }
 
@@ -434,7 +545,7 @@ static NOINLINE void pcd_disassociate(pgp_t *pgp, pool_t *pool, bool_t have_pcd_
     ASSERT(list_empty(&pcd->pgp_list));
     pcd->pfp = NULL;
     /* remove pcd from rbtree */
-    rb_erase(&pcd->pcd_rb_tree_node,&pcd_tree_roots[firstbyte]);
+    rb_erase(&pcd->pcd_rb_tree_node,&pcd_tree_roots[pcd_bucket]);
     /* reinit the struct for safety for now */
     RB_CLEAR_NODE(&pcd->pcd_rb_tree_node);
     /* now free up the pcd memory */
@@ -460,7 +571,7 @@ static NOINLINE void pcd_disassociate(pgp_t *pgp, pool_t *pool, bool_t have_pcd_
             pcd_tot_csize -= PAGE_SIZE;
         tmem_page_free(pool,pfp);
     }
-    tmem_write_unlock(&pcd_tree_rwlocks[firstbyte]);
+    tmem_write_unlock(&pcd_tree_rwlocks[pcd_bucket]);
 }
 
 
@@ -471,7 +582,9 @@ static NOINLINE int pcd_associate(pgp_t *pgp, char *cdata, pagesize_t csize)
     pcd_t *pcd;
     int cmp;
     pagesize_t pfp_size = 0;
-    uint8_t firstbyte = (cdata == NULL) ? tmh_get_first_byte(pgp->pfp) : *cdata;
+    uint64_t fingerprint;
+    uint8_t codec = (cdata == NULL) ? PCD_UNCOMPRESSED : pgp->codec;
+    uint8_t pcd_bucket;
     int ret = 0;
 
     if ( !tmh_dedup_enabled() )
@@ -491,28 +604,30 @@ static NOINLINE int pcd_associate(pgp_t *pgp, char *cdata, pagesize_t csize)
         }
         ASSERT(pfp_size <= PAGE_SIZE);
         ASSERT(!(pfp_size & (sizeof(uint64_t)-1)));
+        fingerprint = tmh_page_fingerprint(pgp->pfp);
     }
-    tmem_write_lock(&pcd_tree_rwlocks[firstbyte]);
+    else
+        fingerprint = tmh_fingerprint(cdata, csize);
+    pcd_bucket = pcd_bucket_of(fingerprint);
+    tmem_write_lock(&pcd_tree_rwlocks[pcd_bucket]);
 
     /* look for page match */
-    root = &pcd_tree_roots[firstbyte];
+    root = &pcd_tree_roots[pcd_bucket];
     new = &(root->rb_node);
     while ( *new )
     {
         pcd = container_of(*new, pcd_t, pcd_rb_tree_node);
         parent = *new;
-        /* compare new entry and rbtree entry, set cmp accordingly */
-        if ( cdata != NULL )
-        {
-            if ( pcd->size < PAGE_SIZE )
-                /* both new entry and rbtree entry are compressed */
-                cmp = tmh_pcd_cmp(cdata,csize,pcd->cdata,pcd->size);
-            else
-                /* new entry is compressed, rbtree entry is not */
-                cmp = -1;
-        } else if ( pcd->size < PAGE_SIZE )
-            /* rbtree entry is compressed, rbtree entry is not */
-            cmp = 1;
+        /* compare new entry and rbtree entry, set cmp accordingly: by
+         * fingerprint first, so full compares are only done on a likely
+         * match, then by codec so only like data is compared */
+        if ( fingerprint != pcd->fingerprint )
+            cmp = (fingerprint < pcd->fingerprint) ? -1 : 1;
+        else if ( codec != pcd->codec )
+            cmp = (codec < pcd->codec) ? -1 : 1;
+        else if ( cdata != NULL )
+            /* both new entry and rbtree entry are compressed */
+            cmp = tmh_pcd_cmp(cdata,csize,pcd->cdata,pcd->size);
         else if ( tmh_tze_enabled() ) {
             if ( pcd->size < PAGE_SIZE )
                 /* both new entry and rbtree entry are trailing zero */
@@ -560,6 +675,8 @@ static NOINLINE int pcd_associate(pgp_t *pgp, char *cdata, pagesize_t csize)
     RB_CLEAR_NODE(&pcd->pcd_rb_tree_node);  /* is this necessary */
     INIT_LIST_HEAD(&pcd->pgp_list);  /* is this necessary */
     pcd->pgp_ref_count = 0;
+    pcd->fingerprint = fingerprint;
+    pcd->codec = codec;
     if ( cdata != NULL )
     {
         memcpy(pcd->cdata,cdata,csize);
@@ -589,12 +706,12 @@ static NOINLINE int pcd_associate(pgp_t *pgp, char *cdata, pagesize_t csize)
 match:
     pcd->pgp_ref_count++;
     list_add(&pgp->pcd_siblings,&pcd->pgp_list);
-    pgp->firstbyte = firstbyte;
+    pgp->pcd_bucket = pcd_bucket;
     pgp->eviction_attempted = 0;
     pgp->pcd = pcd;
 
 unlock:
-    tmem_write_unlock(&pcd_tree_rwlocks[firstbyte]);
+    tmem_write_unlock(&pcd_tree_rwlocks[pcd_bucket]);
     return ret;
 }
 
@@ -609,7 +726,7 @@ static NOINLINE pgp_t *pgp_alloc(obj_t *obj)
     ASSERT(obj != NULL);
     ASSERT(obj->pool != NULL);
     pool = obj->pool;
-    if ( (pgp = tmem_malloc(pgp_t, pool)) == NULL )
+    if ( (pgp = tmem_prealloc_pgp(pool)) == NULL )
         return NULL;
     pgp->us.obj = obj;
     INIT_LIST_HEAD(&pgp->global_eph_pages);
@@ -617,7 +734,7 @@ static NOINLINE pgp_t *pgp_alloc(obj_t *obj)
     pgp->pfp = NULL;
     if ( tmh_dedup_enabled() )
     {
-        pgp->firstbyte = NOT_SHAREABLE;
+        pgp->pcd_bucket = NOT_SHAREABLE;
         pgp->eviction_attempted = 0;
         INIT_LIST_HEAD(&pgp->pcd_siblings);
     }
@@ -646,7 +763,7 @@ static NOINLINE void pgp_free_data(pgp_t *pgp, pool_t *pool)
 
     if ( pgp->pfp == NULL )
         return;
-    if ( tmh_dedup_enabled() && pgp->firstbyte != NOT_SHAREABLE )
+    if ( tmh_dedup_enabled() && pgp->pcd_bucket != NOT_SHAREABLE )
         pcd_disassociate(pgp,pool,0); /* pgp->size lost */
     else if ( pgp_size )
         tmem_free(pgp->cdata,pgp_size,pool);
@@ -887,32 +1004,42 @@ unsigned oid_hash(OID *oidp)
                      BITS_PER_LONG) & OBJ_HASH_BUCKETS_MASK);
 }
 
-/* searches for object==oid in pool, returns locked object if found */
-static NOINLINE obj_t * obj_find(pool_t *pool, OID *oidp)
+/*
+ * Lookups walk the object trees without taking pool_rwlock.  Changes to a
+ * tree are made with pool_rwlock held for write and bracketed by bumps of
+ * the bucket's sequence count, and objects are only freed after an RCU
+ * grace period, so a lockless walk may see a tree in the middle of a
+ * rebalance but never freed memory.  Such walks are bounded and retried;
+ * after a few failed attempts the walk is done under the read lock.
+ */
+#define OBJ_FIND_LOCKLESS_TRIES 4
+#define OBJ_RB_MAX_DEPTH (2 * BITS_PER_LONG) /* no valid rbtree is deeper */
+
+static void obj_rb_write_begin(pool_t *pool, unsigned bucket)
 {
-    struct rb_node *node;
+    ASSERT_WRITELOCK(&pool->pool_rwlock);
+    pool->obj_rb_seq[bucket]++;
+    smp_wmb();
+}
+
+static void obj_rb_write_end(pool_t *pool, unsigned bucket)
+{
+    smp_wmb();
+    pool->obj_rb_seq[bucket]++;
+}
+
+static obj_t *obj_rb_lookup(struct rb_root *root, OID *oidp)
+{
+    struct rb_node *node = root->rb_node;
     obj_t *obj;
+    int depth = 0;
 
-restart_find:
-    tmem_read_lock(&pool->pool_rwlock);
-    node = pool->obj_rb_root[oid_hash(oidp)].rb_node;
-    while ( node )
+    while ( node && depth++ < OBJ_RB_MAX_DEPTH )
     {
         obj = container_of(node, obj_t, rb_tree_node);
         switch ( oid_compare(&obj->oid, oidp) )
         {
             case 0: /* equal */
-                if ( tmh_lock_all )
-                    obj->no_evict = 1;
-                else
-                {
-                    if ( !tmem_spin_trylock(&obj->obj_spinlock) )
-                    {
-                        tmem_read_unlock(&pool->pool_rwlock);
-                        goto restart_find;
-                    }
-                    tmem_read_unlock(&pool->pool_rwlock);
-                }
                 return obj;
             case -1:
                 node = node->rb_left;
@@ -921,10 +1048,89 @@ restart_find:
                 node = node->rb_right;
         }
     }
-    tmem_read_unlock(&pool->pool_rwlock);
     return NULL;
 }
 
+/* searches for object==oid in pool, returns locked object if found */
+static NOINLINE obj_t * obj_find(pool_t *pool, OID *oidp)
+{
+    unsigned bucket = oid_hash(oidp);
+    unsigned seq;
+    int tries = 0;
+    obj_t *obj;
+
+    if ( tmh_lock_all )
+    {
+        if ( (obj = obj_rb_lookup(&pool->obj_rb_root[bucket], oidp)) != NULL )
+            obj->no_evict = 1;
+        return obj;
+    }
+
+    /*
+     * Persistent objects live in the client's heap, which is gone once the
+     * client is destroyed, so they are freed at once rather than after a
+     * grace period and may only be looked up under pool_rwlock.
+     */
+    if ( is_persistent(pool) )
+        goto restart_find;
+
+    pool->lookups++;
+    while ( tries++ < OBJ_FIND_LOCKLESS_TRIES )
+    {
+        rcu_read_lock(&tmem_rcu_lock);
+        seq = read_atomic(&pool->obj_rb_seq[bucket]);
+        smp_rmb();
+        obj = (seq & 1) ? NULL : obj_rb_lookup(&pool->obj_rb_root[bucket],
+                                                 oidp);
+        smp_rmb();
+        if ( (seq & 1) || read_atomic(&pool->obj_rb_seq[bucket]) != seq )
+        {
+            rcu_read_unlock(&tmem_rcu_lock);
+            pool->lookup_retries++;
+            continue;
+        }
+        if ( obj == NULL )
+        {
+            rcu_read_unlock(&tmem_rcu_lock);
+            return NULL;
+        }
+        if ( !spin_trylock(&obj->obj_spinlock) )
+        {
+            pool->obj_contended++;
+            spin_lock(&obj->obj_spinlock);
+        }
+        /* obj_free invalidates both under obj_spinlock */
+        if ( obj->pool == pool && !oid_compare(&obj->oid, oidp) )
+        {
+            rcu_read_unlock(&tmem_rcu_lock);
+            return obj;
+        }
+        spin_unlock(&obj->obj_spinlock);
+        rcu_read_unlock(&tmem_rcu_lock);
+        pool->lookup_retries++;
+    }
+
+    pool->lookup_locked++;
+restart_find:
+    read_lock(&pool->pool_rwlock);
+    obj = obj_rb_lookup(&pool->obj_rb_root[bucket], oidp);
+    if ( obj != NULL && !spin_trylock(&obj->obj_spinlock) )
+    {
+        read_unlock(&pool->pool_rwlock);
+        pool->obj_contended++;
+        goto restart_find;
+    }
+    read_unlock(&pool->pool_rwlock);
+    return obj;
+}
+
+static void obj_rcu_free(struct rcu_head *head)
+{
+    obj_t *obj = container_of(head, obj_t, rcu_head);
+
+    tmem_free(obj,sizeof(obj_t),NULL);
+}
+
 /* free an object that has no more pgps in it */
 static NOINLINE void obj_free(obj_t *obj, int no_rebalance)
 {
@@ -953,9 +1159,16 @@ static NOINLINE void obj_free(obj_t *obj, int no_rebalance)
     atomic_dec_and_assert(global_obj_count);
     /* use no_rebalance only if all objects are being destroyed anyway */
     if ( !no_rebalance )
+    {
+        obj_rb_write_begin(pool,oid_hash(&old_oid));
         rb_erase(&obj->rb_tree_node,&pool->obj_rb_root[oid_hash(&old_oid)]);
+        obj_rb_write_end(pool,oid_hash(&old_oid));
+    }
     tmem_spin_unlock(&obj->obj_spinlock);
-    tmem_free(obj,sizeof(obj_t),pool);
+    if ( is_persistent(pool) )
+        tmem_free(obj,sizeof(obj_t),pool);
+    else
+        call_rcu(&obj->rcu_head, obj_rcu_free);
 }
 
 static NOINLINE int obj_rb_insert(struct rb_root *root, obj_t *obj)
@@ -995,7 +1208,7 @@ static NOINLINE obj_t * obj_new(pool_t *pool, OID *oidp)
 
     ASSERT(pool != NULL);
     ASSERT_WRITELOCK(&pool->pool_rwlock);
-    if ( (obj = tmem_malloc(obj_t,pool)) == NULL )
+    if ( (obj = tmem_prealloc_obj(pool)) == NULL )
         return NULL;
     pool->obj_count++;
     if (pool->obj_count > pool->obj_count_max)
@@ -1011,7 +1224,9 @@ static NOINLINE obj_t * obj_new(pool_t *pool, OID *oidp)
     obj->last_client = CLI_ID_NULL;
     SET_SENTINEL(obj,OBJ);
     tmem_spin_lock(&obj->obj_spinlock);
+    obj_rb_write_begin(pool,oid_hash(oidp));
     obj_rb_insert(&pool->obj_rb_root[oid_hash(oidp)], obj);
+    obj_rb_write_end(pool,oid_hash(oidp));
     obj->no_evict = 1;
     ASSERT_SPINLOCK(&obj->obj_spinlock);
     return obj;
@@ -1032,7 +1247,7 @@ static void pool_destroy_objs(pool_t *pool, bool_t selective, cli_id_t cli_id)
     obj_t *obj;
     int i;
 
-    tmem_write_lock(&pool->pool_rwlock);
+    tmem_pool_write_lock(pool);
     pool->is_dying = 1;
     for (i = 0; i < OBJ_HASH_BUCKETS; i++)
     {
@@ -1052,7 +1267,7 @@ static void pool_destroy_objs(pool_t *pool, bool_t selective, cli_id_t cli_id)
                 tmem_spin_unlock(&obj->obj_spinlock);
         }
     }
-    tmem_write_unlock(&pool->pool_rwlock);
+    tmem_pool_write_unlock(pool);
 }
 
 
@@ -1081,6 +1296,14 @@ static pool_t * pool_alloc(void)
     pool->found_gets = pool->gets = 0;
     pool->flushs_found = pool->flushs = 0;
     pool->flush_objs_found = pool->flush_objs = 0;
+    pool->lookups = pool->lookup_retries = pool->lookup_locked = 0;
+    pool->obj_contended = 0;
+    pool->pool_write_locks = pool->pool_write_contended = 0;
+    pool->codec = tmh_default_codec();
+    pool->compress_puts = pool->compress_poor = pool->decompress_gets = 0;
+    pool->compress_bytes = pool->compress_cycles = 0;
+    pool->decompress_cycles = 0;
+    memset(pool->obj_rb_seq, 0, sizeof(pool->obj_rb_seq));
     pool->is_dying = 0;
     SET_SENTINEL(pool,POOL);
     return pool;
@@ -1234,6 +1457,7 @@ static client_t *client_create(cli_id_t cli_id)
     }
     client->cli_id = cli_id;
     client->compress = tmh_compression_enabled();
+    client->codec = tmh_default_codec();
     client->shared_auth_required = tmh_shared_auth();
     for ( i = 0; i < MAX_GLOBAL_SHARED_POOLS; i++)
         client->shared_auth_uuid[i][0] =
@@ -1304,7 +1528,7 @@ static bool_t tmem_try_to_evict_pgp(pgp_t *pgp, bool_t *hold_pool_rwlock)
     obj_t *obj = pgp->us.obj;
     pool_t *pool = obj->pool;
     client_t *client = pool->client;
-    uint16_t firstbyte = pgp->firstbyte;
+    uint16_t pcd_bucket = pgp->pcd_bucket;
 
     if ( pool->is_dying )
         return 0;
@@ -1314,11 +1538,11 @@ static bool_t tmem_try_to_evict_pgp(pgp_t *pgp, bool_t *hold_pool_rwlock)
     {
         if ( tmh_dedup_enabled() )
         {
-            firstbyte = pgp->firstbyte;
-            if ( firstbyte ==  NOT_SHAREABLE )
+            pcd_bucket = pgp->pcd_bucket;
+            if ( pcd_bucket ==  NOT_SHAREABLE )
                 goto obj_unlock;
-            ASSERT(firstbyte < 256);
-            if ( !tmem_write_trylock(&pcd_tree_rwlocks[firstbyte]) )
+            ASSERT(pcd_bucket < 256);
+            if ( !tmem_write_trylock(&pcd_tree_rwlocks[pcd_bucket]) )
                 goto obj_unlock;
             if ( pgp->pcd->pgp_ref_count > 1 && !pgp->eviction_attempted )
             {
@@ -1338,7 +1562,7 @@ static bool_t tmem_try_to_evict_pgp(pgp_t *pgp, bool_t *hold_pool_rwlock)
             return 1;
         }
 pcd_unlock:
-        tmem_write_unlock(&pcd_tree_rwlocks[firstbyte]);
+        tmem_write_unlock(&pcd_tree_rwlocks[pcd_bucket]);
 obj_unlock:
         tmem_spin_unlock(&obj->obj_spinlock);
     }
@@ -1386,7 +1610,7 @@ found:
     ASSERT_SPINLOCK(&obj->obj_spinlock);
     pgp_del = pgp_delete_from_obj(obj, pgp->index);
     ASSERT(pgp_del == pgp);
-    if ( tmh_dedup_enabled() && pgp->firstbyte != NOT_SHAREABLE )
+    if ( tmh_dedup_enabled() && pgp->pcd_bucket != NOT_SHAREABLE )
     {
         ASSERT(pgp->pcd->pgp_ref_count == 1 || pgp->eviction_attempted);
         pcd_disassociate(pgp,pool,1);
@@ -1400,7 +1624,7 @@ found:
     else
         tmem_spin_unlock(&obj->obj_spinlock);
     if ( hold_pool_rwlock )
-        tmem_write_unlock(&pool->pool_rwlock);
+        tmem_pool_write_unlock(pool);
     evicted_pgs++;
     ret = 1;
 
@@ -1446,9 +1670,11 @@ static inline void tmem_ensure_avail_pages(void)
 static NOINLINE int do_tmem_put_compress(pgp_t *pgp, tmem_cli_mfn_t cmfn,
                                          tmem_cli_va_param_t clibuf)
 {
+    pool_t *pool = pgp->us.obj->pool;
     void *dst, *p;
     size_t size;
     int ret = 0;
+    uint64_t start = get_cycles();
     DECL_LOCAL_CYC_COUNTER(compress);
     
     ASSERT(pgp != NULL);
@@ -1460,10 +1686,12 @@ static NOINLINE int do_tmem_put_compress(pgp_t *pgp, tmem_cli_mfn_t cmfn,
     if ( pgp->pfp != NULL )
         pgp_free_data(pgp, pgp->us.obj->pool);
     START_CYC_COUNTER(compress);
-    ret = tmh_compress_from_client(cmfn, &dst, &size, clibuf);
+    pgp->codec = pool->codec;
+    ret = tmh_compress_from_client(cmfn, pgp->codec, &dst, &size, clibuf);
     if ( ret <= 0 )
         goto out;
     else if ( (size == 0) || (size >= tmem_subpage_maxsize()) ) {
+        pool->compress_poor++;
         ret = 0;
         goto out;
     } else if ( tmh_dedup_enabled() && !is_persistent(pgp->us.obj->pool) ) {
@@ -1479,9 +1707,12 @@ static NOINLINE int do_tmem_put_compress(pgp_t *pgp, tmem_cli_mfn_t cmfn,
     pgp->size = size;
     pgp->us.obj->pool->client->compressed_pages++;
     pgp->us.obj->pool->client->compressed_sum_size += size;
+    pool->compress_puts++;
+    pool->compress_bytes += size;
     ret = 1;
 
 out:
+    pool->compress_cycles += get_cycles() - start;
     END_CYC_COUNTER(compress);
     return ret;
 }
@@ -1564,9 +1795,9 @@ cleanup:
     pgp_delete(pgpfound,0);
     if ( obj->pgp_count == 0 )
     {
-        tmem_write_lock(&pool->pool_rwlock);
+        tmem_pool_write_lock(pool);
         obj_free(obj,0);
-        tmem_write_unlock(&pool->pool_rwlock);
+        tmem_pool_write_unlock(pool);
     } else {
         obj->no_evict = 0;
         tmem_spin_unlock(&obj->obj_spinlock);
@@ -1588,6 +1819,7 @@ static NOINLINE int do_tmem_put(pool_t *pool,
 
     ASSERT(pool != NULL);
     pool->puts++;
+    tmem_preload(pool);
     /* does page already exist (dup)?  if so, handle specially */
     if ( (obj = objfound = obj_find(pool,oidp)) != NULL )
     {
@@ -1603,14 +1835,14 @@ static NOINLINE int do_tmem_put(pool_t *pool,
 
     if ( (objfound == NULL) )
     {
-        tmem_write_lock(&pool->pool_rwlock);
+        tmem_pool_write_lock(pool);
         if ( (obj = objnew = obj_new(pool,oidp)) == NULL )
         {
-            tmem_write_unlock(&pool->pool_rwlock);
+            tmem_pool_write_unlock(pool);
             return -ENOMEM;
         }
         ASSERT_SPINLOCK(&objnew->obj_spinlock);
-        tmem_write_unlock(&pool->pool_rwlock);
+        tmem_pool_write_unlock(pool);
     }
 
     ASSERT((obj != NULL)&&((objnew==obj)||(objfound==obj))&&(objnew!=objfound));
@@ -1712,9 +1944,9 @@ free:
     }
     if ( objnew )
     {
-        tmem_write_lock(&pool->pool_rwlock);
+        tmem_pool_write_lock(pool);
         obj_free(objnew,0);
-        tmem_write_unlock(&pool->pool_rwlock);
+        tmem_pool_write_unlock(pool);
     }
     pool->no_mem_puts++;
     return ret;
@@ -1728,6 +1960,7 @@ static NOINLINE int do_tmem_get(pool_t *pool, OID *oidp, uint32_t index,
     pgp_t *pgp;
     client_t *client = pool->client;
     DECL_LOCAL_CYC_COUNTER(decompress);
+    uint64_t start;
     int rc;
 
     if ( !_atomic_read(pool->pgp_count) )
@@ -1751,13 +1984,16 @@ static NOINLINE int do_tmem_get(pool_t *pool, OID *oidp, uint32_t index,
     }
     ASSERT(pgp->size != -1);
     if ( tmh_dedup_enabled() && !is_persistent(pool) &&
-              pgp->firstbyte != NOT_SHAREABLE )
-        rc = pcd_copy_to_client(cmfn, pgp);
+              pgp->pcd_bucket != NOT_SHAREABLE )
+        rc = pcd_copy_to_client(cmfn, pgp, pool);
     else if ( pgp->size != 0 )
     {
         START_CYC_COUNTER(decompress);
-        rc = tmh_decompress_to_client(cmfn, pgp->cdata,
+        start = get_cycles();
+        rc = tmh_decompress_to_client(cmfn, pgp->codec, pgp->cdata,
                                       pgp->size, clibuf);
+        pool->decompress_gets++;
+        pool->decompress_cycles += get_cycles() - start;
         END_CYC_COUNTER(decompress);
     }
     else
@@ -1773,10 +2009,10 @@ static NOINLINE int do_tmem_get(pool_t *pool, OID *oidp, uint32_t index,
             pgp_delete(pgp,0);
             if ( obj->pgp_count == 0 )
             {
-                tmem_write_lock(&pool->pool_rwlock);
+                tmem_pool_write_lock(pool);
                 obj_free(obj,0);
                 obj = NULL;
-                tmem_write_unlock(&pool->pool_rwlock);
+                tmem_pool_write_unlock(pool);
             }
         } else {
             tmem_spin_lock(&eph_lists_spinlock);
@@ -1826,9 +2062,9 @@ static NOINLINE int do_tmem_flush_page(pool_t *pool, OID *oidp, uint32_t index)
     pgp_delete(pgp,0);
     if ( obj->pgp_count == 0 )
     {
-        tmem_write_lock(&pool->pool_rwlock);
+        tmem_pool_write_lock(pool);
         obj_free(obj,0);
-        tmem_write_unlock(&pool->pool_rwlock);
+        tmem_pool_write_unlock(pool);
     } else {
         obj->no_evict = 0;
         tmem_spin_unlock(&obj->obj_spinlock);
@@ -1850,10 +2086,10 @@ static NOINLINE int do_tmem_flush_object(pool_t *pool, OID *oidp)
     obj = obj_find(pool,oidp);
     if ( obj == NULL )
         goto out;
-    tmem_write_lock(&pool->pool_rwlock);
+    tmem_pool_write_lock(pool);
     obj_destroy(obj,0);
     pool->flush_objs_found++;
-    tmem_write_unlock(&pool->pool_rwlock);
+    tmem_pool_write_unlock(pool);
 
 out:
     if ( pool->client->frozen )
@@ -1964,6 +2200,7 @@ static NOINLINE int do_tmem_new_pool(cli_id_t this_cli_id,
     }
     pool->shared = shared;
     pool->client = client;
+    pool->codec = client->codec;
     if ( shared )
     {
         first_unused_s_poolid = MAX_GLOBAL_SHARED_POOLS;
@@ -2074,9 +2311,9 @@ static int tmemc_list_client(client_t *c, tmem_cli_va_param_t buf,
     pool_t *p;
     bool_t s;
 
-    n = scnprintf(info,BSIZE,"C=CI:%d,ww:%d,ca:%d,co:%d,fr:%d,"
+    n = scnprintf(info,BSIZE,"C=CI:%d,ww:%d,ca:%d,co:%d,cz:%d,fr:%d,"
         "Tc:%"PRIu64",Ge:%ld,Pp:%ld,Gp:%ld%c",
-        c->cli_id, c->weight, c->cap, c->compress, c->frozen,
+        c->cli_id, c->weight, c->cap, c->compress, c->codec, c->frozen,
         c->total_cycles, c->succ_eph_gets, c->succ_pers_puts, c->succ_pers_gets,
         use_long ? ',' : '\n');
     if (use_long)
@@ -2103,14 +2340,21 @@ static int tmemc_list_client(client_t *c, tmem_cli_va_param_t buf,
             n += scnprintf(info+n,BSIZE-n,
              "Pc:%d,Pm:%d,Oc:%ld,Om:%ld,Nc:%lu,Nm:%lu,"
              "ps:%lu,pt:%lu,pd:%lu,pr:%lu,px:%lu,gs:%lu,gt:%lu,"
-             "fs:%lu,ft:%lu,os:%lu,ot:%lu\n",
+             "fs:%lu,ft:%lu,os:%lu,ot:%lu,"
+             "Lk:%lu,Lr:%lu,Ll:%lu,Lc:%lu,Lw:%lu,Lx:%lu,"
+             "Zc:%u,Zp:%lu,Zn:%lu,Zb:%"PRIu64",Zy:%"PRIu64","
+             "Zg:%lu,Zd:%"PRIu64"\n",
              _atomic_read(p->pgp_count), p->pgp_count_max,
              p->obj_count, p->obj_count_max,
              p->objnode_count, p->objnode_count_max,
              p->good_puts, p->puts,p->dup_puts_flushed, p->dup_puts_replaced,
              p->no_mem_puts, 
              p->found_gets, p->gets,
-             p->flushs_found, p->flushs, p->flush_objs_found, p->flush_objs);
+             p->flushs_found, p->flushs, p->flush_objs_found, p->flush_objs,
+             p->lookups, p->lookup_retries, p->lookup_locked,
+             p->obj_contended, p->pool_write_locks, p->pool_write_contended,
+             p->codec, p->compress_puts, p->compress_poor, p->compress_bytes,
+             p->compress_cycles, p->decompress_gets, p->decompress_cycles);
         if ( sum + n >= len )
             return sum;
         tmh_copy_to_client_buf_offset(buf,off+sum,info,n+1);
@@ -2142,14 +2386,21 @@ static int tmemc_list_shared(tmem_cli_va_param_t buf, int off, uint32_t len,
             n += scnprintf(info+n,BSIZE-n,
              "Pc:%d,Pm:%d,Oc:%ld,Om:%ld,Nc:%lu,Nm:%lu,"
              "ps:%lu,pt:%lu,pd:%lu,pr:%lu,px:%lu,gs:%lu,gt:%lu,"
-             "fs:%lu,ft:%lu,os:%lu,ot:%lu\n",
+             "fs:%lu,ft:%lu,os:%lu,ot:%lu,"
+             "Lk:%lu,Lr:%lu,Ll:%lu,Lc:%lu,Lw:%lu,Lx:%lu,"
+             "Zc:%u,Zp:%lu,Zn:%lu,Zb:%"PRIu64",Zy:%"PRIu64","
+             "Zg:%lu,Zd:%"PRIu64"\n",
              _atomic_read(p->pgp_count), p->pgp_count_max,
              p->obj_count, p->obj_count_max,
              p->objnode_count, p->objnode_count_max,
              p->good_puts, p->puts,p->dup_puts_flushed, p->dup_puts_replaced,
              p->no_mem_puts, 
              p->found_gets, p->gets,
-             p->flushs_found, p->flushs, p->flush_objs_found, p->flush_objs);
+             p->flushs_found, p->flushs, p->flush_objs_found, p->flush_objs,
+             p->lookups, p->lookup_retries, p->lookup_locked,
+             p->obj_contended, p->pool_write_locks, p->pool_write_contended,
+             p->codec, p->compress_puts, p->compress_poor, p->compress_bytes,
+             p->compress_cycles, p->decompress_gets, p->decompress_cycles);
         if ( sum + n >= len )
             return sum;
         tmh_copy_to_client_buf_offset(buf,off+sum,info,n+1);
@@ -2211,14 +2462,18 @@ static int tmemc_list_global(tmem_cli_va_param_t buf, int off, uint32_t len,
     if (use_long)
         n += scnprintf(info+n,BSIZE-n,
           "Ec:%ld,Em:%ld,Oc:%d,Om:%d,Nc:%d,Nm:%d,Pc:%d,Pm:%d,"
-          "Fc:%d,Fm:%d,Sc:%d,Sm:%d,Ep:%lu,Gd:%lu,Zt:%lu,Gz:%lu\n",
+          "Fc:%d,Fm:%d,Sc:%d,Sm:%d,Ep:%lu,Gd:%lu,Zt:%lu,Gz:%lu,"
+          "Gr:%lu,Gc:%lu,Gw:%lu,Gx:%lu,Ph:%lu,Pu:%lu\n",
           global_eph_count, global_eph_count_max,
           _atomic_read(global_obj_count), global_obj_count_max,
           _atomic_read(global_rtree_node_count), global_rtree_node_count_max,
           _atomic_read(global_pgp_count), global_pgp_count_max,
           _atomic_read(global_page_count), global_page_count_max,
           _atomic_read(global_pcd_count), global_pcd_count_max,
-         tot_good_eph_puts,deduped_puts,pcd_tot_tze_size,pcd_tot_csize);
+         tot_good_eph_puts,deduped_puts,pcd_tot_tze_size,pcd_tot_csize,
+         tmem_read_locks,tmem_read_contended,
+         tmem_write_locks,tmem_write_contended,
+         prealloc_hits,prealloc_misses);
     if ( sum + n >= len )
         return sum;
     tmh_copy_to_client_buf_offset(buf,off+sum,info,n+1);
@@ -2300,6 +2555,48 @@ static int tmemc_set_var(cli_id_t cli_id, uint32_t subop, uint32_t arg1)
     return 0;
 }
 
+/* a negative pool_id sets the codec of all of the client's pools, and of
+ * the ones it creates later; data already stored keeps its own codec */
+static int tmemc_set_codec_one(client_t *client, int32_t pool_id,
+                               uint32_t codec)
+{
+    int i;
+
+    if ( pool_id >= 0 )
+    {
+        if ( pool_id >= MAX_POOLS_PER_DOMAIN || client->pools[pool_id] == NULL )
+            return -1;
+        client->pools[pool_id]->codec = codec;
+    }
+    else
+    {
+        client->codec = codec;
+        for ( i = 0; i < MAX_POOLS_PER_DOMAIN; i++ )
+            if ( client->pools[i] != NULL )
+                client->pools[i]->codec = codec;
+    }
+    tmh_client_info("tmem: codec %s for %s=%d pool %d\n",
+                    codec == TMEM_CODEC_LZ4 ? "lz4" : "lzo",
+                    cli_id_str, client->cli_id, pool_id);
+    return 0;
+}
+
+static int tmemc_set_codec(cli_id_t cli_id, int32_t pool_id, uint32_t codec)
+{
+    client_t *client;
+
+    if ( codec != TMEM_CODEC_LZO && codec != TMEM_CODEC_LZ4 )
+        return -1;
+    if ( cli_id == CLI_ID_NULL )
+        list_for_each_entry(client,&global_client_list,client_list)
+            tmemc_set_codec_one(client, -1, codec);
+    else if ( (client = tmh_client_from_cli_id(cli_id)) == NULL)
+        return -1;
+    else
+        return tmemc_set_codec_one(client, pool_id, codec);
+    return 0;
+}
+
 static NOINLINE int tmemc_shared_pool_auth(cli_id_t cli_id, uint64_t uuid_lo,
                                   uint64_t uuid_hi, bool_t auth)
 {
@@ -2577,6 +2874,9 @@ static NOINLINE int do_tmem_control(struct tmem_op *op)
     case TMEMC_SET_COMPRESS:
         ret = tmemc_set_var(op->u.ctrl.cli_id,subop,op->u.ctrl.arg1);
         break;
+    case TMEMC_SET_CODEC:
+        ret = tmemc_set_codec(op->u.ctrl.cli_id,pool_id,op->u.ctrl.arg1);
+        break;
     case TMEMC_QUERY_FREEABLE_MB:
         ret = tmh_freeable_pages() >> (20 - PAGE_SHIFT);
         break;
@@ -2685,18 +2985,18 @@ EXPORT long do_tmem_op(tmem_cli_op_t uops)
 
     if ( op.cmd == TMEM_CONTROL )
     {
-        tmem_write_lock(&tmem_rwlock);
+        tmem_global_write_lock();
         tmem_write_lock_set = 1;
         rc = do_tmem_control(&op);
         goto out;
     } else if ( op.cmd == TMEM_AUTH ) {
-        tmem_write_lock(&tmem_rwlock);
+        tmem_global_write_lock();
         tmem_write_lock_set = 1;
         rc = tmemc_shared_pool_auth(op.u.creat.arg1,op.u.creat.uuid[0],
                          op.u.creat.uuid[1],op.u.creat.flags);
         goto out;
     } else if ( op.cmd == TMEM_RESTORE_NEW ) {
-        tmem_write_lock(&tmem_rwlock);
+        tmem_global_write_lock();
         tmem_write_lock_set = 1;
         rc = do_tmem_new_pool(op.u.creat.arg1, op.pool_id, op.u.creat.flags,
                          op.u.creat.uuid[0], op.u.creat.uuid[1]);
@@ -2706,7 +3006,7 @@ EXPORT long do_tmem_op(tmem_cli_op_t uops)
     /* create per-client tmem structure dynamically on first use by client */
     if ( client == NULL )
     {
-        tmem_write_lock(&tmem_rwlock);
+        tmem_global_write_lock();
         tmem_write_lock_set = 1;
         if ( (client = client_create(tmh_get_cli_id_from_current())) == NULL )
         {
@@ -2721,7 +3021,7 @@ EXPORT long do_tmem_op(tmem_cli_op_t uops)
     {
         if ( !tmem_write_lock_set )
         {
-            tmem_write_lock(&tmem_rwlock);
+            tmem_global_write_lock();
             tmem_write_lock_set = 1;
         }
     }
@@ -2729,7 +3029,7 @@ EXPORT long do_tmem_op(tmem_cli_op_t uops)
     {
         if ( !tmem_write_lock_set )
         {
-            tmem_read_lock(&tmem_rwlock);
+            tmem_global_read_lock();
             tmem_read_lock_set = 1;
         }
         if ( ((uint32_t)op.pool_id >= MAX_POOLS_PER_DOMAIN) ||
@@ -2955,9 +3255,10 @@ static int __init init_tmem(void)
 
     if ( tmh_init() )
     {
-        printk("tmem: initialized comp=%d dedup=%d tze=%d global-lock=%d\n",
-            tmh_compression_enabled(), tmh_dedup_enabled(), tmh_tze_enabled(),
-            tmh_lock_all);
+        printk("tmem: initialized comp=%d codec=%s dedup=%d tze=%d "
+            "global-lock=%d\n", tmh_compression_enabled(),
+            tmh_default_codec() == TMEM_CODEC_LZ4 ? "lz4" : "lzo",
+            tmh_dedup_enabled(), tmh_tze_enabled(), tmh_lock_all);
         if ( tmh_dedup_enabled()&&tmh_compression_enabled()&&tmh_tze_enabled() )
         {
             tmh_tze_disable();
@@ -9,6 +9,7 @@
 #include <xen/tmem.h>
 #include <xen/tmem_xen.h>
 #include <xen/lzo.h> /* compression code */
+#include <xen/lz4.h>
 #include <xen/paging.h>
 #include <xen/domain_page.h>
 #include <xen/cpu.h>
@@ -22,6 +23,16 @@ boolean_param("tmem", opt_tmem);
 EXPORT bool_t __read_mostly opt_tmem_compress = 0;
 boolean_param("tmem_compress", opt_tmem_compress);
 
+EXPORT unsigned int __read_mostly opt_tmem_codec = TMEM_CODEC_LZO;
+static void __init parse_tmem_codec(char *s)
+{
+    if ( !strcmp(s, "lzo") )
+        opt_tmem_codec = TMEM_CODEC_LZO;
+    else if ( !strcmp(s, "lz4") )
+        opt_tmem_codec = TMEM_CODEC_LZ4;
+}
+custom_param("tmem_codec", parse_tmem_codec);
+
 EXPORT bool_t __read_mostly opt_tmem_dedup = 0;
 boolean_param("tmem_dedup", opt_tmem_dedup);
 
@@ -47,8 +58,9 @@ DECL_CYC_COUNTER(pg_copy);
 
 /* these are a concurrency bottleneck, could be percpu and dynamically
  * allocated iff opt_tmem_compress */
-#define LZO_WORKMEM_BYTES LZO1X_1_MEM_COMPRESS
-#define LZO_DSTMEM_PAGES 2
+#define COMPRESS_WORKMEM_BYTES max_t(size_t, LZO1X_1_MEM_COMPRESS, \
+                                     LZ4_MEM_COMPRESS)
+#define COMPRESS_DSTMEM_PAGES 2
 static DEFINE_PER_CPU_READ_MOSTLY(unsigned char *, workmem);
 static DEFINE_PER_CPU_READ_MOSTLY(unsigned char *, dstmem);
 static DEFINE_PER_CPU_READ_MOSTLY(void *, scratch_page);
@@ -193,7 +205,7 @@ EXPORT int tmh_copy_from_client(pfp_t *pfp,
     return rc;
 }
 
-EXPORT int tmh_compress_from_client(tmem_cli_mfn_t cmfn,
+EXPORT int tmh_compress_from_client(tmem_cli_mfn_t cmfn, unsigned int codec,
     void **out_va, size_t *out_len, tmem_cli_va_param_t clibuf)
 {
     int ret = 0;
@@ -217,8 +229,17 @@ EXPORT int tmh_compress_from_client(tmem_cli_mfn_t cmfn,
     else if ( copy_from_guest(scratch, clibuf, PAGE_SIZE) )
         return -EFAULT;
     mb();
-    ret = lzo1x_1_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len, wmem);
-    ASSERT(ret == LZO_E_OK);
+    if ( codec == TMEM_CODEC_LZ4 )
+    {
+        ret = lz4_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len, wmem);
+        ASSERT(ret == LZ4_E_OK);
+    }
+    else
+    {
+        ret = lzo1x_1_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len,
+                               wmem);
+        ASSERT(ret == LZO_E_OK);
+    }
     *out_va = dmem;
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 0);
@@ -264,8 +285,9 @@ EXPORT int tmh_copy_to_client(tmem_cli_mfn_t cmfn, pfp_t *pfp,
     return rc;
 }
 
-EXPORT int tmh_decompress_to_client(tmem_cli_mfn_t cmfn, void *tmem_va,
-                                    size_t size, tmem_cli_va_param_t clibuf)
+EXPORT int tmh_decompress_to_client(tmem_cli_mfn_t cmfn, unsigned int codec,
+                                    void *tmem_va, size_t size,
+                                    tmem_cli_va_param_t clibuf)
 {
     unsigned long cli_mfn = 0;
     pfp_t *cli_pfp = NULL;
@@ -282,8 +304,17 @@ EXPORT int tmh_decompress_to_client(tmem_cli_mfn_t cmfn, void *tmem_va,
     }
     else if ( !scratch )
         return 0;
-    ret = lzo1x_decompress_safe(tmem_va, size, cli_va ?: scratch, &out_len);
-    ASSERT(ret == LZO_E_OK);
+    if ( codec == TMEM_CODEC_LZ4 )
+    {
+        ret = lz4_decompress_safe(tmem_va, size, cli_va ?: scratch, &out_len);
+        ASSERT(ret == LZ4_E_OK);
+    }
+    else
+    {
+        ret = lzo1x_decompress_safe(tmem_va, size, cli_va ?: scratch,
+                                    &out_len);
+        ASSERT(ret == LZO_E_OK);
+    }
     ASSERT(out_len == PAGE_SIZE);
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 1);
@@ -486,8 +517,8 @@ EXPORT int __init tmh_init(void)
     if ( !tmh_mempool_init() )
         return 0;
 
-    dstmem_order = get_order_from_pages(LZO_DSTMEM_PAGES);
-    workmem_order = get_order_from_bytes(LZO1X_1_MEM_COMPRESS);
+    dstmem_order = get_order_from_pages(COMPRESS_DSTMEM_PAGES);
+    workmem_order = get_order_from_bytes(COMPRESS_WORKMEM_BYTES);
 
     for_each_online_cpu ( cpu )
     {
@@ -161,6 +161,8 @@ struct hap_domain {
 struct log_dirty_domain {
     /* log-dirty radix tree to record dirty pages */
     mfn_t          top;
+    /* tree detached by XEN_DOMCTL_SHADOW_OP_CLEAN_LIST, being reported */
+    mfn_t          snap;
     unsigned int   allocs;
     unsigned int   failed_allocs;
 
@@ -50,6 +50,8 @@ struct page_sharing_info
         struct list_head    gfns;
         rmap_hashtab_t      hash_table;
     };
+    /* The tuple the frame is accounted to. The others save memory. */
+    struct gfn_info *owner;
 };
 
 #define sharing_supported(_d) \
@@ -36,7 +36,7 @@
 #include "grant_table.h"
 #include "hvm/save.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x00000009
+#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000c
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -186,6 +186,10 @@ struct xen_domctl_getpageframeinfo3 {
 #define XEN_DOMCTL_SHADOW_OP_CLEAN       11
  /* Return the bitmap but do not modify internal copy. */
 #define XEN_DOMCTL_SHADOW_OP_PEEK        12
+ /* As CLEAN, but return the dirty pfns as a list (see dirty_list). */
+#define XEN_DOMCTL_SHADOW_OP_CLEAN_LIST  13
+ /* As PEEK, but return the dirty pfns as a list (see dirty_list). */
+#define XEN_DOMCTL_SHADOW_OP_PEEK_LIST   14
 
 /* Memory allocation accessors. */
 #define XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION   30
@@ -241,7 +245,26 @@ struct xen_domctl_shadow_op {
     XEN_GUEST_HANDLE_64(uint8) dirty_bitmap;
     uint64_aligned_t pages; /* Size of buffer. Updated with actual size. */
     struct xen_domctl_shadow_op_stats stats;
+
+    /*
+     * OP_PEEK_LIST / OP_CLEAN_LIST
+     *
+     * The dirty pfns are written to dirty_list in ascending order.  'pages'
+     * is the number of entries the list can hold on entry and the number
+     * written on return, so the cost of a call follows the number of dirty
+     * pages rather than the size of the guest.  A round is started with
+     * cursor 0 and continued by passing back the cursor returned until it
+     * reads XEN_DOMCTL_SHADOW_LIST_DONE; a call may return early (with
+     * fewer entries than requested) if preemption is pending.
+     *
+     * OP_CLEAN_LIST cleans the whole log atomically when a round starts,
+     * so pages dirtied during the round are reported by the next one.
+     * Stats are returned (and for CLEAN_LIST reset) when a round starts.
+     */
+    XEN_GUEST_HANDLE_64(uint64) dirty_list;
+    uint64_aligned_t cursor; /* IN: first pfn to report, OUT: next cursor */
 };
+#define XEN_DOMCTL_SHADOW_LIST_DONE (~(uint64_t)0)
 typedef struct xen_domctl_shadow_op xen_domctl_shadow_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_shadow_op_t);
 
@@ -760,11 +783,19 @@ struct xen_domctl_gdbsx_domstatus {
 
 /* Use for teardown/setup of helper<->hypervisor interface for paging, 
  * access and sharing.*/
+/*
+ * The ENABLE ops of all three modes map nr_ring_pages consecutive gfns,
+ * starting at the ring pfn in the HVM params, as one ring.  E2BIG is
+ * returned if the domain has fewer pages than that reserved (see
+ * HVM_PARAM_MEM_EVENT_RING_PAGES) or more than MEM_EVENT_RING_MAX_PAGES
+ * are asked for.
+ */
 struct xen_domctl_mem_event_op {
     uint32_t       op;           /* XEN_DOMCTL_MEM_EVENT_OP_*_* */
     uint32_t       mode;         /* XEN_DOMCTL_MEM_EVENT_OP_* */
 
     uint32_t port;              /* OUT: event channel for ring */
+    uint32_t nr_ring_pages;     /* IN: pages in the ring, 0 means one */
 };
 typedef struct xen_domctl_mem_event_op xen_domctl_mem_event_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_mem_event_op_t);
@@ -773,14 +804,46 @@ DEFINE_XEN_GUEST_HANDLE(xen_domctl_mem_event_op_t);
  * Memory sharing operations
  */
 /* XEN_DOMCTL_mem_sharing_op.
- * The CONTROL sub-domctl is used for bringup/teardown. */
+ * The CONTROL sub-domctl is used for bringup/teardown.
+ * The STATS sub-domctl returns the sharing counters of the domain along
+ * with the host wide ones.  All of them are maintained as pages are shared
+ * and unshared, so this is cheap and does not audit anything.  It also
+ * works on domains that cannot share memory. */
 #define XEN_DOMCTL_MEM_SHARING_CONTROL          0
+#define XEN_DOMCTL_MEM_SHARING_STATS            1
+
+/* Shared frames are counted in bucket n of the fan-out histogram when they
+ * back 2^n to 2^(n+1)-1 gfns; the last bucket counts all the larger ones. */
+#define XEN_DOMCTL_MEM_SHARING_FANOUT_BUCKETS   8
+
+struct xen_domctl_mem_sharing_stats {
+    /* OUT: gfns of the domain backed by a shared frame. */
+    uint64_aligned_t shared_pages;
+    /* OUT: those of them whose frame is accounted to another gfn, i.e. the
+     * memory this domain saves.  Summed over all domains, this is
+     * nr_saved_mfns. */
+    uint64_aligned_t saved_pages;
+    /* OUT: host wide, as XENMEM_get_sharing_{shared,freed}_pages. */
+    uint64_aligned_t nr_shared_mfns;
+    uint64_aligned_t nr_saved_mfns;
+    /* OUT: shared frames whose reverse map is a hash table, and the number
+     * of list to hash table conversions (and of those that failed for lack
+     * of memory) and of hash table to list conversions since boot. */
+    uint64_aligned_t rmap_hash_frames;
+    uint64_aligned_t rmap_to_hash;
+    uint64_aligned_t rmap_to_hash_failed;
+    uint64_aligned_t rmap_to_list;
+    /* OUT: shared frames by number of gfns backed. */
+    uint32_t fanout[XEN_DOMCTL_MEM_SHARING_FANOUT_BUCKETS];
+};
+typedef struct xen_domctl_mem_sharing_stats xen_domctl_mem_sharing_stats_t;
 
 struct xen_domctl_mem_sharing_op {
     uint8_t op; /* XEN_DOMCTL_MEM_SHARING_* */
 
     union {
         uint8_t enable;                   /* CONTROL */
+        xen_domctl_mem_sharing_stats_t stats; /* STATS */
     } u;
 };
 typedef struct xen_domctl_mem_sharing_op xen_domctl_mem_sharing_op_t;
@@ -842,6 +905,28 @@ struct xen_domctl_set_broken_page_p2m {
 typedef struct xen_domctl_set_broken_page_p2m xen_domctl_set_broken_page_p2m_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_set_broken_page_p2m_t);
 
+/*
+ * XEN_DOMCTL_transfer_pages: move the pages backing a list of gfns of a
+ * shut down (e.g. suspended) HVM domain to the same gfns of another HVM
+ * domain, without copying their contents.  Used for same-host migration.
+ *
+ * 'domain' is the source.  errs[i] is set to 0 if gfns[i] was moved, or
+ * to a -errno value if it was left with the source: -ENOENT if the source
+ * has no RAM there, -EBUSY if the page is shared or referenced elsewhere,
+ * -ENOMEM if the target has no headroom.  The call may return before the
+ * whole list is done if preemption is pending; the caller continues it
+ * with the updated 'done' until done == nr.
+ */
+struct xen_domctl_transfer_pages {
+    domid_t  target;                 /* IN: domain receiving the pages */
+    uint32_t nr;                     /* IN: number of gfns */
+    uint32_t done;                   /* IN/OUT: entries processed so far */
+    XEN_GUEST_HANDLE_64(uint64) gfns; /* IN */
+    XEN_GUEST_HANDLE_64(int) errs;   /* OUT */
+};
+typedef struct xen_domctl_transfer_pages xen_domctl_transfer_pages_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_transfer_pages_t);
+
 struct xen_domctl {
     uint32_t cmd;
 #define XEN_DOMCTL_createdomain                   1
@@ -908,6 +993,7 @@ struct xen_domctl {
 #define XEN_DOMCTL_audit_p2m                     65
 #define XEN_DOMCTL_set_virq_handler              66
 #define XEN_DOMCTL_set_broken_page_p2m           67
+#define XEN_DOMCTL_transfer_pages                68
 #define XEN_DOMCTL_gdbsx_guestmemio            1000
 #define XEN_DOMCTL_gdbsx_pausevcpu             1001
 #define XEN_DOMCTL_gdbsx_unpausevcpu           1002
@@ -964,6 +1050,7 @@ struct xen_domctl {
         struct xen_domctl_set_virq_handler  set_virq_handler;
         struct xen_domctl_gdbsx_memio       gdbsx_guest_memio;
         struct xen_domctl_set_broken_page_p2m set_broken_page_p2m;
+        struct xen_domctl_transfer_pages    transfer_pages;
         struct xen_domctl_gdbsx_pauseunp_vcpu gdbsx_pauseunp_vcpu;
         struct xen_domctl_gdbsx_domstatus   gdbsx_domstatus;
         uint8_t                             pad[128];
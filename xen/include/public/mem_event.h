@@ -48,6 +48,14 @@
 #define MEM_EVENT_REASON_MSR         7    /* MSR was hit: gfn is MSR value, gla is MSR address;
                                              does NOT honour HVMPME_onchangeonly */
 
+/*
+ * A ring may span several consecutive guest pages, starting at the gfn in
+ * its HVM_PARAM_*_RING_PFN.  HVM_PARAM_MEM_EVENT_RING_PAGES says how many
+ * pages are reserved for each ring, the helper picks the actual size when
+ * enabling the ring.
+ */
+#define MEM_EVENT_RING_MAX_PAGES     8
+
 typedef struct mem_event_st {
     uint32_t flags;
     uint32_t vcpu_id;
@@ -356,6 +356,7 @@ typedef struct xen_pod_target xen_pod_target_t;
 #define XENMEM_paging_op_nominate           0
 #define XENMEM_paging_op_evict              1
 #define XENMEM_paging_op_prep               2
+#define XENMEM_paging_op_resume             3
 
 #define XENMEM_access_op                    21
 #define XENMEM_access_op_resume             0
@@ -383,6 +384,9 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_event_op_t);
 #define XENMEM_sharing_op_debug_gref        6
 #define XENMEM_sharing_op_add_physmap       7
 #define XENMEM_sharing_op_audit             8
+#define XENMEM_sharing_op_range_share       9
+#define XENMEM_sharing_op_batch_share       10
+#define XENMEM_sharing_op_range_add_physmap 11
 
 #define XENMEM_SHARING_OP_S_HANDLE_INVALID  (-10)
 #define XENMEM_SHARING_OP_C_HANDLE_INVALID  (-9)
@@ -400,6 +404,26 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_event_op_t);
 #define XENMEM_SHARING_OP_FIELD_GET_GREF(field)        \
     ((field) & (~XENMEM_SHARING_OP_FIELD_IS_GREF_FLAG))
 
+/* A pair of gfns to be shared by OP_BATCH_SHARE */
+struct xen_mem_sharing_pair {
+    uint64_aligned_t source_gfn;    /* IN: gfn in the source domain */
+    uint64_aligned_t client_gfn;    /* IN: gfn in the client domain */
+};
+typedef struct xen_mem_sharing_pair xen_mem_sharing_pair_t;
+DEFINE_XEN_GUEST_HANDLE(xen_mem_sharing_pair_t);
+
+/*
+ * OP_RANGE_SHARE and OP_BATCH_SHARE nominate and share many pages in one
+ * call, either a contiguous range of source gfns mapped onto a contiguous
+ * range of client gfns or a list of gfn pairs.  Pairs which cannot be
+ * shared (not populated, mmio, referenced elsewhere, ...) are skipped and
+ * counted.  The call is preemptible: opaque records the progress and must
+ * be zero when the operation is started.
+ *
+ * OP_RANGE_ADD_PHYSMAP takes the same arguments as OP_RANGE_SHARE, but adds
+ * the source pages to the physmap of the client like OP_ADD_PHYSMAP does,
+ * so the client gfns must not be populated.
+ */
 struct xen_mem_sharing_op {
     uint8_t     op;     /* XENMEM_sharing_op_* */
     domid_t     domain;
@@ -419,6 +443,23 @@ struct xen_mem_sharing_op {
             uint64_aligned_t client_handle; /* IN: handle to the client page */
             domid_t  client_domain; /* IN: the client domain id */
         } share; 
+        struct mem_sharing_op_range {     /* OP_RANGE_SHARE/ADD_PHYSMAP */
+            uint64_aligned_t first_gfn;     /* IN: first source gfn */
+            uint64_aligned_t last_gfn;      /* IN: last source gfn */
+            uint64_aligned_t client_gfn;    /* IN: client gfn of first_gfn */
+            uint64_aligned_t opaque;        /* IN/OUT: must be 0 */
+            uint64_aligned_t nr_shared;     /* OUT: pairs shared */
+            uint64_aligned_t nr_skipped;    /* OUT: pairs not sharable */
+            domid_t  client_domain; /* IN: the client domain id */
+        } range;
+        struct mem_sharing_op_batch {     /* OP_BATCH_SHARE */
+            XEN_GUEST_HANDLE_64(xen_mem_sharing_pair_t) pairs; /* IN */
+            uint64_aligned_t nr_pairs;      /* IN: number of pairs */
+            uint64_aligned_t opaque;        /* IN/OUT: must be 0 */
+            uint64_aligned_t nr_shared;     /* OUT: pairs shared */
+            uint64_aligned_t nr_skipped;    /* OUT: pairs not sharable */
+            domid_t  client_domain; /* IN: the client domain id */
+        } batch;
         struct mem_sharing_op_debug {     /* OP_DEBUG_xxx */
             union {
                 uint64_aligned_t gfn;      /* IN: gfn to debug          */
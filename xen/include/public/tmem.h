@@ -59,6 +59,7 @@
 #define TMEMC_SET_CAP                6
 #define TMEMC_SET_COMPRESS           7
 #define TMEMC_QUERY_FREEABLE_MB      8
+#define TMEMC_SET_CODEC              9
 #define TMEMC_SAVE_BEGIN             10
 #define TMEMC_SAVE_GET_VERSION       11
 #define TMEMC_SAVE_GET_MAXPOOLS      12
@@ -89,6 +90,10 @@
 #define TMEM_CLIENT_COMPRESS       1
 #define TMEM_CLIENT_FROZEN         2
 
+/* Compressors for HYPERVISOR_tmem_op(TMEM_CONTROL/TMEMC_SET_CODEC) */
+#define TMEM_CODEC_LZO             0
+#define TMEM_CODEC_LZ4             1
+
 /* Special errno values */
 #define EFROZEN                 1000
 #define EEMPTY                  1001
@@ -0,0 +1,35 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 block format compressor and decompressor
+ *
+ *  Produces and consumes raw LZ4 blocks, as found inside the frames of
+ *  the reference implementation at http://code.google.com/p/lz4/.  The
+ *  compressor is the single pass, greedy variant, for inputs smaller
+ *  than 64KiB.
+ */
+
+#define LZ4_MAX_INPUT_SIZE 0xffff
+#define LZ4_HASH_LOG 12
+#define LZ4_MEM_COMPRESS ((1 << LZ4_HASH_LOG) * sizeof(uint16_t))
+
+#define lz4_worst_compress(x) ((x) + ((x) / 255) + 16)
+
+/* This requires 'wrkmem' of size LZ4_MEM_COMPRESS */
+int lz4_compress(const unsigned char *src, size_t src_len,
+                 unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/* safe decompression with overrun testing, *dst_len is the buffer size */
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+                        unsigned char *dst, size_t *dst_len);
+
+/*
+ * Return values (< 0 = Error)
+ */
+#define LZ4_E_OK                  0
+#define LZ4_E_ERROR               (-1)
+#define LZ4_E_INPUT_OVERRUN       (-4)
+#define LZ4_E_OUTPUT_OVERRUN      (-5)
+#define LZ4_E_LOOKBEHIND_OVERRUN  (-6)
+
+#endif
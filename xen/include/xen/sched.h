@@ -200,12 +200,13 @@ struct mem_event_domain
 {
     /* ring lock */
     spinlock_t ring_lock;
-    /* The ring has 64 entries */
-    unsigned char foreign_producers;
-    unsigned char target_producers;
-    /* shared ring page */
+    /* A single page ring has 64 entries, a larger one up to 512 */
+    unsigned short foreign_producers;
+    unsigned short target_producers;
+    /* shared ring pages, mapped contiguously */
     void *ring_page;
-    struct page_info *ring_pg_struct;
+    unsigned int nr_ring_pages;
+    struct page_info *ring_pg_struct[MEM_EVENT_RING_MAX_PAGES];
     /* front-end ring */
     mem_event_front_ring_t front_ring;
     /* event channel port (vcpu0 only) */
@@ -245,6 +246,7 @@ struct domain
     unsigned int     outstanding_pages; /* pages claimed but not possessed  */
     unsigned int     max_pages;       /* maximum value for tot_pages        */
     atomic_t         shr_pages;       /* number of shared pages             */
+    atomic_t         shr_saved_pages; /* shared pages not owning the frame  */
     atomic_t         paged_pages;     /* number of paged-out pages          */
     unsigned int     xenheap_pages;   /* # pages allocated from Xen heap    */
 
@@ -58,6 +58,12 @@ static inline bool_t tmh_compression_enabled(void)
     return opt_tmem_compress;
 }
 
+extern unsigned int opt_tmem_codec;
+static inline unsigned int tmh_default_codec(void)
+{
+    return opt_tmem_codec;
+}
+
 extern bool_t opt_tmem_dedup;
 static inline bool_t tmh_dedup_enabled(void)
 {
@@ -337,11 +343,39 @@ static inline bool_t tmh_current_is_privileged(void)
     return !xsm_tmem_control(XSM_PRIV);
 }
 
-static inline uint8_t tmh_get_first_byte(pfp_t *pfp)
+/* cheap 64-bit content hash, used to index and order the dedup trees */
+#define TMH_FP_MUL1 0x87c37b91114253d5ULL
+#define TMH_FP_MUL2 0x4cf5ad432745937fULL
+
+static inline uint64_t tmh_fingerprint_mix(uint64_t h, uint64_t v)
 {
-    void *p = __map_domain_page(pfp);
+    v *= TMH_FP_MUL1;
+    v = (v << 31) | (v >> 33);
+    h ^= v * TMH_FP_MUL2;
+    return ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+}
 
-    return (uint8_t)(*(char *)p);
+static inline uint64_t tmh_fingerprint(const void *va, pagesize_t len)
+{
+    const uint64_t *p = va;
+    const unsigned char *tail;
+    uint64_t h = len, v = 0;
+    pagesize_t i;
+
+    for ( i = len / sizeof(uint64_t); i; i--, p++ )
+        h = tmh_fingerprint_mix(h, *p);
+    tail = (const unsigned char *)p;
+    for ( i = len & (sizeof(uint64_t) - 1); i; i-- )
+        v = (v << 8) | tail[i - 1];
+    h = tmh_fingerprint_mix(h, v);
+    h ^= h >> 33;
+    h *= TMH_FP_MUL1;
+    return h ^ (h >> 29);
+}
+
+static inline uint64_t tmh_page_fingerprint(pfp_t *pfp)
+{
+    return tmh_fingerprint(__map_domain_page(pfp), PAGE_SIZE);
 }
 
 static inline int tmh_page_cmp(pfp_t *pfp1, pfp_t *pfp2)
@@ -490,11 +524,11 @@ static inline void tmh_copy_to_client_buf_offset(tmem_cli_va_param_t clibuf,
 #define tmh_cli_id_str "domid"
 #define tmh_client_str "domain"
 
-int tmh_decompress_to_client(tmem_cli_mfn_t, void *, size_t,
-			     tmem_cli_va_param_t);
+int tmh_decompress_to_client(tmem_cli_mfn_t, unsigned int codec, void *,
+			     size_t, tmem_cli_va_param_t);
 
-int tmh_compress_from_client(tmem_cli_mfn_t, void **, size_t *,
-			     tmem_cli_va_param_t);
+int tmh_compress_from_client(tmem_cli_mfn_t, unsigned int codec, void **,
+			     size_t *, tmem_cli_va_param_t);
 
 int tmh_copy_from_client(pfp_t *, tmem_cli_mfn_t, pagesize_t tmem_offset,
     pagesize_t pfn_offset, pagesize_t len, tmem_cli_va_param_t);
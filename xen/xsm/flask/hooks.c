@@ -670,6 +670,7 @@ static int flask_domctl(struct domain *d, int cmd)
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__GETADDRSIZE);
 
     case XEN_DOMCTL_mem_sharing_op:
+    case XEN_DOMCTL_transfer_pages:
         return current_has_perm(d, SECCLASS_HVM, HVM__MEM_SHARING);
 
     case XEN_DOMCTL_pin_mem_cacheattr:
@@ -1110,6 +1111,8 @@ static int flask_shadow_control(struct domain *d, uint32_t op)
     case XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
+    case XEN_DOMCTL_SHADOW_OP_PEEK_LIST:
+    case XEN_DOMCTL_SHADOW_OP_CLEAN_LIST:
         perm = SHADOW__LOGDIRTY;
         break;
     default: